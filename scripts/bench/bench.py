@@ -0,0 +1,163 @@
+#!/usr/bin/env python3
+
+"""
+Runs the standard Disim scenarios headless and reports their throughput.
+
+./scripts/bench/bench.py --output=bench.json
+./scripts/bench/bench.py --quick --scenario=loop --ncpu=0,2,4
+
+Every run uses the same seed and a fixed number of steps. The simulator
+writes its counters with --stats, the peak RSS comes from wait4().
+"""
+
+import argparse, json, os, platform, shlex, shutil, subprocess, sys, tempfile, time
+
+SCHEMA = 1
+ROOT = os.path.abspath(os.path.join(os.path.dirname(__file__), '..', '..'))
+sys.path.insert(0, os.path.join(ROOT, 'scripts', 'generator'))
+import generate
+
+""" The scenarios: name, map, density sweep [veh/km], extra arguments """
+def scenarios(workdir, args):
+  loop = os.path.join(ROOT, 'maps', 'loop.map')
+  i210 = os.path.join(ROOT, 'maps', 'I-210W.map')
+  idm = os.path.join(ROOT, 'scripts', 'car', 'IDM_MOBIL.lua')
+  i210_control = os.path.join(ROOT, 'scripts', 'control', 'I-210W.lua')
+  s = []
+  s.append(('loop', loop, [20, 40, 80], []))
+  s.append(('I-210W', i210, [0], ['--start-time=06:00', '--lua=' + idm, '--luacontrol=' + i210_control]))
+  for km in ([10] if args.quick else [10, 50]):
+    s.append(('corridor-%dkm' % km, corridor(workdir, km), [10, 30], []))
+  for km in ([100] if args.quick else [100, 500]):
+    prefix = freeway(workdir, km, args.seed)
+    s.append(('freeway-%dkm' % km, prefix + '.map', [20], ['--start-time=07:00', '--luacontrol=' + prefix + '.lua']))
+  return s
+
+""" Generates a freeway of km kilometers with interchanges, sensors and its control script """
+def freeway(workdir, km, seed):
+  prefix = os.path.join(workdir, 'freeway-%dkm' % km)
+  generate.generate(prefix, generate.parser().parse_args(['--output=' + prefix, '--length=%d' % km,
+                                                          '--seed=%d' % seed]))
+  return prefix
+
+""" Writes a straight corridor of km kilometers with 3 lanes fed at their start """
+def corridor(workdir, km):
+  filename = os.path.join(workdir, 'corridor-%dkm.map' % km)
+  with open(filename, 'w') as f:
+    f.write('$NAME,Corridor of %d km\n$LANE_WIDTH,3.5\n' % km)
+    f.write('$SEGMENT,straight,1000\n$TYPE,entry\n$SPEED,120\n$NUM_LANES,0,3\n')
+    for l in range(3):
+      f.write('$LANE,%d,1800,entry_%d\n' % (l, l))
+    for i in range(1, km):
+      f.write('$SEGMENT,straight,1000\n$NUM_LANES,3\n')
+  return filename
+
+""" The --duration (whole seconds) of a run of about steps steps """
+def duration(steps, time_step):
+  # The simulation stops once its time exceeds --duration, the rates are per step anyway
+  return max(1, int(round((steps - 1) * time_step)))
+
+""" Runs disim once and returns its last counters and its peak RSS [KB] """
+def run(binary, arguments, workdir):
+  stats = os.path.join(workdir, 'stats.json')
+  if os.path.exists(stats):
+    os.remove(stats)
+  command = [binary, '--nogui', '--stats=' + stats, '--stats-period=0'] + arguments
+  errors = os.path.join(workdir, 'stderr.txt')
+  start = time.time()
+  with open(os.devnull, 'w') as null, open(errors, 'w') as err:
+    p = subprocess.Popen(command, cwd=ROOT, stdout=null, stderr=err)
+    _, status, usage = os.wait4(p.pid, 0)
+    p.returncode = status
+  elapsed = time.time() - start
+  with open(errors) as f:
+    error = f.read()
+  if status != 0 or not os.path.exists(stats):
+    sys.stderr.write('Failed: %s\n%s\n' % (' '.join(shlex.quote(c) for c in command), error))
+    return None, 0, elapsed
+  with open(stats) as f:
+    lines = [l for l in f if l.strip()]
+  # ru_maxrss is in KB on Linux and in bytes on MacOS
+  rss = usage.ru_maxrss if platform.system() != 'Darwin' else usage.ru_maxrss // 1024
+  return json.loads(lines[-1]), rss, elapsed
+
+def version():
+  try:
+    return subprocess.check_output(['git', 'describe', '--always', '--dirty'], cwd=ROOT).decode().strip()
+  except (OSError, subprocess.CalledProcessError):
+    return 'unknown'
+
+def main():
+  parser = argparse.ArgumentParser(description='Disim benchmark suite')
+  parser.add_argument('--binary', default=os.path.join(ROOT, 'disim'), help='The disim executable')
+  parser.add_argument('--output', default='-', help='The JSON report (- for stdout)')
+  parser.add_argument('--ncpu', default='0,1,2,4,8', help='The values of --ncpu to sweep')
+  parser.add_argument('--steps', type=int, default=2000, help='The number of steps of each run')
+  parser.add_argument('--time-step', type=float, default=0.064, help='The time step [s]')
+  parser.add_argument('--seed', type=int, default=1, help='The seed of every run')
+  parser.add_argument('--scenario', action='append', help='Only run the scenarios starting with that name')
+  parser.add_argument('--quick', action='store_true', help='Fewer scenarios and steps')
+  args = parser.parse_args()
+
+  if not os.access(args.binary, os.X_OK):
+    sys.stderr.write('%s not found, run make first.\n' % args.binary)
+    return 1
+  steps = args.steps // 4 if args.quick else args.steps
+  ncpus = [int(n) for n in args.ncpu.split(',')]
+
+  workdir = tempfile.mkdtemp(prefix='disim-bench-')
+  results = []
+  for name, map, densities, extra in scenarios(workdir, args):
+    if args.scenario and not any(name.startswith(s) for s in args.scenario):
+      continue
+    for density in densities:
+      serial = None
+      for ncpu in ncpus:
+        arguments = ['--map=' + map, '--density=%d' % density, '--ncpu=%d' % ncpu,
+                     '--seed=%d' % args.seed, '--time-step=%g' % args.time_step,
+                     '--duration=%d' % duration(steps, args.time_step), '--verbose-level=0'] + extra
+        stats, rss, elapsed = run(args.binary, arguments, workdir)
+        if not stats:
+          continue
+        sps = stats['step'] / stats['wall'] if stats['wall'] > 0 else 0.0
+        r = {
+          'scenario': name,
+          'density': density,
+          'ncpu': ncpu,
+          'steps': stats['step'],
+          'wall': round(stats['wall'], 6),
+          'elapsed': round(elapsed, 6),
+          'mean_cars': round(stats['vehicle_steps'] / float(max(stats['step'], 1)), 2),
+          'steps_per_s': round(sps, 3),
+          'vehicle_steps_per_s': round(stats['vehicle_steps'] / stats['wall'], 3) if stats['wall'] > 0 else 0.0,
+          'peak_rss_kb': rss,
+        }
+        # Scaling is relative to the first run of the sweep (usually --ncpu=0)
+        if serial is None:
+          serial = r
+        r['speedup'] = round(r['steps_per_s'] / serial['steps_per_s'], 3) if serial['steps_per_s'] > 0 else 0.0
+        r['efficiency'] = round(r['speedup'] / max(ncpu, 1), 3)
+        results.append(r)
+        sys.stderr.write('%-16s density=%-4d ncpu=%-2d %10.1f steps/s %12.1f vehicle-steps/s %8d KB\n' %
+                         (name, density, ncpu, r['steps_per_s'], r['vehicle_steps_per_s'], rss))
+
+  shutil.rmtree(workdir, ignore_errors=True)
+
+  report = {
+    'schema': SCHEMA,
+    'version': version(),
+    'date': time.strftime('%Y-%m-%dT%H:%M:%S'),
+    'host': {'system': platform.system(), 'machine': platform.machine(), 'cpus': os.cpu_count()},
+    'config': {'steps': steps, 'time_step': args.time_step, 'seed': args.seed},
+    'results': results,
+  }
+  text = json.dumps(report, indent=2, sort_keys=True)
+  if args.output == '-':
+    print(text)
+  else:
+    with open(args.output, 'w') as f:
+      f.write(text + '\n')
+  return 0 if results else 1
+
+if __name__ == '__main__':
+  sys.exit(main())
@@ -0,0 +1,257 @@
+#!/usr/bin/env python3
+
+"""
+Runs the benchmark scenarios several times and compares them to a baseline.
+
+./scripts/bench/regress.py                      # compare to scripts/bench/baseline.json
+./scripts/bench/regress.py --update-baseline    # record a new baseline
+./scripts/bench/regress.py --quick --scenario=loop --microbench=./disim_microbench
+
+Each scenario of bench.py is run --runs times (the runs of all the scenarios
+are interleaved so that a slow drift of the machine spreads over all of them).
+The time per step and the time per step of each phase of Simulator::step()
+are measured, as well as the time per operation of the microbenchmarks when
+--microbench is given. For each metric, the median and a bootstrap confidence
+interval of the median are computed from the raw samples.
+
+A metric is flagged as a regression when its median is more than --threshold
+percent slower than the baseline and the confidence intervals do not overlap.
+A change beyond the threshold with overlapping intervals is reported as noise.
+The raw samples are written to the report (and to the baseline), so two
+reports can always be compared again with --compare.
+
+No baseline is shipped: the times depend on the machine, so each machine
+records its own (from a clean tree, at the revision to compare against):
+
+make regress-baseline                           # or ./scripts/bench/regress.py --update-baseline
+
+The comparison stops without running anything when there is no baseline or
+when it was recorded on another machine.
+"""
+
+import argparse, json, os, platform, random, subprocess, sys, tempfile, shutil, time
+
+import bench
+
+SCHEMA = 1
+ROOT = bench.ROOT
+BASELINE = os.path.join(ROOT, 'scripts', 'bench', 'baseline.json')
+PHASES = ['control', 'entries', 'sensors', 'simulate', 'move', 'delete']
+# Phases shorter than this (in ms per step) are too noisy to be flagged
+MIN_PHASE_TIME = 0.01
+
+def median(samples):
+  s = sorted(samples)
+  n = len(s)
+  if n == 0:
+    return 0.0
+  return s[n // 2] if n % 2 else 0.5 * (s[n // 2 - 1] + s[n // 2])
+
+""" Percentile bootstrap confidence interval of the median """
+def interval(samples, confidence, resamples=2000):
+  if len(samples) < 2:
+    return (samples[0], samples[0]) if samples else (0.0, 0.0)
+  # A fixed seed keeps the report of the same samples identical
+  r = random.Random(len(samples))
+  medians = sorted(median([r.choice(samples) for _ in samples]) for _ in range(resamples))
+  alpha = (1.0 - confidence) / 2.0
+  low = medians[int(alpha * (resamples - 1))]
+  high = medians[int((1.0 - alpha) * (resamples - 1))]
+  return low, high
+
+def summarize(samples, confidence):
+  low, high = interval(samples, confidence)
+  return {'median': median(samples), 'low': low, 'high': high, 'n': len(samples)}
+
+""" Runs every case once and appends its samples to metrics (name -> list) """
+def run_scenarios(args, workdir, metrics):
+  ncpus = [int(n) for n in args.ncpu.split(',')]
+  duration = bench.duration(args.steps, args.time_step)
+  for name, map, densities, extra in bench.scenarios(workdir, args):
+    if args.scenario and not any(name.startswith(s) for s in args.scenario):
+      continue
+    for density in densities:
+      for ncpu in ncpus:
+        arguments = ['--map=' + map, '--density=%d' % density, '--ncpu=%d' % ncpu,
+                     '--seed=%d' % args.seed, '--time-step=%g' % args.time_step,
+                     '--duration=%d' % duration, '--verbose-level=0'] + extra
+        stats, _, _ = bench.run(args.binary, arguments, workdir)
+        if not stats or stats['step'] == 0:
+          continue
+        key = '%s/density=%d/ncpu=%d' % (name, density, ncpu)
+        steps = float(stats['step'])
+        metrics.setdefault(key + '/step', []).append(1000.0 * stats['wall'] / steps)
+        for p in PHASES:
+          metrics.setdefault(key + '/' + p, []).append(1000.0 * stats['phases'][p] / steps)
+
+""" Runs the microbenchmarks once and appends their samples to metrics """
+def run_microbench(args, metrics):
+  command = [args.microbench] + (['--lua=' + os.path.join(ROOT, 'scripts', 'car', 'IDM_MOBIL.lua')]
+                                 if args.microbench_lua else [])
+  try:
+    with open(os.devnull, 'w') as null:
+      output = subprocess.check_output(command, cwd=ROOT, stderr=null).decode()
+  except (OSError, subprocess.CalledProcessError) as e:
+    sys.stderr.write('Failed: %s (%s)\n' % (' '.join(command), e))
+    return
+  for line in output.splitlines():
+    if not line.strip():
+      continue
+    r = json.loads(line)
+    key = 'micro/%s/density=%d/threads=%d' % (r['benchmark'], r['density'], r['threads'])
+    metrics.setdefault(key, []).extend(r['ns_per_op'])
+
+def host():
+  return {'system': platform.system(), 'machine': platform.machine(), 'cpus': os.cpu_count(),
+          'node': platform.node()}
+
+""" Loads the baseline, or returns None if it cannot be compared on this machine """
+def load_baseline(filename, machine):
+  if not os.path.exists(filename):
+    sys.stderr.write('No baseline %s on this machine, record a baseline with make regress-baseline.\n' % filename)
+    return None
+  baseline = load(filename)
+  if baseline['host'] != machine:
+    sys.stderr.write('The baseline %s was recorded on another machine (%s), record a baseline with '
+                     'make regress-baseline.\n' % (filename, baseline['host'].get('node', 'unknown')))
+    return None
+  return baseline
+
+def unit(name):
+  return 'ns/op' if name.startswith('micro/') else 'ms/step'
+
+""" Compares two reports and returns the rows of the diff and the number of regressions """
+def compare(baseline, current, args):
+  rows = []
+  regressions = 0
+  for name in sorted(set(baseline['metrics']) | set(current['metrics'])):
+    if name not in baseline['metrics'] or name not in current['metrics']:
+      rows.append((name, baseline['metrics'].get(name), current['metrics'].get(name), None,
+                   'new' if name in current['metrics'] else 'missing'))
+      continue
+    b = summarize(baseline['metrics'][name], args.confidence)
+    c = summarize(current['metrics'][name], args.confidence)
+    change = (c['median'] / b['median'] - 1.0) * 100.0 if b['median'] > 0 else 0.0
+    overlap = c['low'] <= b['high'] and b['low'] <= c['high']
+    small = unit(name) == 'ms/step' and max(b['median'], c['median']) < MIN_PHASE_TIME
+    if abs(change) <= args.threshold or small:
+      status = 'ok'
+    elif overlap:
+      status = 'noise'
+    elif change > 0:
+      status = 'REGRESSION'
+      regressions += 1
+    else:
+      status = 'improved'
+    rows.append((name, b, c, change, status))
+  return rows, regressions
+
+def print_diff(rows, args, out):
+  def fmt(s):
+    if not s:
+      return '%-30s' % '-'
+    if isinstance(s, list):
+      s = summarize(s, args.confidence)
+    return '%9.4f [%9.4f, %9.4f]' % (s['median'], s['low'], s['high'])
+  out.write('%-52s %-30s %-30s %8s  %s\n' % ('metric', 'baseline median [CI]', 'current median [CI]',
+                                             'change', 'status'))
+  scenario = None
+  for name, b, c, change, status in rows:
+    # One block per scenario, one line per phase
+    case = name.rsplit('/', 1)[0]
+    if case != scenario:
+      out.write('\n')
+      scenario = case
+    out.write('%-52s %-30s %-30s %8s  %s\n' % (name, fmt(b), fmt(c),
+                                               '%+7.1f%%' % change if change is not None else '', status))
+
+def load(filename):
+  with open(filename) as f:
+    report = json.load(f)
+  if report.get('schema') != SCHEMA:
+    raise ValueError('%s has schema %s, expected %d' % (filename, report.get('schema'), SCHEMA))
+  return report
+
+def save(report, filename):
+  with open(filename, 'w') as f:
+    json.dump(report, f, indent=1, sort_keys=True)
+    f.write('\n')
+
+def main():
+  parser = argparse.ArgumentParser(description='Disim performance regression harness')
+  parser.add_argument('--binary', default=os.path.join(ROOT, 'disim'), help='The disim executable')
+  parser.add_argument('--microbench', help='Also run this disim_microbench executable')
+  parser.add_argument('--microbench-lua', action='store_true', help='Benchmark callThink with IDM_MOBIL.lua')
+  parser.add_argument('--baseline', default=BASELINE, help='The baseline report')
+  parser.add_argument('--update-baseline', action='store_true', help='Write the results as the new baseline')
+  parser.add_argument('--compare', metavar='REPORT', help='Compare an existing report instead of running')
+  parser.add_argument('--output', default='regress.json', help='The report with the raw samples')
+  parser.add_argument('--runs', type=int, default=5, help='The number of runs of each scenario')
+  parser.add_argument('--threshold', type=float, default=5.0, help='The tolerated slowdown [%%]')
+  parser.add_argument('--confidence', type=float, default=0.95, help='The level of the confidence intervals')
+  parser.add_argument('--ncpu', default='0,4', help='The values of --ncpu to sweep')
+  parser.add_argument('--steps', type=int, default=1000, help='The number of steps of each run')
+  parser.add_argument('--time-step', type=float, default=0.064, help='The time step [s]')
+  parser.add_argument('--seed', type=int, default=1, help='The seed of every run')
+  parser.add_argument('--scenario', action='append', help='Only run the scenarios starting with that name')
+  parser.add_argument('--quick', action='store_true', help='Fewer scenarios and steps')
+  args = parser.parse_args()
+
+  baseline = None
+  if args.compare:
+    current = load(args.compare)
+  else:
+    # Do not run for nothing
+    if not args.update_baseline:
+      baseline = load_baseline(args.baseline, host())
+      if not baseline:
+        return 2
+    if not os.access(args.binary, os.X_OK):
+      sys.stderr.write('%s not found, run make first.\n' % args.binary)
+      return 2
+    if args.quick:
+      args.steps //= 4
+    metrics = {}
+    workdir = tempfile.mkdtemp(prefix='disim-regress-')
+    for i in range(args.runs):
+      sys.stderr.write('Run %d/%d\n' % (i + 1, args.runs))
+      run_scenarios(args, workdir, metrics)
+      if args.microbench:
+        run_microbench(args, metrics)
+    shutil.rmtree(workdir, ignore_errors=True)
+    if not metrics:
+      sys.stderr.write('No scenario could be run.\n')
+      return 2
+    current = {
+      'schema': SCHEMA,
+      'version': bench.version(),
+      'date': time.strftime('%Y-%m-%dT%H:%M:%S'),
+      'host': host(),
+      'config': {'runs': args.runs, 'steps': args.steps, 'time_step': args.time_step, 'seed': args.seed,
+                 'ncpu': args.ncpu},
+      'metrics': metrics,
+    }
+    save(current, args.output)
+
+  if args.update_baseline:
+    save(current, args.baseline)
+    sys.stderr.write('Baseline written to %s.\n' % args.baseline)
+    return 0
+
+  if not baseline:
+    baseline = load_baseline(args.baseline, current['host'])
+    if not baseline:
+      return 2
+  if baseline['config'] != current['config']:
+    sys.stderr.write('Warning: the baseline was recorded with another configuration.\n')
+
+  rows, regressions = compare(baseline, current, args)
+  sys.stdout.write('Baseline %s (%s), current %s (%s), threshold %.1f%%, %d%% intervals\n' %
+                   (baseline['version'], baseline['date'], current['version'], current['date'],
+                    args.threshold, int(args.confidence * 100)))
+  print_diff(rows, args, sys.stdout)
+  sys.stdout.write('\n%d regression(s)\n' % regressions)
+  return 1 if regressions else 0
+
+if __name__ == '__main__':
+  sys.exit(main())
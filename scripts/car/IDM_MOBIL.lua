@@ -1,15 +1,79 @@
 --[[
 This LUA script implements the IDM from Martin Treiber:
 http://www.vwi.tu-dresden.de/~treiber/
+
+With LuaJIT, the speeds, positions and lengths of the car and of its
+neighbors are read from the FFI view given to think() (see LuaFFI.h)
+instead of through the car accessors.
 --]]
 
--- Variables specific to each car
-vars = {}
+-- Variables specific to each car, stored natively (slot i is the i-th name from 0)
+slots = { "v0", "a", "b", "gamma", "t", "s0", "b_safe", "p", "a_thr", "llc" }
+local V0, A, B, GAMMA, T, S0, B_SAFE, P, A_THR, LLC = 0, 1, 2, 3, 4, 5, 6, 7, 8, 9
+
+-- The slots of the car being controlled
+local v0, a, b, gamma, t, s0, b_safe, p, a_thr, llc
 
 function printf(...)
   io.stdout:write(string.format(...))
 end
 
+-- Kinematics of the car (at index ME) and of its neighbors (at their role),
+-- reused from one call to the next
+local ME = RIGHT_TRAIL + 1
+local present, speeds, rears, distances = {}, {}, {}, {}
+local front, position
+
+--[[
+Reads the slots of the car, from its FFI view if there is one.
+--]]
+local function load_slots(self, view)
+  if (view) then
+    local s = view.slots
+    v0, a, b, gamma, t, s0, b_safe, p, a_thr, llc =
+      s[V0], s[A], s[B], s[GAMMA], s[T], s[S0], s[B_SAFE], s[P], s[A_THR], s[LLC]
+  else
+    v0, a, b, gamma, t, s0, b_safe, p, a_thr, llc = self:getSlots()
+  end
+end
+
+--[[
+Reads the kinematics of the car, from its FFI view if there is one.
+--]]
+local function load_self(self, view)
+  if (view) then
+    front, position = view.front, view.position
+    speeds[ME], rears[ME] = view.speed, view.rear
+  else
+    front, rears[ME] = self:getGeometry()
+    speeds[ME] = self:getSpeed()
+    position = self:getPosition()
+  end
+  present[ME] = true
+end
+
+--[[
+Reads the kinematics of the neighbors from first to last (roles).
+--]]
+local function load_neighbors(neighbors, view, first, last)
+  for i = first, last do
+    if (view) then
+      local n = view.neighbors[i]
+      present[i] = (n.id >= 0)
+      distances[i], speeds[i], rears[i] = n.distance, n.speed, n.rear
+    else
+      local car = neighbors[i].car
+      distances[i] = neighbors[i].distance
+      present[i] = (car ~= nil)
+      if (car) then
+        local f
+        f, rears[i] = car:getGeometry()
+        speeds[i] = car:getSpeed()
+      end
+    end
+  end
+end
+
 --[[
 The init function: it initializes the variables
 of the self car depending on the type of vehicle it is.
@@ -49,69 +113,77 @@ function init(self, options)
   a_thr_arg = math.min(a_arg, a_truck_arg);
 
   -- Store necessary variables specific to that car
-  vars[self] = { v0 = v0_arg, a = a_arg, b = b_arg, gamma = gamma_arg, t = t_arg, s0 = s0_arg, b_safe = b_safe_arg, p = p_arg, a_thr = a_thr_arg, llc = 0.0 }
-
   if (self:getType() == TRUCK) then
-    vars[self].v0 = v0_truck_arg
-    vars[self].a = a_truck_arg
-    vars[self].b = b_arg
-    vars[self].gamma = gamma_arg
-    vars[self].t = t_truck_arg
-    vars[self].s0 = s0_truck_arg
-    vars[self].b_safe = b_safe_arg
-    vars[self].p = p_arg
-    vars[self].a_thr = a_thr_arg
-    vars[self].llc = 0.0
+    v0_arg = v0_truck_arg
+    a_arg = a_truck_arg
+    t_arg = t_truck_arg
+    s0_arg = s0_truck_arg
   end
+  self:setSlot(V0, v0_arg)
+  self:setSlot(A, a_arg)
+  self:setSlot(B, b_arg)
+  self:setSlot(GAMMA, gamma_arg)
+  self:setSlot(T, t_arg)
+  self:setSlot(S0, s0_arg)
+  self:setSlot(B_SAFE, b_safe_arg)
+  self:setSlot(P, p_arg)
+  self:setSlot(A_THR, a_thr_arg)
+  self:setSlot(LLC, 0.0)
 end
 
 --[[
 The think function: it performs the IDM and MOBIL algorithms.
+The view is only given by LuaJIT.
 --]]
-function think(self, dt, neighbors)
+function think(self, dt, neighbors, view)
   -- Declare variables
-  local speed_pref, dist, acceleration, lane_change
+  local lane, speed_pref, acceleration, lane_change
+
+  load_slots(self, view)
+  load_self(self, view)
+  load_neighbors(neighbors, view, LEAD, LEAD)
 
   -- Get prefered speed
-  speed_pref = self:getLane():getSpeedLimit()
-  if (speed_pref > vars[self].v0) then
-    speed_pref = vars[self].v0
+  lane = self:getLane()
+  speed_pref = lane:getSpeedLimit()
+  if (speed_pref > v0) then
+    speed_pref = v0
   end
 
   -- Compute IDM acceleration
-  acceleration = IDM(self, self:getLane(), self, neighbors[LEAD].car, speed_pref, neighbors[LEAD].distance)
+  acceleration = IDM(self, lane:getLengthLeft(self, position), ME, LEAD, speed_pref, distances[LEAD])
 
   -- If I have to exit the highway...
   if (self:getDestination()) then
-    vars[self].llc = vars[self].llc + 4*dt
+    llc = llc + 4*dt
   end
 
   lane_change = 0
-  if (vars[self].llc > 5.0) then
+  if (llc > 5.0) then
+    load_neighbors(neighbors, view, TRAIL, RIGHT_TRAIL)
     -- Perform MOBIL of the right lane
     if (self:isRightAllowed()) then
-      lane_change = MOBIL(self, self:getLane():getRight(), self, speed_pref, acceleration,
-                          neighbors[TRAIL].car, neighbors[TRAIL].distance,
-                          neighbors[LEAD].car, neighbors[LEAD].distance,
-                          neighbors[RIGHT_TRAIL].car, neighbors[RIGHT_TRAIL].distance,
-                          neighbors[RIGHT_LEAD].car, neighbors[RIGHT_LEAD].distance)
+      lane_change = MOBIL(self, lane:getRight(), lane, speed_pref, acceleration,
+                          TRAIL, LEAD, RIGHT_TRAIL, RIGHT_LEAD)
     end
     -- Perform MOBIL of the left lane
     if (lane_change == 0 and self:isLeftAllowed()) then
-      lane_change = -MOBIL(self, self:getLane():getLeft(), self, speed_pref, acceleration,
-                           neighbors[TRAIL].car, neighbors[TRAIL].distance,
-                           neighbors[LEAD].car, neighbors[LEAD].distance,
-                           neighbors[LEFT_TRAIL].car, neighbors[LEFT_TRAIL].distance,
-                           neighbors[LEFT_LEAD].car, neighbors[LEFT_LEAD].distance)
+      lane_change = -MOBIL(self, lane:getLeft(), lane, speed_pref, acceleration,
+                           TRAIL, LEAD, LEFT_TRAIL, LEFT_LEAD)
     end
 
     if (lane_change ~= 0) then
-      vars[self].llc = 0.0
+      llc = 0.0
     end
   end
 
   -- Update variables
-  vars[self].llc = vars[self].llc + dt;
+  llc = llc + dt;
+  if (view) then
+    view.slots[LLC] = llc
+  else
+    self:setSlot(LLC, llc)
+  end
 
   self:setAcceleration(acceleration)
   self:setLaneChange(lane_change)
@@ -122,40 +194,50 @@ The destroy function: it clears the variables of the
 self vehicle.
 --]]
 function destroy(self)
-  -- Remove the variables stored for that car
-  vars[self] = nil
+  -- The slots are freed with the car
+end
+
+--[[
+The migration functions: the car is moved to another LUA state (to
+balance the threads). All its variables are in the slots, which are
+kept, so there is nothing to carry over.
+--]]
+function migrate_out(self)
+  return nil
+end
+
+function migrate_in(self, data)
 end
 
 --[[
 This function performs the IDM using self's variables for the
 host vehicle behind the lead vehicle using a specific preferred
 speed, a specific leader speed and distance to that leading vehicle.
+The host and the lead are ME or a neighbor role, left is the distance
+left on the lane (see LuaLane:getLengthLeft()).
 --]]
-function IDM(self, lane, host, lead, speed_pref, dist)
+function IDM(self, left, host, lead, speed_pref, dist)
   -- Declare variables
-  local speed, s_star, dv, f, r, ndist, acceleration, nlead, lead_speed
+  local speed, s_star, dv, f, r, ndist, acceleration, lead_speed
 
   -- Check host
-  if (not host) then
+  if (not present[host]) then
     return 0
   end
 
   -- See if we need to merge or stop for a red light and set variables correctly
-  ndist = lane:getLengthLeft(self)
-  f = self:getGeometry()
-  nlead = nil
-  ndist = ndist - f
+  f = front
+  ndist = left - f
   if (ndist < 0) then
     ndist = 1000;
   end
   lead_speed = 0
   r = 0
-  if (lead) then
-    phi,r = lead:getGeometry()
+  if (lead and present[lead]) then
+    r = rears[lead]
     if (dist-f-r < ndist) then
-      nlead = lead
       ndist = dist - f - r
-      lead_speed = nlead:getSpeed()
+      lead_speed = speeds[lead]
     end
   end
   if (ndist < 0) then
@@ -163,17 +245,17 @@ function IDM(self, lane, host, lead, speed_pref, dist)
   end
 
   -- Current speed
-  speed = host:getSpeed()
+  speed = speeds[host]
 
   -- Get wanted range s*
   dv = speed - lead_speed
-  s_star = vars[self].s0 + speed*vars[self].t + speed*dv/(2*math.sqrt(vars[self].a*vars[self].b))
+  s_star = s0 + speed*t + speed*dv/(2*math.sqrt(a*b))
   if (s_star < 0) then
     s_star = 0
   end
 
   -- Compute IDM acceleration
-  acceleration = vars[self].a*(1 - (speed/speed_pref)^vars[self].gamma - s_star^2/ndist^2)
+  acceleration = a*(1 - (speed/speed_pref)^gamma - s_star^2/ndist^2)
   if (acceleration < -9.0) then
     acceleration = -9.0
   end
@@ -183,40 +265,39 @@ function IDM(self, lane, host, lead, speed_pref, dist)
 end
 
 --[[
-This function performs the MOBIL on the host using self's variables.
-It returns 1 if a lane change occurs.
+This function performs the MOBIL on self (on the lane hlane) using
+self's variables. The trail, lead, ntrail and nlead vehicles are
+given by their neighbor role. It returns 1 if a lane change occurs.
 --]]
-function MOBIL(self, lane, host, speed_pref, host_oacc,
-               trail, trail_dist, lead, lead_dist, ntrail, ntrail_dist, nlead, nlead_dist)
+function MOBIL(self, lane, hlane, speed_pref, host_oacc, trail, lead, ntrail, nlead)
   -- Declare variables
-  local ntrail_nacc, host_nacc, hlane, ntrail_oacc, otrail_oacc, otrail_nacc, dist_left
+  local ntrail_nacc, host_nacc, ntrail_oacc, otrail_oacc, otrail_nacc, dist_left, dlane
 
-  -- Check host
-  if ((not host) or (not lane)) then
+  -- Check lane
+  if (not lane) then
     return 0
   end
 
   -- Check merge direction: do not change lane in the wrong direction
-  hlane = host:getLane()
-  dist_left = lane:getLengthLeft(self)
+  dist_left = lane:getLengthLeft(self, position)
   if ((lane:getMergeDirection() == 1 and lane:getRight() == hlane and dist_left < 300) or
       (lane:getMergeDirection() == -1 and lane:getLeft() == hlane and dist_left < 300)) then
     return 0
   end
 
   -- Check the safety criterion for ntrail vehicle
-  ntrail_nacc = IDM(self, lane, ntrail, self, speed_pref, ntrail_dist)
-  if (ntrail_nacc < -vars[self].b_safe) then
+  ntrail_nacc = IDM(self, dist_left, ntrail, ME, speed_pref, distances[ntrail])
+  if (ntrail_nacc < -b_safe) then
     return 0
   end
 
   -- New rear vehicle acceleration
-  host_nacc = IDM(self, lane, self, nlead, speed_pref, nlead_dist)
+  host_nacc = IDM(self, dist_left, ME, nlead, speed_pref, distances[nlead])
 
   -- I am trying to enter the highway (More aggresive)
   if ((hlane:getMergeDirection() == 1 and hlane:getRight() == lane and dist_left < 200) or
       (hlane:getMergeDirection() == -1 and hlane:getLeft() == lane and dist_left < 200)) then
-    if (host_nacc < -2*vars[self].b_safe) then
+    if (host_nacc < -2*b_safe) then
       return 0
     else
       return 1
@@ -224,7 +305,7 @@ function MOBIL(self, lane, host, speed_pref, host_oacc,
   end
 
   -- Check safety for host vehicle
-  if (host_nacc < -vars[self].b_safe) then
+  if (host_nacc < -b_safe) then
     return 0
   end
 
@@ -283,10 +364,10 @@ function MOBIL(self, lane, host, speed_pref, host_oacc,
   end
 
   -- Check the benefits
-  ntrail_oacc = IDM(self, lane, ntrail, nlead, speed_pref, ntrail_dist + nlead_dist)
-  otrail_oacc = IDM(self, lane, trail, self, speed_pref, trail_dist)
-  otrail_nacc = IDM(self, lane, trail, lead, speed_pref, trail_dist + lead_dist)
-  if (host_nacc - host_oacc > vars[self].p*(otrail_oacc + ntrail_oacc - otrail_nacc - ntrail_nacc) + vars[self].a_thr) then
+  ntrail_oacc = IDM(self, dist_left, ntrail, nlead, speed_pref, distances[ntrail] + distances[nlead])
+  otrail_oacc = IDM(self, dist_left, trail, ME, speed_pref, distances[trail])
+  otrail_nacc = IDM(self, dist_left, trail, lead, speed_pref, distances[trail] + distances[lead])
+  if (host_nacc - host_oacc > p*(otrail_oacc + ntrail_oacc - otrail_nacc - ntrail_nacc) + a_thr) then
     return 1
   end
 
@@ -296,11 +377,14 @@ end
 
 --[[
 This function is an extra function linked with the LuaLane
-object. It returns the distance left on that lane in meters.
+object. It returns the distance left on that lane in meters
+(-1 if the lane does not end). The position of the car on the
+lane can be given if it is known.
 --]]
-function LuaLane:getLengthLeft(car)
+function LuaLane:getLengthLeft(car, p)
+  local ok, pf, traffic_light
   ok = false
-  p = car:getPosition()
+  p = p or car:getPosition()
   pf = 1000.0
   traffic_light = car:nextTrafficLight()
 
@@ -16,9 +16,16 @@ The LUA script need to provide 1 function, namely update().
 update() takes 2 arguments:
  - self: which is a pointer to the infrastructure that this script is controlling.
  - t: which is the current simulation time in seconds.
- - dt: which is the current simulation time step.
+ - dt: which is the time elapsed since the previous call to update().
 It should not return any value.
 
+update() is called at every time step unless --control-period is given.
+Alternatively, the script can provide several update functions with their own
+period and phase (in seconds) in a global array:
+  controllers = { { update = meter, period = 30 }, { update = limit, period = 60, phase = 5 } }
+
+Relative paths given to io.open(), dofile(), ... are relative to the script directory.
+
 The LUA API is documented at: http://en.wikibooks.org/wiki/Disim_Highway_Simulator/The_LUA_API
 
 --]]
@@ -0,0 +1,339 @@
+#!/usr/bin/env python3
+
+"""
+Generates freeway scenarios of any size: a map, its demand and a control script.
+
+./scripts/generator/generate.py --output=maps/generated/freeway --length=100
+./scripts/generator/generate.py --output=/tmp/huge --length=1000 --lanes=7 --seed=3
+./disim --map=/tmp/huge.map --luacontrol=/tmp/huge.lua --density=140
+
+The freeway starts with an entry segment feeding every lane and is then made
+of segments of --segment-length meters. Interchanges (an off-ramp followed by
+a metered on-ramp) are placed every --ramp-spacing km on average, groups of
+density and flow sensors (one per lane) every --sensor-spacing km, and a
+fraction --curvature of the other segments are curves. A fraction --markings
+of the straight segments get a solid line between two lanes.
+
+Three files are written next to each other:
+  PREFIX.map         The map.
+  PREFIX_demand.txt  The entry rates [veh/h] of the mainline and of every
+                     on-ramp during a day (morning and evening peaks), one
+                     line per entry: name, then one rate per --demand-step.
+  PREFIX.lua         The control script: it sets the entry rates from the
+                     demand file by time of day and meters the on-ramps
+                     with ALINEA on the mainline density upstream of them.
+
+The same seed and parameters always produce the same files. To put about a
+million vehicles in flight, fill a long map at its creation, e.g.
+--length=1000 --lanes=7 with --density=140 (veh/km/lane).
+"""
+
+import argparse, math, os, random, sys
+
+# Fixed lengths of the interchange segments [m] (as in maps/I-210W.map)
+EXIT_LENGTH = 200
+RAMP_GAP = 100
+ENTRY_LENGTH = 240
+MERGE_LENGTH = 60
+METER_POSITION = 140
+SENSOR_LENGTH = 500
+JAM_DENSITY = 150  # [veh/km/lane]
+
+class Writer:
+  def __init__(self, f):
+    self.f = f
+    self.segments = 0
+
+  def line(self, *fields):
+    text = ','.join(str(x) for x in fields)
+    # The map reader reads lines of up to 99 characters
+    assert len(text) < 99, text
+    self.f.write(text + '\n')
+
+  def segment(self, geometry, *values):
+    self.f.write('\n')
+    self.line('$SEGMENT', geometry, *values)
+    self.segments += 1
+
+def num(x):
+  return ('%.3f' % x).rstrip('0').rstrip('.')
+
+def mean(rates):
+  return '%.0f' % (sum(rates) / len(rates))
+
+""" The demand of an entry during a day: a base level with a morning and an evening peak """
+def profile(r, base, step):
+  morning = 8.0 + r.uniform(-0.5, 0.5)
+  evening = 17.5 + r.uniform(-0.5, 0.5)
+  scale = r.uniform(0.7, 1.3)
+  rates = []
+  for k in range(int(86400 // step)):
+    h = k * step / 3600.0
+    shape = 0.25 + 0.75 * math.exp(-((h - morning) / 1.2) ** 2) + 0.6 * math.exp(-((h - evening) / 1.5) ** 2)
+    rates.append(max(0.0, base * scale * min(shape, 1.0) * r.uniform(0.9, 1.1)))
+  return rates
+
+def generate(prefix, args):
+  r = random.Random(args.seed)
+  lanes = args.lanes
+  length = args.length * 1000.0
+  name = os.path.basename(prefix)
+  demand = []  # (name, rates)
+  meters = []  # (actuator, queue sensor, mainline density sensors)
+  sensors = 0
+  ramps = 0
+  heading = 0.0  # [degrees], kept within +-90 so that the road does not spiral
+  position = 0.0
+  next_ramp = args.ramp_spacing * 1000.0 * r.uniform(0.5, 1.5) if args.ramp_spacing > 0 else float('inf')
+  next_sensor = args.sensor_spacing * 1000.0 if args.sensor_spacing > 0 else float('inf')
+  log = 'log' if args.log_sensors else 'nolog'
+
+  with open(prefix + '.map', 'w') as f:
+    w = Writer(f)
+    f.write('# Generated by scripts/generator/generate.py (seed %d)\n\n' % args.seed)
+    w.line('$NAME', 'Generated freeway %s' % name)
+    w.line('$LANE_WIDTH', num(args.lane_width))
+
+    # The mainline entry
+    w.segment('straight', 200)
+    w.line('$TYPE', 'entry', 'left')
+    w.line('$SPEED', num(args.speed))
+    w.line('$NUM_LANES', 0, lanes)
+    # Without the control script, the entries keep their mean demand
+    demand.append(('mainline', profile(r, args.mainline_demand, args.demand_step)))
+    for l in range(lanes):
+      w.line('$LANE', l, mean(demand[-1][1]), 'mainline')
+    position += 200
+
+    while position < length:
+      if position >= next_ramp and position + EXIT_LENGTH + RAMP_GAP + ENTRY_LENGTH + MERGE_LENGTH < length:
+        ramps += 1
+        # Off-ramp
+        w.segment('straight', EXIT_LENGTH)
+        w.line('$TYPE', 'exit', 'right')
+        w.line('$NUM_LANES', lanes, 1)
+        w.line('$LANE', lanes, num(r.uniform(args.exit_ratio * 0.5, args.exit_ratio * 1.5)), 'off%d' % ramps)
+        w.segment('straight', RAMP_GAP)
+        w.line('$NUM_LANES', lanes)
+        # Metered on-ramp, with the mainline density just upstream of the merge
+        meter = 'meter%d' % ramps
+        w.segment('straight', ENTRY_LENGTH)
+        w.line('$TYPE', 'entry', 'right')
+        w.line('$NUM_LANES', lanes, 1)
+        demand.append(('on%d' % ramps, profile(r, args.ramp_demand, args.demand_step)))
+        w.line('$LANE', lanes, mean(demand[-1][1]), 'on%d' % ramps)
+        w.line('$RIGHT_MARKING', lanes - 1, 0, METER_POSITION, 'solid')
+        w.line('$LEFT_MARKING', lanes, 0, METER_POSITION, 'solid')
+        w.line('$TRAFFIC_LIGHT', meter, lanes, METER_POSITION)
+        w.line('$DENSITY_SENSOR', meter + '_queue', lanes, 1, METER_POSITION, 'nolog')
+        densities = []
+        for l in range(lanes):
+          densities.append('%s_density_%d' % (meter, l + 1))
+          w.line('$DENSITY_SENSOR', densities[-1], l, 10, ENTRY_LENGTH - 10, log)
+        w.segment('straight', MERGE_LENGTH)
+        w.line('$TYPE', 'none', 'left')
+        w.line('$NUM_LANES', lanes)
+        meters.append((meter, meter + '_queue', densities))
+        sensors += lanes + 1
+        position += EXIT_LENGTH + RAMP_GAP + ENTRY_LENGTH + MERGE_LENGTH
+        next_ramp = position + args.ramp_spacing * 1000.0 * r.uniform(0.5, 1.5)
+
+      elif position >= next_sensor:
+        # A group of sensors on a straight segment
+        group = int(next_sensor // (args.sensor_spacing * 1000.0))
+        w.segment('straight', SENSOR_LENGTH)
+        w.line('$NUM_LANES', lanes)
+        for l in range(lanes):
+          w.line('$DENSITY_SENSOR', 's%d_density_%d' % (group, l + 1), l, 10, SENSOR_LENGTH - 10, log)
+          w.line('$FLOW_SENSOR', 's%d_flow_%d' % (group, l + 1), l, SENSOR_LENGTH // 2, log)
+        sensors += 2 * lanes
+        position += SENSOR_LENGTH
+        next_sensor += args.sensor_spacing * 1000.0
+
+      elif r.random() < args.curvature:
+        radius = r.uniform(args.min_radius, args.max_radius)
+        angle = args.segment_length / radius * 180.0 / math.pi
+        # Random turns, but always back towards the main direction past 45 degrees
+        if abs(heading) > 45.0:
+          angle = -math.copysign(angle, heading)
+        elif r.random() < 0.5:
+          angle = -angle
+        heading += angle
+        w.segment('circular', num(radius), num(angle))
+        w.line('$NUM_LANES', lanes)
+        position += args.segment_length
+
+      else:
+        w.segment('straight', num(args.segment_length))
+        w.line('$NUM_LANES', lanes)
+        if lanes > 1 and r.random() < args.markings:
+          l = r.randrange(lanes - 1)
+          w.line('$RIGHT_MARKING', l, 0, num(args.segment_length), 'solid')
+          w.line('$LEFT_MARKING', l + 1, 0, num(args.segment_length), 'solid')
+        position += args.segment_length
+
+  with open(prefix + '_demand.txt', 'w') as f:
+    f.write('# Entry rates [veh/h] every %d s from 00:00 (the mainline rate is per lane)\n' % args.demand_step)
+    for entry, rates in demand:
+      f.write('%s %s\n' % (entry, ' '.join('%.0f' % x for x in rates)))
+
+  with open(prefix + '.lua', 'w') as f:
+    f.write(CONTROL % {
+      'map': name + '.map',
+      'demand': name + '_demand.txt',
+      'step': args.demand_step,
+      'metering': 'true' if args.metering else 'false',
+      'critical': num(args.critical_density),
+      'meters': ',\n  '.join('{ actuator = "%s", queue = "%s", density = { %s } }' %
+                             (m, q, ', '.join('"%s"' % d for d in ds)) for m, q, ds in meters),
+    })
+
+  return {
+    'segments': w.segments,
+    'length_km': position / 1000.0,
+    'lane_km': position / 1000.0 * lanes,
+    'ramps': ramps,
+    'sensors': sensors,
+    'max_vehicles': int(position / 1000.0 * lanes * JAM_DENSITY),
+  }
+
+CONTROL = '''--[[
+Generated by scripts/generator/generate.py for: %(map)s
+
+Sets the entry rates of the mainline and of the on-ramps every minute from
+%(demand)s (by time of day, see --start-time), and meters the
+on-ramps with ALINEA on the mainline density upstream of each of them.
+--]]
+
+demand_file = "%(demand)s"
+demand_step = %(step)d  -- [s]
+metering = %(metering)s
+critical_density = %(critical)s  -- [veh/km/lane]
+K_alinea = 0.1
+meters = {
+  %(meters)s
+}
+
+demand = {}
+entries = {}
+
+function init(self)
+  -- The path is relative to this script
+  for line in io.lines(demand_file) do
+    if (line:sub(1, 1) ~= "#") then
+      local rates = {}
+      local name = nil
+      for field in line:gmatch("%%S+") do
+        if (name == nil) then name = field else table.insert(rates, tonumber(field)) end
+      end
+      if (name ~= nil) then demand[name] = rates end
+    end
+  end
+  for i, lane in ipairs(self:getEntryLanes()) do
+    if (demand[lane:getName()] ~= nil) then
+      table.insert(entries, lane)
+    end
+  end
+  for i, m in ipairs(meters) do
+    m.light = self:getRoadActuator(m.actuator)
+    m.sensors = {}
+    for j, d in ipairs(m.density) do
+      m.sensors[j] = self:getRoadSensor(d)
+    end
+    m.green = 3
+    m.red = metering and 3 or 0
+    m.lastchange = 0
+  end
+end
+
+-- Every minute: entry rates of the current time of day
+function update_demand(self, t, dt)
+  local h, m = self:getTimeOfDay(t):match("(%%d+):(%%d+)")
+  local k = math.floor((tonumber(h)*3600 + tonumber(m)*60)/demand_step) + 1
+  for i, lane in ipairs(entries) do
+    local rates = demand[lane:getName()]
+    lane:setEntryRate(rates[math.min(k, #rates)])
+  end
+end
+
+-- Every second: the ramp meter lights
+function update_lights(self, t, dt)
+  for i, m in ipairs(meters) do
+    m.lastchange = m.lastchange + dt
+    if (m.red <= 0) then
+      m.light:green()
+    elseif (m.light:getColor() == RED and m.lastchange > m.red) then
+      m.lastchange = 0
+      m.light:green()
+    elseif (m.light:getColor() == GREEN and m.lastchange > m.green) then
+      m.lastchange = 0
+      m.light:red()
+    end
+  end
+end
+
+-- Every minute: ALINEA on the red time
+function update_metering(self, t, dt)
+  for i, m in ipairs(meters) do
+    local density = 0
+    for j, s in ipairs(m.sensors) do
+      density = density + s:getValue()
+    end
+    density = density / #m.sensors
+    m.red = math.max(0, math.min(50, m.red + (density - critical_density)*K_alinea))
+  end
+end
+
+controllers = {
+  { update = update_demand, period = 60 },
+  { update = update_lights, period = 1 },
+}
+if (metering) then
+  table.insert(controllers, { update = update_metering, period = 60, phase = 30 })
+end
+
+function destroy(self)
+end
+'''
+
+def parser():
+  p = argparse.ArgumentParser(description='Disim scenario generator')
+  p.add_argument('--output', required=True, help='The prefix of the generated files')
+  p.add_argument('--seed', type=int, default=1, help='The random seed')
+  p.add_argument('--length', type=float, default=50.0, help='The length of the freeway [km]')
+  p.add_argument('--lanes', type=int, default=3, help='The number of lanes')
+  p.add_argument('--lane-width', type=float, default=3.5, help='The lane width [m]')
+  p.add_argument('--speed', type=float, default=105.0, help='The speed limit [km/h]')
+  p.add_argument('--segment-length', type=float, default=500.0, help='The length of the plain segments [m]')
+  p.add_argument('--ramp-spacing', type=float, default=2.0, help='The mean distance between interchanges [km] (0 for none)')
+  p.add_argument('--sensor-spacing', type=float, default=1.0, help='The distance between sensor groups [km] (0 for none)')
+  p.add_argument('--log-sensors', action='store_true', help='Record the sensor groups with --record')
+  p.add_argument('--curvature', type=float, default=0.3, help='The fraction of curved segments')
+  p.add_argument('--min-radius', type=float, default=800.0, help='The smallest curve radius [m]')
+  p.add_argument('--max-radius', type=float, default=3000.0, help='The largest curve radius [m]')
+  p.add_argument('--markings', type=float, default=0.05, help='The fraction of straight segments with a solid line')
+  p.add_argument('--mainline-demand', type=float, default=1500.0, help='The peak mainline demand [veh/h/lane]')
+  p.add_argument('--ramp-demand', type=float, default=600.0, help='The peak on-ramp demand [veh/h]')
+  p.add_argument('--exit-ratio', type=float, default=0.05, help='The mean fraction of vehicles leaving at each off-ramp')
+  p.add_argument('--demand-step', type=int, default=300, help='The time step of the demand profiles [s]')
+  p.add_argument('--critical-density', type=float, default=27.0, help='The ALINEA target density [veh/km/lane]')
+  p.add_argument('--no-metering', dest='metering', action='store_false', help='Leave the ramp meters green')
+  return p
+
+def main():
+  args = parser().parse_args()
+  if args.lanes < 1 or args.length <= 0 or args.segment_length <= 0:
+    sys.stderr.write('The length and the number of lanes must be positive.\n')
+    return 1
+  directory = os.path.dirname(args.output)
+  if directory and not os.path.isdir(directory):
+    os.makedirs(directory)
+  summary = generate(args.output, args)
+  sys.stderr.write('%s.map: %.1f km, %d segments, %.0f lane-km, %d interchanges, %d sensors, '
+                   'up to %d vehicles\n' % (args.output, summary['length_km'], summary['segments'],
+                                            summary['lane_km'], summary['ramps'], summary['sensors'],
+                                            summary['max_vehicles']))
+  return 0
+
+if __name__ == '__main__':
+  sys.exit(main())
@@ -209,9 +209,9 @@ bool Car::isTracked()
   return is_tracked;
 }
 
-void Car::simulate(double dt, vector<neighbor_t> &neighbors, bool fake)
+void Car::simulate(double dt, vector<neighbor_t> &neighbors, bool fake, bool think)
 {
-  control->think(dt, neighbors);
+  if (think) control->think(dt, neighbors);
 
   if (!fake) time_alive += dt;
 }
@@ -230,8 +230,10 @@ class Car {
    * This function directly calls the control.
    * @param dt time difference between the last call and now.
    * @param neighbors other nearby cars on which the control can plan.
+   * @param fake if true, the time alive of the car is not updated.
+   * @param think if false, the control is not called (its commands were already set, e.g. by a batched controller).
    */
-  void simulate(double dt, vector<neighbor_t> &neighbors, bool fake = false);
+  void simulate(double dt, vector<neighbor_t> &neighbors, bool fake = false, bool think = true);
 
   /**
    * Sets the current lane of the car. This does not
@@ -11,11 +11,14 @@
 #define MAX(x,y) (((x)>(y))?(x):(y))
 #define MIN(x,y) (((x)<(y))?(x):(y))
 
+vector<string> CarControl::slot_names;
+
 CarControl::CarControl(Car *self, gengetopt_args_info *options)
 {
   this->a = 0.0;
   this->l = 0;
   this->self = self;
+  this->slots.assign(slot_names.size(), 0.0);
 
 #ifdef LUA
   this->luaCar = new LuaCar(NULL);
@@ -39,6 +42,48 @@ CarControl::~CarControl()
 #endif
 }
 
+void CarControl::setSlotNames(const vector<string> &names)
+{
+  slot_names = names;
+}
+
+int CarControl::getSlotIndex(const char *name)
+{
+  for (unsigned int i = 0; i < slot_names.size(); i++) {
+    if (slot_names[i] == name) return i;
+  }
+  return -1;
+}
+
+const vector<string> &CarControl::getSlotNames()
+{
+  return slot_names;
+}
+
+double CarControl::getSlot(int i)
+{
+  if (i < 0 || i >= (int)slots.size()) return 0.0;
+  return slots[i];
+}
+
+void CarControl::setSlot(int i, double v)
+{
+  if (i < 0) return;
+  // The slots may have been declared after this car was created
+  if (i >= (int)slots.size()) slots.resize(i+1, 0.0);
+  slots[i] = v;
+}
+
+vector<double> &CarControl::getSlots()
+{
+  return slots;
+}
+
+void CarControl::clearSlots()
+{
+  slots.assign(slot_names.size(), 0.0);
+}
+
 void CarControl::think(double dt, vector<neighbor_t> &neighbors)
 {
 #ifdef LUA
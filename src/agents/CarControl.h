@@ -2,6 +2,7 @@
 #define CAR_CONTROL_H
 
 #include <vector>
+#include <string>
 #include <cmdline.h>
 
 #ifdef LUA
@@ -83,6 +84,55 @@ class CarControl {
    */
   Car *getCar();
 
+  /**
+   * Declares the per-vehicle slots (named numeric variables) shared by
+   * all the controllers. This is done by LuaBinding when a script
+   * defines the global <em>slots</em> array, but native controllers can
+   * declare their own. Existing cars keep their values until clearSlots().
+   * @param names The slot names, a slot index is its position in that vector.
+   */
+  static void setSlotNames(const vector<string> &names);
+
+  /**
+   * Gets the index of a slot. This should be looked up once and not at
+   * every step.
+   * @param name The slot name.
+   * @return The index or -1 if there is no slot with that name.
+   */
+  static int getSlotIndex(const char *name);
+
+  /**
+   * Gets the declared slots.
+   * @return The slot names.
+   */
+  static const vector<string> &getSlotNames();
+
+  /**
+   * Gets the value of a slot.
+   * @param i The slot index.
+   * @return The value (0 if the slot was never set).
+   */
+  double getSlot(int i);
+
+  /**
+   * Sets the value of a slot.
+   * @param i The slot index.
+   * @param v The value.
+   */
+  void setSlot(int i, double v);
+
+  /**
+   * Gets all the slot values of this car (e.g. to save them). The
+   * values are stored contiguously in the order of getSlotNames().
+   * @return The slot values.
+   */
+  vector<double> &getSlots();
+
+  /**
+   * Resets all the slots to 0.
+   */
+  void clearSlots();
+
 #ifdef LUA
   /**
    * Gets the LUA object corresponding to this CarControl.
@@ -103,6 +153,8 @@ class CarControl {
   Car *self;
   double random_uniform();
   double random_normal();
+  vector<double> slots;
+  static vector<string> slot_names;
 
 #ifdef LUA
   LuaCar *luaCar;
@@ -7,6 +7,8 @@ CarState::CarState()
   yaw = 0.0;
   steering_angle = 0.0;
   speed = 0.0;
+  lane = NULL;
+  position = 0.0;
 }
 
 CarState::~CarState()
@@ -0,0 +1,381 @@
+/*!
+ * \file MicroBench.cpp
+ * \brief Microbenchmarks of the hot primitives of the simulator
+ *
+ * ./disim_microbench [disim options]
+ *
+ * Each benchmark runs on a synthetic corridor (built with the real Map,
+ * Lane and Simulator classes) filled at several densities. The results are
+ * printed on stdout as one JSON object per line with the time per operation
+ * of every sample, and as a table on stderr. The options are the ones of
+ * disim (e.g. --lua=scripts/car/IDM_MOBIL.lua to benchmark callThink), except
+ * --map, --density and --ncpu which are set by the benchmark. With a script
+ * that can be moved between LUA states (2 by default), migrate() is also
+ * checked: the run fails if a car does not keep its slot values.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <algorithm>
+#include <vector>
+#include <string>
+
+#include <engine/Simulator.h>
+#include <utils/Stats.h>
+#include <utils/Memory.h>
+#include <cmdline.h>
+
+#ifdef LUA
+#include <bindings/lua/LuaBinding.h>
+#endif
+
+#define SAMPLES 7
+#define MIN_SAMPLE_TIME 0.05  // [s]
+#define CORRIDOR_SEGMENTS 5   // of 1 km
+#define MAX_THREADS 4
+
+using namespace std;
+
+class MicroBench;
+typedef long (MicroBench::*bench_t)();
+
+/**
+ * @brief Microbenchmarks of the simulator.
+ *
+ * It is a friend of Simulator to reach its private primitives.
+ */
+class MicroBench {
+ public:
+  MicroBench(int argc, char **argv);
+  ~MicroBench();
+  int run();
+
+ private:
+  int setUp(int density);
+  void tearDown();
+  void measure(const char *name, bench_t bench, int threads = 1);
+
+  long benchNeighbors();
+  long benchTrigger();
+  long benchTriggerCrossing();
+  long benchExchange();
+#ifdef LUA
+  long benchThink();
+  long benchPushCold();
+  long benchPushWarm();
+  long benchMigrate();
+#endif
+  static void *exchangeThread(void *ptr);
+
+  vector<string> arguments;
+  char filename[64];
+  int density;
+  int nthreads;
+  gengetopt_args_info options;
+  bool parsed;
+  bool failed;
+  Map *map;
+  Simulator *simulator;
+  vector<Car *> cars;
+  vector< vector<neighbor_t> > neighbors;
+  RoadSensor *sensor;
+#ifdef LUA
+  lua_State *L;
+#endif
+};
+
+typedef struct {
+  MicroBench *bench;
+  int id;
+  long ops;
+} exchange_arg_t;
+
+MicroBench::MicroBench(int argc, char **argv)
+{
+  for (int i = 1; i < argc; i++) arguments.push_back(argv[i]);
+  strcpy(filename, "/tmp/disim-microbench-XXXXXX");
+  int fd = mkstemp(filename);
+  if (fd >= 0) close(fd);
+  parsed = false;
+  failed = false;
+  map = NULL;
+  simulator = NULL;
+  sensor = NULL;
+  nthreads = 1;
+#ifdef LUA
+  L = NULL;
+#endif
+}
+
+MicroBench::~MicroBench()
+{
+  tearDown();
+  unlink(filename);
+}
+
+int MicroBench::setUp(int density)
+{
+  tearDown();
+  this->density = density;
+
+  // A straight corridor of 3 lanes with sensors in its middle
+  FILE *f = fopen(filename, "w");
+  if (!f) {
+    fprintf(stderr, "Unable to write the map to %s.\n", filename);
+    return -1;
+  }
+  fprintf(f, "$NAME,Microbenchmark corridor\n$LANE_WIDTH,3.5\n");
+  for (int i = 0; i < CORRIDOR_SEGMENTS; i++) {
+    fprintf(f, "$SEGMENT,straight,1000\n$SPEED,120\n$NUM_LANES,3\n");
+    if (i == CORRIDOR_SEGMENTS/2) {
+      fprintf(f, "$DENSITY_SENSOR,density,1,400,600,nolog\n");
+      fprintf(f, "$SPEED_SENSOR,speed,1,500,nolog\n");
+      fprintf(f, "$FLOW_SENSOR,flow,1,500,nolog\n");
+    }
+  }
+  fclose(f);
+
+  // The options of disim with the corridor
+  vector<string> args;
+  char buffer[128];
+  args.push_back("disim_microbench");
+  args.push_back(string("--map=") + filename);
+  snprintf(buffer, sizeof(buffer), "--density=%d", density);
+  args.push_back(buffer);
+  args.push_back("--ncpu=0");
+  args.push_back("--lua-states=2");
+  args.insert(args.end(), arguments.begin(), arguments.end());
+  vector<char *> argv;
+  for (unsigned int i = 0; i < args.size(); i++) argv.push_back((char *)args[i].c_str());
+  if (cmdline_parser(argv.size(), &argv[0], &options) != 0) return -1;
+  parsed = true;
+  if (options.memory_stats_flag) Memory::enable();
+
+  map = new Map(&options);
+  simulator = new Simulator(&options, map);
+  for (int i = 0; i < simulator->getCarsCount(); i++) cars.push_back(simulator->getCar(i));
+  neighbors.resize(cars.size());
+  for (unsigned int i = 0; i < cars.size(); i++) simulator->getNeighbors(cars[i], &neighbors[i]);
+  sensor = map->sensors.empty() ? NULL : map->sensors[0];
+  return 0;
+}
+
+void MicroBench::tearDown()
+{
+  cars.clear();
+  neighbors.clear();
+  delete simulator;
+  simulator = NULL;
+  delete map;
+  map = NULL;
+  sensor = NULL;
+  if (parsed) cmdline_parser_free(&options);
+  parsed = false;
+}
+
+void MicroBench::measure(const char *name, bench_t bench, int threads)
+{
+  nthreads = threads;
+  (this->*bench)();  // Warm up
+
+  vector<double> samples;
+  long total = 0;
+  for (int s = 0; s < SAMPLES; s++) {
+    long ops = 0;
+    double start = Stats::now(), elapsed = 0.0;
+    do {
+      ops += (this->*bench)();
+      elapsed = Stats::now() - start;
+    } while (elapsed < MIN_SAMPLE_TIME && ops > 0);
+    if (!ops) return;
+    samples.push_back(elapsed/(double)ops*1e9);
+    total += ops;
+  }
+
+  printf("{\"benchmark\": \"%s\", \"density\": %d, \"cars\": %u, \"threads\": %d, \"ops\": %ld, \"ns_per_op\": [",
+         name, density, (unsigned int)cars.size(), threads, total);
+  for (unsigned int s = 0; s < samples.size(); s++) printf("%s%.2f", (s ? ", " : ""), samples[s]);
+  printf("]}\n");
+  fflush(stdout);
+
+  sort(samples.begin(), samples.end());
+  fprintf(stderr, "%-24s density=%-4d cars=%-6u threads=%-2d %10.1f ns/op (min %.1f, max %.1f)\n", name, density,
+          (unsigned int)cars.size(), threads, samples[samples.size()/2], samples.front(), samples.back());
+}
+
+long MicroBench::benchNeighbors()
+{
+  for (unsigned int i = 0; i < cars.size(); i++) {
+    neighbors[i].clear();
+    simulator->getNeighbors(cars[i], &neighbors[i]);
+  }
+  return cars.size();
+}
+
+long MicroBench::benchTrigger()
+{
+  // Mostly cars that do not cross the sensor
+  long ops = 0;
+  for (unsigned int i = 0; i < cars.size(); i++) {
+    if (cars[i]->getLane() != sensor->lane) continue;
+    double p = cars[i]->getPosition();
+    sensor->trigger(cars[i], p, p + cars[i]->getSpeed()*0.064);
+    ops++;
+  }
+  return ops;
+}
+
+long MicroBench::benchTriggerCrossing()
+{
+  // Every call counts a car
+  long ops = 0;
+  for (unsigned int i = 0; i < cars.size(); i++) {
+    if (cars[i]->getLane() != sensor->lane) continue;
+    sensor->trigger(cars[i], 499.5, 500.5);
+    ops++;
+  }
+  return ops;
+}
+
+void *MicroBench::exchangeThread(void *ptr)
+{
+  exchange_arg_t *arg = (exchange_arg_t *)ptr;
+  MicroBench *b = arg->bench;
+  arg->ops = 0;
+
+  // Each thread moves its own cars back and forth between two lanes
+  for (unsigned int i = arg->id; i < b->cars.size(); i += b->nthreads) {
+    Car *car = b->cars[i];
+    Lane *l = car->getLane();
+    Lane *n = l->left ? l->left : l->right;
+    if (!n) continue;
+    b->simulator->exchangeCar(car, l, n, true);
+    b->simulator->exchangeCar(car, n, l, true);
+    arg->ops += 2;
+  }
+  return NULL;
+}
+
+long MicroBench::benchExchange()
+{
+  pthread_t threads[MAX_THREADS];
+  exchange_arg_t args[MAX_THREADS];
+  for (int t = 0; t < nthreads; t++) {
+    args[t].bench = this;
+    args[t].id = t;
+    pthread_create(&threads[t], NULL, exchangeThread, &args[t]);
+  }
+  long ops = 0;
+  for (int t = 0; t < nthreads; t++) {
+    pthread_join(threads[t], NULL);
+    ops += args[t].ops;
+  }
+  return ops;
+}
+
+#ifdef LUA
+long MicroBench::benchThink()
+{
+  for (unsigned int i = 0; i < cars.size(); i++) {
+    LuaBinding::getInstance().callThink(cars[i]->getControl()->getLuaCar(), 0.064, neighbors[i]);
+  }
+  return cars.size();
+}
+
+long MicroBench::benchPushCold()
+{
+  // The first push of each car to a state creates its userdata (the time
+  // includes creating and closing the state)
+  L = luaL_newstate();
+  Lunar<LuaCar>::Register(L);
+  for (unsigned int i = 0; i < cars.size(); i++) {
+    Lunar<LuaCar>::push(L, cars[i]->getControl()->getLuaCar());
+    lua_pop(L, 1);
+  }
+  lua_close(L);
+  L = NULL;
+  return cars.size();
+}
+
+long MicroBench::benchPushWarm()
+{
+  if (!L) {
+    L = luaL_newstate();
+    Lunar<LuaCar>::Register(L);
+  }
+  for (unsigned int i = 0; i < cars.size(); i++) {
+    Lunar<LuaCar>::push(L, cars[i]->getControl()->getLuaCar());
+    lua_pop(L, 1);
+  }
+  return cars.size();
+}
+
+long MicroBench::benchMigrate()
+{
+  // Every car goes to the next state and back
+  if (failed) return 0;
+  LuaBinding &binding = LuaBinding::getInstance();
+  int n = binding.getStateCount();
+  for (unsigned int i = 0; i < cars.size(); i++) {
+    CarControl *control = cars[i]->getControl();
+    LuaCar *car = control->getLuaCar();
+    vector<double> slots = control->getSlots();
+    int state = car->getState();
+    if (binding.migrate(car, (state + 1) % n) || binding.migrate(car, state) || control->getSlots() != slots) {
+      fprintf(stderr, "Car %d did not keep its slots when moved to another LUA state.\n", cars[i]->getID());
+      failed = true;
+      return 0;
+    }
+  }
+  return 2*cars.size();
+}
+#endif
+
+int MicroBench::run()
+{
+  static const int densities[] = {10, 40, 100};
+
+  for (unsigned int d = 0; d < sizeof(densities)/sizeof(densities[0]); d++) {
+    if (setUp(densities[d])) return -1;
+
+    measure("getNeighbors", &MicroBench::benchNeighbors);
+    if (sensor) {
+      measure("RoadSensor::trigger", &MicroBench::benchTrigger);
+      measure("RoadSensor::trigger/cross", &MicroBench::benchTriggerCrossing);
+    }
+#ifdef LUA
+    if (options.lua_given) {
+      measure("LuaBinding::callThink", &MicroBench::benchThink);
+    }
+    if (options.lua_given && LuaBinding::getInstance().getStateCount() > 1 && LuaBinding::getInstance().canMigrate()) {
+      // Values that init() does not give, so that a car initialized again is noticed
+      for (unsigned int i = 0; i < cars.size(); i++) {
+        vector<double> &slots = cars[i]->getControl()->getSlots();
+        for (unsigned int k = 0; k < slots.size(); k++) slots[k] = cars[i]->getID() + 0.125*k;
+      }
+      measure("LuaBinding::migrate", &MicroBench::benchMigrate);
+      if (failed) return -1;
+    }
+    measure("Lunar::push/cold", &MicroBench::benchPushCold);
+    measure("Lunar::push/warm", &MicroBench::benchPushWarm);
+    if (L) lua_close(L);
+    L = NULL;
+#endif
+    // Last since it reorders the cars of the lanes
+    for (int t = 1; t <= MAX_THREADS; t *= 2) {
+      measure("exchangeCar", &MicroBench::benchExchange, t);
+    }
+  }
+  tearDown();
+  return 0;
+}
+
+int main(int argc, char *argv[])
+{
+  Log::setVerboseLevel(0);
+  MicroBench bench(argc, argv);
+  return bench.run() ? 1 : 0;
+}
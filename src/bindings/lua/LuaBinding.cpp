@@ -2,42 +2,156 @@
 #include <stdlib.h>
 #include <string.h>
 #include "LuaBinding.h"
+#include <utils/Stats.h>
+#include <utils/Trace.h>
+#include <utils/Memory.h>
 
 #define lua_setConst(L,name) { lua_pushnumber(L,name); lua_setglobal(L,#name); }
 
+// Margin when comparing the simulation time with the controller schedule
+#define CONTROL_EPSILON 1e-9
+
+// Makes the relative paths used by a script relative to the script
+// directory (given as argument) instead of the current directory
+static const char *script_prelude =
+  "local dir = ...\n"
+  "local function resolve(name)\n"
+  "  if type(name) == 'string' and name:sub(1, 1) ~= '/' then return dir .. '/' .. name end\n"
+  "  return name\n"
+  "end\n"
+  "local open, lines, do_file, load_file = io.open, io.lines, dofile, loadfile\n"
+  "io.open = function(name, ...) return open(resolve(name), ...) end\n"
+  "io.lines = function(name) if name == nil then return lines() end return lines(resolve(name)) end\n"
+  "dofile = function(name) if name == nil then return do_file() end return do_file(resolve(name)) end\n"
+  "loadfile = function(name) if name == nil then return load_file() end return load_file(resolve(name)) end\n"
+  "package.path = dir .. '/?.lua;' .. package.path\n"
+  "SCRIPT_DIR = dir\n";
+
+#ifndef LUAJIT
+// LUA allocations are counted per thread and added to the LUA tag in batches
+#define MEMORY_BATCH 16384
+
+static __thread long memory_pending = 0;
+
+static void *lua_allocator(void *ud, void *ptr, size_t osize, size_t nsize)
+{
+  void *p = NULL;
+  if (nsize == 0) {
+    free(ptr);
+  } else {
+    p = realloc(ptr, nsize);
+    if (!p) return NULL;
+  }
+  memory_pending += (long)nsize - (long)osize;
+  if (memory_pending > MEMORY_BATCH || memory_pending < -MEMORY_BATCH) {
+    Memory::add(Memory::MEM_LUA, memory_pending);
+    memory_pending = 0;
+  }
+  return p;
+}
+
+static int panic(lua_State *L)
+{
+  fprintf(stderr, "PANIC: unprotected error in call to Lua API (%s)\n", lua_tostring(L, -1));
+  return 0;
+}
+#endif
+
+// Creates a state whose memory is accounted for
+static lua_State *new_state()
+{
+#ifdef LUAJIT
+  // LuaJIT does not accept custom allocators on 64-bit systems
+  return luaL_newstate();
+#else
+  lua_State *L = lua_newstate(lua_allocator, NULL);
+  if (L) lua_atpanic(L, panic);
+  return L;
+#endif
+}
+
+// Returns the absolute directory of a file (to be freed)
+static char *script_directory(const char *filename)
+{
+  char *dir = strdup(filename);
+  char *p = strrchr(dir, '/');
+  if (!p) {
+    free(dir);
+    dir = strdup(".");
+  } else if (p == dir) {
+    p[1] = '\0';
+  } else {
+    *p = '\0';
+  }
+  char *absolute = realpath(dir, NULL);
+  if (absolute) {
+    free(dir);
+    dir = absolute;
+  }
+  return dir;
+}
+
+// False before the instance is built and once it is destroyed (objects
+// released during the static destruction find no states to clean)
+static bool alive = false;
+
 LuaBinding::LuaBinding()
 {
+  alive = true;
   ninstances = 0;
+  profiler = NULL;
   path = NULL;
   controlpath = NULL;
-
-  if (getcwd(cwd, sizeof(cwd)) == NULL) {
-    cwd[0] = '.';
-    cwd[1] = '\0';
-  }
+  controlL = NULL;
+  next_control = 0.0;
+  migrate_hooks = false;
+  pthread_mutex_init(&release_mutex, NULL);
 }
 
 LuaBinding::~LuaBinding()
 {
+  alive = false;
   unload();
+  freeStates();
+  unloadControl();
+  delete profiler;
+  pthread_mutex_destroy(&release_mutex);
+}
+
+void LuaBinding::freeStates()
+{
+  delete [] this->L;
+  delete [] this->init_ref;
+  delete [] this->think_ref;
+  delete [] this->destroy_ref;
+  delete [] this->think_batch_ref;
+  delete [] this->neighbors_ref;
+  delete [] this->batch_ref;
+  delete [] this->batch_pool_ref;
+  delete [] this->batch_size;
+#ifdef LUAJIT
   for (int i = 0; i < ninstances; i++) {
-    pthread_mutex_destroy(&(this->mutex[i]));
+    delete [] this->view[i];
   }
-  delete [] this->L;
-
-  unloadControl();
+  delete [] this->view;
+  delete [] this->view_size;
+  delete [] this->view_ref;
+  delete [] this->view_cast_ref;
+#endif
+  delete [] this->batch_members;
+  delete [] this->batched;
+  delete [] this->released;
+  ninstances = 0;
 }
 
 void LuaBinding::unload()
 {
   for (int i = 0; i < ninstances; i++) {
-    pthread_mutex_lock(&(this->mutex[i]));
     if (this->L[i]) {
       lua_gc(this->L[i], LUA_GCCOLLECT, 0);
       lua_close(this->L[i]);
       this->L[i] = NULL;
     }
-    pthread_mutex_unlock(&(this->mutex[i]));
   }
 
   if (path) {
@@ -75,10 +189,11 @@ int LuaBinding::loadControlFile(char *filename)
   }
 
   // Create a new stack
-  this->controlL = luaL_newstate();
+  this->controlL = new_state();
 
   // Open all libraries
   luaL_openlibs(this->controlL);
+  if (profiler) profiler->attach(this->controlL, ninstances);
 
   // Set all constants
   lua_setConst(this->controlL, LEAD);
@@ -110,39 +225,90 @@ int LuaBinding::loadControlFile(char *filename)
   Lunar<LuaRoadActuator>::Register(this->controlL);
   Lunar<LuaInfrastructure>::Register(this->controlL);
 
-  // Change the path to script
+  // Relative paths are resolved from the script directory
   if (controlpath) free(controlpath);
-  controlpath = strdup(filename);
-  char *p = strrchr(controlpath, '/');
-  int index = 0;
-  if (!p) {
-    // It is safe to assume a non empty string here
-    controlpath[0] = '.';
-    controlpath[1] = '\0';
-  } else {
-    *p = '\0';
-    index = (int)(p-controlpath)+1;
-  }
-  chdir(controlpath);
+  controlpath = script_directory(filename);
 
   // Launch the file
-  if (luaL_dofile(this->controlL, filename+index)) {
+  if (setScriptDirectory(this->controlL, controlpath) || luaL_dofile(this->controlL, filename)) {
     // error
     fprintf(stderr, "The LUA script is invalid: %s\n", lua_tostring(this->controlL, -1));
     lua_pop(this->controlL, 1);
     lua_gc(this->controlL, LUA_GCCOLLECT, 0);
     lua_close(this->controlL);
     this->controlL = NULL;
-    chdir(cwd);
     return -1;
   }
 
-  // Change it back
-  chdir(cwd);
+  // Schedule the update functions
+  cacheControllers();
 
   return 0;
 }
 
+int LuaBinding::setScriptDirectory(lua_State *L, const char *dir)
+{
+  if (luaL_loadstring(L, script_prelude)) return -1;
+  lua_pushstring(L, dir);
+  return lua_pcall(L, 1, 0, 0);
+}
+
+void LuaBinding::cacheControllers()
+{
+  // The references of a previous state are gone with it
+  controls.clear();
+
+  // Either a list of controllers with their own period and phase:
+  // controllers = { { update = f, period = 5, phase = 2.5 }, ... }
+  lua_getglobal(this->controlL, "controllers");
+  if (lua_istable(this->controlL, -1)) {
+    int n = lua_objlen(this->controlL, -1);
+    for (int k = 1; k <= n; k++) {
+      lua_rawgeti(this->controlL, -1, k);
+      if (lua_istable(this->controlL, -1)) {
+        control_t c;
+        lua_getfield(this->controlL, -1, "period");
+        c.period = lua_isnumber(this->controlL, -1) ? lua_tonumber(this->controlL, -1) : options->control_period_arg;
+        lua_pop(this->controlL, 1);
+        lua_getfield(this->controlL, -1, "phase");
+        c.next = lua_isnumber(this->controlL, -1) ? lua_tonumber(this->controlL, -1) : options->control_phase_arg;
+        lua_pop(this->controlL, 1);
+        c.last = -1.0;
+        lua_getfield(this->controlL, -1, "update");
+        if (lua_isfunction(this->controlL, -1)) {
+          c.ref = luaL_ref(this->controlL, LUA_REGISTRYINDEX);
+          controls.push_back(c);
+        } else {
+          lua_pop(this->controlL, 1);
+        }
+      }
+      lua_pop(this->controlL, 1);
+    }
+  }
+  lua_pop(this->controlL, 1);
+
+  // Or the update() function
+  if (controls.empty()) {
+    control_t c;
+    lua_getglobal(this->controlL, "update");
+    c.ref = luaL_ref(this->controlL, LUA_REGISTRYINDEX);
+    c.period = options->control_period_arg;
+    c.next = options->control_phase_arg;
+    c.last = -1.0;
+    controls.push_back(c);
+  }
+
+  next_control = controls[0].next;
+  for (unsigned int k = 1; k < controls.size(); k++) {
+    if (controls[k].next < next_control) next_control = controls[k].next;
+  }
+}
+
+bool LuaBinding::isControlDue(double t)
+{
+  return this->controlL && t + CONTROL_EPSILON >= next_control;
+}
+
 int LuaBinding::loadFile(char *filename)
 {
   if (access(filename, R_OK)) {
@@ -150,21 +316,12 @@ int LuaBinding::loadFile(char *filename)
     return -1;
   }
 
+  // Relative paths are resolved from the script directory
   if (path) free(path);
-  path = strdup(filename);
-  char *p = strrchr(path, '/');
-  int index = 0;
-  if (!p) {
-    // It is safe to assume a non empty string here
-    path[0] = '.';
-    path[1] = '\0';
-  } else {
-    *p = '\0';
-    index = (int)(p-path)+1;
-  }
+  path = script_directory(filename);
+  migrate_hooks = false;
 
   for (int i = 0; i < ninstances; i++) {
-    pthread_mutex_lock(&(this->mutex[i]));
 
     // Garbage collect and close if necessary
     if (this->L[i]) {
@@ -174,10 +331,11 @@ int LuaBinding::loadFile(char *filename)
     }
 
     // Create a new stack
-    this->L[i] = luaL_newstate();
+    this->L[i] = new_state();
 
     // Open all libraries
     luaL_openlibs(this->L[i]);
+    if (profiler) profiler->attach(this->L[i], i);
 
     // Set all constants
     lua_setConst(this->L[i], LEAD);
@@ -209,60 +367,219 @@ int LuaBinding::loadFile(char *filename)
     Lunar<LuaRoadActuator>::Register(this->L[i]);
     Lunar<LuaInfrastructure>::Register(this->L[i]);
 
-    // Change the path to script
-    chdir(path);
-
     // Launch the file
-    if (luaL_dofile(this->L[i], filename+index)) {
+    if (setScriptDirectory(this->L[i], path) || luaL_dofile(this->L[i], filename)) {
       // error
       fprintf(stderr, "The LUA script is invalid: %s\n", lua_tostring(this->L[i], -1));
       lua_pop(this->L[i], 1);
       lua_gc(this->L[i], LUA_GCCOLLECT, 0);
       lua_close(this->L[i]);
       this->L[i] = NULL;
-      /* This can be ignored since the script will fail for the first one */
-#if 0
-      for (int j = 0; j < i; j++) {
-        pthread_mutex_lock(&(this->mutex[j]));
-        lua_gc(this->L[j], LUA_GCCOLLECT, 0);
-        lua_close(this->L[j]);
-        this->L[j] = NULL;
-        pthread_mutex_unlock(&(this->mutex[j]));
-      }
-#endif
-      chdir(cwd);
-      pthread_mutex_unlock(&(this->mutex[i]));
       return -1;
     }
 
-    chdir(cwd);
-    pthread_mutex_unlock(&(this->mutex[i]));
+    // Keep the controller functions and the neighbors table at hand
+    cacheReferences(i);
   }
 
   return 0;
 }
 
-int LuaBinding::callInit(LuaCar *self)
+void LuaBinding::cacheReferences(int i)
+{
+  // The global functions are looked up once, changing them at runtime
+  // from within the script will not be noticed.
+  lua_getglobal(this->L[i], "init");
+  init_ref[i] = luaL_ref(this->L[i], LUA_REGISTRYINDEX);
+  lua_getglobal(this->L[i], "think");
+  think_ref[i] = luaL_ref(this->L[i], LUA_REGISTRYINDEX);
+  lua_getglobal(this->L[i], "destroy");
+  destroy_ref[i] = luaL_ref(this->L[i], LUA_REGISTRYINDEX);
+  lua_getglobal(this->L[i], "think_batch");
+  think_batch_ref[i] = luaL_ref(this->L[i], LUA_REGISTRYINDEX);
+
+  // The neighbors table (and its inner tables) are created once and
+  // overwritten at each call to think(), so that no table gets allocated
+  // on the hot path.
+  lua_createtable(this->L[i], 0, RIGHT_TRAIL+1);
+  for (int k = LEAD; k <= RIGHT_TRAIL; k++) {
+    lua_createtable(this->L[i], 0, 2);
+    lua_rawseti(this->L[i], -2, k);
+  }
+  neighbors_ref[i] = luaL_ref(this->L[i], LUA_REGISTRYINDEX);
+
+  // Same thing for think_batch(): the array given to the script and
+  // the pool of cells it points to grow as needed and are reused.
+  lua_newtable(this->L[i]);
+  batch_ref[i] = luaL_ref(this->L[i], LUA_REGISTRYINDEX);
+  lua_newtable(this->L[i]);
+  batch_pool_ref[i] = luaL_ref(this->L[i], LUA_REGISTRYINDEX);
+  batch_size[i] = 0;
+
+  // Per-vehicle slots declared by the script. All the states
+  // load the same file so the names are taken from the first one.
+  vector<string> names;
+  if (LuaCar::registerSlots(this->L[i], i == 0 ? &names : NULL) >= 0 && i == 0) {
+    CarControl::setSlotNames(names);
+  }
+
+  // Same thing for the migration hooks
+  if (i == 0) {
+    lua_getglobal(this->L[i], "migrate_out");
+    lua_getglobal(this->L[i], "migrate_in");
+    migrate_hooks = lua_isfunction(this->L[i], -2) && lua_isfunction(this->L[i], -1);
+    lua_pop(this->L[i], 2);
+  }
+
+#ifdef LUAJIT
+  // Declare the FFI views and keep a function that casts a light
+  // userdata to a ffi_car_t pointer.
+  view_ref[i] = LUA_NOREF;
+  view_cast_ref[i] = LUA_NOREF;
+  int r = luaL_loadstring(this->L[i],
+                          "local ffi = require('ffi')\n"
+                          "ffi.cdef(...)\n"
+                          "return function(p) return ffi.cast('ffi_car_t *', p) end");
+  if (!r) {
+    lua_pushstring(this->L[i], LUAFFI_CDEF);
+    r = lua_pcall(this->L[i], 1, 1, 0);
+  }
+  if (r) {
+    fprintf(stderr, "Unable to set up the FFI views: %s\n", lua_tostring(this->L[i], -1));
+    lua_pop(this->L[i], 1);
+    return;
+  }
+  view_cast_ref[i] = luaL_ref(this->L[i], LUA_REGISTRYINDEX);
+  // The buffer may survive a reload, the cdata pointing to it does not
+  if (view_size[i] > 0) {
+    int n = view_size[i];
+    view_size[i] = 0;
+    getViews(i, n);
+  }
+#endif
+}
+
+#ifdef LUAJIT
+ffi_car_t *LuaBinding::getViews(int i, int n)
+{
+  if (view_cast_ref[i] == LUA_NOREF) return NULL;
+  if (n <= view_size[i]) return view[i];
+
+  // Grow the buffer and point a new cdata to it. This is rare since the
+  // buffer never shrinks.
+  ffi_car_t *v = new ffi_car_t[n];
+  lua_rawgeti(this->L[i], LUA_REGISTRYINDEX, view_cast_ref[i]);
+  lua_pushlightuserdata(this->L[i], v);
+  if (lua_pcall(this->L[i], 1, 1, 0)) {
+    fprintf(stderr, "Unable to set up the FFI views: %s\n", lua_tostring(this->L[i], -1));
+    lua_pop(this->L[i], 1);
+    delete [] v;
+    return NULL;
+  }
+  luaL_unref(this->L[i], LUA_REGISTRYINDEX, view_ref[i]);
+  view_ref[i] = luaL_ref(this->L[i], LUA_REGISTRYINDEX);
+  delete [] view[i];
+  view[i] = v;
+  view_size[i] = n;
+  return v;
+}
+
+void LuaBinding::fillView(ffi_car_t *v, Car *car, vector<struct neighbor_struct> &neighbors)
+{
+  double s, t;
+  v->id = car->getID();
+  v->type = (int)car->getType();
+  v->position = car->getPosition();
+  v->speed = car->getSpeed();
+  v->acceleration = car->getAcceleration();
+  car->getCarGeometry(&v->front, &v->rear, &s, &t);
+  unsigned int i;
+  for (i = 0; i < neighbors.size() && i < LUAFFI_NEIGHBORS; i++) {
+    ffi_neighbor_t *n = &v->neighbors[i];
+    n->distance = neighbors[i].distance;
+    if (neighbors[i].car) {
+      n->id = neighbors[i].car->getID();
+      n->position = neighbors[i].car->getPosition();
+      n->speed = neighbors[i].car->getSpeed();
+      neighbors[i].car->getCarGeometry(&n->front, &n->rear, &s, &t);
+    } else {
+      n->id = -1;
+      n->position = n->speed = n->front = n->rear = 0.0;
+    }
+  }
+  for (; i < LUAFFI_NEIGHBORS; i++) {
+    v->neighbors[i].id = -1;
+  }
+  vector<double> &slots = car->getControl()->getSlots();
+  v->slots = slots.empty() ? NULL : &slots[0];
+}
+#endif
+
+void LuaBinding::fillNeighbors(lua_State *L, vector<struct neighbor_struct> &neighbors)
 {
-  // This pattern has to be the same than in Simulator otherwise
-  // there will be performances loss.
-  int i = self->getSelf()->getID() % ninstances;
+  // The neighbors table is on top of the stack
+  unsigned int i;
+  for (i = 0; i < neighbors.size(); i++) {
+    lua_rawgeti(L, -1, i);
+    if (!lua_istable(L, -1)) {
+      // The script overwrote (or never had) this cell
+      lua_pop(L, 1);
+      lua_createtable(L, 0, 2);
+      lua_pushvalue(L, -1);
+      lua_rawseti(L, -3, i);
+    }
+    // Store car pointer
+    lua_pushliteral(L, "car");
+    if (neighbors[i].car)
+      Lunar<LuaCar>::push(L, neighbors[i].car->getControl()->getLuaCar());
+    else
+      lua_pushnil(L);
+    lua_rawset(L, -3);
+    // Store the distance
+    lua_pushliteral(L, "distance");
+    lua_pushnumber(L, neighbors[i].distance);
+    lua_rawset(L, -3);
+    lua_pop(L, 1);
+  }
+  // Hide the cells that are left over from a larger neighbors vector
+  for (;; i++) {
+    lua_rawgeti(L, -1, i);
+    bool more = !lua_isnil(L, -1);
+    lua_pop(L, 1);
+    if (!more) break;
+    lua_pushnil(L);
+    lua_rawseti(L, -2, i);
+  }
+}
 
-  pthread_mutex_lock(&(this->mutex[i]));
+int LuaBinding::callInit(LuaCar *self)
+{
+  // The state of a car is chosen once, the Simulator groups the cars
+  // by state so that each state is only used by one thread.
+  if (self->getState() < 0 || self->getState() >= ninstances) {
+    self->setState(self->getSelf()->getID() % ninstances);
+  }
+  int i = self->getState();
   if (!this->L[i]) {
-    pthread_mutex_unlock(&(this->mutex[i]));
     return -1;
   }
 
+  if (profiler) profiler->begin(i, LuaProfiler::INIT);
+
   // Get the function
-  lua_getglobal(L[i], "init");
+  lua_rawgeti(this->L[i], LUA_REGISTRYINDEX, init_ref[i]);
 
   // Push arguments
   Lunar<LuaCar>::push(this->L[i], self);
   lua_pushstring(this->L[i], options->lua_args_arg);
 
   // Call the function with 1 argument and 0 returns
+  Stats::count(Stats::LUA_CALLS);
+  double start = Stats::now();
   int r = lua_pcall(L[i], 2, 0, 0);
+  double stop = Stats::now();
+  Trace::add("lua init", start, stop);
+  if (profiler) profiler->end(this->L[i], i, LuaProfiler::INIT, stop - start, self->getSelf());
 
   // Check error
   if (r) {
@@ -271,60 +588,49 @@ int LuaBinding::callInit(LuaCar *self)
     lua_gc(this->L[i], LUA_GCCOLLECT, 0);
     lua_close(this->L[i]);
     this->L[i] = NULL;
-    pthread_mutex_unlock(&(this->mutex[i]));
     return -1;
   }
 
-  pthread_mutex_unlock(&(this->mutex[i]));
-
   return 0;
 }
 
 int LuaBinding::callThink(LuaCar *self, double dt, vector<struct neighbor_struct> &neighbors)
 {
-  int j = self->getSelf()->getID() % ninstances;
-
-  pthread_mutex_lock(&(this->mutex[j]));
+  int j = self->getState();
   if (!this->L[j]) {
-    pthread_mutex_unlock(&(this->mutex[j]));
     return -1;
   }
 
-    // Get the function
-  lua_getglobal(L[j], "think");
+  if (profiler) profiler->begin(j, LuaProfiler::THINK);
+
+  // Get the function
+  lua_rawgeti(this->L[j], LUA_REGISTRYINDEX, think_ref[j]);
 
   // Push arguments
   Lunar<LuaCar>::push(this->L[j], self);
   lua_pushnumber(this->L[j], dt);
-  // Push the whole array
-  lua_newtable(this->L[j]);
-  for (unsigned int i = 0; i < neighbors.size(); i++) {
-    // Put the table index
-    lua_pushnumber(L[j], i);
-
-    // Push the cell value
-
-    // Here we have to store another table with keys car and distance
-    lua_newtable(this->L[j]);
-    // Store the car key
-    lua_pushstring(L[j], "car");
-    // Store car pointer
-    if (neighbors[i].car)
-      Lunar<LuaCar>::push(this->L[j], neighbors[i].car->getControl()->getLuaCar());
-    else
-      Lunar<LuaCar>::push(this->L[j], NULL);
-    lua_rawset(L[j], -3);
-    // Store the distance key
-    lua_pushstring(L[j], "distance");
-    lua_pushnumber(this->L[j], neighbors[i].distance);
-    lua_rawset(L[j], -3);
-
-    // Put the whole in the main table
-    lua_rawset(L[j], -3);
+  // Fill in the preallocated neighbors table
+  lua_rawgeti(this->L[j], LUA_REGISTRYINDEX, neighbors_ref[j]);
+  fillNeighbors(this->L[j], neighbors);
+  int nargs = 3;
+#ifdef LUAJIT
+  // The FFI view of the car goes in the first slot
+  ffi_car_t *v = getViews(j, 1);
+  if (v) {
+    fillView(v, self->getSelf(), neighbors);
+    lua_rawgeti(this->L[j], LUA_REGISTRYINDEX, view_ref[j]);
+    nargs++;
   }
+#endif
 
-  // Call the function with 3 argument and 0 returns
-  int r = lua_pcall(L[j], 3, 0, 0);
+  // Call the function with 3 (or 4) arguments and 0 returns
+  Stats::count(Stats::LUA_CALLS);
+  double start = Stats::now();
+  int r = lua_pcall(L[j], nargs, 0, 0);
+  double stop = Stats::now();
+  Trace::add("lua think", start, stop);
+  Stats::addLua(stop - start);
+  if (profiler) profiler->end(this->L[j], j, LuaProfiler::THINK, stop - start, self->getSelf());
 
   // Check error
   if (r) {
@@ -333,33 +639,170 @@ int LuaBinding::callThink(LuaCar *self, double dt, vector<struct neighbor_struct
     lua_gc(this->L[j], LUA_GCCOLLECT, 0);
     lua_close(this->L[j]);
     this->L[j] = NULL;
-    pthread_mutex_unlock(&(this->mutex[j]));
     return -1;
   }
 
-  pthread_mutex_unlock(&(this->mutex[j]));
+  return 0;
+}
+
+int LuaBinding::callThinkBatch(vector<Car *> &cars, vector< vector<struct neighbor_struct> > &neighbors, double dt)
+{
+  if (cars.empty() || ninstances == 0) return -1;
+
+  // A thread can own several states, make one batch per state. The
+  // member lists of a state are only touched by the thread owning it.
+  for (unsigned int k = 0; k < cars.size(); k++) {
+    batch_members[cars[k]->getControl()->getLuaCar()->getState()].clear();
+  }
+  for (unsigned int k = 0; k < cars.size(); k++) {
+    batch_members[cars[k]->getControl()->getLuaCar()->getState()].push_back(k);
+  }
+  // A failed state does not keep the others from being batched
+  int r = -1;
+  for (unsigned int k = 0; k < cars.size(); k++) {
+    int j = cars[k]->getControl()->getLuaCar()->getState();
+    if (batch_members[j].empty()) continue;
+    batched[j] = (callThinkBatch(j, cars, neighbors, batch_members[j], dt) == 0);
+    if (batched[j]) r = 0;
+    batch_members[j].clear();
+  }
+
+  return r;
+}
+
+bool LuaBinding::isBatched(LuaCar *self)
+{
+  return batched[self->getState()];
+}
+
+int LuaBinding::callThinkBatch(int j, vector<Car *> &cars, vector< vector<struct neighbor_struct> > &neighbors,
+                               vector<int> &members, double dt)
+{
+  if (!this->L[j] || think_batch_ref[j] == LUA_REFNIL) {
+    return -1;
+  }
+
+  if (profiler) profiler->begin(j, LuaProfiler::THINK_BATCH);
+
+  // Get the function
+  lua_rawgeti(this->L[j], LUA_REGISTRYINDEX, think_batch_ref[j]);
+
+  // Push arguments
+  lua_rawgeti(this->L[j], LUA_REGISTRYINDEX, batch_ref[j]);
+  lua_rawgeti(this->L[j], LUA_REGISTRYINDEX, batch_pool_ref[j]);
+  int n = (int)members.size();
+  for (int k = 1; k <= n; k++) {
+    Car *car = cars[members[k-1]];
+    lua_rawgeti(this->L[j], -1, k);
+    if (!lua_istable(this->L[j], -1)) {
+      // New cell with its own neighbors table
+      lua_pop(this->L[j], 1);
+      lua_createtable(this->L[j], 0, 4);
+      lua_pushliteral(this->L[j], "neighbors");
+      lua_createtable(this->L[j], 0, RIGHT_TRAIL+1);
+      lua_rawset(this->L[j], -3);
+      lua_pushvalue(this->L[j], -1);
+      lua_rawseti(this->L[j], -3, k);
+    }
+    lua_pushliteral(this->L[j], "car");
+    Lunar<LuaCar>::push(this->L[j], car->getControl()->getLuaCar());
+    lua_rawset(this->L[j], -3);
+    lua_pushliteral(this->L[j], "speed");
+    lua_pushnumber(this->L[j], car->getSpeed());
+    lua_rawset(this->L[j], -3);
+    lua_pushliteral(this->L[j], "position");
+    lua_pushnumber(this->L[j], car->getPosition());
+    lua_rawset(this->L[j], -3);
+    lua_pushliteral(this->L[j], "neighbors");
+    lua_rawget(this->L[j], -2);
+    fillNeighbors(this->L[j], neighbors[members[k-1]]);
+    lua_pop(this->L[j], 1);
+    // cars[k] = cell
+    lua_rawseti(this->L[j], -3, k);
+  }
+  lua_pop(this->L[j], 1);
+  // Cut the array at n so that #cars is right
+  for (int k = n+1; k <= batch_size[j]; k++) {
+    lua_pushnil(this->L[j]);
+    lua_rawseti(this->L[j], -2, k);
+  }
+  batch_size[j] = n;
+  lua_pushnumber(this->L[j], dt);
+  int nargs = 2;
+#ifdef LUAJIT
+  // The FFI views are indexed like cars (slot 0 is used by think())
+  ffi_car_t *v = getViews(j, n+1);
+  if (v) {
+    for (int k = 1; k <= n; k++) {
+      fillView(&v[k], cars[members[k-1]], neighbors[members[k-1]]);
+    }
+    lua_rawgeti(this->L[j], LUA_REGISTRYINDEX, view_ref[j]);
+    nargs++;
+  }
+#endif
+
+  // Call the function with 2 (or 3) arguments and 2 returns
+  Stats::count(Stats::LUA_CALLS);
+  double start = Stats::now();
+  int r = lua_pcall(this->L[j], nargs, 2, 0);
+  double stop = Stats::now();
+  Trace::add("lua think_batch", start, stop);
+  Stats::addLua(stop - start);
+  if (profiler) profiler->end(this->L[j], j, LuaProfiler::THINK_BATCH, stop - start);
+
+  // Check error
+  if (r) {
+    fprintf(stderr, "Controller error in think_batch: %s\n", lua_tostring(this->L[j], -1));
+    lua_pop(this->L[j], 1);
+    lua_gc(this->L[j], LUA_GCCOLLECT, 0);
+    lua_close(this->L[j]);
+    this->L[j] = NULL;
+    return -1;
+  }
+
+  // Read back the commands (if any)
+  if (lua_istable(this->L[j], -2)) {
+    for (int k = 1; k <= n; k++) {
+      lua_rawgeti(this->L[j], -2, k);
+      cars[members[k-1]]->getControl()->setAcceleration(lua_tonumber(this->L[j], -1));
+      lua_pop(this->L[j], 1);
+    }
+  }
+  if (lua_istable(this->L[j], -1)) {
+    for (int k = 1; k <= n; k++) {
+      lua_rawgeti(this->L[j], -1, k);
+      cars[members[k-1]]->getControl()->setLaneChange((int)lua_tonumber(this->L[j], -1));
+      lua_pop(this->L[j], 1);
+    }
+  }
+  lua_pop(this->L[j], 2);
 
   return 0;
 }
 
 int LuaBinding::callDestroy(LuaCar *self)
 {
-  int i = self->getSelf()->getID() % ninstances;
-
-  pthread_mutex_lock(&(this->mutex[i]));
+  int i = self->getState();
+  if (i < 0 || i >= ninstances) return -1;
   if (!this->L[i]) {
-    pthread_mutex_unlock(&(this->mutex[i]));
     return -1;
   }
 
+  if (profiler) profiler->begin(i, LuaProfiler::DESTROY);
+
   // Get the function
-  lua_getglobal(L[i], "destroy");
+  lua_rawgeti(this->L[i], LUA_REGISTRYINDEX, destroy_ref[i]);
 
   // Push arguments
   Lunar<LuaCar>::push(this->L[i], self);
 
   // Call the function with 1 argument and 0 returns
+  Stats::count(Stats::LUA_CALLS);
+  double start = Stats::now();
   int r = lua_pcall(L[i], 1, 0, 0);
+  double stop = Stats::now();
+  Trace::add("lua destroy", start, stop);
+  if (profiler) profiler->end(this->L[i], i, LuaProfiler::DESTROY, stop - start, self->getSelf());
 
   // Check error
   if (r) {
@@ -368,19 +811,115 @@ int LuaBinding::callDestroy(LuaCar *self)
     lua_gc(this->L[i], LUA_GCCOLLECT, 0);
     lua_close(this->L[i]);
     this->L[i] = NULL;
-    pthread_mutex_unlock(&(this->mutex[i]));
     return -1;
   }
 
-  pthread_mutex_unlock(&(this->mutex[i]));
+  return 0;
+}
+
+int LuaBinding::migrate(LuaCar *self, int state)
+{
+  if (state < 0 || state >= ninstances) return -1;
+  int from = self->getState();
+  if (from == state) return 0;
+  if (from < 0 || from >= ninstances || !this->L[from] || !this->L[state]) {
+    // Nothing to carry over
+    self->setState(state);
+    return 0;
+  }
+
+  lua_getglobal(this->L[from], "migrate_out");
+  lua_getglobal(this->L[state], "migrate_in");
+  if (!lua_isfunction(this->L[from], -1) || !lua_isfunction(this->L[state], -1)) {
+    // Without hooks, the values the script keeps for the car would be lost
+    lua_pop(this->L[from], 1);
+    lua_pop(this->L[state], 1);
+    return 1;
+  }
+
+  // Get the per-car values out of the old state
+  Lunar<LuaCar>::push(this->L[from], self);
+  Stats::count(Stats::LUA_CALLS);
+  double span = Trace::begin();
+  int r = lua_pcall(this->L[from], 1, 1, 0);
+  Trace::end("lua migrate", span);
+  if (r) {
+    fprintf(stderr, "Controller error in migrate_out: %s\n", lua_tostring(this->L[from], -1));
+    lua_pop(this->L[from], 1);
+    lua_pop(this->L[state], 1);
+    lua_gc(this->L[from], LUA_GCCOLLECT, 0);
+    lua_close(this->L[from]);
+    this->L[from] = NULL;
+    return -1;
+  }
+  lua_pushnil(this->L[from]);
+  lua_rawseti(this->L[from], LUA_REGISTRYINDEX, self->lunarRef());
+  self->setState(state);
+
+  // And give them to the new one
+  Lunar<LuaCar>::push(this->L[state], self);
+  copyValue(this->L[from], -1, this->L[state], 0);
+  lua_pop(this->L[from], 1);
+  Stats::count(Stats::LUA_CALLS);
+  span = Trace::begin();
+  r = lua_pcall(this->L[state], 2, 0, 0);
+  Trace::end("lua migrate", span);
+  if (r) {
+    fprintf(stderr, "Controller error in migrate_in: %s\n", lua_tostring(this->L[state], -1));
+    lua_pop(this->L[state], 1);
+    lua_gc(this->L[state], LUA_GCCOLLECT, 0);
+    lua_close(this->L[state]);
+    this->L[state] = NULL;
+    // The car stays with the thread that owns its old state
+    self->setState(from);
+    return -1;
+  }
 
   return 0;
 }
 
+void LuaBinding::copyValue(lua_State *from, int index, lua_State *to, int depth)
+{
+  size_t len;
+  const char *str;
+
+  switch (lua_type(from, index)) {
+  case LUA_TBOOLEAN:
+    lua_pushboolean(to, lua_toboolean(from, index));
+    return;
+  case LUA_TNUMBER:
+    lua_pushnumber(to, lua_tonumber(from, index));
+    return;
+  case LUA_TSTRING:
+    str = lua_tolstring(from, index, &len);
+    lua_pushlstring(to, str, len);
+    return;
+  case LUA_TTABLE:
+    if (depth < 16) {
+      if (index < 0) index = lua_gettop(from) + index + 1;
+      lua_newtable(to);
+      lua_pushnil(from);
+      while (lua_next(from, index)) {
+        copyValue(from, -2, to, depth+1);
+        copyValue(from, -1, to, depth+1);
+        if (lua_isnil(to, -2) || lua_isnil(to, -1)) lua_pop(to, 2);
+        else lua_rawset(to, -3);
+        lua_pop(from, 1);
+      }
+      return;
+    }
+  default:
+    // Functions, userdata and threads cannot be moved
+    lua_pushnil(to);
+  }
+}
+
 int LuaBinding::callControlInit(LuaInfrastructure *self)
 {
   if (!this->controlL) return -1;
 
+  if (profiler) profiler->begin(ninstances, LuaProfiler::CONTROL_INIT);
+
   // Get the function
   lua_getglobal(controlL, "init");
 
@@ -388,9 +927,12 @@ int LuaBinding::callControlInit(LuaInfrastructure *self)
   Lunar<LuaInfrastructure>::push(this->controlL, self);
 
   // Call the function with 1 arguments and 0 return
-  chdir(controlpath);
+  Stats::count(Stats::LUA_CALLS);
+  double start = Stats::now();
   int r = lua_pcall(controlL, 1, 0, 0);
-  chdir(cwd);
+  double stop = Stats::now();
+  Trace::add("lua control_init", start, stop);
+  if (profiler) profiler->end(this->controlL, ninstances, LuaProfiler::CONTROL_INIT, stop - start);
 
   // Check error
   if (r) {
@@ -408,19 +950,45 @@ int LuaBinding::callControlInit(LuaInfrastructure *self)
 int LuaBinding::callControlUpdate(LuaInfrastructure *self, double t, double dt)
 {
   if (!this->controlL) return -1;
+  if (t + CONTROL_EPSILON < next_control) {
+    return 0;
+  }
 
-  // Get the function
-  lua_getglobal(controlL, "update");
+  if (profiler) profiler->begin(ninstances, LuaProfiler::CONTROL_UPDATE);
 
-  // Push arguments
-  Lunar<LuaInfrastructure>::push(this->controlL, self);
-  lua_pushnumber(this->controlL, t);
-  lua_pushnumber(this->controlL, dt);
+  int r = 0;
+  double time = 0.0;
+  for (unsigned int k = 0; k < controls.size(); k++) {
+    control_t &c = controls[k];
+    if (t + CONTROL_EPSILON < c.next) continue;
 
-  // Call the function with 3 arguments and 0 return
-  chdir(controlpath);
-  int r = lua_pcall(controlL, 3, 0, 0);
-  chdir(cwd);
+    // Get the function
+    lua_rawgeti(controlL, LUA_REGISTRYINDEX, c.ref);
+
+    // Push arguments (dt is the time since the last call of that controller)
+    Lunar<LuaInfrastructure>::push(this->controlL, self);
+    lua_pushnumber(this->controlL, t);
+    lua_pushnumber(this->controlL, (c.last < 0.0) ? dt : t - c.last);
+
+    // Call the function with 3 arguments and 0 return
+    Stats::count(Stats::LUA_CALLS);
+    double start = Stats::now();
+    r = lua_pcall(controlL, 3, 0, 0);
+    double stop = Stats::now();
+    Trace::add("lua control_update", start, stop);
+    Stats::addLua(stop - start);
+    time += stop - start;
+    if (r) break;
+
+    // Next call
+    c.last = t;
+    if (c.period > 0.0) {
+      while (c.next <= t + CONTROL_EPSILON) c.next += c.period;
+    } else {
+      c.next = t;
+    }
+  }
+  if (profiler) profiler->end(this->controlL, ninstances, LuaProfiler::CONTROL_UPDATE, time);
 
   // Check error
   if (r) {
@@ -432,6 +1000,11 @@ int LuaBinding::callControlUpdate(LuaInfrastructure *self, double t, double dt)
     return -1;
   }
 
+  next_control = controls[0].next;
+  for (unsigned int k = 1; k < controls.size(); k++) {
+    if (controls[k].next < next_control) next_control = controls[k].next;
+  }
+
   return 0;
 }
 
@@ -439,16 +1012,21 @@ int LuaBinding::callControlDestroy(LuaInfrastructure *self)
 {
   if (!this->controlL) return -1;
 
+  if (profiler) profiler->begin(ninstances, LuaProfiler::CONTROL_DESTROY);
+
   // Get the function
   lua_getglobal(controlL, "destroy");
 
   // Push arguments
   Lunar<LuaInfrastructure>::push(this->controlL, self);
 
-  // Call the function with 3 arguments and 0 return
-  chdir(controlpath);
+  // Call the function with 1 argument and 0 return
+  Stats::count(Stats::LUA_CALLS);
+  double start = Stats::now();
   int r = lua_pcall(controlL, 1, 0, 0);
-  chdir(cwd);
+  double stop = Stats::now();
+  Trace::add("lua control_destroy", start, stop);
+  if (profiler) profiler->end(this->controlL, ninstances, LuaProfiler::CONTROL_DESTROY, stop - start);
 
   // Check error
   if (r) {
@@ -463,18 +1041,131 @@ int LuaBinding::callControlDestroy(LuaInfrastructure *self)
   return 0;
 }
 
+void LuaBinding::writeProfile()
+{
+  if (profiler) profiler->write();
+}
+
+int LuaBinding::getStateCount()
+{
+  return ninstances;
+}
+
+bool LuaBinding::canMigrate()
+{
+  // Without a script there is nothing to lose
+  return migrate_hooks || !path;
+}
+
+void LuaBinding::release(LunarObject *obj)
+{
+  if (!obj->isLunarCached() || !alive) return;
+
+  // The states may be running on other threads: their owners clear the
+  // index at the next step (see collect())
+  LuaBinding &binding = getInstance();
+  pthread_mutex_lock(&(binding.release_mutex));
+  for (int i = 0; i < binding.ninstances; i++) {
+    binding.released[i].push_back(obj->lunarRef());
+  }
+  binding.control_released.push_back(obj->lunarRef());
+  pthread_mutex_unlock(&(binding.release_mutex));
+}
+
+void LuaBinding::collect(int worker, int nworkers)
+{
+  vector<int> refs;
+  for (int i = worker; i < ninstances; i += (nworkers > 0 ? nworkers : 1)) {
+    pthread_mutex_lock(&release_mutex);
+    refs.swap(released[i]);
+    pthread_mutex_unlock(&release_mutex);
+
+    // The indices are never reused, so clearing them late is harmless
+    if (this->L[i]) {
+      for (unsigned int k = 0; k < refs.size(); k++) {
+        lua_pushnil(this->L[i]);
+        lua_rawseti(this->L[i], LUA_REGISTRYINDEX, refs[k]);
+      }
+    }
+    refs.clear();
+  }
+}
+
+void LuaBinding::collectControl()
+{
+  vector<int> refs;
+  pthread_mutex_lock(&release_mutex);
+  refs.swap(control_released);
+  pthread_mutex_unlock(&release_mutex);
+
+  if (this->controlL) {
+    for (unsigned int k = 0; k < refs.size(); k++) {
+      lua_pushnil(this->controlL);
+      lua_rawseti(this->controlL, LUA_REGISTRYINDEX, refs[k]);
+    }
+  }
+}
+
 void LuaBinding::setOptions(gengetopt_args_info *options)
 {
-  int n = options->ncpu_arg;
-  if (n == 0) n = 1;
+  int n = options->lua_states_arg;
+  if (n <= 0) n = options->ncpu_arg;
+  if (n <= 0) n = 1;
+  if (options->ncpu_arg > n) {
+    fprintf(stderr, "Only %d of the %d threads will run LUA controllers (--lua-states=%d).\n", n, options->ncpu_arg, n);
+  }
 
+  // A new Simulator is created each time the map is reset
   getInstance().options = options;
+  if (getInstance().ninstances == n) return;
+  if (getInstance().ninstances > 0) {
+    getInstance().unload();
+    getInstance().freeStates();
+  }
+
   getInstance().ninstances = n;
+
+  // The infrastructure controller is profiled as the last state
+  delete getInstance().profiler;
+  getInstance().profiler = NULL;
+  if (options->lua_profile_given) {
+    getInstance().profiler = new LuaProfiler(n+1, options->lua_profile_arg, options->lua_profile_period_arg);
+  }
   getInstance().L = new lua_State *[n];
-  getInstance().mutex = new pthread_mutex_t[n];
+  getInstance().init_ref = new int[n];
+  getInstance().think_ref = new int[n];
+  getInstance().destroy_ref = new int[n];
+  getInstance().think_batch_ref = new int[n];
+  getInstance().neighbors_ref = new int[n];
+  getInstance().batch_ref = new int[n];
+  getInstance().batch_pool_ref = new int[n];
+  getInstance().batch_size = new int[n];
+#ifdef LUAJIT
+  getInstance().view = new ffi_car_t *[n];
+  getInstance().view_size = new int[n];
+  getInstance().view_ref = new int[n];
+  getInstance().view_cast_ref = new int[n];
+#endif
+  getInstance().batch_members = new vector<int>[n];
+  getInstance().batched = new bool[n];
+  getInstance().released = new vector<int>[n];
   for (int i = 0; i < n; i++) {
     getInstance().L[i] = NULL;
-    pthread_mutex_init(&(getInstance().mutex[i]), NULL);
+    getInstance().init_ref[i] = LUA_NOREF;
+    getInstance().think_ref[i] = LUA_NOREF;
+    getInstance().destroy_ref[i] = LUA_NOREF;
+    getInstance().think_batch_ref[i] = LUA_REFNIL;
+    getInstance().neighbors_ref[i] = LUA_NOREF;
+    getInstance().batch_ref[i] = LUA_NOREF;
+    getInstance().batch_pool_ref[i] = LUA_NOREF;
+    getInstance().batch_size[i] = 0;
+    getInstance().batched[i] = false;
+#ifdef LUAJIT
+    getInstance().view[i] = NULL;
+    getInstance().view_size[i] = 0;
+    getInstance().view_ref[i] = LUA_NOREF;
+    getInstance().view_cast_ref[i] = LUA_NOREF;
+#endif
   }
 }
 
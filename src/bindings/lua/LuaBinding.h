@@ -6,6 +6,7 @@ extern "C" {
 #include <lauxlib.h>
 #include <lualib.h>
 }
+#include <pthread.h>
 #include "lunar.h"
 
 #include "LuaCar.h"
@@ -13,6 +14,8 @@ extern "C" {
 #include "LuaRoadSensor.h"
 #include "LuaRoadActuator.h"
 #include "LuaInfrastructure.h"
+#include "LuaFFI.h"
+#include "LuaProfiler.h"
 
 #include "cmdline.h"
 
@@ -24,6 +27,12 @@ extern "C" {
  * the appropriate tables and accessible class for LUA.
  * This class is Singleton (the Simulator engine is responsible to
  * load the file).
+ *
+ * There is one LUA state per worker thread by default (see --lua-states).
+ * Each car is bound to a state and the Simulator gives all the cars of a
+ * state to the same thread, so that the calls do not need any locking.
+ * Loading, init() and destroy() are only done between steps, and the
+ * objects that die only queue the removal of their userdata (see release()).
  */
 class LuaBinding {
  private:
@@ -85,6 +94,38 @@ class LuaBinding {
    */
   int callDestroy(LuaCar *self);
 
+  /**
+   * Moves a car to another LUA state (e.g. when it changes thread).
+   * If the script defines migrate_out(self) and migrate_in(self, data),
+   * the value returned by the first one in the old state is copied (plain
+   * values and tables only) and given to the second one in the new state.
+   * The slots (see CarControl::getSlot()) are kept. Without these hooks
+   * the car is not moved, since the values the script keeps for it (e.g.
+   * in a vars[self] table) would be lost.
+   * @param self The car.
+   * @param state The new state.
+   * @return 0 on success, 1 if the car cannot be moved, -1 on a LUA error (the car is not moved either)
+   */
+  int migrate(LuaCar *self, int state);
+
+  /**
+   * Tells whether the cars can be moved to another state (see migrate()):
+   * no script is loaded or it defines migrate_out() and migrate_in().
+   */
+  bool canMigrate();
+
+  /**
+   * Gets the number of LUA states for the car controllers.
+   * @return The number of states.
+   */
+  int getStateCount();
+
+  /**
+   * Writes the profile of the LUA controllers (if --lua-profile is given).
+   * This needs to be called while the map is still alive.
+   */
+  void writeProfile();
+
   /**
    * Calls the think function
    * that should be provided in the LUA script (think())
@@ -93,8 +134,38 @@ class LuaBinding {
   int callThink(LuaCar *self, double dt, vector<struct neighbor_struct> &neighbors);
 
   /**
-   * Calls the update function from the infrastructure controller.
-   * This function should be provided in the LUA control script (update())
+   * Calls the batched think function (think_batch()) on a group of cars
+   * if the LUA script provides it, with one call per LUA state. The cars
+   * of a state that could not be batched (see isBatched()) still need to
+   * think on their own: through think() or, if their state was closed by
+   * an error, through the C++ control.
+   * @param cars The cars.
+   * @param neighbors The neighbors of each car (in the same order).
+   * @param dt The time step.
+   * @return 0 if at least one state was batched, -1 if think() should be called for each car instead
+   */
+  int callThinkBatch(vector<Car *> &cars, vector< vector<struct neighbor_struct> > &neighbors, double dt);
+
+  /**
+   * Tells whether the last callThinkBatch() of the thread thought for a car.
+   */
+  bool isBatched(LuaCar *self);
+
+  /**
+   * Tells whether an infrastructure controller needs to be called at
+   * that time (see --control-period and --control-phase).
+   * @param t The simulation time.
+   * @return true if callControlUpdate() needs to be called.
+   */
+  bool isControlDue(double t);
+
+  /**
+   * Calls the update functions from the infrastructure controller that are due.
+   * This function should be provided in the LUA control script (update()).
+   * The script can also give several update functions with their own period and
+   * phase in the <em>controllers</em> global array (e.g. controllers = { { update = f,
+   * period = 5, phase = 2.5 } }). The dt given to each function is the time since
+   * its last call.
    * @return 0 on success
    */
   int callControlUpdate(LuaInfrastructure *self, double t, double dt);
@@ -113,14 +184,80 @@ class LuaBinding {
    */
   int callControlInit(LuaInfrastructure *self);
 
+  /**
+   * Removes the userdata of a dying object from all LUA states.
+   * This needs to be called by the destructor of every object pushed
+   * through Lunar (see LunarObject). The registry index is only queued:
+   * each state clears it in collect(), on the thread that runs it. Does
+   * nothing once the binding is destroyed.
+   * @param obj The object.
+   */
+  static void release(LunarObject *obj);
+
+  /**
+   * Clears the userdata of the released objects (see release()) in the
+   * states of a worker thread. Each worker calls it before running its
+   * cars, since a state is only used by one thread during a step.
+   * @param worker The worker (0 without threads).
+   * @param nworkers The number of workers (0 without threads): the worker runs the states with state % nworkers == worker.
+   */
+  void collect(int worker, int nworkers);
+
+  /**
+   * Clears the userdata of the released objects in the infrastructure
+   * controller state. To be called by the main thread between steps.
+   */
+  void collectControl();
+
  private:
+  void cacheReferences(int i);
+  void cacheControllers();
+  static int setScriptDirectory(lua_State *L, const char *dir);
+  void freeStates();
+  int callThinkBatch(int j, vector<Car *> &cars, vector< vector<struct neighbor_struct> > &neighbors,
+                     vector<int> &members, double dt);
+  static void copyValue(lua_State *from, int index, lua_State *to, int depth);
+  static void fillNeighbors(lua_State *L, vector<struct neighbor_struct> &neighbors);
+#ifdef LUAJIT
+  ffi_car_t *getViews(int i, int n);
+  static void fillView(ffi_car_t *v, Car *car, vector<struct neighbor_struct> &neighbors);
+#endif
+
   int ninstances;
   lua_State **L;    // Car controllers
+  int *init_ref;    // Registry references to init(), think() and destroy()
+  int *think_ref;
+  int *destroy_ref;
+  int *think_batch_ref; // LUA_REFNIL if the script has no think_batch()
+  int *neighbors_ref; // Registry reference to the reused neighbors table
+  int *batch_ref;     // Registry references to the reused think_batch() tables
+  int *batch_pool_ref;
+  int *batch_size;
+  vector<int> *batch_members; // Indices of the cars of each state in a batch
+  bool *batched;              // Whether the last batch of each state succeeded
+  vector<int> *released;      // Registry indices left to clear in each state (see collect())
+#ifdef LUAJIT
+  ffi_car_t **view;   // FFI views given to think() and think_batch()
+  int *view_size;
+  int *view_ref;      // Registry reference to the ffi_car_t * cdata
+  int *view_cast_ref;
+#endif
   lua_State *controlL; // Lane controller
-  pthread_mutex_t *mutex;
-  char *path;
+  vector<int> control_released;
+  pthread_mutex_t release_mutex; // Only guards the released lists
+  LuaProfiler *profiler; // NULL unless --lua-profile is given
+  char *path;        // Absolute directories of the scripts
   char *controlpath;
-  char cwd[1024];
+
+  typedef struct {
+    int ref;       // Registry reference to the update function
+    double period; // [s] (0 for every step)
+    double next;   // Time of the next call
+    double last;   // Time of the last call (negative before the first one)
+  } control_t;
+  vector<control_t> controls;
+  double next_control;
+  bool migrate_hooks; // Whether the script defines migrate_out() and migrate_in()
   gengetopt_args_info *options;
 };
 
@@ -1,10 +1,49 @@
 #include "LuaCar.h"
+#include "LuaBinding.h"
 #include "LuaLane.h"
 #include "LuaRoadActuator.h"
 
 LuaCar::LuaCar(lua_State *L)
 {
+  this->state = -1;
+}
+
+int LuaCar::registerSlots(lua_State *L, vector<string> *names)
+{
+  lua_getglobal(L, "slots");
+  if (!lua_istable(L, -1)) {
+    lua_pop(L, 1);
+    return -1;
+  }
+
+  // The index of a slot is its position in the array (from 0)
+  int n = lua_objlen(L, -1);
+  for (int k = 1; k <= n; k++) {
+    lua_rawgeti(L, -1, k);
+    if (names) names->push_back(lua_isstring(L, -1) ? lua_tostring(L, -1) : "");
+    lua_pop(L, 1);
+  }
+  lua_pop(L, 1);
 
+  return n;
+}
+
+int LuaCar::getSlots(lua_State *L)
+{
+  vector<double> &slots = control->getSlots();
+  luaL_checkstack(L, slots.size(), "too many slots");
+  for (unsigned int i = 0; i < slots.size(); i++) {
+    lua_pushnumber(L, slots[i]);
+  }
+  return slots.size();
+}
+
+int LuaCar::setSlot(lua_State *L)
+{
+  int i = luaL_checkint(L, 1);
+  if (i < 0) return luaL_argerror(L, 1, "negative slot index");
+  control->setSlot(i, luaL_checknumber(L, 2));
+  return 0;
 }
 
 int LuaCar::getPosition(lua_State *L)
@@ -116,7 +155,7 @@ int LuaCar::setSpeed(lua_State *L)
 
 LuaCar::~LuaCar()
 {
-
+  LuaBinding::release(this);
 }
 
 void LuaCar::setSelf(Car *self, CarControl *control)
@@ -130,6 +169,16 @@ Car *LuaCar::getSelf()
   return this->self;
 }
 
+int LuaCar::getState()
+{
+  return this->state;
+}
+
+void LuaCar::setState(int state)
+{
+  this->state = state;
+}
+
 const char LuaCar::className[] = "LuaCar";
 Lunar<LuaCar>::RegType LuaCar::methods[] = {
   LUNAR_DECLARE_METHOD(LuaCar, getPosition),
@@ -145,5 +194,7 @@ Lunar<LuaCar>::RegType LuaCar::methods[] = {
   LUNAR_DECLARE_METHOD(LuaCar, setSpeed),
   LUNAR_DECLARE_METHOD(LuaCar, setLaneChange),
   LUNAR_DECLARE_METHOD(LuaCar, getDestination),
+  LUNAR_DECLARE_METHOD(LuaCar, getSlots),
+  LUNAR_DECLARE_METHOD(LuaCar, setSlot),
   {0,0}
 };
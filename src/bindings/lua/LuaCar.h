@@ -11,11 +11,13 @@ extern "C" {
 #include <agents/Car.h>
 #include <agents/CarControl.h>
 
-class LuaCar {
+class LuaCar : public LunarObject {
  public:
   // C++ functions
   void setSelf(Car *self, CarControl *control);
   Car *getSelf();
+  int getState();
+  void setState(int state);
  
   // Lua functions
   LuaCar(lua_State *L);
@@ -32,14 +34,30 @@ class LuaCar {
   int setLaneChange(lua_State *L);
   int setSpeed(lua_State *L);
   int getDestination(lua_State *L);
+  int getSlots(lua_State *L);
+  int setSlot(lua_State *L);
   ~LuaCar();
 
+  /**
+   * Reads the slots declared by the script in the global <em>slots</em>
+   * array (e.g. slots = { "v0", "a" }). The values live in CarControl,
+   * the script reads them all at once with self:getSlots() and writes
+   * one with self:setSlot(i, value), where i is the position of the
+   * slot in the array starting from 0 (as in the FFI view). The method
+   * lookups of the cars are left untouched.
+   * @param L The LUA state.
+   * @param names If not NULL, receives the slot names.
+   * @return The number of slots or -1 if the script declares none.
+   */
+  static int registerSlots(lua_State *L, vector<string> *names);
+
   static const char className[];
   static Lunar<LuaCar>::RegType methods[];
 
  private:
   Car *self;
   CarControl *control;
+  int state; // LUA state of the car (see LuaBinding)
 };
 
 #endif
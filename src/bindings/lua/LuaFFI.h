@@ -0,0 +1,58 @@
+#ifndef LUAFFI_H
+#define LUAFFI_H
+
+#ifdef LUAJIT
+
+/*
+ * Plain C views onto the vehicle state that LuaJIT scripts read through
+ * the FFI (see LuaBinding). The declarations given to ffi.cdef() below
+ * must match these structures exactly.
+ */
+
+#define LUAFFI_NEIGHBORS 6
+
+typedef struct {
+  int id;           // -1 if there is no neighbor
+  double distance;
+  double position;
+  double speed;
+  double front;
+  double rear;
+} ffi_neighbor_t;
+
+typedef struct {
+  int id;
+  int type;
+  double position;
+  double speed;
+  double acceleration;
+  double front;
+  double rear;
+  ffi_neighbor_t neighbors[LUAFFI_NEIGHBORS];
+  double *slots;    // The slots of the car (see CarControl::getSlots()), NULL if none
+} ffi_car_t;
+
+#define LUAFFI_CDEF \
+  "typedef struct {" \
+  "  int id;" \
+  "  double distance;" \
+  "  double position;" \
+  "  double speed;" \
+  "  double front;" \
+  "  double rear;" \
+  "} ffi_neighbor_t;" \
+  "typedef struct {" \
+  "  int id;" \
+  "  int type;" \
+  "  double position;" \
+  "  double speed;" \
+  "  double acceleration;" \
+  "  double front;" \
+  "  double rear;" \
+  "  ffi_neighbor_t neighbors[6];" \
+  "  double *slots;" \
+  "} ffi_car_t;"
+
+#endif
+
+#endif
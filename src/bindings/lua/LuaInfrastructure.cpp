@@ -1,4 +1,5 @@
 #include "LuaInfrastructure.h"
+#include "LuaBinding.h"
 #include "LuaRoadSensor.h"
 #include "LuaRoadActuator.h"
 #include "LuaLane.h"
@@ -125,7 +126,7 @@ int LuaInfrastructure::getRoadActuator(lua_State *L)
 
 LuaInfrastructure::~LuaInfrastructure()
 {
-
+  LuaBinding::release(this);
 }
 
 const char LuaInfrastructure::className[] = "LuaInfrastructure";
@@ -10,7 +10,7 @@ extern "C" {
 
 #include <map/Map.h>
 
-class LuaInfrastructure {
+class LuaInfrastructure : public LunarObject {
  public:
   // C++ functions
   void setSelf(Map *self);
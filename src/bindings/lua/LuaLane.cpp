@@ -1,4 +1,5 @@
 #include "LuaLane.h"
+#include "LuaBinding.h"
 
 LuaLane::LuaLane(lua_State *L)
 {
@@ -144,7 +145,7 @@ int LuaLane::getVehicleCount(lua_State *L)
 
 LuaLane::~LuaLane()
 {
-
+  LuaBinding::release(this);
 }
 
 void LuaLane::setSelf(Lane *self)
@@ -10,7 +10,7 @@ extern "C" {
 
 #include <map/Map.h>
 
-class LuaLane {
+class LuaLane : public LunarObject {
  public:
   // C++ functions
   void setSelf(Lane *self);
@@ -0,0 +1,267 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <algorithm>
+#include <set>
+#include "LuaProfiler.h"
+
+#include <agents/Car.h>
+#include <map/Map.h>
+
+#define MAX_DEPTH 64
+
+char LuaProfiler::key;
+
+static const char *call_names[] = {"init", "think", "think_batch", "destroy",
+                                   "control_init", "control_update", "control_destroy"};
+
+LuaProfiler::LuaProfiler(int nstates, const char *prefix, int period)
+{
+  this->states.resize(nstates);
+  for (int i = 0; i < nstates; i++) {
+    state_t &s = this->states[i];
+    memset(s.calls, 0, sizeof(s.calls));
+    memset(s.types, 0, sizeof(s.types));
+    s.gc.count = 0;
+    s.gc.time = 0.0;
+    s.memory = 0;
+    s.peak = 0;
+    s.samples = 0;
+    s.current = INIT;
+  }
+  this->prefix = prefix;
+  this->period = (period > 0) ? period : 1000;
+}
+
+LuaProfiler::~LuaProfiler()
+{
+}
+
+double LuaProfiler::now()
+{
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (double)t.tv_sec + (double)t.tv_nsec*1e-9;
+}
+
+void LuaProfiler::attach(lua_State *L, int state)
+{
+  // The hook finds its counters through the registry
+  lua_pushlightuserdata(L, &key);
+  lua_pushlightuserdata(L, &this->states[state]);
+  lua_rawset(L, LUA_REGISTRYINDEX);
+  lua_sethook(L, hook, LUA_MASKCOUNT, period);
+
+  // The collector is run by end() only
+  lua_gc(L, LUA_GCSTOP, 0);
+  this->states[state].memory = lua_gc(L, LUA_GCCOUNT, 0);
+  this->states[state].peak = std::max(this->states[state].peak, this->states[state].memory);
+}
+
+void LuaProfiler::begin(int state, call_t call)
+{
+  this->states[state].current = call;
+}
+
+void LuaProfiler::end(lua_State *L, int state, call_t call, double time, Car *car)
+{
+  state_t &s = this->states[state];
+
+  s.calls[call].count++;
+  s.calls[call].time += time;
+  // The lane of a car is only known once it is on the map
+  if (car && call == THINK) {
+    s.types[car->getType()].count++;
+    s.types[car->getType()].time += time;
+    if (car->getLane()) {
+      counter_t &c = s.lanes[car->getLane()];
+      c.count++;
+      c.time += time;
+    }
+  }
+
+  // Collect as much as what was allocated by the call
+  double t = now();
+  int kb = lua_gc(L, LUA_GCCOUNT, 0);
+  if (kb > s.peak) s.peak = kb;
+  lua_gc(L, LUA_GCSTEP, (kb > s.memory) ? kb - s.memory : 0);
+  lua_gc(L, LUA_GCSTOP, 0);
+  s.memory = lua_gc(L, LUA_GCCOUNT, 0);
+  s.gc.count++;
+  s.gc.time += now() - t;
+}
+
+void LuaProfiler::hook(lua_State *L, lua_Debug *ar)
+{
+  lua_pushlightuserdata(L, &key);
+  lua_rawget(L, LUA_REGISTRYINDEX);
+  state_t *s = (state_t *)lua_touserdata(L, -1);
+  lua_pop(L, 1);
+  if (!s) return;
+
+  lua_Debug d;
+  int depth = 0;
+  while (depth < MAX_DEPTH && lua_getstack(L, depth, &d)) depth++;
+
+  // Folded stack: outermost frame first, separated by ';'
+  char buffer[4096];
+  int n = 0;
+  for (int level = depth-1; level >= 0 && n < (int)sizeof(buffer) - 256; level--) {
+    lua_getstack(L, level, &d);
+    lua_getinfo(L, "Sn", &d);
+    const char *name = d.name;
+    if (!name) name = (level == depth-1) ? call_names[s->current] : "?";
+    if (d.what[0] == 'C') {
+      n += snprintf(buffer+n, sizeof(buffer)-n, "%s%s@[C]", (n ? ";" : ""), name);
+    } else {
+      const char *src = strrchr(d.short_src, '/');
+      src = src ? src+1 : d.short_src;
+      n += snprintf(buffer+n, sizeof(buffer)-n, "%s%s@%.64s:%d", (n ? ";" : ""), name, src, d.linedefined);
+    }
+    if (n >= (int)sizeof(buffer)) n = sizeof(buffer) - 1;
+  }
+  // Frame names cannot contain spaces in the folded format
+  for (int i = 0; i < n; i++) {
+    if (buffer[i] == ' ') buffer[i] = '_';
+  }
+
+  s->samples++;
+  s->stacks[string(buffer, n)]++;
+}
+
+string LuaProfiler::laneName(Lane *l)
+{
+  char buffer[128];
+  int index = 0;
+  for (unsigned int i = 0; i < l->segment->lanes.size(); i++) {
+    if (l->segment->lanes[i] == l) index = i;
+  }
+  snprintf(buffer, sizeof(buffer), "lane %d at (%.0f, %.0f)", index, l->x_start, l->y_start);
+  return string(buffer);
+}
+
+static bool compare_time(const pair<string, double> &a, const pair<string, double> &b)
+{
+  return a.second > b.second;
+}
+
+static bool compare_samples(const pair<string, pair<long, long> > &a, const pair<string, pair<long, long> > &b)
+{
+  return a.second.first > b.second.first;
+}
+
+int LuaProfiler::write()
+{
+  string filename = prefix + ".txt";
+  FILE *f = fopen(filename.c_str(), "w");
+  if (!f) {
+    fprintf(stderr, "Unable to write the LUA profile to %s.\n", filename.c_str());
+    return -1;
+  }
+
+  // Calls
+  fprintf(f, "Calls:\n");
+  fprintf(f, "%-16s %12s %12s %12s\n", "function", "count", "total [s]", "mean [us]");
+  for (int c = 0; c < NCALLS; c++) {
+    long count = 0;
+    double time = 0.0;
+    for (unsigned int i = 0; i < states.size(); i++) {
+      count += states[i].calls[c].count;
+      time += states[i].calls[c].time;
+    }
+    if (!count) continue;
+    fprintf(f, "%-16s %12ld %12.4f %12.3f\n", call_names[c], count, time, time/(double)count*1e6);
+  }
+
+  // Garbage collection and memory
+  fprintf(f, "\nStates:\n");
+  fprintf(f, "%-8s %12s %12s %12s %12s %12s\n", "state", "gc steps", "gc [s]", "memory [KB]", "peak [KB]", "samples");
+  for (unsigned int i = 0; i < states.size(); i++) {
+    state_t &s = states[i];
+    if (!s.gc.count) continue;
+    fprintf(f, "%-8d %12ld %12.4f %12d %12d %12ld\n", i, s.gc.count, s.gc.time, s.memory, s.peak, s.samples);
+  }
+
+  // Vehicle types
+  fprintf(f, "\nthink() per vehicle type:\n");
+  fprintf(f, "%-16s %12s %12s %12s\n", "type", "count", "total [s]", "mean [us]");
+  for (int t = 0; t < 2; t++) {
+    long count = 0;
+    double time = 0.0;
+    for (unsigned int i = 0; i < states.size(); i++) {
+      count += states[i].types[t].count;
+      time += states[i].types[t].time;
+    }
+    if (!count) continue;
+    fprintf(f, "%-16s %12ld %12.4f %12.3f\n", (t == TRUCK) ? "truck" : "car", count, time, time/(double)count*1e6);
+  }
+
+  // Lanes
+  map<Lane *, counter_t> lanes;
+  for (unsigned int i = 0; i < states.size(); i++) {
+    for (map<Lane *, counter_t>::iterator it = states[i].lanes.begin(); it != states[i].lanes.end(); it++) {
+      counter_t &c = lanes[it->first];
+      c.count += it->second.count;
+      c.time += it->second.time;
+    }
+    states[i].lanes.clear();
+  }
+  vector< pair<string, double> > lane_times;
+  for (map<Lane *, counter_t>::iterator it = lanes.begin(); it != lanes.end(); it++) {
+    if (!it->first) continue;
+    lane_times.push_back(make_pair(laneName(it->first), it->second.time));
+  }
+  sort(lane_times.begin(), lane_times.end(), compare_time);
+  fprintf(f, "\nthink() per lane (top 20):\n");
+  for (unsigned int i = 0; i < lane_times.size() && i < 20; i++) {
+    fprintf(f, "%-40s %12.4f s\n", lane_times[i].first.c_str(), lane_times[i].second);
+  }
+
+  // Flat profile from the sampled stacks
+  map<string, long> stacks;
+  for (unsigned int i = 0; i < states.size(); i++) {
+    for (map<string, long>::iterator it = states[i].stacks.begin(); it != states[i].stacks.end(); it++) {
+      stacks[it->first] += it->second;
+    }
+  }
+  long total = 0;
+  map<string, pair<long, long> > functions; // self, total
+  for (map<string, long>::iterator it = stacks.begin(); it != stacks.end(); it++) {
+    total += it->second;
+    set<string> seen;
+    size_t begin = 0;
+    while (true) {
+      size_t end = it->first.find(';', begin);
+      string frame = it->first.substr(begin, (end == string::npos) ? string::npos : end - begin);
+      if (seen.insert(frame).second) functions[frame].second += it->second;
+      if (end == string::npos) {
+        functions[frame].first += it->second;
+        break;
+      }
+      begin = end + 1;
+    }
+  }
+  vector< pair<string, pair<long, long> > > flat(functions.begin(), functions.end());
+  sort(flat.begin(), flat.end(), compare_samples);
+  fprintf(f, "\nFlat profile (%ld samples, one every %d instructions):\n", total, period);
+  fprintf(f, "%8s %8s  %s\n", "self %", "total %", "function");
+  for (unsigned int i = 0; i < flat.size() && total > 0; i++) {
+    fprintf(f, "%8.2f %8.2f  %s\n", 100.0*(double)flat[i].second.first/(double)total,
+            100.0*(double)flat[i].second.second/(double)total, flat[i].first.c_str());
+  }
+  fclose(f);
+
+  // Folded stacks (for flamegraph.pl)
+  filename = prefix + ".folded";
+  f = fopen(filename.c_str(), "w");
+  if (!f) {
+    fprintf(stderr, "Unable to write the LUA stacks to %s.\n", filename.c_str());
+    return -1;
+  }
+  for (map<string, long>::iterator it = stacks.begin(); it != stacks.end(); it++) {
+    fprintf(f, "%s %ld\n", it->first.c_str(), it->second);
+  }
+  fclose(f);
+
+  return 0;
+}
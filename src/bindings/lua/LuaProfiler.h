@@ -0,0 +1,105 @@
+#ifndef LUAPROFILER_H
+#define LUAPROFILER_H
+
+extern "C" {
+#include <lua.h>
+#include <lauxlib.h>
+}
+
+#include <map>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+class Car;
+class Lane;
+
+/**
+ * @brief Profiler of the LUA controllers
+ *
+ * It times the calls made by LuaBinding, samples the LUA stacks every
+ * few VM instructions with a counting hook and drives the garbage
+ * collector explicitly after each call so that its cost can be measured.
+ * Each LUA state has its own counters: since a state is only used by one
+ * thread at a time, nothing is locked. The profiler only exists when
+ * --lua-profile is given.
+ */
+class LuaProfiler {
+ public:
+  typedef enum {INIT = 0, THINK, THINK_BATCH, DESTROY, CONTROL_INIT, CONTROL_UPDATE, CONTROL_DESTROY, NCALLS} call_t;
+
+  /**
+   * Constructor.
+   * @param nstates The number of states (the states are numbered from 0 to nstates-1).
+   * @param prefix The output files are prefix.txt and prefix.folded.
+   * @param period The number of VM instructions between two stack samples.
+   */
+  LuaProfiler(int nstates, const char *prefix, int period);
+
+  /**
+   * Destructor.
+   */
+  ~LuaProfiler();
+
+  /**
+   * Starts profiling a newly created state.
+   * @param L The LUA state.
+   * @param state Its index.
+   */
+  void attach(lua_State *L, int state);
+
+  /**
+   * Marks the beginning of a call (for the sampled stacks).
+   * @param state The state index.
+   * @param call The function being called.
+   */
+  void begin(int state, call_t call);
+
+  /**
+   * Marks the end of a call and runs the garbage collector.
+   * @param L The LUA state.
+   * @param state The state index.
+   * @param call The function that was called.
+   * @param time The duration of the call [s] (as measured by the caller).
+   * @param car The car being controlled (or NULL).
+   */
+  void end(lua_State *L, int state, call_t call, double time, Car *car = NULL);
+
+  /**
+   * Writes the report and the folded stacks. The per-lane counters are
+   * reset since the lanes may not survive (the map needs to be alive
+   * when calling this function).
+   * @return 0 on success.
+   */
+  int write();
+
+ private:
+  typedef struct {
+    long count;
+    double time;
+  } counter_t;
+
+  typedef struct {
+    counter_t calls[NCALLS];
+    counter_t gc;
+    int memory;    // [KB]
+    int peak;      // [KB]
+    long samples;
+    call_t current;
+    map<string, long> stacks;
+    counter_t types[2];
+    map<Lane *, counter_t> lanes;
+  } state_t;
+
+  static double now();
+  static void hook(lua_State *L, lua_Debug *ar);
+  static string laneName(Lane *l);
+
+  vector<state_t> states;
+  string prefix;
+  int period;
+  static char key;
+};
+
+#endif
@@ -1,4 +1,5 @@
 #include "LuaRoadActuator.h"
+#include "LuaBinding.h"
 #include "LuaLane.h"
 
 void LuaRoadActuator::setSelf(RoadActuator *self)
@@ -110,7 +111,7 @@ int LuaRoadActuator::getLane(lua_State *L)
 
 LuaRoadActuator::~LuaRoadActuator()
 {
-
+  LuaBinding::release(this);
 }
 
 const char LuaRoadActuator::className[] = "LuaRoadActuator";
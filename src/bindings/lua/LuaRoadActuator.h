@@ -10,7 +10,7 @@ extern "C" {
 
 #include <map/Map.h>
 
-class LuaRoadActuator {
+class LuaRoadActuator : public LunarObject {
  public:
   // C++ functions
   void setSelf(RoadActuator *self);
@@ -1,4 +1,5 @@
 #include "LuaRoadSensor.h"
+#include "LuaBinding.h"
 #include "LuaLane.h"
 
 void LuaRoadSensor::setSelf(RoadSensor *self)
@@ -58,7 +59,7 @@ int LuaRoadSensor::getLane(lua_State *L)
 
 LuaRoadSensor::~LuaRoadSensor()
 {
-
+  LuaBinding::release(this);
 }
 
 const char LuaRoadSensor::className[] = "LuaRoadSensor";
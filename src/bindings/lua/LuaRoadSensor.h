@@ -10,7 +10,7 @@ extern "C" {
 
 #include <map/Map.h>
 
-class LuaRoadSensor {
+class LuaRoadSensor : public LunarObject {
  public:
   // C++ functions
   void setSelf(RoadSensor *self);
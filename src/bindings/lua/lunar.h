@@ -6,6 +6,31 @@ extern "C" {
 #include <lauxlib.h>
 }
 
+/**
+ * Base class of the C++ objects pushed to LUA with Lunar.
+ * Each object owns a registry index under which its userdata is kept in
+ * every LUA state it has been pushed to, so that pushing it again is a
+ * single lua_rawgeti. The indices are negative so that they never collide
+ * with the references handed out by luaL_ref (nor with LUA_NOREF/LUA_REFNIL).
+ * The owner of the LUA states must clear that index when the object dies.
+ */
+class LunarObject {
+ public:
+  LunarObject() : lunar_ref(LUA_NOREF - nextIndex()), lunar_cached(false) {}
+  int lunarRef() const { return lunar_ref; }
+  bool isLunarCached() const { return lunar_cached; }
+  void setLunarCached() { lunar_cached = true; }
+
+ private:
+  static int nextIndex() {
+    static int count = 0;
+    return __sync_add_and_fetch(&count, 1);
+  }
+
+  int lunar_ref;
+  bool lunar_cached;
+};
+
 template <typename T> class Lunar {
   typedef struct { T *pT; } userdataType;
  public:
@@ -111,6 +136,12 @@ template <typename T> int Lunar<T>::call(lua_State *L, const char *method, int n
 template <typename T> int Lunar<T>::push(lua_State *L, T *obj, bool gc)
 {
   if (!obj) { lua_pushnil(L); return 0; }
+  if (!gc) {
+    // Objects owned by C++ keep their userdata in the registry
+    lua_rawgeti(L, LUA_REGISTRYINDEX, obj->lunarRef());
+    if (!lua_isnil(L, -1)) return lua_gettop(L);
+    lua_pop(L, 1);
+  }
   luaL_getmetatable(L, T::className);  // lookup metatable in Lua registry
   if (lua_isnil(L, -1)) luaL_error(L, "%s missing metatable", T::className);
   int mt = lua_gettop(L);
@@ -132,6 +163,11 @@ template <typename T> int Lunar<T>::push(lua_State *L, T *obj, bool gc)
   }
   lua_replace(L, mt);
   lua_settop(L, mt);
+  if (!gc) {
+    lua_pushvalue(L, mt);
+    lua_rawseti(L, LUA_REGISTRYINDEX, obj->lunarRef());
+    obj->setLunarCached();
+  }
   return mt;  // index of userdata containing pointer to T object
 }
 
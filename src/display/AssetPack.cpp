@@ -0,0 +1,540 @@
+#include "AssetPack.h"
+#include "Model_3DS.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <utils/Log.h>
+
+#define ASSET_PACK_MAGIC "DISIMPAK"
+#define ASSET_PACK_VERSION 1
+
+// Alignment of the entries in the pack and of the arrays in an entry
+#define ENTRY_ALIGNMENT 16
+#define ARRAY_ALIGNMENT 4
+
+typedef struct {
+  int32_t numObjects;
+  int32_t numMaterials;
+  int32_t totalVerts;
+  int32_t totalFaces;
+} model_header_t;
+
+typedef struct {
+  char name[80];
+  char mapname[80];
+  int32_t textured;
+  Model_3DS::Color4i color;
+} material_t;
+
+typedef struct {
+  char name[80];
+  int32_t numVerts;
+  int32_t numTexCoords;
+  int32_t numFaces;
+  int32_t numMatFaces;
+  int32_t textured;
+} object_t;
+
+typedef struct {
+  int32_t numSubFaces;
+  int32_t MatIndex;
+} material_faces_t;
+
+typedef struct {
+  uint32_t width;
+  uint32_t height;
+  uint32_t levels;  // Down to 1x1
+  uint32_t channels;
+} texture_header_t;
+
+static bool endsWith(const string &s, const char *suffix)
+{
+  size_t n = strlen(suffix);
+  return s.size() >= n && strcasecmp(s.c_str() + s.size() - n, suffix) == 0;
+}
+
+/**
+ * The files of a subdirectory (and of its own subdirectories up to depth).
+ */
+static void listFiles(const char *directory, const string &sub, int depth, vector<string> *files)
+{
+  string path = string(directory) + "/" + sub;
+  DIR *dir = opendir(path.c_str());
+  if (!dir) return;
+
+  vector<string> names;
+  struct dirent *d;
+  while ((d = readdir(dir)) != NULL) {
+    if (d->d_name[0] != '.') names.push_back(d->d_name);
+  }
+  closedir(dir);
+  // The same pack whatever the order of the directory
+  sort(names.begin(), names.end());
+
+  for (unsigned int i = 0; i < names.size(); i++) {
+    struct stat st;
+    string name = sub + names[i];
+    if (stat((path + names[i]).c_str(), &st)) continue;
+    if (S_ISDIR(st.st_mode)) {
+      if (depth > 0) listFiles(directory, name + "/", depth - 1, files);
+    } else {
+      files->push_back(name);
+    }
+  }
+}
+
+AssetPack &AssetPack::getInstance()
+{
+  static AssetPack instance;
+  return instance;
+}
+
+AssetPack::AssetPack()
+{
+  base = NULL;
+  length = 0;
+  header = NULL;
+  entries = NULL;
+}
+
+AssetPack::~AssetPack()
+{
+  close();
+}
+
+int AssetPack::open(const char *directory, const char *filename)
+{
+  close();
+
+  int fd = ::open(filename, O_RDONLY);
+  if (fd < 0) {
+    Log::getStream(5) << "No asset pack " << filename << endl;
+    return -1;
+  }
+  struct stat st;
+  if (fstat(fd, &st) || st.st_size < (off_t)sizeof(header_t)) {
+    ::close(fd);
+    fprintf(stderr, "Warning: The asset pack %s is corrupted.\n", filename);
+    return -1;
+  }
+
+  // Private and writable, as the models may modify their arrays
+  void *p = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+  if (p == MAP_FAILED) {
+    fprintf(stderr, "Warning: Unable to map the asset pack %s.\n", filename);
+    return -1;
+  }
+  base = (char *)p;
+  length = st.st_size;
+  header = (const header_t *)base;
+  entries = (const entry_t *)(base + sizeof(header_t));
+
+  bool ok = !memcmp(header->magic, ASSET_PACK_MAGIC, sizeof(header->magic)) &&
+    header->version == ASSET_PACK_VERSION &&
+    header->count <= (length - sizeof(header_t))/sizeof(entry_t);
+  for (uint32_t i = 0; ok && i < header->count; i++) {
+    ok = entries[i].offset % ENTRY_ALIGNMENT == 0 && entries[i].offset <= length &&
+      entries[i].size <= length - entries[i].offset &&
+      memchr(entries[i].name, '\0', sizeof(entries[i].name)) != NULL;
+  }
+  if (!ok) {
+    fprintf(stderr, "Warning: The asset pack %s is corrupted or from another version.\n", filename);
+    close();
+    return -1;
+  }
+
+  this->directory = directory;
+  Log::getStream(5) << "Asset pack " << filename << ": " << header->count << " entries" << endl;
+  return 0;
+}
+
+void AssetPack::close()
+{
+  if (base) munmap(base, length);
+  base = NULL;
+  length = 0;
+  header = NULL;
+  entries = NULL;
+}
+
+const AssetPack::entry_t *AssetPack::find(const char *filename, kind_t kind, int type)
+{
+  if (!base) return NULL;
+
+  // The names are relative to the directory of the assets
+  if (strncmp(filename, directory.c_str(), directory.size())) return NULL;
+  const char *name = filename + directory.size();
+  while (*name == '/') name++;
+
+  for (uint32_t i = 0; i < header->count; i++) {
+    const entry_t *e = &entries[i];
+    if (e->kind != (uint32_t)kind || e->type != type || strcmp(e->name, name)) continue;
+
+    // The original file changed since the pack was built (it may also not be shipped)
+    struct stat st;
+    if (!stat(filename, &st) && (st.st_size != e->source_size || st.st_mtime != e->source_mtime)) {
+      Log::getStream(5) << "Asset pack: " << name << " is stale" << endl;
+      return NULL;
+    }
+    return e;
+  }
+  return NULL;
+}
+
+const char *AssetPack::take(const char **p, const char *end, size_t size)
+{
+  if (size > (size_t)(end - *p)) return NULL;
+  const char *q = *p;
+  size = (size + ARRAY_ALIGNMENT - 1)/ARRAY_ALIGNMENT*ARRAY_ALIGNMENT;
+  *p = (size > (size_t)(end - *p)) ? end : *p + size;
+  return q;
+}
+
+int AssetPack::loadModel(const char *filename, Model_3DS *model)
+{
+  const entry_t *e = find(filename, MODEL, -1);
+  if (!e) return -1;
+
+  const char *p = base + e->offset;
+  const char *end = p + e->size;
+  const model_header_t *h = (const model_header_t *)take(&p, end, sizeof(model_header_t));
+  if (!h || h->numObjects < 0 || h->numMaterials < 0) return -1;
+
+  // The arrays of the objects stay in the mapping
+  Model_3DS::Material *materials = new Model_3DS::Material[h->numMaterials];
+  Model_3DS::Object *objects = new Model_3DS::Object[h->numObjects];
+  for (int i = 0; i < h->numObjects; i++) {
+    objects[i].MatFaces = NULL;
+    objects[i].numMatFaces = 0;
+  }
+  bool ok = true;
+
+  for (int i = 0; ok && i < h->numMaterials; i++) {
+    const material_t *m = (const material_t *)take(&p, end, sizeof(material_t));
+    if (!(ok = (m != NULL))) break;
+    memcpy(materials[i].name, m->name, sizeof(materials[i].name));
+    memcpy(materials[i].mapname, m->mapname, sizeof(materials[i].mapname));
+    materials[i].name[sizeof(materials[i].name)-1] = '\0';
+    materials[i].mapname[sizeof(materials[i].mapname)-1] = '\0';
+    materials[i].textured = m->textured;
+    materials[i].color = m->color;
+    materials[i].tex = 0;
+  }
+
+  for (int i = 0; ok && i < h->numObjects; i++) {
+    Model_3DS::Object *o = &objects[i];
+    const object_t *b = (const object_t *)take(&p, end, sizeof(object_t));
+    if (!(ok = (b != NULL && b->numVerts >= 0 && b->numTexCoords >= 0 && b->numFaces >= 0 && b->numMatFaces >= 0))) break;
+    memcpy(o->name, b->name, sizeof(o->name));
+    o->name[sizeof(o->name)-1] = '\0';
+    o->numVerts = b->numVerts;
+    o->numTexCoords = b->numTexCoords;
+    o->numFaces = b->numFaces;
+    o->numMatFaces = b->numMatFaces;
+    o->textured = b->textured;
+    o->pos.x = o->pos.y = o->pos.z = 0.0f;
+    o->rot.x = o->rot.y = o->rot.z = 0.0f;
+    o->Vertexes = (float *)take(&p, end, o->numVerts*3*sizeof(float));
+    o->Normals = (float *)take(&p, end, o->numVerts*3*sizeof(float));
+    o->TexCoords = (float *)take(&p, end, o->numTexCoords*2*sizeof(float));
+    o->Faces = (unsigned short *)take(&p, end, o->numFaces*sizeof(unsigned short));
+    o->MatFaces = new Model_3DS::MaterialFaces[o->numMatFaces];
+    ok = o->Vertexes && o->Normals && o->TexCoords && o->Faces;
+    for (int j = 0; ok && j < o->numMatFaces; j++) {
+      const material_faces_t *f = (const material_faces_t *)take(&p, end, sizeof(material_faces_t));
+      if (!(ok = (f != NULL && f->numSubFaces >= 0 && f->MatIndex >= 0 && f->MatIndex < h->numMaterials))) break;
+      o->MatFaces[j].numSubFaces = f->numSubFaces;
+      o->MatFaces[j].MatIndex = f->MatIndex;
+      o->MatFaces[j].subFaces = (unsigned short *)take(&p, end, f->numSubFaces*sizeof(unsigned short));
+      ok = o->MatFaces[j].subFaces != NULL;
+    }
+  }
+
+  if (!ok) {
+    fprintf(stderr, "Warning: The model %s is corrupted in the asset pack.\n", e->name);
+    for (int i = 0; i < h->numObjects; i++) delete [] objects[i].MatFaces;
+    delete [] objects;
+    delete [] materials;
+    return -1;
+  }
+
+  model->numObjects = h->numObjects;
+  model->numMaterials = h->numMaterials;
+  model->totalVerts = h->totalVerts;
+  model->totalFaces = h->totalFaces;
+  model->Materials = materials;
+  model->Objects = objects;
+  return 0;
+}
+
+int AssetPack::loadTexture(GLuint *TID, const char *filename, image_type_t type, bool wrap)
+{
+  const entry_t *e = find(filename, TEXTURE, type);
+  if (!e) return -1;
+
+  const char *p = base + e->offset;
+  const char *end = p + e->size;
+  const texture_header_t *h = (const texture_header_t *)take(&p, end, sizeof(texture_header_t));
+  if (!h || h->channels != 4) return -1;
+
+  // Check the size of the whole chain first
+  size_t size = 0;
+  uint32_t w = h->width, hh = h->height;
+  for (uint32_t l = 0; l < h->levels; l++) {
+    size += (size_t)w*hh*4;
+    w = w > 1 ? w/2 : 1;
+    hh = hh > 1 ? hh/2 : 1;
+  }
+  if (h->levels == 0 || size > (size_t)(end - p)) {
+    fprintf(stderr, "Warning: The texture %s is corrupted in the asset pack.\n", e->name);
+    return -1;
+  }
+
+  glGenTextures(1, TID);
+  glBindTexture(GL_TEXTURE_2D, *TID);
+
+  glTexEnvf(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_MODULATE);
+  glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, h->levels > 1 ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR);
+  glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+  glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, wrap ? GL_REPEAT : GL_CLAMP);
+  glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, wrap ? GL_REPEAT : GL_CLAMP);
+
+  // Every level as it is stored
+  w = h->width;
+  hh = h->height;
+  for (uint32_t l = 0; l < h->levels; l++) {
+    glTexImage2D(GL_TEXTURE_2D, l, GL_RGBA, w, hh, 0, GL_RGBA, GL_UNSIGNED_BYTE, p);
+    p += (size_t)w*hh*4;
+    w = w > 1 ? w/2 : 1;
+    hh = hh > 1 ? hh/2 : 1;
+  }
+  return 0;
+}
+
+void AssetPack::append(vector<char> *data, const void *p, size_t size)
+{
+  data->insert(data->end(), (const char *)p, (const char *)p + size);
+  while (data->size() % ARRAY_ALIGNMENT) data->push_back(0);
+}
+
+int AssetPack::source(const char *directory, const char *name, entry_t *entry)
+{
+  char path[512];
+  snprintf(path, sizeof(path), "%s/%s", directory, name);
+  struct stat st;
+  if (strlen(name) >= sizeof(entry->name) || stat(path, &st)) return -1;
+
+  memset(entry, 0, sizeof(entry_t));
+  strcpy(entry->name, name);
+  entry->source_size = st.st_size;
+  entry->source_mtime = st.st_mtime;
+  return 0;
+}
+
+int AssetPack::packTexture(const char *directory, const char *name, image_type_t type, vector<pending_t> *pending)
+{
+  for (unsigned int i = 0; i < pending->size(); i++) {
+    const entry_t *e = &(*pending)[i].entry;
+    if (e->kind == TEXTURE && e->type == type && !strcmp(e->name, name)) return 0;
+  }
+
+  pending_t t;
+  if (source(directory, name, &t.entry)) {
+    fprintf(stderr, "Warning: Unable to find the texture %s.\n", name);
+    return -1;
+  }
+  t.entry.kind = TEXTURE;
+  t.entry.type = type;
+
+  char path[512];
+  snprintf(path, sizeof(path), "%s/%s", directory, name);
+  TextureManager decoder;
+  image_t image;
+  int result = decoder.loadImage(path, type, &image);
+  if (result < 0) {
+    fprintf(stderr, "Warning: Unable to decode the texture %s.\n", name);
+    return -1;
+  }
+
+  // Everything becomes RGBA, as glTexImage2D would expand it
+  uint32_t w = image.sizeX, h = image.sizeY;
+  int channels = (result == 1) ? 4 : 3;
+  vector<unsigned char> level((size_t)w*h*4);
+  for (size_t i = 0; i < (size_t)w*h; i++) {
+    level[4*i] = image.data[channels*i];
+    level[4*i+1] = image.data[channels*i+1];
+    level[4*i+2] = image.data[channels*i+2];
+    level[4*i+3] = (channels == 4) ? image.data[channels*i+3] : 255;
+  }
+  free(image.data);
+
+  texture_header_t header;
+  header.width = w;
+  header.height = h;
+  header.levels = 1;
+  header.channels = 4;
+  for (uint32_t x = w, y = h; x > 1 || y > 1; x = x > 1 ? x/2 : 1, y = y > 1 ? y/2 : 1) header.levels++;
+  append(&t.data, &header, sizeof(header));
+
+  // The mipmaps (box filter, the last row and column are repeated for odd sizes)
+  for (uint32_t l = 0; l < header.levels; l++) {
+    append(&t.data, &level[0], level.size());
+    if (l + 1 == header.levels) break;
+
+    uint32_t w2 = w > 1 ? w/2 : 1, h2 = h > 1 ? h/2 : 1;
+    vector<unsigned char> next((size_t)w2*h2*4);
+    for (uint32_t y = 0; y < h2; y++) {
+      uint32_t y0 = 2*y < h ? 2*y : h-1, y1 = 2*y+1 < h ? 2*y+1 : h-1;
+      for (uint32_t x = 0; x < w2; x++) {
+        uint32_t x0 = 2*x < w ? 2*x : w-1, x1 = 2*x+1 < w ? 2*x+1 : w-1;
+        for (int c = 0; c < 4; c++) {
+          int sum = level[((size_t)y0*w+x0)*4+c] + level[((size_t)y0*w+x1)*4+c] +
+            level[((size_t)y1*w+x0)*4+c] + level[((size_t)y1*w+x1)*4+c];
+          next[((size_t)y*w2+x)*4+c] = (sum + 2)/4;
+        }
+      }
+    }
+    level.swap(next);
+    w = w2;
+    h = h2;
+  }
+
+  pending->push_back(t);
+  return 0;
+}
+
+int AssetPack::packModel(const char *directory, const char *name, vector<pending_t> *pending)
+{
+  pending_t m;
+  if (source(directory, name, &m.entry)) return -1;
+  m.entry.kind = MODEL;
+  m.entry.type = -1;
+
+  // Only parsed, there is no GL context
+  char path[512];
+  snprintf(path, sizeof(path), "%s/%s", directory, name);
+  Model_3DS model;
+  model.gltextures = false;
+  model.Load(path);
+  if (!model.visible) return -1;
+
+  model_header_t header;
+  header.numObjects = model.numObjects;
+  header.numMaterials = model.numMaterials;
+  header.totalVerts = model.totalVerts;
+  header.totalFaces = model.totalFaces;
+  append(&m.data, &header, sizeof(header));
+
+  // The textures of the materials are next to the model
+  string dir(name);
+  dir = dir.substr(0, dir.find_last_of('/') + 1);
+
+  for (int i = 0; i < model.numMaterials; i++) {
+    Model_3DS::Material *mat = &model.Materials[i];
+    material_t material;
+    memset(&material, 0, sizeof(material));
+    snprintf(material.name, sizeof(material.name), "%s", mat->name);
+    snprintf(material.mapname, sizeof(material.mapname), "%s", mat->mapname);
+    material.textured = mat->textured;
+    material.color = mat->color;
+    append(&m.data, &material, sizeof(material));
+
+    if (mat->mapname[0]) packTexture(directory, (dir + mat->mapname).c_str(), BMP_IMAGE, pending);
+  }
+
+  for (int i = 0; i < model.numObjects; i++) {
+    Model_3DS::Object *o = &model.Objects[i];
+    object_t object;
+    memset(&object, 0, sizeof(object));
+    snprintf(object.name, sizeof(object.name), "%s", o->name);
+    object.numVerts = o->numVerts;
+    object.numTexCoords = o->numTexCoords;
+    object.numFaces = o->numFaces;
+    object.numMatFaces = o->numMatFaces;
+    object.textured = o->textured;
+    append(&m.data, &object, sizeof(object));
+    append(&m.data, o->Vertexes, o->numVerts*3*sizeof(float));
+    append(&m.data, o->Normals, o->numVerts*3*sizeof(float));
+    append(&m.data, o->TexCoords, o->numTexCoords*2*sizeof(float));
+    append(&m.data, o->Faces, o->numFaces*sizeof(unsigned short));
+    for (int j = 0; j < o->numMatFaces; j++) {
+      material_faces_t faces;
+      faces.numSubFaces = o->MatFaces[j].numSubFaces;
+      faces.MatIndex = o->MatFaces[j].MatIndex;
+      append(&m.data, &faces, sizeof(faces));
+      append(&m.data, o->MatFaces[j].subFaces, faces.numSubFaces*sizeof(unsigned short));
+    }
+  }
+
+  pending->push_back(m);
+  return 0;
+}
+
+int AssetPack::build(const char *directory, const char *filename)
+{
+  vector<pending_t> pending;
+  vector<string> files;
+
+  listFiles(directory, "models/", 0, &files);
+  for (unsigned int i = 0; i < files.size(); i++) {
+    if (!endsWith(files[i], ".3ds")) continue;
+    if (packModel(directory, files[i].c_str(), &pending))
+      fprintf(stderr, "Warning: Unable to pack the model %s.\n", files[i].c_str());
+  }
+
+  files.clear();
+  listFiles(directory, "textures/", 1, &files);
+  for (unsigned int i = 0; i < files.size(); i++) {
+    if (endsWith(files[i], ".bmp")) packTexture(directory, files[i].c_str(), BMP_IMAGE, &pending);
+    else if (endsWith(files[i], ".png")) packTexture(directory, files[i].c_str(), PNG_IMAGE, &pending);
+  }
+
+  // The entries after the table, each aligned
+  header_t header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, ASSET_PACK_MAGIC, sizeof(header.magic));
+  header.version = ASSET_PACK_VERSION;
+  header.count = pending.size();
+  uint64_t offset = sizeof(header_t) + pending.size()*sizeof(entry_t);
+  for (unsigned int i = 0; i < pending.size(); i++) {
+    offset = (offset + ENTRY_ALIGNMENT - 1)/ENTRY_ALIGNMENT*ENTRY_ALIGNMENT;
+    pending[i].entry.offset = offset;
+    pending[i].entry.size = pending[i].data.size();
+    offset += pending[i].data.size();
+  }
+
+  // Written aside and renamed, so that a running viewer never maps half a file
+  char temporary[512];
+  snprintf(temporary, sizeof(temporary), "%s.%d", filename, (int)getpid());
+  FILE *f = fopen(temporary, "wb");
+  if (!f) {
+    fprintf(stderr, "Warning: Unable to write the asset pack %s.\n", temporary);
+    return -1;
+  }
+  bool ok = fwrite(&header, sizeof(header), 1, f) == 1;
+  for (unsigned int i = 0; ok && i < pending.size(); i++) {
+    ok = fwrite(&pending[i].entry, sizeof(entry_t), 1, f) == 1;
+  }
+  static const char padding[ENTRY_ALIGNMENT] = {0};
+  for (unsigned int i = 0; ok && i < pending.size(); i++) {
+    long position = ftell(f);
+    ok = position >= 0 && (uint64_t)position <= pending[i].entry.offset &&
+      fwrite(padding, 1, pending[i].entry.offset - position, f) == pending[i].entry.offset - position &&
+      (pending[i].data.empty() || fwrite(&pending[i].data[0], pending[i].data.size(), 1, f) == 1);
+  }
+  if (fclose(f) || !ok || rename(temporary, filename)) {
+    fprintf(stderr, "Warning: Unable to write the asset pack %s.\n", filename);
+    unlink(temporary);
+    return -1;
+  }
+
+  printf("Asset pack %s: %u entries, %lu bytes\n", filename, (unsigned int)pending.size(), (unsigned long)offset);
+  return 0;
+}
@@ -0,0 +1,122 @@
+#ifndef ASSET_PACK_H
+#define ASSET_PACK_H
+
+#ifdef MAC
+#include <GLUT/glut.h>
+#else
+#include <GL/glut.h>
+#endif
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "TextureManager.h"
+
+using namespace std;
+
+class Model_3DS;
+
+/**
+ * @brief Preprocessed models and textures, ready to be uploaded.
+ *
+ * The pack is built offline (disim --pack-assets) from the directory of the
+ * models and textures: the 3DS models are stored as the vertex, normal,
+ * texture coordinate and face arrays of Model_3DS, and the textures as
+ * RGBA images with all their mipmaps. At runtime the whole pack is mapped
+ * in memory once; the models point directly into the mapping and the
+ * textures are uploaded level by level without decoding.
+ *
+ * Every entry remembers the size and modification time of its original
+ * file. When they do not match anymore, the entry is stale and the
+ * original file is loaded instead.
+ */
+class AssetPack
+{
+ public:
+  /**
+   * The pack used by Model_3DS and TextureManager.
+   */
+  static AssetPack &getInstance();
+
+  ~AssetPack();
+
+  /**
+   * Maps a pack in memory (the previous one is closed).
+   * @param directory The directory the names of the assets are relative to.
+   * @param filename The pack.
+   * @return 0 on success.
+   */
+  int open(const char *directory, const char *filename);
+
+  /**
+   * Unmaps the pack (the models loaded from it must not be drawn anymore).
+   */
+  void close();
+
+  /**
+   * Fills a model from the pack.
+   * @param filename The path of the original 3DS file.
+   * @param model The model (it must be empty).
+   * @return 0 on success, -1 if the model is not in the pack or is stale.
+   */
+  int loadModel(const char *filename, Model_3DS *model);
+
+  /**
+   * Creates a texture from the pack (the GL context must be current).
+   * @param TID Receives the texture.
+   * @param filename The path of the original image.
+   * @param type How the original image is decoded.
+   * @param wrap Whether the texture repeats.
+   * @return 0 on success, -1 if the texture is not in the pack or is stale.
+   */
+  int loadTexture(GLuint *TID, const char *filename, image_type_t type, bool wrap);
+
+  /**
+   * Converts the models (models/ *.3ds) and the textures (textures/ *.bmp
+   * and *.png, one level deep) of a directory into a pack.
+   * @param directory The directory of the assets.
+   * @param filename The pack to write.
+   * @return 0 on success.
+   */
+  static int build(const char *directory, const char *filename);
+
+ private:
+  typedef enum { MODEL = 1, TEXTURE } kind_t;
+
+  typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t count;
+  } header_t;
+
+  typedef struct {
+    char name[120];     // Relative to the directory
+    uint32_t kind;
+    int32_t type;       // image_type_t of the textures
+    int64_t source_size;
+    int64_t source_mtime;
+    uint64_t offset;    // From the start of the pack
+    uint64_t size;
+  } entry_t;
+
+  typedef struct {
+    entry_t entry;
+    vector<char> data;
+  } pending_t;
+
+  AssetPack();
+
+  const entry_t *find(const char *filename, kind_t kind, int type);
+  static int source(const char *directory, const char *name, entry_t *entry);
+  static int packModel(const char *directory, const char *name, vector<pending_t> *pending);
+  static int packTexture(const char *directory, const char *name, image_type_t type, vector<pending_t> *pending);
+  static void append(vector<char> *data, const void *p, size_t size);
+  static const char *take(const char **p, const char *end, size_t size);
+
+  string directory;
+  char *base;
+  size_t length;
+  const header_t *header;
+  const entry_t *entries;
+};
+
+#endif
@@ -0,0 +1,625 @@
+#define GL_GLEXT_PROTOTYPES
+#include "DeviceOverlay.h"
+#ifdef MAC
+#include <OpenGL/glext.h>
+#else
+#include <GL/glext.h>
+#endif
+#include "TextureManager.h"
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include <utils/Log.h>
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+#define MIN(x,y) (((x)<(y))?(x):(y))
+#define MAX(x,y) (((x)>(y))?(x):(y))
+
+#define LIGHT_HEIGHT 2.0
+#define LIGHT_SIDE   0.07
+#define LIGHT_BOX_HEIGHT 0.6
+#define LIGHT_BOX_SIDE 0.17
+#define SPEED_RADIUS 1.0
+#define SPEED_HEIGHT 10.0
+
+// Sides of the discs and of the circles
+#define DISC_STEPS 16
+
+// The glyph texture: 16x8 cells in ASCII order (as for PerformanceHud)
+#define FONT_COLUMNS 16
+#define FONT_ROWS 8
+// Height of a glyph relative to its width (as the stroke font of GLUT)
+#define GLYPH_ASPECT 1.5
+
+static const GLubyte black[4] = {0, 0, 0, 255};
+static const GLubyte white[4] = {255, 255, 255, 255};
+static const GLubyte red[4] = {255, 0, 0, 255};
+static const GLubyte dark_red[4] = {128, 0, 0, 255};
+static const GLubyte dim_red[4] = {77, 0, 0, 255};
+static const GLubyte green[4] = {0, 255, 0, 255};
+static const GLubyte dim_green[4] = {0, 77, 0, 255};
+static const GLubyte blue[4] = {0, 0, 255, 255};
+static const GLubyte cyan[4] = {0, 255, 255, 255};
+static const GLubyte dark_cyan[4] = {0, 128, 128, 255};
+static const GLubyte yellow[4] = {255, 255, 0, 255};
+static const GLubyte dark_yellow[4] = {128, 128, 0, 255};
+
+static const GLfloat identity[16] = {1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1};
+
+DeviceOverlay::DeviceOverlay(Map *map)
+{
+  this->map = map;
+  built = false;
+  first_line = 0;
+  line_count = 0;
+  dirty_first = 0;
+  dirty_last = 0;
+  buffer = 0;
+  font = 0;
+  loaded = false;
+  checked = false;
+  buffers = false;
+}
+
+DeviceOverlay::~DeviceOverlay()
+{
+  reset();
+}
+
+void DeviceOverlay::load(char *filename)
+{
+  if (loaded) return;
+  loaded = true;
+
+  TextureManager textures;
+  if (textures.loadTexture(&font, filename, PNG_IMAGE, false)) {
+    fprintf(stderr, "Warning: Unable to load the glyphs of the sensor labels (%s).\n", filename);
+    font = 0;
+    return;
+  }
+  // The labels are seen from afar and at an angle
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+  Log::getStream(5) << "Label glyph texture loaded: " << font << endl;
+}
+
+void DeviceOverlay::reset()
+{
+  if (buffers && buffer) glDeleteBuffers(1, &buffer);
+  buffer = 0;
+  checked = false;
+
+  if (font) glDeleteTextures(1, &font);
+  font = 0;
+  loaded = false;
+}
+
+void DeviceOverlay::transform(const GLfloat *m, double x, double y, double z, vertex_t *v)
+{
+  // Column-major, as the GL matrices
+  v->x = m[0]*x + m[4]*y + m[8]*z + m[12];
+  v->y = m[1]*x + m[5]*y + m[9]*z + m[13];
+  v->z = m[2]*x + m[6]*y + m[10]*z + m[14];
+}
+
+void DeviceOverlay::setColor(vertex_t *v, const GLubyte *color)
+{
+  v->color[0] = color[0];
+  v->color[1] = color[1];
+  v->color[2] = color[2];
+  v->color[3] = color[3];
+}
+
+void DeviceOverlay::addVertex(vector<vertex_t> *stream, const GLfloat *m, double x, double y, double z, const GLubyte *color)
+{
+  vertex_t v;
+  transform(m, x, y, z, &v);
+  v.u = v.v = 0.0f;
+  setColor(&v, color);
+  stream->push_back(v);
+}
+
+void DeviceOverlay::addCube(const GLubyte *color)
+{
+  // As glutSolidCube(1.0) in the current modelview matrix
+  static const int faces[6][4] = {
+    {0, 1, 3, 2}, {4, 6, 7, 5}, {0, 4, 5, 1}, {2, 3, 7, 6}, {0, 2, 6, 4}, {1, 5, 7, 3}
+  };
+  GLfloat m[16];
+  glGetFloatv(GL_MODELVIEW_MATRIX, m);
+  for (int f = 0; f < 6; f++) {
+    static const int corners[6] = {0, 1, 2, 0, 2, 3};
+    for (int k = 0; k < 6; k++) {
+      int c = faces[f][corners[k]];
+      addVertex(&triangles, m, (c & 4) ? 0.5 : -0.5, (c & 2) ? 0.5 : -0.5, (c & 1) ? 0.5 : -0.5, color);
+    }
+  }
+}
+
+void DeviceOverlay::addDisc(double inner, double outer, double z, const GLubyte *color)
+{
+  // In the plane z of the current modelview matrix (a ring if inner > 0)
+  GLfloat m[16];
+  glGetFloatv(GL_MODELVIEW_MATRIX, m);
+  for (int k = 0; k < DISC_STEPS; k++) {
+    double a = 2.0*M_PI*k/DISC_STEPS;
+    double b = 2.0*M_PI*(k + 1)/DISC_STEPS;
+    if (inner <= 0.0) {
+      addVertex(&triangles, m, 0.0, 0.0, z, color);
+    } else {
+      addVertex(&triangles, m, cos(a)*inner, sin(a)*inner, z, color);
+      addVertex(&triangles, m, cos(b)*outer, sin(b)*outer, z, color);
+      addVertex(&triangles, m, cos(b)*inner, sin(b)*inner, z, color);
+      addVertex(&triangles, m, cos(a)*inner, sin(a)*inner, z, color);
+    }
+    addVertex(&triangles, m, cos(a)*outer, sin(a)*outer, z, color);
+    addVertex(&triangles, m, cos(b)*outer, sin(b)*outer, z, color);
+  }
+}
+
+void DeviceOverlay::addCircle(double radius, const GLubyte *color)
+{
+  // In the plane z = 0 of the current modelview matrix
+  GLfloat m[16];
+  glGetFloatv(GL_MODELVIEW_MATRIX, m);
+  for (int k = 0; k < DISC_STEPS; k++) {
+    double a = 2.0*M_PI*k/DISC_STEPS;
+    double b = 2.0*M_PI*(k + 1)/DISC_STEPS;
+    addVertex(&lines, m, cos(a)*radius, sin(a)*radius, 0.0, color);
+    addVertex(&lines, m, cos(b)*radius, sin(b)*radius, 0.0, color);
+  }
+}
+
+void DeviceOverlay::addPart(int device, source_t source, bool lines, GLint first, const GLubyte *on, const GLubyte *off)
+{
+  part_t p;
+  p.device = device;
+  p.source = source;
+  p.lines = lines;
+  p.first = first;
+  p.count = (lines ? this->lines.size() : triangles.size()) - first;
+  memcpy(p.on, on, 4);
+  memcpy(p.off, off, 4);
+  p.state = -1;
+  parts.push_back(p);
+}
+
+void DeviceOverlay::addLabel(int device, source_t source, const char *format, float x, float y, float z, float angle, float size, float offset_x, float offset_y, float offset_z, const GLubyte *color)
+{
+  label_t l;
+  l.device = device;
+  l.source = source;
+  l.format = format;
+  l.size = size;
+  memcpy(l.color, color, 4);
+  l.first = 0;
+  l.count = 0;
+  l.text[0] = '\0';
+
+  // The transforms of the former RealisticDrawer::drawText()
+  glPushMatrix();
+  glTranslatef(x, y, z);
+  glRotatef(180, 0, 0, 1);
+  glRotatef(90, 1, 0, 0);
+  glRotatef(angle*180.0/M_PI, 0, 0, 1);
+  glTranslatef(offset_x, offset_z, offset_y);
+  glGetFloatv(GL_MODELVIEW_MATRIX, l.transform);
+  glPopMatrix();
+
+  l.center[0] = l.transform[12];
+  l.center[1] = l.transform[13];
+  l.center[2] = l.transform[14];
+  labels.push_back(l);
+}
+
+void DeviceOverlay::build()
+{
+  triangles.clear();
+  lines.clear();
+  parts.clear();
+  labels.clear();
+  double w = map->lane_width;
+
+  // The shapes are laid out with the matrix stack, as they used to be drawn
+  glMatrixMode(GL_MODELVIEW);
+  glPushMatrix();
+
+  for (unsigned int i = 0; i < map->actuators.size(); i++) {
+    RoadActuator *a = map->actuators[i];
+    Lane *l = a->lane;
+    double x1, y1, f, yaw;
+    GLint first;
+
+    switch (a->type) {
+    case TRAFFICLIGHT:
+      if (l->segment->geometry == STRAIGHT) {
+        x1 = l->x_start + cos(l->a_start)*a->position + cos(l->a_start + M_PI/2.0)*w/2.0;
+        y1 = l->y_start + sin(l->a_start)*a->position + sin(l->a_start + M_PI/2.0)*w/2.0;
+        yaw = l->a_start - M_PI/2.0;
+      } else {
+        f = (l->segment->angle < 0.0)?-1.0:1.0;
+        x1 = l->xc - cos(l->angle_start + f*a->position)*(l->radius-f*w/2.0);
+        y1 = l->yc - sin(l->angle_start + f*a->position)*(l->radius-f*w/2.0);
+        yaw = l->angle_start + f*a->position + ((f < 0.0)?0.0:M_PI);
+      }
+
+      glLoadIdentity();
+      glTranslatef(x1,LIGHT_HEIGHT/2.0,y1);
+      glRotatef(-(yaw/M_PI)*180.0, 0.0, 1.0, 0.0);
+      glScalef(LIGHT_SIDE,LIGHT_HEIGHT,LIGHT_SIDE);
+      addCube(black);
+
+      glLoadIdentity();
+      glTranslatef(x1,LIGHT_HEIGHT+LIGHT_BOX_HEIGHT/2.0,y1);
+      glRotatef(-(yaw/M_PI)*180.0, 0.0, 1.0, 0.0);
+      glScalef(LIGHT_BOX_SIDE,LIGHT_BOX_HEIGHT,LIGHT_BOX_SIDE);
+      addCube(black);
+
+      // The lamps (flattened spheres) as their section just in front of the box
+      glLoadIdentity();
+      glTranslatef(x1,LIGHT_HEIGHT+2.0*LIGHT_BOX_HEIGHT/3.0,y1);
+      glRotatef(-(yaw/M_PI)*180.0, 0.0, 1.0, 0.0);
+      glTranslatef(0.0, 0.0, -LIGHT_BOX_SIDE/2.0*0.9);
+      glScalef(LIGHT_BOX_SIDE*0.4,LIGHT_BOX_SIDE*0.4, 0.05);
+      first = triangles.size();
+      addDisc(0.0, 1.0, -0.3, dim_green);
+      addPart(i, GREEN_LAMP, false, first, green, dim_green);
+
+      glLoadIdentity();
+      glTranslatef(x1,LIGHT_HEIGHT+1.0*LIGHT_BOX_HEIGHT/3.0,y1);
+      glRotatef(-(yaw/M_PI)*180.0, 0.0, 1.0, 0.0);
+      glTranslatef(0.0, 0.0, -LIGHT_BOX_SIDE/2.0*0.9);
+      glScalef(LIGHT_BOX_SIDE*0.4,LIGHT_BOX_SIDE*0.4, 0.05);
+      first = triangles.size();
+      addDisc(0.0, 1.0, -0.3, dim_red);
+      addPart(i, RED_LAMP, false, first, red, dim_red);
+
+      break;
+    case SPEEDLIMIT:
+      if (l->segment->geometry == STRAIGHT) {
+        x1 = l->x_start + cos(l->a_start)*a->position;
+        y1 = l->y_start + sin(l->a_start)*a->position;
+        yaw = l->a_start;
+      } else {
+        f = (l->segment->angle < 0.0)?-1.0:1.0;
+        x1 = l->xc - cos(l->angle_start + f*a->position)*l->radius;
+        y1 = l->yc - sin(l->angle_start + f*a->position)*l->radius;
+        yaw = l->angle_start + f*a->position + ((f < 0.0)?0.0:M_PI) + M_PI/2.0;
+      }
+
+      // The signs are in the plane x = 0
+      glLoadIdentity();
+      glTranslatef(x1,SPEED_HEIGHT,y1);
+      glRotatef(-(yaw/M_PI)*180.0, 0.0, 1.0, 0.0);
+      glPushMatrix();
+      glRotatef(-90, 0.0, 1.0, 0.0);
+      addDisc(SPEED_RADIUS*0.8, SPEED_RADIUS, 0.0, red);
+      addDisc(0.0, SPEED_RADIUS*0.8, 0.0, white);
+      glPopMatrix();
+      glTranslatef(-0.02, 0.0, 0.0);
+      glRotatef(-90, 1.0, 0.0, 0.0);
+      glRotatef(90, 0.0, 0.0, 1.0);
+      addLabel(i, MAXIMUM_SPEED, "%.0f", 0.0, 0.0, 0.0, 0.0, SPEED_RADIUS*0.5, 0.0, 0.0, SPEED_RADIUS*0.05, black);
+
+      glLoadIdentity();
+      glTranslatef(x1,SPEED_HEIGHT-SPEED_RADIUS*2.0,y1);
+      glRotatef(-(yaw/M_PI)*180.0, 0.0, 1.0, 0.0);
+      glPushMatrix();
+      glRotatef(-90, 0.0, 1.0, 0.0);
+      addDisc(SPEED_RADIUS*0.8*0.8, SPEED_RADIUS*0.8, 0.0, white);
+      addDisc(0.0, SPEED_RADIUS*0.8*0.8, 0.0, blue);
+      glPopMatrix();
+      glTranslatef(-0.02, 0.0, 0.0);
+      glRotatef(-90, 1.0, 0.0, 0.0);
+      glRotatef(90, 0.0, 0.0, 1.0);
+      addLabel(i, MINIMUM_SPEED, "%.0f", 0.0, 0.0, 0.0, 0.0, SPEED_RADIUS*0.8*0.5, 0.0, 0.0, SPEED_RADIUS*0.8*0.05, white);
+
+      break;
+    }
+  }
+
+  for (unsigned int i = 0; i < map->sensors.size(); i++) {
+    RoadSensor *r = map->sensors[i];
+    Lane *l = r->lane;
+    double x1, y1, x2, y2, f, x, y, yaw;
+    GLint first;
+
+    glLoadIdentity();
+    switch (r->type) {
+    case DENSITY:
+      if (l->segment->geometry == STRAIGHT) {
+        x1 = l->x_start + cos(l->a_start)*r->position + cos(l->a_start + M_PI/2.0)*w/2.0;
+        x2 = l->x_start + cos(l->a_start)*r->position + cos(l->a_start - M_PI/2.0)*w/2.0;
+        y1 = l->y_start + sin(l->a_start)*r->position + sin(l->a_start + M_PI/2.0)*w/2.0;
+        y2 = l->y_start + sin(l->a_start)*r->position + sin(l->a_start - M_PI/2.0)*w/2.0;
+        yaw = -l->a_start + M_PI/2.0;
+      } else {
+        f = (l->segment->angle < 0.0)?-1.0:1.0;
+        x1 = l->xc - cos(l->angle_start + f*r->position)*(l->radius+w/2.0);
+        x2 = l->xc - cos(l->angle_start + f*r->position)*(l->radius-w/2.0);
+        y1 = l->yc - sin(l->angle_start + f*r->position)*(l->radius+w/2.0);
+        y2 = l->yc - sin(l->angle_start + f*r->position)*(l->radius-w/2.0);
+        yaw = -(l->angle_start + f*r->position) + ((f < 0.0)?0.0:M_PI);
+      }
+      x = (x1+x2)/2.0;
+      y = (y1+y2)/2.0;
+      first = lines.size();
+      addVertex(&lines, identity, x1, 0.01, y1, dark_cyan);
+      addVertex(&lines, identity, x2, 0.01, y2, dark_cyan);
+      addPart(i, ENTRY_LOOP, true, first, cyan, dark_cyan);
+
+      if (l->segment->geometry == STRAIGHT) {
+        x1 = l->x_start + cos(l->a_start)*r->position2 + cos(l->a_start + M_PI/2.0)*w/2.0;
+        x2 = l->x_start + cos(l->a_start)*r->position2 + cos(l->a_start - M_PI/2.0)*w/2.0;
+        y1 = l->y_start + sin(l->a_start)*r->position2 + sin(l->a_start + M_PI/2.0)*w/2.0;
+        y2 = l->y_start + sin(l->a_start)*r->position2 + sin(l->a_start - M_PI/2.0)*w/2.0;
+      } else {
+        f = (l->segment->angle < 0.0)?-1.0:1.0;
+        x1 = l->xc - cos(l->angle_start + f*r->position2)*(l->radius+w/2.0);
+        x2 = l->xc - cos(l->angle_start + f*r->position2)*(l->radius-w/2.0);
+        y1 = l->yc - sin(l->angle_start + f*r->position2)*(l->radius+w/2.0);
+        y2 = l->yc - sin(l->angle_start + f*r->position2)*(l->radius-w/2.0);
+      }
+      first = lines.size();
+      addVertex(&lines, identity, x1, 0.01, y1, dark_cyan);
+      addVertex(&lines, identity, x2, 0.01, y2, dark_cyan);
+      addPart(i, EXIT_LOOP, true, first, cyan, dark_cyan);
+
+      addLabel(i, RESULT, "%.0f veh/km", x, 0.02, y, yaw, 0.2, 0.0, 0.0, -0.1, cyan);
+
+      break;
+    case SPEED:
+    case FLOW:
+      if (l->segment->geometry == STRAIGHT) {
+        x1 = l->x_start + cos(l->a_start)*r->position;
+        y1 = l->y_start + sin(l->a_start)*r->position;
+        yaw = -l->a_start + M_PI/2.0;
+      } else {
+        f = (l->segment->angle < 0.0)?-1.0:1.0;
+        x1 = l->xc - cos(l->angle_start + f*r->position)*l->radius;
+        y1 = l->yc - sin(l->angle_start + f*r->position)*l->radius;
+        yaw = -(l->angle_start + f*r->position) + ((f < 0.0)?0.0:M_PI);
+      }
+
+      // On the ground
+      glPushMatrix();
+      glTranslatef(x1, 0.01, y1);
+      glRotatef(90, 1.0, 0.0, 0.0);
+      if (r->type == SPEED) {
+        first = lines.size();
+        addCircle(w/4.0, dark_red);
+        addPart(i, LOOP, true, first, red, dark_red);
+      } else {
+        first = triangles.size();
+        addDisc(0.0, w/8.0, 0.0, dark_yellow);
+        addPart(i, LOOP, false, first, yellow, dark_yellow);
+      }
+      glPopMatrix();
+
+      if (r->type == SPEED) {
+        addLabel(i, RESULT, "%.0f km/h", x1, 0.02, y1, yaw, 0.2, 0.0, 0.0, -w/4.0-0.1, red);
+      } else {
+        addLabel(i, RESULT, "%.0f veh/h", x1, 0.02, y1, yaw, 0.2, 0.0, 0.0, w/8.0+0.1, yellow);
+      }
+
+      break;
+    }
+  }
+
+  glPopMatrix();
+
+  // One stream: the triangles, the lines, then room for the glyphs of each label
+  vertices.swap(triangles);
+  first_line = vertices.size();
+  line_count = lines.size();
+  vertices.insert(vertices.end(), lines.begin(), lines.end());
+  vector<vertex_t>().swap(triangles);
+  vector<vertex_t>().swap(lines);
+  for (unsigned int i = 0; i < parts.size(); i++) {
+    if (parts[i].lines) parts[i].first += first_line;
+  }
+  vertex_t blank;
+  memset(&blank, 0, sizeof(blank));
+  for (unsigned int i = 0; i < labels.size(); i++) {
+    labels[i].first = vertices.size();
+    vertices.resize(vertices.size() + 4*LABEL_LENGTH, blank);
+  }
+  dirty_first = vertices.size();
+  dirty_last = 0;
+  built = true;
+
+  Log::getStream(5) << "Devices: " << parts.size() << " parts, " << labels.size() << " labels, " << vertices.size() << " vertices" << endl;
+}
+
+void DeviceOverlay::touch(GLint first, GLsizei count)
+{
+  dirty_first = MIN(dirty_first, first);
+  dirty_last = MAX(dirty_last, first + count);
+}
+
+void DeviceOverlay::layout(label_t *label, const char *text)
+{
+  strncpy(label->text, text, LABEL_LENGTH);
+  label->text[LABEL_LENGTH] = '\0';
+
+  // Centered on the origin of the plane of the text
+  const GLfloat ds = 1.0/FONT_COLUMNS;
+  const GLfloat dt = 1.0/FONT_ROWS;
+  float w = label->size;
+  float h = label->size*GLYPH_ASPECT/2.0;
+  float x = -w*strlen(label->text)/2.0;
+  vertex_t *v = &vertices[label->first];
+  for (const char *c = label->text; *c; c++, x += w) {
+    unsigned char g = (unsigned char)*c;
+    if (g <= ' ' || g >= FONT_COLUMNS*FONT_ROWS) continue;
+    // The glyph texture is upside down (row 0 at the top of the image)
+    GLfloat s = (g % FONT_COLUMNS)*ds;
+    GLfloat t = 1.0 - (g / FONT_COLUMNS)*dt;
+    transform(label->transform, x, -h, 0.0, &v[0]);
+    transform(label->transform, x + w, -h, 0.0, &v[1]);
+    transform(label->transform, x + w, h, 0.0, &v[2]);
+    transform(label->transform, x, h, 0.0, &v[3]);
+    v[0].u = s;      v[0].v = t - dt;
+    v[1].u = s + ds; v[1].v = t - dt;
+    v[2].u = s + ds; v[2].v = t;
+    v[3].u = s;      v[3].v = t;
+    for (int k = 0; k < 4; k++) setColor(&v[k], label->color);
+    v += 4;
+  }
+  label->count = v - &vertices[label->first];
+  touch(label->first, label->count);
+}
+
+bool DeviceOverlay::visible(const label_t *label, const GLdouble planes[6][4], const double *eye)
+{
+  const GLfloat *c = label->center;
+  double range = label->size*LABEL_RANGE;
+  double dx = c[0] - eye[0];
+  double dy = c[1] - eye[1];
+  double dz = c[2] - eye[2];
+  if (dx*dx + dy*dy + dz*dz > range*range) return false;
+
+  double radius = label->size*LABEL_LENGTH/2.0;
+  for (int i = 0; i < 6; i++) {
+    if (planes[i][0]*c[0] + planes[i][1]*c[1] + planes[i][2]*c[2] + planes[i][3] < -radius) return false;
+  }
+  return true;
+}
+
+void DeviceOverlay::draw(const Snapshot *snapshot)
+{
+  if (snapshot->actuators.size() != map->actuators.size() || snapshot->sensors.size() != map->sensors.size()) return;
+  if (!built) build();
+  if (vertices.empty()) return;
+
+  // The colors only change with the state of the devices
+  for (unsigned int i = 0; i < parts.size(); i++) {
+    part_t *p = &parts[i];
+    int state;
+    switch (p->source) {
+    case GREEN_LAMP:
+      state = snapshot->actuators[p->device].color == GREEN;
+      break;
+    case RED_LAMP:
+      state = snapshot->actuators[p->device].color == RED;
+      break;
+    case ENTRY_LOOP:
+      state = snapshot->sensors[p->device].entry_triggered;
+      break;
+    case EXIT_LOOP:
+      state = snapshot->sensors[p->device].exit_triggered;
+      break;
+    default:
+      state = snapshot->sensors[p->device].triggered;
+      break;
+    }
+    if (state == p->state) continue;
+    p->state = state;
+    for (GLsizei k = 0; k < p->count; k++) setColor(&vertices[p->first + k], state ? p->on : p->off);
+    touch(p->first, p->count);
+  }
+
+  // The planes of the frustum (normalized) and the viewer, from the current matrices
+  GLdouble pm[16], m[16], clip[16], planes[6][4];
+  glGetDoublev(GL_PROJECTION_MATRIX, pm);
+  glGetDoublev(GL_MODELVIEW_MATRIX, m);
+  for (int i = 0; i < 4; i++) {
+    for (int j = 0; j < 4; j++) {
+      clip[4*i+j] = m[4*i]*pm[j] + m[4*i+1]*pm[4+j] + m[4*i+2]*pm[8+j] + m[4*i+3]*pm[12+j];
+    }
+  }
+  for (int i = 0; i < 3; i++) {
+    for (int j = 0; j < 4; j++) {
+      planes[2*i][j]   = clip[4*j+3] + clip[4*j+i];
+      planes[2*i+1][j] = clip[4*j+3] - clip[4*j+i];
+    }
+  }
+  for (int i = 0; i < 6; i++) {
+    double n = sqrt(planes[i][0]*planes[i][0] + planes[i][1]*planes[i][1] + planes[i][2]*planes[i][2]);
+    if (n > 0.0) for (int j = 0; j < 4; j++) planes[i][j] /= n;
+  }
+  double eye[3];
+  for (int i = 0; i < 3; i++) eye[i] = -(m[4*i]*m[12] + m[4*i+1]*m[13] + m[4*i+2]*m[14]);
+
+  // The labels that can be read, laid out again when their text changed
+  indices.clear();
+  for (unsigned int i = 0; i < labels.size(); i++) {
+    label_t *l = &labels[i];
+    if (!visible(l, planes, eye)) continue;
+
+    double value;
+    switch (l->source) {
+    case MAXIMUM_SPEED:
+      value = snapshot->actuators[l->device].maximum_speed*3.6;
+      break;
+    case MINIMUM_SPEED:
+      value = snapshot->actuators[l->device].minimum_speed*3.6;
+      break;
+    default:
+      value = snapshot->sensors[l->device].result;
+      break;
+    }
+    char text[32];
+    snprintf(text, 32, l->format, value);
+    if (strncmp(text, l->text, LABEL_LENGTH) != 0) layout(l, text);
+
+    for (GLsizei k = 0; k < l->count; k++) indices.push_back(l->first + k);
+  }
+
+  // Only what changed goes to the vertex buffer
+  if (!checked) {
+    int major = 1, minor = 0;
+    const char *version = (const char *)glGetString(GL_VERSION);
+    if (version) sscanf(version, "%d.%d", &major, &minor);
+    buffers = major > 1 || minor >= 5;
+    checked = true;
+  }
+  if (buffers) {
+    if (!buffer) {
+      glGenBuffers(1, &buffer);
+      glBindBuffer(GL_ARRAY_BUFFER, buffer);
+      glBufferData(GL_ARRAY_BUFFER, vertices.size()*sizeof(vertex_t), &vertices[0], GL_DYNAMIC_DRAW);
+    } else if (dirty_last > dirty_first) {
+      glBindBuffer(GL_ARRAY_BUFFER, buffer);
+      glBufferSubData(GL_ARRAY_BUFFER, dirty_first*sizeof(vertex_t), (dirty_last - dirty_first)*sizeof(vertex_t), &vertices[dirty_first]);
+    } else {
+      glBindBuffer(GL_ARRAY_BUFFER, buffer);
+    }
+  }
+  dirty_first = vertices.size();
+  dirty_last = 0;
+
+  glPushAttrib(GL_ENABLE_BIT | GL_CURRENT_BIT | GL_COLOR_BUFFER_BIT);
+  glDisable(GL_LIGHTING);
+  glDisable(GL_TEXTURE_2D);
+  glEnableClientState(GL_VERTEX_ARRAY);
+  glEnableClientState(GL_COLOR_ARRAY);
+  // Offsets in the buffer object, or pointers to the client memory
+  const char *base = buffers ? NULL : (const char *)&vertices[0];
+  glVertexPointer(3, GL_FLOAT, sizeof(vertex_t), base + offsetof(vertex_t, x));
+  glColorPointer(4, GL_UNSIGNED_BYTE, sizeof(vertex_t), base + offsetof(vertex_t, color));
+
+  if (first_line) glDrawArrays(GL_TRIANGLES, 0, first_line);
+  if (line_count) glDrawArrays(GL_LINES, first_line, line_count);
+
+  if (font && !indices.empty()) {
+    glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+    glTexCoordPointer(2, GL_FLOAT, sizeof(vertex_t), base + offsetof(vertex_t, u));
+    glEnable(GL_TEXTURE_2D);
+    glBindTexture(GL_TEXTURE_2D, font);
+    // The edges of the glyphs are cut rather than blended, so that the labels need no sorting
+    glEnable(GL_ALPHA_TEST);
+    glAlphaFunc(GL_GREATER, 0.5);
+    glDrawElements(GL_QUADS, indices.size(), GL_UNSIGNED_INT, &indices[0]);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+  }
+
+  if (buffers) glBindBuffer(GL_ARRAY_BUFFER, 0);
+  glDisableClientState(GL_COLOR_ARRAY);
+  glDisableClientState(GL_VERTEX_ARRAY);
+  glPopAttrib();
+}
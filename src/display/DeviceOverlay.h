@@ -0,0 +1,132 @@
+#ifndef DEVICE_OVERLAY_H
+#define DEVICE_OVERLAY_H
+
+#ifdef MAC
+#include <GLUT/glut.h>
+#else
+#include <GL/glut.h>
+#endif
+#include <vector>
+#include <map/Map.h>
+#include "Snapshot.h"
+
+using namespace std;
+
+// Longest label (the rest is cut)
+#define LABEL_LENGTH 12
+// Labels farther than this many times their glyph width are not drawn
+#define LABEL_RANGE 500.0
+
+/**
+ * @brief Batched drawing of the road actuators and sensors, with their labels.
+ *
+ * The markers (traffic lights, speed limit signs and sensor loops) are laid
+ * out once in world coordinates in a single vertex stream, drawn with one
+ * call for the triangles and one for the lines. A snapshot only changes the
+ * colors of the lamps and of the loops: they are written back to the stream
+ * (and to its vertex buffer) when the state of their device changes.
+ *
+ * The labels (speed limits and sensor results) are quads textured with the
+ * glyphs of textures/font.png, in the same stream. The quads of a label are
+ * only laid out again when its text changes, and the labels outside the
+ * view frustum or too far away to be read are left out of the draw call.
+ */
+class DeviceOverlay
+{
+ public:
+  DeviceOverlay(Map *map);
+  ~DeviceOverlay();
+
+  /**
+   * Loads the glyph texture in the current context.
+   * @param filename The glyph texture (PNG).
+   */
+  void load(char *filename);
+
+  /**
+   * Releases the GL objects (when the context is recreated).
+   */
+  void reset();
+
+  /**
+   * Draws the devices in the state of a snapshot of the map.
+   */
+  void draw(const Snapshot *snapshot);
+
+ private:
+  typedef struct {
+    GLfloat x, y, z;
+    GLfloat u, v;
+    GLubyte color[4];
+  } vertex_t;
+
+  // The state shown by a part or a label
+  typedef enum {GREEN_LAMP, RED_LAMP, ENTRY_LOOP, EXIT_LOOP, LOOP, MAXIMUM_SPEED, MINIMUM_SPEED, RESULT} source_t;
+
+  // Vertices colored by the state of a device
+  typedef struct {
+    int device;  // In Map::actuators or Map::sensors
+    source_t source;
+    bool lines;  // In the lines (otherwise in the triangles)
+    GLint first;
+    GLsizei count;
+    GLubyte on[4];
+    GLubyte off[4];
+    int state;  // -1 until known
+  } part_t;
+
+  typedef struct {
+    int device;
+    source_t source;
+    const char *format;
+    GLfloat transform[16];  // From the plane of the text (centered on the origin) to the world
+    GLfloat center[3];
+    float size;             // Width of a glyph [m]
+    GLubyte color[4];
+    GLint first;            // Room for LABEL_LENGTH quads
+    GLsizei count;          // Vertices of the glyphs of the text
+    char text[LABEL_LENGTH + 1];
+  } label_t;
+
+  void build();
+  void transform(const GLfloat *m, double x, double y, double z, vertex_t *v);
+  void setColor(vertex_t *v, const GLubyte *color);
+  void addVertex(vector<vertex_t> *stream, const GLfloat *m, double x, double y, double z, const GLubyte *color);
+  void addCube(const GLubyte *color);
+  void addDisc(double inner, double outer, double z, const GLubyte *color);
+  void addCircle(double radius, const GLubyte *color);
+  void addPart(int device, source_t source, bool lines, GLint first, const GLubyte *on, const GLubyte *off);
+  void addLabel(int device, source_t source, const char *format, float x, float y, float z, float angle, float size, float offset_x, float offset_y, float offset_z, const GLubyte *color);
+  void layout(label_t *label, const char *text);
+  void touch(GLint first, GLsizei count);
+  bool visible(const label_t *label, const GLdouble planes[6][4], const double *eye);
+
+  Map *map;
+  bool built;
+
+  // Building (with the modelview matrix in use)
+  vector<vertex_t> triangles;
+  vector<vertex_t> lines;
+
+  // The stream: the triangles, the lines then the glyphs
+  vector<vertex_t> vertices;
+  GLint first_line;
+  GLsizei line_count;
+  vector<part_t> parts;
+  vector<label_t> labels;
+  vector<GLuint> indices;  // Of the glyphs of the visible labels
+
+  // Vertices changed since the last upload
+  int dirty_first;
+  int dirty_last;
+
+  GLuint buffer;
+  GLuint font;
+  bool loaded;
+
+  // GL capabilities
+  bool checked;
+  bool buffers;
+};
+
+#endif
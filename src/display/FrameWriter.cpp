@@ -0,0 +1,153 @@
+#include "FrameWriter.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <png.h>
+#include <utils/Log.h>
+
+FrameWriter::FrameWriter()
+{
+  width = 0;
+  height = 0;
+  stopping = false;
+  failures = 0;
+  pthread_mutex_init(&mutex, NULL);
+  pthread_cond_init(&queued, NULL);
+  pthread_cond_init(&freed, NULL);
+}
+
+FrameWriter::~FrameWriter()
+{
+  finish();
+  for (unsigned int i = 0; i < buffers.size(); i++) free(buffers[i]);
+  pthread_cond_destroy(&freed);
+  pthread_cond_destroy(&queued);
+  pthread_mutex_destroy(&mutex);
+}
+
+int FrameWriter::start(int threads, int width, int height)
+{
+  if (threads <= 0) threads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (threads <= 0) threads = 1;
+  this->width = width;
+  this->height = height;
+  stopping = false;
+
+  for (int i = 0; i < 2*threads; i++) {
+    unsigned char *buffer = (unsigned char *)malloc((size_t)width*height*3);
+    if (!buffer) {
+      fprintf(stderr, "Error: Unable to allocate the frame buffers.\n");
+      return -1;
+    }
+    buffers.push_back(buffer);
+    available.push_back(buffer);
+  }
+
+  for (int i = 0; i < threads; i++) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, FrameWriter::work, this) != 0) {
+      fprintf(stderr, "Error: Unable to start the frame writers.\n");
+      return -1;
+    }
+    workers.push_back(thread);
+  }
+  Log::getStream(5) << "Frame writer: " << threads << " threads" << endl;
+  return 0;
+}
+
+unsigned char *FrameWriter::acquire()
+{
+  pthread_mutex_lock(&mutex);
+  while (available.empty()) pthread_cond_wait(&freed, &mutex);
+  unsigned char *buffer = available.back();
+  available.pop_back();
+  pthread_mutex_unlock(&mutex);
+  return buffer;
+}
+
+void FrameWriter::submit(unsigned char *pixels, const char *filename)
+{
+  job_t job;
+  job.pixels = pixels;
+  job.filename = filename;
+
+  pthread_mutex_lock(&mutex);
+  jobs.push_back(job);
+  pthread_cond_signal(&queued);
+  pthread_mutex_unlock(&mutex);
+}
+
+int FrameWriter::finish()
+{
+  pthread_mutex_lock(&mutex);
+  stopping = true;
+  pthread_cond_broadcast(&queued);
+  pthread_mutex_unlock(&mutex);
+
+  // The workers empty the queue before they stop
+  for (unsigned int i = 0; i < workers.size(); i++) pthread_join(workers[i], NULL);
+  workers.clear();
+  return failures;
+}
+
+void *FrameWriter::work(void *ptr)
+{
+  FrameWriter *self = (FrameWriter *)ptr;
+
+  pthread_mutex_lock(&self->mutex);
+  while (true) {
+    while (self->jobs.empty() && !self->stopping) pthread_cond_wait(&self->queued, &self->mutex);
+    if (self->jobs.empty()) break;
+    job_t job = self->jobs.front();
+    self->jobs.pop_front();
+    pthread_mutex_unlock(&self->mutex);
+
+    int result = self->writePNG(job.pixels, job.filename.c_str());
+
+    pthread_mutex_lock(&self->mutex);
+    if (result) self->failures++;
+    self->available.push_back(job.pixels);
+    pthread_cond_signal(&self->freed);
+  }
+  pthread_mutex_unlock(&self->mutex);
+
+  return NULL;
+}
+
+int FrameWriter::writePNG(const unsigned char *pixels, const char *filename)
+{
+  FILE *f = fopen(filename, "wb");
+  if (!f) {
+    fprintf(stderr, "Warning: Unable to write the frame %s.\n", filename);
+    return -1;
+  }
+
+  png_structp png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+  png_infop info_ptr = png_ptr ? png_create_info_struct(png_ptr) : NULL;
+  if (!png_ptr || !info_ptr || setjmp(png_jmpbuf(png_ptr))) {
+    fprintf(stderr, "Warning: Unable to compress the frame %s.\n", filename);
+    png_destroy_write_struct(&png_ptr, &info_ptr);
+    fclose(f);
+    return -1;
+  }
+
+  png_init_io(png_ptr, f);
+  // Fast compression: the frames are many and mostly go to a video encoder
+  png_set_compression_level(png_ptr, 3);
+  png_set_IHDR(png_ptr, info_ptr, width, height, 8, PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE,
+               PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+  png_write_info(png_ptr, info_ptr);
+
+  // The last row of the GL frame is the top of the image
+  for (int y = height-1; y >= 0; y--) {
+    png_write_row(png_ptr, (png_bytep)(pixels + (size_t)y*width*3));
+  }
+  png_write_end(png_ptr, NULL);
+  png_destroy_write_struct(&png_ptr, &info_ptr);
+
+  if (fclose(f)) {
+    fprintf(stderr, "Warning: Unable to write the frame %s.\n", filename);
+    return -1;
+  }
+  return 0;
+}
@@ -0,0 +1,72 @@
+#ifndef FRAME_WRITER_H
+#define FRAME_WRITER_H
+
+#include <pthread.h>
+#include <string>
+#include <vector>
+#include <deque>
+
+using namespace std;
+
+/**
+ * @brief Compresses the rendered frames to PNG files on worker threads.
+ *
+ * The renderer takes a free buffer, fills it with an RGB frame (bottom row
+ * first, as glReadPixels returns it) and submits it with its file name.
+ * The workers compress and write the frames in any order and give the
+ * buffers back. There are twice as many buffers as workers, so that the
+ * renderer only waits when the workers cannot keep up.
+ */
+class FrameWriter
+{
+ public:
+  FrameWriter();
+  ~FrameWriter();
+
+  /**
+   * Starts the workers.
+   * @param threads The number of workers (the number of cores if 0).
+   * @return 0 on success.
+   */
+  int start(int threads, int width, int height);
+
+  /**
+   * A free buffer of width*height*3 bytes (waits for one if needed).
+   */
+  unsigned char *acquire();
+
+  /**
+   * Queues a buffer from acquire() to be written to a file.
+   */
+  void submit(unsigned char *pixels, const char *filename);
+
+  /**
+   * Writes the queued frames and stops the workers.
+   * @return The number of frames that could not be written.
+   */
+  int finish();
+
+ private:
+  typedef struct {
+    unsigned char *pixels;
+    string filename;
+  } job_t;
+
+  static void *work(void *ptr);
+  int writePNG(const unsigned char *pixels, const char *filename);
+
+  int width;
+  int height;
+  vector<pthread_t> workers;
+  vector<unsigned char *> buffers;
+
+  pthread_mutex_t mutex;
+  pthread_cond_t queued;  // A job was submitted (or the workers stop)
+  pthread_cond_t freed;   // A buffer is free
+  deque<job_t> jobs;
+  vector<unsigned char *> available;
+  bool stopping;
+  int failures;
+};
+
+#endif
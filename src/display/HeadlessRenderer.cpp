@@ -0,0 +1,264 @@
+#include "HeadlessRenderer.h"
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <utils/Log.h>
+
+#ifndef OSMESA
+#include <EGL/eglext.h>
+#endif
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+// As in Fl_Glv_Window
+#define HFOV 30.0
+#define NEAR_CLIP 0.3
+#define FAR_CLIP 1500.0
+
+HeadlessRenderer::HeadlessRenderer()
+{
+  width = 0;
+  height = 0;
+  clear_r = clear_g = clear_b = 0.0;
+  viewer_center_x = viewer_center_y = viewer_center_z = 0.0;
+  viewer_y = 0.0;
+#ifdef OSMESA
+  context = NULL;
+#else
+  display = EGL_NO_DISPLAY;
+  surface = EGL_NO_SURFACE;
+  context = EGL_NO_CONTEXT;
+#endif
+}
+
+HeadlessRenderer::~HeadlessRenderer()
+{
+#ifdef OSMESA
+  if (context) OSMesaDestroyContext(context);
+#else
+  if (display != EGL_NO_DISPLAY) {
+    eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+    if (context != EGL_NO_CONTEXT) eglDestroyContext(display, context);
+    if (surface != EGL_NO_SURFACE) eglDestroySurface(display, surface);
+    eglTerminate(display);
+  }
+#endif
+}
+
+int HeadlessRenderer::init(int width, int height)
+{
+  this->width = width;
+  this->height = height;
+
+#ifdef OSMESA
+  context = OSMesaCreateContextExt(OSMESA_RGBA, 24, 8, 0, NULL);
+  if (!context) {
+    fprintf(stderr, "Error: Unable to create the OSMesa context.\n");
+    return -1;
+  }
+  buffer.resize((size_t)width*height*4);
+  if (!OSMesaMakeCurrent(context, &buffer[0], GL_UNSIGNED_BYTE, width, height)) {
+    fprintf(stderr, "Error: Unable to make the OSMesa context current.\n");
+    return -1;
+  }
+#else
+  // The surfaceless platform of Mesa needs neither X nor a GPU
+  const char *extensions = eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+  if (extensions && strstr(extensions, "EGL_MESA_platform_surfaceless")) {
+    PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay =
+      (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+    if (getPlatformDisplay) display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+  }
+  if (display == EGL_NO_DISPLAY) display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+
+  EGLint major, minor;
+  if (display == EGL_NO_DISPLAY || !eglInitialize(display, &major, &minor)) {
+    fprintf(stderr, "Error: Unable to initialize EGL.\n");
+    return -1;
+  }
+
+  const EGLint config_attributes[] = {
+    EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+    EGL_RED_SIZE, 8, EGL_GREEN_SIZE, 8, EGL_BLUE_SIZE, 8,
+    EGL_DEPTH_SIZE, 24,
+    EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+    EGL_NONE
+  };
+  EGLConfig config;
+  EGLint count = 0;
+  if (!eglChooseConfig(display, config_attributes, &config, 1, &count) || count < 1) {
+    fprintf(stderr, "Error: No EGL configuration for offscreen OpenGL rendering.\n");
+    return -1;
+  }
+
+  const EGLint surface_attributes[] = {EGL_WIDTH, width, EGL_HEIGHT, height, EGL_NONE};
+  surface = eglCreatePbufferSurface(display, config, surface_attributes);
+  // The fixed pipeline of the drawing code needs desktop OpenGL (compatibility)
+  eglBindAPI(EGL_OPENGL_API);
+  context = eglCreateContext(display, config, EGL_NO_CONTEXT, NULL);
+  if (surface == EGL_NO_SURFACE || context == EGL_NO_CONTEXT ||
+      !eglMakeCurrent(display, surface, surface, context)) {
+    fprintf(stderr, "Error: Unable to create the EGL context (%dx%d).\n", width, height);
+    return -1;
+  }
+  Log::getStream(5) << "EGL " << major << "." << minor << ": " << (const char *)glGetString(GL_RENDERER) << endl;
+#endif
+
+  return 0;
+}
+
+int HeadlessRenderer::loadCameraPath(const char *filename)
+{
+  FILE *f = fopen(filename, "r");
+  if (!f) {
+    fprintf(stderr, "Error: Unable to open the camera path %s.\n", filename);
+    return -1;
+  }
+
+  char line[256];
+  int n = 0;
+  path.clear();
+  while (fgets(line, sizeof(line), f)) {
+    n++;
+    char *c = line;
+    while (*c == ' ' || *c == '\t') c++;
+    if (*c == '#' || *c == '\n' || *c == '\r' || *c == '\0') continue;
+
+    key_t key;
+    key.car = -1;
+    key.x = key.z = 0.0;
+    bool ok = sscanf(c, "%lf car %d %lf %lf %lf", &key.time, &key.car, &key.dist, &key.phi, &key.alpha) == 5;
+    if (!ok) {
+      key.car = -1;
+      ok = sscanf(c, "%lf %lf %lf %lf %lf %lf", &key.time, &key.x, &key.z, &key.dist, &key.phi, &key.alpha) == 6;
+    }
+    if (!ok) {
+      fprintf(stderr, "Error: Invalid key frame at %s:%d.\n", filename, n);
+      fclose(f);
+      return -1;
+    }
+    if (!path.empty() && key.time < path.back().time) {
+      fprintf(stderr, "Error: The key frames of %s are not in time order (line %d).\n", filename, n);
+      fclose(f);
+      return -1;
+    }
+    path.push_back(key);
+  }
+  fclose(f);
+
+  Log::getStream(5) << "Camera path " << filename << ": " << path.size() << " key frames" << endl;
+  return 0;
+}
+
+void HeadlessRenderer::setClearColor(double r, double g, double b)
+{
+  clear_r = r;
+  clear_g = g;
+  clear_b = b;
+}
+
+void HeadlessRenderer::center(const key_t *key, const Snapshot *snapshot, double *x, double *z, double *yaw)
+{
+  *x = key->x;
+  *z = key->z;
+  *yaw = 0.0;
+  if (key->car < 0) return;
+
+  const vehicle_snapshot_t *car = snapshot->find(key->car);
+  if (car) {
+    *x = car->x;
+    *z = car->y;
+    *yaw = car->yaw;
+  } else {
+    // The car left: stay where it was last seen
+    *x = viewer_center_x;
+    *z = viewer_center_z;
+  }
+}
+
+void HeadlessRenderer::begin(const Snapshot *snapshot)
+{
+  // The state of Fl_Glv_Window::draw()
+  glViewport(0, 0, width, height);
+  glClearColor(clear_r, clear_g, clear_b, 0.0);
+  glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+  glEnable(GL_DEPTH_TEST);
+  glEnable(GL_POINT_SMOOTH);
+  glDepthFunc(GL_LEQUAL);
+  glEnable(GL_COLOR_MATERIAL);
+
+  // The initial view of the GUI without a path
+  double x = 0.0, z = 0.0, yaw = 0.0, dist = 300.0, phi = M_PI/4.0, alpha = 0.0;
+  if (!path.empty()) {
+    unsigned int k = 0;
+    while (k+1 < path.size() && path[k+1].time <= snapshot->time) k++;
+    const key_t *a = &path[k];
+    center(a, snapshot, &x, &z, &yaw);
+    dist = a->dist;
+    phi = a->phi;
+    alpha = a->alpha;
+
+    if (k+1 < path.size() && snapshot->time > a->time) {
+      const key_t *b = &path[k+1];
+      double t = (snapshot->time - a->time)/(b->time - a->time);
+      double bx, bz, byaw;
+      center(b, snapshot, &bx, &bz, &byaw);
+      double dyaw = byaw - yaw;
+      while (dyaw > M_PI) dyaw -= 2.0*M_PI;
+      while (dyaw < -M_PI) dyaw += 2.0*M_PI;
+      x += (bx - x)*t;
+      z += (bz - z)*t;
+      yaw += dyaw*t;
+      dist += (b->dist - dist)*t;
+      phi += (b->phi - phi)*t;
+      alpha += (b->alpha - alpha)*t;
+    }
+  }
+  viewer_center_x = x;
+  viewer_center_y = 0.0;
+  viewer_center_z = z;
+
+  // As Fl_Glv_Window::update_viewer()
+  double viewer_x = x + dist*cos(phi)*cos(yaw + M_PI + alpha);
+  viewer_y = dist*sin(phi);
+  double viewer_z = z + dist*cos(phi)*sin(yaw + M_PI + alpha);
+
+  glMatrixMode(GL_PROJECTION);
+  glLoadIdentity();
+  gluPerspective(HFOV, (float)width/(float)height, NEAR_CLIP, FAR_CLIP);
+
+  glMatrixMode(GL_MODELVIEW);
+  glLoadIdentity();
+  gluLookAt(viewer_x, viewer_y, viewer_z, x, 2.0, z, 0.0, 1.0, 0.0);
+}
+
+void HeadlessRenderer::get_viewer_coords(double *x, double *y, double *z)
+{
+  *x = viewer_center_x;
+  *y = viewer_center_y;
+  *z = viewer_center_z;
+}
+
+void HeadlessRenderer::read(unsigned char *pixels)
+{
+  glFinish();
+  glPixelStorei(GL_PACK_ALIGNMENT, 1);
+  glReadPixels(0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, pixels);
+}
+
+double HeadlessRenderer::get_camera_height()
+{
+  return viewer_y;
+}
+
+int HeadlessRenderer::w()
+{
+  return width;
+}
+
+int HeadlessRenderer::h()
+{
+  return height;
+}
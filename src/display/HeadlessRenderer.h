@@ -0,0 +1,109 @@
+#ifndef HEADLESS_RENDERER_H
+#define HEADLESS_RENDERER_H
+
+#ifdef MAC
+#include <GLUT/glut.h>
+#else
+#include <GL/glut.h>
+#endif
+#ifdef OSMESA
+#include <GL/osmesa.h>
+#else
+#include <EGL/egl.h>
+#endif
+#include <vector>
+#include "Snapshot.h"
+
+using namespace std;
+
+/**
+ * @brief An offscreen GL context with the camera of Fl_Glv_Window.
+ *
+ * The context is created without any display, with EGL (a pbuffer on the
+ * surfaceless platform of Mesa when it is available) or with OSMesa when
+ * compiled with OSMESA. The camera follows a scripted path, read from a
+ * text file with one key frame per line:
+ *
+ *   <time> <x> <z> <dist> <phi> <alpha>
+ *   <time> car <id> <dist> <phi> <alpha>
+ *
+ * The first form looks at a fixed point, the second follows a car as the
+ * follow mode of the GUI does. The time is the simulation time in seconds,
+ * dist, phi and alpha are as in Fl_Glv_Window::set_camera(). The camera
+ * moves linearly between two key frames and lines starting with # are
+ * ignored.
+ */
+class HeadlessRenderer
+{
+ public:
+  HeadlessRenderer();
+  ~HeadlessRenderer();
+
+  /**
+   * Creates the context and makes it current.
+   * @return 0 on success.
+   */
+  int init(int width, int height);
+
+  /**
+   * Reads the camera path (without one the camera stays at the initial view of the GUI).
+   * @return 0 on success.
+   */
+  int loadCameraPath(const char *filename);
+
+  void setClearColor(double r, double g, double b);
+
+  /**
+   * Clears the frame and sets the projection and the camera, as Fl_Glv_Window::draw() does.
+   * @param snapshot The state being drawn (to find the followed cars).
+   */
+  void begin(const Snapshot *snapshot);
+
+  /**
+   * The point the camera looks at.
+   */
+  void get_viewer_coords(double *x, double *y, double *z);
+
+  /**
+   * The height of the camera.
+   */
+  double get_camera_height();
+
+  /**
+   * Reads the frame as RGB, bottom row first.
+   * @param pixels At least w()*h()*3 bytes.
+   */
+  void read(unsigned char *pixels);
+
+  int w();
+  int h();
+
+ private:
+  typedef struct {
+    double time;
+    int car;  // -1 for a fixed point
+    double x, z;
+    double dist, phi, alpha;
+  } key_t;
+
+  void center(const key_t *key, const Snapshot *snapshot, double *x, double *z, double *yaw);
+
+  int width;
+  int height;
+  double clear_r, clear_g, clear_b;
+
+  vector<key_t> path;
+  double viewer_center_x, viewer_center_y, viewer_center_z;
+  double viewer_y;
+
+#ifdef OSMESA
+  OSMesaContext context;
+  vector<unsigned char> buffer;
+#else
+  EGLDisplay display;
+  EGLSurface surface;
+  EGLContext context;
+#endif
+};
+
+#endif
@@ -1,11 +1,13 @@
 #include "LaneOptions.h"
+#include "SimViewer.h"
 
-LaneOptions::LaneOptions(Lane *l) : Fl_Window(365,30,"Lane Options")
+LaneOptions::LaneOptions(Lane *l, SimViewer *viewer) : Fl_Window(365,30,"Lane Options")
 {
   char title[255];
   sprintf(title, "Lane Options (%s)", l->name);
 
   this->lane = l;
+  this->viewer = viewer;
 
   label(title);
 
@@ -78,5 +80,8 @@ void LaneOptions::onSlide(Fl_Widget *w, void *data)
 {
   ((LaneOptions *)data)->tipwin->value(((LaneOptions *)data)->rateSlider->value());
   ((LaneOptions *)data)->tipwin->position(Fl::event_x_root(), Fl::event_y_root()+20);
+  // The simulation thread reads the entry rate between two steps only
+  ((LaneOptions *)data)->viewer->lockSimulation();
   ((LaneOptions *)data)->lane->entry_rate = ((LaneOptions *)data)->rateSlider->value()/3600.0;
+  ((LaneOptions *)data)->viewer->unlockSimulation();
 }
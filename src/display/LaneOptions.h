@@ -17,6 +17,8 @@
 
 using namespace std;
 
+class SimViewer;
+
 /* Floating tip window.
  * This displays a value on a yellow background.
  * Code taken from: http://seriss.com/people/erco/fltk/#SliderTooltip
@@ -86,7 +88,7 @@ class TipValueSlider : public Fl_Slider {
 
 class LaneOptions : public Fl_Window {
  public:
-  LaneOptions(Lane *l);
+  LaneOptions(Lane *l, SimViewer *viewer);
   ~LaneOptions();
   void setLane(Lane *l);
   void update();
@@ -97,6 +99,7 @@ class LaneOptions : public Fl_Window {
   TipValueSlider *rateSlider;
   Fl_Output *textlabel;
   Lane *lane;
+  SimViewer *viewer;
   static void onSlide(Fl_Widget *w, void *data);
 };
 
@@ -75,6 +75,7 @@
 #define warn( x )  message( __FILE__LINE__ #x "\n" ) 
 
 #include "Model_3DS.h"
+#include "AssetPack.h"
 
 #include <string.h>
 #include <math.h>			// Header file for the math library
@@ -143,6 +144,9 @@ Model_3DS::Model_3DS()
   // The model is visible by default
   visible = true;
 
+  // The textures are created by default
+  gltextures = true;
+
   // Set up the default position
   pos.x = 0.0f;
   pos.y = 0.0f;
@@ -212,7 +216,17 @@ void Model_3DS::Load(char *name)
     memcpy (path, name, src-name);
     path[src-name] = '\0';
   }
-  
+
+  // The preprocessed copy, if it is up to date
+  if (gltextures && AssetPack::getInstance().loadModel(name, this) == 0)
+    {
+      Log::getStream(5) << "Loading packed 3DS model " << name << " with textures: ";
+      modelname = name;
+      CreateTextures();
+      Log::getStream(5) << endl;
+      return;
+    }
+
   // Load the file
   Log::getStream(5) << "Loading 3DS model " << name << " with textures: ";
   bin3ds = fopen(name,"rb");
@@ -272,11 +286,27 @@ void Model_3DS::Load(char *name)
         }
     }
 
-  // Let's build simple colored textures for the materials w/o a texture
+  if (gltextures)
+    CreateTextures();
+  
+  Log::getStream(5) << endl;
+}
+
+void Model_3DS::CreateTextures()
+{
   for (int j = 0; j < numMaterials; j++)
     {
-      if (Materials[j].textured == false)
+      if (Materials[j].mapname[0])
+        {
+          // Load the texture of the diffuse color map
+          char fullname[160];
+          snprintf(fullname, sizeof(fullname), "%s%s", path, Materials[j].mapname);
+          textureManager.loadTexture(&Materials[j].tex, fullname, BMP_IMAGE, false);
+          Log::getStream(5) << Materials[j].tex << " ";
+        }
+      else if (Materials[j].textured == false)
         {
+          // Let's build simple colored textures for the materials w/o a texture
           unsigned char r = Materials[j].color.r;
           unsigned char g = Materials[j].color.g;
           unsigned char b = Materials[j].color.b;
@@ -285,8 +315,6 @@ void Model_3DS::Load(char *name)
           Materials[j].textured = true;
         }
     }
-  
-  Log::getStream(5) << endl;
 }
 
 void Model_3DS::Draw()
@@ -494,7 +522,11 @@ void Model_3DS::EditChunkProcessor(long length, long findex)
 
       // Material is set to untextured until we find otherwise
       for (int d = 0; d < numMaterials; d++)
-        Materials[d].textured = false;
+        {
+          Materials[d].textured = false;
+          Materials[d].tex = 0;
+          Materials[d].mapname[0] = '\0';
+        }
 
       fseek(bin3ds, findex, SEEK_SET);
 
@@ -786,11 +818,9 @@ void Model_3DS::MapNameChunkProcessor(long length, long findex, int matindex)
         }
     }
 
-  // Load the name and indicate that the material has a texture
-  char fullname[80];
-  sprintf(fullname, "%s%s", path, name);
-  textureManager.loadTexture(&Materials[matindex].tex, fullname, BMP_IMAGE, false);
-  printf("%d ", Materials[matindex].tex);
+  // Keep the name (the texture is loaded with the others) and indicate that the material has a texture
+  strncpy(Materials[matindex].mapname, name, sizeof(Materials[matindex].mapname));
+  Materials[matindex].mapname[sizeof(Materials[matindex].mapname)-1] = '\0';
   Materials[matindex].textured = true;
 
   // move the file pointer back to where we got it so
@@ -115,6 +115,7 @@ class Model_3DS
     GLuint tex;	        // The texture (this is the only outside reference in this class)
     bool textured;	// whether or not it is textured
     Color4i color;
+    char mapname[80];	// The texture of the diffuse color map ("" for none)
   };
 
   // Every chunk in the 3ds file starts with this struct
@@ -161,6 +162,7 @@ class Model_3DS
   float scale;			// The size you want the model scaled to
   bool lit;				// True: the model is lit
   bool visible;			// True: the model gets rendered
+  bool gltextures;		// True: the textures are created while loading (false to only parse the file)
   void Load(char *name);	// Loads a model
   void Draw();			// Draws the model
   FILE *bin3ds;			// The binary 3ds file
@@ -203,6 +205,10 @@ private:
   // the normals of the faces that use that vertex
   void CalculateNormals();
 
+  // Creates the textures of the materials (or simple colored
+  // textures for the materials w/o a texture)
+  void CreateTextures();
+
   TextureManager textureManager;
 };
 
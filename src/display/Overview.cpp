@@ -0,0 +1,164 @@
+#include "Overview.h"
+#include <math.h>
+#include <agents/Car.h>
+#include <utils/Log.h>
+
+#define MAX(x,y) (((x)>(y))?(x):(y))
+#define MIN(x,y) (((x)<(y))?(x):(y))
+
+// Largest piece of a cell drawn as one quad on circular lanes [m]
+#define CURVE_STEP 10.0
+// Height of the cells above the road [m]
+#define CELL_HEIGHT 0.3
+// Share of the lane width covered by the cells
+#define CELL_WIDTH 0.8
+// Density drawn as fully jammed [veh/km]
+#define JAM_DENSITY 120.0
+// Time constant of the smoothing, in simulated time [s]
+#define SMOOTHING 5.0
+
+Overview::Overview()
+{
+  map = NULL;
+  last_time = -1.0;
+  last_metric = SPEED;
+}
+
+void Overview::point(Lane *l, double s, double offset, double *x, double *y)
+{
+  if (l->segment->geometry == STRAIGHT) {
+    *x = l->x_start + cos(l->a_start)*s + cos(l->a_start + M_PI/2.0)*offset;
+    *y = l->y_start + sin(l->a_start)*s + sin(l->a_start + M_PI/2.0)*offset;
+  } else {
+    // As Simulator::moveCarAlongCircular()
+    double f = (l->segment->angle < 0.0)?-1.0:1.0;
+    double a = l->angle_start + f*s/l->radius;
+    *x = l->xc - cos(a)*(l->radius - f*offset);
+    *y = l->yc - sin(a)*(l->radius - f*offset);
+  }
+}
+
+void Overview::build(Map *map)
+{
+  this->map = map;
+  lanes.clear();
+  cells.clear();
+  vertices.clear();
+  levels.clear();
+  last_time = -1.0;
+
+  double w = map->lane_width*CELL_WIDTH/2.0;
+  for (unsigned int i = 0; i < map->segments.size(); i++) {
+    Segment *s = map->segments[i];
+    for (unsigned int j = 0; j < s->lanes.size(); j++) {
+      Lane *l = s->lanes[j];
+      lane_cells_t lc;
+      lc.lane = l;
+      lc.radius = (s->geometry == STRAIGHT) ? 0.0 : l->radius;
+      double length = (s->geometry == STRAIGHT) ? s->length : l->radius*fabs(s->angle);
+      lc.first = cells.size();
+      lc.count = MAX(1, (int)floor(length/OVERVIEW_CELL + 0.5));
+      lc.length = MAX(length/lc.count, 1.0);
+      lanes.push_back(lc);
+
+      for (int k = 0; k < lc.count; k++) {
+        double start = k*lc.length;
+        double end = start + lc.length;
+        cell_t c;
+        c.length = lc.length;
+        c.first = vertices.size()/3;
+        int pieces = (s->geometry == STRAIGHT) ? 1 : MAX(1, (int)ceil((end - start)/CURVE_STEP));
+        for (int p = 0; p < pieces; p++) {
+          double a = start + (end - start)*p/pieces;
+          double b = start + (end - start)*(p + 1)/pieces;
+          double x[4], y[4];
+          point(l, a, -w, &x[0], &y[0]);
+          point(l, b, -w, &x[1], &y[1]);
+          point(l, b, w, &x[2], &y[2]);
+          point(l, a, w, &x[3], &y[3]);
+          for (int v = 0; v < 4; v++) {
+            vertices.push_back(x[v]);
+            vertices.push_back(CELL_HEIGHT);
+            vertices.push_back(y[v]);
+          }
+        }
+        c.count = vertices.size()/3 - c.first;
+        cells.push_back(c);
+      }
+    }
+  }
+  colors.assign(vertices.size()/3*4, 255);
+  levels.assign(cells.size(), 0.0);
+
+  Log::getStream(5) << "Overview: " << cells.size() << " cells, " << vertices.size()/3 << " vertices" << endl;
+}
+
+void Overview::aggregate(vector<cell_snapshot_t> *cells) const
+{
+  cells->resize(this->cells.size());
+  for (unsigned int i = 0; i < cells->size(); i++) {
+    (*cells)[i].vehicles = 0;
+    (*cells)[i].speed = 0.0;
+  }
+
+  for (unsigned int i = 0; i < lanes.size(); i++) {
+    const lane_cells_t *lc = &lanes[i];
+    Lane *l = lc->lane;
+    double maximum_speed = (l->maximum_speed > 0.0) ? l->maximum_speed : 1.0;
+    for (unsigned int j = 0; j < l->cars.size(); j++) {
+      Car *car = l->cars[j];
+      double s = car->getPosition();
+      if (lc->radius > 0.0) s *= lc->radius;
+      int k = MAX(0, MIN(lc->count - 1, (int)(s/lc->length)));
+      cell_snapshot_t *c = &(*cells)[lc->first + k];
+      c->vehicles++;
+      c->speed += car->getSpeed()/maximum_speed;
+    }
+  }
+}
+
+bool Overview::matches(const Snapshot *snapshot) const
+{
+  return map && snapshot->map == map && snapshot->cells.size() == cells.size();
+}
+
+void Overview::draw(const Snapshot *snapshot, metric_t metric)
+{
+  if (cells.empty()) return;
+
+  // The levels move towards the ones of the snapshot (and jump there after a change)
+  double dt = snapshot->time - last_time;
+  double alpha = 1.0;
+  if (last_time >= 0.0 && metric == last_metric && dt >= 0.0) alpha = 1.0 - exp(-dt/SMOOTHING);
+  last_time = snapshot->time;
+  last_metric = metric;
+
+  for (unsigned int i = 0; i < cells.size(); i++) {
+    const cell_snapshot_t *c = &snapshot->cells[i];
+    double level = 0.0;
+    if (metric == DENSITY) {
+      level = MIN(1.0, c->vehicles*1000.0/cells[i].length/JAM_DENSITY);
+    } else if (c->vehicles) {
+      level = 1.0 - MAX(0.0, MIN(1.0, c->speed/c->vehicles));
+    }
+    levels[i] += (level - levels[i])*alpha;
+
+    // Green, yellow then red
+    GLubyte r = (GLubyte)(255.0*MIN(1.0, 2.0*levels[i]));
+    GLubyte g = (GLubyte)(230.0*MIN(1.0, 2.0 - 2.0*levels[i]));
+    GLubyte *color = &colors[cells[i].first*4];
+    for (int v = 0; v < cells[i].count; v++, color += 4) {
+      color[0] = r;
+      color[1] = g;
+      color[2] = 0;
+    }
+  }
+
+  glEnableClientState(GL_VERTEX_ARRAY);
+  glEnableClientState(GL_COLOR_ARRAY);
+  glVertexPointer(3, GL_FLOAT, 0, &vertices[0]);
+  glColorPointer(4, GL_UNSIGNED_BYTE, 0, &colors[0]);
+  glDrawArrays(GL_QUADS, 0, vertices.size()/3);
+  glDisableClientState(GL_COLOR_ARRAY);
+  glDisableClientState(GL_VERTEX_ARRAY);
+}
@@ -0,0 +1,85 @@
+#ifndef OVERVIEW_H
+#define OVERVIEW_H
+
+#ifdef MAC
+#include <GLUT/glut.h>
+#else
+#include <GL/glut.h>
+#endif
+#include <vector>
+#include <map/Map.h>
+#include "Snapshot.h"
+
+using namespace std;
+
+// Length of the cells the lanes are split into (about) [m]
+#define OVERVIEW_CELL 50.0
+
+/**
+ * @brief Draws the lanes colored by their traffic instead of the vehicles.
+ *
+ * The lanes are split once into cells of about OVERVIEW_CELL meters. The
+ * simulation thread counts the vehicles of each cell and sums their speeds
+ * when it captures a snapshot (see aggregate()), instead of copying the
+ * vehicles. The display smooths the speed or the density of each cell over
+ * the simulated time and draws all the cells at once, so that the cost of a
+ * frame only depends on the length of the network.
+ */
+class Overview
+{
+ public:
+  typedef enum {SPEED, DENSITY} metric_t;
+
+  Overview();
+
+  /**
+   * Splits the lanes of a map into equal cells (this does not need a GL context).
+   */
+  void build(Map *map);
+
+  /**
+   * Counts the vehicles of each cell (the simulation must not be stepping).
+   * @param cells The cells, in the order of build().
+   */
+  void aggregate(vector<cell_snapshot_t> *cells) const;
+
+  /**
+   * Whether a snapshot has the cells of this overview.
+   */
+  bool matches(const Snapshot *snapshot) const;
+
+  /**
+   * Draws the cells of a snapshot (see matches()).
+   */
+  void draw(const Snapshot *snapshot, metric_t metric);
+
+ private:
+  typedef struct {
+    Lane *lane;
+    double radius;  // The position on circular lanes is an angle (0 for straight lanes)
+    double length;  // Of the cells of the lane [m]
+    int first;      // First cell of the lane
+    int count;
+  } lane_cells_t;
+
+  typedef struct {
+    float length;  // [m]
+    int first;     // First vertex
+    int count;
+  } cell_t;
+
+  void point(Lane *l, double s, double offset, double *x, double *y);
+
+  Map *map;
+  vector<lane_cells_t> lanes;
+  vector<cell_t> cells;
+  vector<GLfloat> vertices;  // x, y, z of the quads of the cells
+  vector<GLubyte> colors;    // One color per vertex
+
+  // Smoothed level of congestion of each cell (0 free, 1 jammed)
+  vector<float> levels;
+  double last_time;
+  metric_t last_metric;
+};
+
+#endif
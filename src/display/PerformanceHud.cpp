@@ -0,0 +1,271 @@
+#include "PerformanceHud.h"
+#include "TextureManager.h"
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <utils/Log.h>
+
+#define MAX(x,y) (((x)>(y))?(x):(y))
+
+// The glyph texture: 16x8 cells in ASCII order
+#define GLYPH_WIDTH 8
+#define GLYPH_HEIGHT 16
+#define FONT_COLUMNS 16
+#define FONT_ROWS 8
+
+// Layout [pixels]
+#define PANEL_X 5
+#define PANEL_Y 30
+#define PANEL_WIDTH 280
+#define PANEL_MARGIN 6
+#define LINE_HEIGHT 15
+#define BAR_X 160
+#define GRAPH_HEIGHT 60
+
+// Time over which the numbers are averaged [s]
+#define HUD_PERIOD 0.5
+
+static const char *phase_labels[Stats::NPHASES] = {"control", "entries", "sensors", "simulate", "move", "delete"};
+static const GLfloat phase_colors[Stats::NPHASES][3] = {
+  {0.9, 0.3, 0.3}, {0.9, 0.6, 0.2}, {0.9, 0.9, 0.3}, {0.3, 0.8, 0.3}, {0.3, 0.6, 0.9}, {0.7, 0.4, 0.9}
+};
+
+PerformanceHud::PerformanceHud()
+{
+  font = 0;
+  loaded = false;
+  head = 0;
+  samples = 0;
+  last_frame = 0.0;
+  step_time = 0.0;
+  memset(&frame_totals, 0, sizeof(frame_totals));
+  period_start = 0.0;
+  period_simulation_time = 0.0;
+  period_frames = 0;
+  period_draw_time = 0.0;
+  memset(&period_totals, 0, sizeof(period_totals));
+  average_frame = 0.0;
+  average_draw = 0.0;
+  average_step = 0.0;
+  realtime_factor = 0.0;
+  lua_share = 0.0;
+  for (int p = 0; p < Stats::NPHASES; p++) phases[p] = 0.0;
+  vehicles = 0;
+}
+
+PerformanceHud::~PerformanceHud()
+{
+  if (loaded && font) glDeleteTextures(1, &font);
+}
+
+void PerformanceHud::load(char *filename)
+{
+  if (loaded) return;
+  loaded = true;
+
+  TextureManager textures;
+  if (textures.loadTexture(&font, filename, PNG_IMAGE, false)) {
+    fprintf(stderr, "Warning: Unable to load the glyphs of the performance overlay (%s).\n", filename);
+    font = 0;
+    return;
+  }
+  // One texel per pixel
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+  Log::getStream(5) << "Glyph texture loaded: " << font << endl;
+}
+
+void PerformanceHud::reset()
+{
+  // The texture went with the old context
+  font = 0;
+  loaded = false;
+}
+
+void PerformanceHud::update(double now, double draw_time, double simulation_time, int vehicles)
+{
+  Stats::totals_t totals;
+  Stats::getTotals(&totals);
+  this->vehicles = vehicles;
+
+  // The counters start again with a new simulator
+  if (period_start <= 0.0 || totals.steps < frame_totals.steps || totals.steps < period_totals.steps) {
+    frame_totals = totals;
+    period_totals = totals;
+    period_start = now;
+    period_simulation_time = simulation_time;
+    period_frames = 0;
+    period_draw_time = 0.0;
+  }
+
+  // The step time of the frame stays the last one when no step ended since
+  long steps = totals.steps - frame_totals.steps;
+  if (steps > 0) {
+    double t = 0.0;
+    for (int p = 0; p < Stats::NPHASES; p++) t += totals.phases[p] - frame_totals.phases[p];
+    step_time = t/(double)steps;
+  }
+  frame_totals = totals;
+
+  if (last_frame > 0.0) {
+    frame_times[head] = now - last_frame;
+    step_times[head] = step_time;
+    head = (head + 1) % HUD_HISTORY;
+    if (samples < HUD_HISTORY) samples++;
+  }
+  last_frame = now;
+
+  period_frames++;
+  period_draw_time += draw_time;
+  if (now - period_start < HUD_PERIOD) return;
+
+  double wall = now - period_start;
+  average_frame = wall/(double)period_frames;
+  average_draw = period_draw_time/(double)period_frames;
+  realtime_factor = (simulation_time - period_simulation_time)/wall;
+
+  steps = totals.steps - period_totals.steps;
+  average_step = 0.0;
+  for (int p = 0; p < Stats::NPHASES; p++) {
+    phases[p] = steps ? (totals.phases[p] - period_totals.phases[p])/(double)steps : 0.0;
+    average_step += phases[p];
+  }
+  double busy = totals.busy - period_totals.busy;
+  lua_share = (busy > 0.0) ? (totals.lua - period_totals.lua)/busy : 0.0;
+
+  period_totals = totals;
+  period_start = now;
+  period_simulation_time = simulation_time;
+  period_frames = 0;
+  period_draw_time = 0.0;
+}
+
+void PerformanceHud::addText(float x, float y, const char *format, ...)
+{
+  char text[64];
+  va_list args;
+  va_start(args, format);
+  vsnprintf(text, 64, format, args);
+  va_end(args);
+
+  // The glyph texture is upside down (row 0 at the top of the image)
+  const GLfloat ds = 1.0/FONT_COLUMNS;
+  const GLfloat dt = 1.0/FONT_ROWS;
+  for (const char *c = text; *c; c++, x += GLYPH_WIDTH) {
+    unsigned char g = (unsigned char)*c;
+    if (g <= ' ' || g >= FONT_COLUMNS*FONT_ROWS) continue;
+    GLfloat s = (g % FONT_COLUMNS)*ds;
+    GLfloat t = 1.0 - (g / FONT_COLUMNS)*dt;
+    glyph_vertex_t v[4] = {
+      {x, y, s, t},
+      {x + GLYPH_WIDTH, y, s + ds, t},
+      {x + GLYPH_WIDTH, y + GLYPH_HEIGHT, s + ds, t - dt},
+      {x, y + GLYPH_HEIGHT, s, t - dt}
+    };
+    glyphs.insert(glyphs.end(), v, v + 4);
+  }
+}
+
+void PerformanceHud::drawGraph(float x, float y, float w, float h)
+{
+  // The scale fits the slowest frame, at least 30 fps
+  double top = 1.0/30.0;
+  for (int i = 0; i < samples; i++) top = MAX(top, MAX(frame_times[i], step_times[i]));
+
+  glBegin(GL_LINES);
+  glColor4f(0.5, 0.5, 0.5, 0.8);
+  glVertex2f(x, y + h - h*(1.0/60.0)/top);
+  glVertex2f(x + w, y + h - h*(1.0/60.0)/top);
+  glEnd();
+
+  float dx = w/(float)(HUD_HISTORY - 1);
+  const double *series[2] = {frame_times, step_times};
+  const GLfloat colors[2][3] = {{1.0, 1.0, 1.0}, {0.3, 0.8, 0.3}};
+  for (int k = 0; k < 2; k++) {
+    glColor3fv(colors[k]);
+    glBegin(GL_LINE_STRIP);
+    for (int i = 0; i < samples; i++) {
+      // The oldest sample on the left
+      int j = (head - samples + i + HUD_HISTORY) % HUD_HISTORY;
+      glVertex2f(x + (HUD_HISTORY - samples + i)*dx, y + h - h*series[k][j]/top);
+    }
+    glEnd();
+  }
+
+  addText(x + 2, y, "%.0f ms", top*1e3);
+}
+
+void PerformanceHud::draw(int width, int height)
+{
+  float x = PANEL_X + PANEL_MARGIN;
+  float y = PANEL_Y + PANEL_MARGIN;
+  float panel_height = 2*PANEL_MARGIN + (6 + Stats::NPHASES)*LINE_HEIGHT + GRAPH_HEIGHT + PANEL_MARGIN;
+  if (PANEL_X + PANEL_WIDTH > width || PANEL_Y + panel_height > height) return;
+
+  glPushAttrib(GL_ENABLE_BIT | GL_CURRENT_BIT | GL_LINE_BIT | GL_COLOR_BUFFER_BIT);
+  glDisable(GL_DEPTH_TEST);
+  glDisable(GL_FOG);
+  glDisable(GL_LIGHTING);
+  glDisable(GL_TEXTURE_2D);
+  glEnable(GL_BLEND);
+  glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+  glLineWidth(1.0);
+
+  glColor4f(0.0, 0.0, 0.0, 0.6);
+  glBegin(GL_QUADS);
+  glVertex2f(PANEL_X, PANEL_Y);
+  glVertex2f(PANEL_X + PANEL_WIDTH, PANEL_Y);
+  glVertex2f(PANEL_X + PANEL_WIDTH, PANEL_Y + panel_height);
+  glVertex2f(PANEL_X, PANEL_Y + panel_height);
+  glEnd();
+
+  glyphs.clear();
+  addText(x, y, "Frame %6.1f ms %5.0f fps", average_frame*1e3, (average_frame > 0.0) ? 1.0/average_frame : 0.0);
+  y += LINE_HEIGHT;
+  addText(x, y, "Draw  %6.1f ms", average_draw*1e3);
+  y += LINE_HEIGHT;
+  addText(x, y, "Step  %6.2f ms", average_step*1e3);
+  y += LINE_HEIGHT;
+  addText(x, y, "Real time %.2f x", realtime_factor);
+  y += LINE_HEIGHT;
+  addText(x, y, "Vehicles %d", vehicles);
+  y += LINE_HEIGHT;
+  addText(x, y, "LUA %.0f %% of the step CPU time", lua_share*100.0);
+  y += LINE_HEIGHT;
+
+  // The phases with their share of the step
+  glBegin(GL_QUADS);
+  for (int p = 0; p < Stats::NPHASES; p++) {
+    float w = (average_step > 0.0) ? (PANEL_WIDTH - BAR_X - PANEL_MARGIN)*phases[p]/average_step : 0.0;
+    float top = y + p*LINE_HEIGHT + 3;
+    glColor3fv(phase_colors[p]);
+    glVertex2f(PANEL_X + BAR_X, top);
+    glVertex2f(PANEL_X + BAR_X + w, top);
+    glVertex2f(PANEL_X + BAR_X + w, top + LINE_HEIGHT - 5);
+    glVertex2f(PANEL_X + BAR_X, top + LINE_HEIGHT - 5);
+  }
+  glEnd();
+  for (int p = 0; p < Stats::NPHASES; p++) {
+    addText(x, y, "%-8s %6.3f ms", phase_labels[p], phases[p]*1e3);
+    y += LINE_HEIGHT;
+  }
+
+  drawGraph(x, y + PANEL_MARGIN, PANEL_WIDTH - 2*PANEL_MARGIN, GRAPH_HEIGHT);
+
+  // All the text at once
+  if (font && !glyphs.empty()) {
+    glEnable(GL_TEXTURE_2D);
+    glBindTexture(GL_TEXTURE_2D, font);
+    glColor3f(1.0, 1.0, 1.0);
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+    glVertexPointer(2, GL_FLOAT, sizeof(glyph_vertex_t), &glyphs[0].x);
+    glTexCoordPointer(2, GL_FLOAT, sizeof(glyph_vertex_t), &glyphs[0].s);
+    glDrawArrays(GL_QUADS, 0, glyphs.size());
+    glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+    glDisableClientState(GL_VERTEX_ARRAY);
+    glBindTexture(GL_TEXTURE_2D, 0);
+  }
+
+  glPopAttrib();
+}
@@ -0,0 +1,96 @@
+#ifndef PERFORMANCE_HUD_H
+#define PERFORMANCE_HUD_H
+
+#ifdef MAC
+#include <GLUT/glut.h>
+#else
+#include <GL/glut.h>
+#endif
+#include <vector>
+#include <utils/Stats.h>
+
+using namespace std;
+
+#define HUD_HISTORY 120
+
+/**
+ * @brief Overlay with the performance of the display and of the simulation.
+ *
+ * Shows the frame time, the step time and its phases, the real-time factor,
+ * the number of vehicles and the share of the step spent in the LUA
+ * controllers, with a graph of the last frame and step times. The numbers
+ * are averaged over half a second, the graph has one sample per frame.
+ *
+ * The text is drawn from a texture of all the glyphs (textures/font.png,
+ * 16x8 cells of 8x16 pixels in ASCII order), as one array of quads.
+ */
+class PerformanceHud
+{
+ public:
+  PerformanceHud();
+  ~PerformanceHud();
+
+  /**
+   * Loads the glyph texture in the current context.
+   * @param filename The glyph texture (PNG).
+   */
+  void load(char *filename);
+
+  /**
+   * Forgets the texture (after the context changed).
+   */
+  void reset();
+
+  /**
+   * Records a frame.
+   * @param now The wall time [s].
+   * @param draw_time The time taken to draw the frame [s].
+   * @param simulation_time The simulation time of the frame [s].
+   * @param vehicles The number of vehicles.
+   */
+  void update(double now, double draw_time, double simulation_time, int vehicles);
+
+  /**
+   * Draws the overlay in the orthographic projection of SimViewer::setOrthographicProjection().
+   */
+  void draw(int width, int height);
+
+ private:
+  typedef struct {
+    GLfloat x, y, s, t;
+  } glyph_vertex_t;
+
+  void addText(float x, float y, const char *format, ...);
+  void drawGraph(float x, float y, float w, float h);
+
+  GLuint font;
+  bool loaded;
+  vector<glyph_vertex_t> glyphs;  // The quads of the text being drawn
+
+  // One sample per frame [s]
+  double frame_times[HUD_HISTORY];
+  double step_times[HUD_HISTORY];
+  int head;
+  int samples;
+
+  double last_frame;
+  double step_time;
+  Stats::totals_t frame_totals;  // At the last frame
+
+  // Averages over the last period
+  double period_start;
+  double period_simulation_time;
+  int period_frames;
+  double period_draw_time;
+  Stats::totals_t period_totals;  // At the start of the period
+
+  double average_frame;
+  double average_draw;
+  double average_step;
+  double realtime_factor;
+  double lua_share;
+  double phases[Stats::NPHASES];  // Per step
+  int vehicles;
+};
+
+#endif
@@ -4,7 +4,11 @@
 #include <string.h>
 #include <time.h>
 #include <stdlib.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <utils/Log.h>
+#include <utils/Memory.h>
 #include <iomanip>
 
 #define TEXTURE_PATH "src/display/textures/"
@@ -19,6 +23,8 @@
 
 RealisticDrawer::RealisticDrawer(gengetopt_args_info *options, Map *map)
 {
+  Memory::Scope scope(Memory::MEM_GUI);
+
   this->options = options;
   
   /* Load the textures */
@@ -26,7 +32,8 @@ RealisticDrawer::RealisticDrawer(gengetopt_args_info *options, Map *map)
   texture_loaded = false;
 
   this->map = map;
-  this->roadList = 0;
+  this->mesh = new RoadMesh();
+  this->devices = new DeviceOverlay(map);
 
   this->weather = NICE;
   if (strcmp(options->weather_arg, "rain") == 0) {
@@ -37,13 +44,19 @@ RealisticDrawer::RealisticDrawer(gengetopt_args_info *options, Map *map)
     setWeather(RAIN | FOG);
   }
 
-  computeTerrain();
+  // The terrain only depends on the map and on the seed, so that it can be cached
+  seed = options->seed_given ? options->seed_arg : 1;
+  random_state = seed;
+  if (loadTerrain()) {
+    computeTerrain();
+    saveTerrain();
+  }
 }
 
 RealisticDrawer::~RealisticDrawer()
 {
-  if (this->roadList != 0)
-    glDeleteLists(this->roadList, 1);
+  delete mesh;
+  delete devices;
 
   if (grass_texture)
     glDeleteTextures(1, &grass_texture);
@@ -65,12 +78,8 @@ RealisticDrawer::~RealisticDrawer()
   delete textureManager;
 }
 
-int RealisticDrawer::predraw()
+void RealisticDrawer::predraw()
 {
-  if (this->roadList == 0)
-    this->roadList = glGenLists(1);
-  glNewList(this->roadList, GL_COMPILE);
-
   /* Loading textures */
   if (!texture_loaded) {
     char path[256];
@@ -97,22 +106,34 @@ int RealisticDrawer::predraw()
     if (textureManager->loadTexture(&skybox_texture[5], path, PNG_IMAGE, false)) skybox_texture[5] = 0;
     Log::getStream(5) << "Skybox textures loaded: " << skybox_texture[0] << " " << skybox_texture[1] << " " << skybox_texture[2] << " " << skybox_texture[3] << " " << skybox_texture[4] << " " << skybox_texture[5] << endl;
 
+    snprintf(path, 256, "%s/%sfont.png", options->exe_path_arg, TEXTURE_PATH);
+    devices->load(path);
+
     texture_loaded = true;
   }
 
-  drawRoad();
-  drawEnvironment();
+  // The static geometry is built once (until the next reset)
+  if (mesh->empty()) {
+    buildRoad();
+    buildEnvironment();
+    mesh->upload();
+  }
+}
 
-  glEndList();
-  return this->roadList;
+void RealisticDrawer::drawRoad()
+{
+  GLuint textures[RoadMesh::NLAYERS] = {0};
+  textures[RoadMesh::ROAD] = road_texture;
+  textures[RoadMesh::GRASS] = grass_texture;
+  mesh->draw(textures);
 }
 
 void RealisticDrawer::reset()
 {
   texture_loaded = false;
 
-  if (this->roadList != 0)
-    glDeleteLists(this->roadList, 1);
+  mesh->clear();
+  devices->reset();
 
   if (grass_texture)
     glDeleteTextures(1, &grass_texture);
@@ -174,39 +195,37 @@ double RealisticDrawer::getTerrainHeight(double x, double y)
 
 #define SIDE_WIDTH 2.0
 
-void RealisticDrawer::drawRoad()
+void RealisticDrawer::buildRoad()
 { 
-  glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
-  glMatrixMode(GL_MODELVIEW);
-
   /* Due to the z-buffer not being updated with transparent object
      we need to create a tunnel to avoid the non-foggy background
      to be visible */
   if ((this->weather & RAIN) && (this->weather & FOG)) {
+    mesh->layer(RoadMesh::TUNNEL);
     for (unsigned int k = 0; k < map->segments.size(); k++) {
       Segment *s = map->segments[k];
       if (s->lanes.empty()) continue;
       if (s->geometry == STRAIGHT) {
-        glPushMatrix();
-        glTranslatef(s->x, 0.0, s->y);
-        glRotatef(-s->a*180.0/M_PI, 0.0, 1.0, 0.0);  
-
-        glColor3f(0.1, 0.1, 0.1);
-        glBegin(GL_QUADS);
-        glVertex3f(0.0, -10.0, 0.0);
-        glVertex3f(s->length, -10.0, 0.0);
-        glVertex3f(s->length, -10.0, (float)s->lanes.size()*map->lane_width);
-        glVertex3f(0.0, -10.0, (float)s->lanes.size()*map->lane_width);
-        glVertex3f(0.0, -10.0, 0.0);
-        glVertex3f(s->length, -10.0, 0.0);
-        glVertex3f(s->length, 0.0, 0.0);
-        glVertex3f(0.0, 0.0, 0.0);
-        glVertex3f(s->length, -10.0, (float)s->lanes.size()*map->lane_width);
-        glVertex3f(0.0, -10.0, (float)s->lanes.size()*map->lane_width);
-        glVertex3f(0.0, 0.0, (float)s->lanes.size()*map->lane_width);
-        glVertex3f(s->length, 0.0, (float)s->lanes.size()*map->lane_width);
-        glEnd();
-        glPopMatrix();
+        mesh->push();
+        mesh->translate(s->x, 0.0, s->y);
+        mesh->rotate(-s->a*180.0/M_PI);  
+
+        mesh->color(0.1, 0.1, 0.1);
+        mesh->begin(GL_QUADS);
+        mesh->vertex(0.0, -10.0, 0.0);
+        mesh->vertex(s->length, -10.0, 0.0);
+        mesh->vertex(s->length, -10.0, (float)s->lanes.size()*map->lane_width);
+        mesh->vertex(0.0, -10.0, (float)s->lanes.size()*map->lane_width);
+        mesh->vertex(0.0, -10.0, 0.0);
+        mesh->vertex(s->length, -10.0, 0.0);
+        mesh->vertex(s->length, 0.0, 0.0);
+        mesh->vertex(0.0, 0.0, 0.0);
+        mesh->vertex(s->length, -10.0, (float)s->lanes.size()*map->lane_width);
+        mesh->vertex(0.0, -10.0, (float)s->lanes.size()*map->lane_width);
+        mesh->vertex(0.0, 0.0, (float)s->lanes.size()*map->lane_width);
+        mesh->vertex(s->length, 0.0, (float)s->lanes.size()*map->lane_width);
+        mesh->end();
+        mesh->pop();
       } else {
         double xc;
         double yc;
@@ -217,12 +236,12 @@ void RealisticDrawer::drawRoad()
           xc = s->x + cos(s->a-M_PI/2.0)*s->radius;
           yc = s->y + sin(s->a-M_PI/2.0)*s->radius;
         }
-        glPushMatrix();
-        glTranslatef(xc, 0.0, yc);
+        mesh->push();
+        mesh->translate(xc, 0.0, yc);
         if (s->angle > 0.0)
-          glRotatef(90.0-s->a*180.0/M_PI, 0.0, 1.0, 0.0);
+          mesh->rotate(90.0-s->a*180.0/M_PI);
         else
-          glRotatef(-90.0-s->a*180.0/M_PI, 0.0, 1.0, 0.0);
+          mesh->rotate(-90.0-s->a*180.0/M_PI);
         
         float r = s->radius;
         if (s->angle < 0.0) {
@@ -234,38 +253,38 @@ void RealisticDrawer::drawRoad()
         float dangle_length = MARK_LENGTH/s->radius;
         float f = (s->angle < 0.0)?-1.0:1.0;
         
-        glColor3f(0.1, 0.1, 0.1);
-        glBegin(GL_TRIANGLE_STRIP);
+        mesh->color(0.1, 0.1, 0.1);
+        mesh->begin(GL_TRIANGLE_STRIP);
         for (float a = 0.0; a < fabs(s->angle); a += dangle_length) {
-          glVertex3f(cos(f*a)*(s->radius), -10.0, sin(f*a)*(s->radius));
-          glVertex3f(cos(f*a)*r, -10.0, sin(f*a)*r);
+          mesh->vertex(cos(f*a)*(s->radius), -10.0, sin(f*a)*(s->radius));
+          mesh->vertex(cos(f*a)*r, -10.0, sin(f*a)*r);
         }
-        glVertex3f(cos(s->angle)*(s->radius), -10.0, sin(s->angle)*(s->radius));
-        glVertex3f(cos(s->angle)*r, -10.0, sin(s->angle)*r);
-        glEnd();
+        mesh->vertex(cos(s->angle)*(s->radius), -10.0, sin(s->angle)*(s->radius));
+        mesh->vertex(cos(s->angle)*r, -10.0, sin(s->angle)*r);
+        mesh->end();
 
-        glBegin(GL_TRIANGLE_STRIP);
+        mesh->begin(GL_TRIANGLE_STRIP);
         for (float a = 0.0; a < fabs(s->angle); a += dangle_length) {
-          glVertex3f(cos(f*a)*(s->radius), -10.0, sin(f*a)*(s->radius));
-          glVertex3f(cos(f*a)*(s->radius),  0.0, sin(f*a)*(s->radius));
+          mesh->vertex(cos(f*a)*(s->radius), -10.0, sin(f*a)*(s->radius));
+          mesh->vertex(cos(f*a)*(s->radius),  0.0, sin(f*a)*(s->radius));
         }
-        glVertex3f(cos(s->angle)*(s->radius), -10.0, sin(s->angle)*(s->radius));
-        glVertex3f(cos(s->angle)*(s->radius), 0.0, sin(s->angle)*(s->radius));
-        glEnd();
+        mesh->vertex(cos(s->angle)*(s->radius), -10.0, sin(s->angle)*(s->radius));
+        mesh->vertex(cos(s->angle)*(s->radius), 0.0, sin(s->angle)*(s->radius));
+        mesh->end();
 
-        glBegin(GL_TRIANGLE_STRIP);
+        mesh->begin(GL_TRIANGLE_STRIP);
         for (float a = 0.0; a < fabs(s->angle); a += dangle_length) {
-          glVertex3f(cos(f*a)*r, -10.0, sin(f*a)*r);
-          glVertex3f(cos(f*a)*r, 0.0, sin(f*a)*r);
+          mesh->vertex(cos(f*a)*r, -10.0, sin(f*a)*r);
+          mesh->vertex(cos(f*a)*r, 0.0, sin(f*a)*r);
         }
-        glVertex3f(cos(s->angle)*r, -10.0, sin(s->angle)*r);
-        glVertex3f(cos(s->angle)*r, 0.0, sin(s->angle)*r);
-        glEnd();
-        glPopMatrix();
+        mesh->vertex(cos(s->angle)*r, -10.0, sin(s->angle)*r);
+        mesh->vertex(cos(s->angle)*r, 0.0, sin(s->angle)*r);
+        mesh->end();
+        mesh->pop();
       }
 
       // For entry and exit
-      glBegin(GL_QUADS);
+      mesh->begin(GL_QUADS);
       for (unsigned int j = 0; j < s->lanes.size(); j++) {
         Lane *l = s->lanes[j];
         double x1, x2, y1, y2;
@@ -274,23 +293,23 @@ void RealisticDrawer::drawRoad()
           y1 = l->y_start + sin(l->a_start + M_PI/2.0)*map->lane_width/2.0;
           x2 = l->x_start + cos(l->a_start - M_PI/2.0)*map->lane_width/2.0;
           y2 = l->y_start + sin(l->a_start - M_PI/2.0)*map->lane_width/2.0;
-          glVertex3f(x1, 0.0, y1);
-          glVertex3f(x1, -10.0, y1);
-          glVertex3f(x2, -10.0, y2);
-          glVertex3f(x2, 0.0, y2);
+          mesh->vertex(x1, 0.0, y1);
+          mesh->vertex(x1, -10.0, y1);
+          mesh->vertex(x2, -10.0, y2);
+          mesh->vertex(x2, 0.0, y2);
         }
         if (l->type == EXIT || l->merge_direction != 0) {
           x1 = l->x_end + cos(l->a_end + M_PI/2.0)*map->lane_width/2.0;
           y1 = l->y_end + sin(l->a_end + M_PI/2.0)*map->lane_width/2.0;
           x2 = l->x_end + cos(l->a_end - M_PI/2.0)*map->lane_width/2.0;
           y2 = l->y_end + sin(l->a_end - M_PI/2.0)*map->lane_width/2.0;
-          glVertex3f(x1, 0.0, y1);
-          glVertex3f(x1, -10.0, y1);
-          glVertex3f(x2, -10.0, y2);
-          glVertex3f(x2, 0.0, y2);
+          mesh->vertex(x1, 0.0, y1);
+          mesh->vertex(x1, -10.0, y1);
+          mesh->vertex(x2, -10.0, y2);
+          mesh->vertex(x2, 0.0, y2);
         }
       }
-      glEnd();
+      mesh->end();
     }
   }
 
@@ -304,119 +323,112 @@ void RealisticDrawer::drawRoad()
       Log::getStream(5) << "  Straight segment: " << setiosflags(ios::fixed) << setprecision(2) << s->x << " " << setiosflags(ios::fixed) << setprecision(2) << s->y << " " << setiosflags(ios::fixed) << setprecision(2) << s->a << endl;
 
       // Transform
-      glPushMatrix();
-      glTranslatef(s->x, 0.0, s->y);
-      glRotatef(-s->a*180.0/M_PI, 0.0, 1.0, 0.0);   
+      mesh->push();
+      mesh->translate(s->x, 0.0, s->y);
+      mesh->rotate(-s->a*180.0/M_PI);   
 
       // road
       if (this->weather & RAIN)
-        glColor4f(1.0, 1.0, 1.0, 0.3);
+        mesh->color(1.0, 1.0, 1.0, 0.3);
       else
-        glColor3f(1.0, 1.0, 1.0);
-      glBindTexture(GL_TEXTURE_2D, road_texture);
-      
-      glEnable(GL_TEXTURE_2D);
-      
-      glBegin(GL_QUADS);
-      glTexCoord2f(0.0, 0.0);
-      glVertex3f(0.0, 0.0, 0.0);
-      glTexCoord2f(s->length, 0.0);
-      glVertex3f(s->length, 0.0, 0.0);
-      glTexCoord2f(s->length, (float)s->lanes.size()*map->lane_width);
-      glVertex3f(s->length, 0.0, (float)s->lanes.size()*map->lane_width);
-      glTexCoord2f(0.0, (float)s->lanes.size()*map->lane_width);
-      glVertex3f(0.0, 0.0, (float)s->lanes.size()*map->lane_width);
-      glEnd();
-      
-      glDisable(GL_TEXTURE_2D);
+        mesh->color(1.0, 1.0, 1.0);
+      mesh->layer(RoadMesh::ROAD);
+      mesh->begin(GL_QUADS);
+      mesh->texCoord(0.0, 0.0);
+      mesh->vertex(0.0, 0.0, 0.0);
+      mesh->texCoord(s->length, 0.0);
+      mesh->vertex(s->length, 0.0, 0.0);
+      mesh->texCoord(s->length, (float)s->lanes.size()*map->lane_width);
+      mesh->vertex(s->length, 0.0, (float)s->lanes.size()*map->lane_width);
+      mesh->texCoord(0.0, (float)s->lanes.size()*map->lane_width);
+      mesh->vertex(0.0, 0.0, (float)s->lanes.size()*map->lane_width);
+      mesh->end();
 
       // Grass
-      glColor3f(1.0, 1.0, 1.0);
-      glBindTexture(GL_TEXTURE_2D, grass_texture);
-      glEnable(GL_TEXTURE_2D);
-      glBegin(GL_QUADS);
-      glTexCoord2f(0.0, -SIDE_WIDTH);
-      glVertex3f(0.0, -0.05, -SIDE_WIDTH);
-      glTexCoord2f(s->length, -SIDE_WIDTH);
-      glVertex3f(s->length, -0.05, -SIDE_WIDTH);
-      glTexCoord2f(s->length, ((float)s->lanes.size())*map->lane_width+SIDE_WIDTH);
-      glVertex3f(s->length, -0.05, ((float)s->lanes.size())*map->lane_width+SIDE_WIDTH);
-      glTexCoord2f(0.0,((float)s->lanes.size())*map->lane_width+SIDE_WIDTH);
-      glVertex3f(0.0, -0.05, ((float)s->lanes.size())*map->lane_width+SIDE_WIDTH);
-      glEnd();
-      glDisable(GL_TEXTURE_2D);
+      mesh->color(1.0, 1.0, 1.0);
+      mesh->layer(RoadMesh::GRASS);
+      mesh->begin(GL_QUADS);
+      mesh->texCoord(0.0, -SIDE_WIDTH);
+      mesh->vertex(0.0, -0.05, -SIDE_WIDTH);
+      mesh->texCoord(s->length, -SIDE_WIDTH);
+      mesh->vertex(s->length, -0.05, -SIDE_WIDTH);
+      mesh->texCoord(s->length, ((float)s->lanes.size())*map->lane_width+SIDE_WIDTH);
+      mesh->vertex(s->length, -0.05, ((float)s->lanes.size())*map->lane_width+SIDE_WIDTH);
+      mesh->texCoord(0.0,((float)s->lanes.size())*map->lane_width+SIDE_WIDTH);
+      mesh->vertex(0.0, -0.05, ((float)s->lanes.size())*map->lane_width+SIDE_WIDTH);
+      mesh->end();
+      mesh->layer(RoadMesh::MARKINGS);
 
       // Mark start of segment
-      glBegin(GL_LINES);
-      glColor3f(1, 1, 0);
-      glLineWidth(3);
-      glVertex3f(0.0, 0.0, -SIDE_WIDTH-1.0);
-      glVertex3f(0.0, 0.0, (float)(s->lanes.size())*map->lane_width+SIDE_WIDTH+1.0);
-      glEnd();
+      mesh->begin(GL_LINES);
+      mesh->color(1, 1, 0);
+      mesh->vertex(0.0, 0.0, -SIDE_WIDTH-1.0);
+      mesh->vertex(0.0, 0.0, (float)(s->lanes.size())*map->lane_width+SIDE_WIDTH+1.0);
+      mesh->end();
 
       // broken lane markings
-      glBegin(GL_QUADS);
-      glColor3f(1, 1, 1);
+      mesh->begin(GL_QUADS);
+      mesh->color(1, 1, 1);
       for (unsigned int i = 0; i < s->lanes.size()-1; i++) {
         float z = ((float)(i+1))*map->lane_width;
         Lane *l = s->lanes[i];
         for (float x = 0.0; x < s->length; x += MARK_LENGTH+MARK_INTER) {
           if ((l->allowedRight(x) == 0.0 || l->right->allowedLeft(x) == 0.0) &&
               (l->allowedRight(x+MARK_LENGTH) == 0.0 || l->right->allowedLeft(x+MARK_LENGTH) == 0.0)) {
-            glVertex3f(x, 0.01, z-MARK_WIDTH/2.0);
-            glVertex3f(x, 0.01, z+MARK_WIDTH/2.0);
-            glVertex3f(x+MARK_LENGTH, 0.01, z+MARK_WIDTH/2.0);
-            glVertex3f(x+MARK_LENGTH, 0.01, z-MARK_WIDTH/2.0);
+            mesh->vertex(x, 0.01, z-MARK_WIDTH/2.0);
+            mesh->vertex(x, 0.01, z+MARK_WIDTH/2.0);
+            mesh->vertex(x+MARK_LENGTH, 0.01, z+MARK_WIDTH/2.0);
+            mesh->vertex(x+MARK_LENGTH, 0.01, z-MARK_WIDTH/2.0);
           } else {
             // solid
-            glVertex3f(x, 0.01, z-MARK_WIDTH/2.0);
-            glVertex3f(x, 0.01, z+MARK_WIDTH/2.0);
-            glVertex3f(x+MARK_LENGTH+MARK_INTER, 0.01, z+MARK_WIDTH/2.0);
-            glVertex3f(x+MARK_LENGTH+MARK_INTER, 0.01, z-MARK_WIDTH/2.0);
+            mesh->vertex(x, 0.01, z-MARK_WIDTH/2.0);
+            mesh->vertex(x, 0.01, z+MARK_WIDTH/2.0);
+            mesh->vertex(x+MARK_LENGTH+MARK_INTER, 0.01, z+MARK_WIDTH/2.0);
+            mesh->vertex(x+MARK_LENGTH+MARK_INTER, 0.01, z-MARK_WIDTH/2.0);
           }
         }
       }
-      glEnd();
+      mesh->end();
 
       // solid markings
-      glBegin(GL_QUADS);
-      glColor3f(1, 1, 1);
+      mesh->begin(GL_QUADS);
+      mesh->color(1, 1, 1);
       for (unsigned int i = 0; i < s->lanes.size()-1; i++) {
         float z = ((float)(i+1))*map->lane_width;
         Lane *l = s->lanes[i];
         for (float x = 0.0; x < s->length; x += MARK_LENGTH+MARK_INTER) {
           if ((l->allowedRight(x) != 0.0 || l->allowedRight(x+MARK_LENGTH) != 0.0) &&
               (l->right->allowedLeft(x) == 0.0 && l->right->allowedLeft(x+MARK_LENGTH) == 0.0)) {
-            glVertex3f(x, 0.01, z-INNER_MARK_OFFSET-MARK_WIDTH/2.0);
-            glVertex3f(x, 0.01, z-INNER_MARK_OFFSET+MARK_WIDTH/2.0);
-            glVertex3f(x+MARK_LENGTH+MARK_INTER, 0.01, z-INNER_MARK_OFFSET+MARK_WIDTH/2.0);
-            glVertex3f(x+MARK_LENGTH+MARK_INTER, 0.01, z-INNER_MARK_OFFSET-MARK_WIDTH/2.0);
+            mesh->vertex(x, 0.01, z-INNER_MARK_OFFSET-MARK_WIDTH/2.0);
+            mesh->vertex(x, 0.01, z-INNER_MARK_OFFSET+MARK_WIDTH/2.0);
+            mesh->vertex(x+MARK_LENGTH+MARK_INTER, 0.01, z-INNER_MARK_OFFSET+MARK_WIDTH/2.0);
+            mesh->vertex(x+MARK_LENGTH+MARK_INTER, 0.01, z-INNER_MARK_OFFSET-MARK_WIDTH/2.0);
           }
           if ((l->right->allowedLeft(x) != 0.0 || l->right->allowedLeft(x+MARK_LENGTH) != 0.0) &&
               (l->allowedRight(x) == 0.0 && l->allowedRight(x+MARK_LENGTH) == 0.0)) {
-            glVertex3f(x, 0.01, z+INNER_MARK_OFFSET-MARK_WIDTH/2.0);
-            glVertex3f(x, 0.01, z+INNER_MARK_OFFSET+MARK_WIDTH/2.0);
-            glVertex3f(x+MARK_LENGTH+MARK_INTER, 0.01, z+INNER_MARK_OFFSET+MARK_WIDTH/2.0);
-            glVertex3f(x+MARK_LENGTH+MARK_INTER, 0.01, z+INNER_MARK_OFFSET-MARK_WIDTH/2.0);
+            mesh->vertex(x, 0.01, z+INNER_MARK_OFFSET-MARK_WIDTH/2.0);
+            mesh->vertex(x, 0.01, z+INNER_MARK_OFFSET+MARK_WIDTH/2.0);
+            mesh->vertex(x+MARK_LENGTH+MARK_INTER, 0.01, z+INNER_MARK_OFFSET+MARK_WIDTH/2.0);
+            mesh->vertex(x+MARK_LENGTH+MARK_INTER, 0.01, z+INNER_MARK_OFFSET-MARK_WIDTH/2.0);
           }
         }
       }
-      glEnd();
+      mesh->end();
       
       // plain white
-      glBegin(GL_QUADS);
-      glColor3f(1, 1, 1);
-      glVertex3f(0.0, 0.01, -MARK_WIDTH/2.0);
-      glVertex3f(0.0, 0.01,  MARK_WIDTH/2.0);
-      glVertex3f(s->length, 0.01,  MARK_WIDTH/2.0);
-      glVertex3f(s->length, 0.01, -MARK_WIDTH/2.0);
-      glVertex3f(0.0, 0.01, (float)s->lanes.size()*map->lane_width-MARK_WIDTH/2.0);
-      glVertex3f(0.0, 0.01, (float)s->lanes.size()*map->lane_width+MARK_WIDTH/2.0);
-      glVertex3f(s->length, 0.01, (float)s->lanes.size()*map->lane_width+MARK_WIDTH/2.0);
-      glVertex3f(s->length, 0.01, (float)s->lanes.size()*map->lane_width-MARK_WIDTH/2.0);
-      glEnd();
-
-      glPopMatrix();
+      mesh->begin(GL_QUADS);
+      mesh->color(1, 1, 1);
+      mesh->vertex(0.0, 0.01, -MARK_WIDTH/2.0);
+      mesh->vertex(0.0, 0.01,  MARK_WIDTH/2.0);
+      mesh->vertex(s->length, 0.01,  MARK_WIDTH/2.0);
+      mesh->vertex(s->length, 0.01, -MARK_WIDTH/2.0);
+      mesh->vertex(0.0, 0.01, (float)s->lanes.size()*map->lane_width-MARK_WIDTH/2.0);
+      mesh->vertex(0.0, 0.01, (float)s->lanes.size()*map->lane_width+MARK_WIDTH/2.0);
+      mesh->vertex(s->length, 0.01, (float)s->lanes.size()*map->lane_width+MARK_WIDTH/2.0);
+      mesh->vertex(s->length, 0.01, (float)s->lanes.size()*map->lane_width-MARK_WIDTH/2.0);
+      mesh->end();
+
+      mesh->pop();
     } else if (s->geometry == CIRCULAR) {
       // Center of the circle
       double xc;
@@ -430,12 +442,12 @@ void RealisticDrawer::drawRoad()
       }
       Log::getStream(5) << "  Circular segment: " << setiosflags(ios::fixed) << setprecision(2) << s->x << " " << setiosflags(ios::fixed) << setprecision(2) << s->y << " " << setiosflags(ios::fixed) << setprecision(2) << s->a << " (Center: " << setiosflags(ios::fixed) << setprecision(2) << xc << " " << setiosflags(ios::fixed) << setprecision(2) << yc << " - Radius: " << setiosflags(ios::fixed) << setprecision(2) << s->radius << ")" << endl;
       
-      glPushMatrix();
-      glTranslatef(xc, 0.0, yc);
+      mesh->push();
+      mesh->translate(xc, 0.0, yc);
       if (s->angle > 0.0)
-        glRotatef(90.0-s->a*180.0/M_PI, 0.0, 1.0, 0.0);
+        mesh->rotate(90.0-s->a*180.0/M_PI);
       else
-        glRotatef(-90.0-s->a*180.0/M_PI, 0.0, 1.0, 0.0);
+        mesh->rotate(-90.0-s->a*180.0/M_PI);
 
       float r = s->radius;
       if (s->angle < 0.0) {
@@ -449,62 +461,55 @@ void RealisticDrawer::drawRoad()
 
       // road
       if (this->weather & RAIN)
-        glColor4f(1.0, 1.0, 1.0, 0.3);
+        mesh->color(1.0, 1.0, 1.0, 0.3);
       else
-        glColor3f(1.0, 1.0, 1.0);
-      glBindTexture(GL_TEXTURE_2D, road_texture);
-      
-      glEnable(GL_TEXTURE_2D);
-      glBegin(GL_TRIANGLE_STRIP);
+        mesh->color(1.0, 1.0, 1.0);
+      mesh->layer(RoadMesh::ROAD);
+      mesh->begin(GL_TRIANGLE_STRIP);
       for (float a = 0.0; a < fabs(s->angle); a += dangle_length) {
-        glTexCoord2f(cos(f*a)*(s->radius), sin(f*a)*(s->radius));
-        glVertex3f(cos(f*a)*(s->radius), 0.0, sin(f*a)*(s->radius));
-        glTexCoord2f(cos(f*a)*r, sin(f*a)*r);
-        glVertex3f(cos(f*a)*r, 0.0, sin(f*a)*r);
+        mesh->texCoord(cos(f*a)*(s->radius), sin(f*a)*(s->radius));
+        mesh->vertex(cos(f*a)*(s->radius), 0.0, sin(f*a)*(s->radius));
+        mesh->texCoord(cos(f*a)*r, sin(f*a)*r);
+        mesh->vertex(cos(f*a)*r, 0.0, sin(f*a)*r);
       }
-      glTexCoord2f(cos(s->angle)*(s->radius), sin(s->angle)*(s->radius));
-      glVertex3f(cos(s->angle)*(s->radius), 0.0, sin(s->angle)*(s->radius));
-      glTexCoord2f(cos(s->angle)*r, sin(s->angle)*r);
-      glVertex3f(cos(s->angle)*r, 0.0, sin(s->angle)*r);
-      glEnd();
-      glDisable(GL_TEXTURE_2D);
+      mesh->texCoord(cos(s->angle)*(s->radius), sin(s->angle)*(s->radius));
+      mesh->vertex(cos(s->angle)*(s->radius), 0.0, sin(s->angle)*(s->radius));
+      mesh->texCoord(cos(s->angle)*r, sin(s->angle)*r);
+      mesh->vertex(cos(s->angle)*r, 0.0, sin(s->angle)*r);
+      mesh->end();
 
       // Grass
-      glColor3f(1.0, 1.0, 1.0);
-      glBindTexture(GL_TEXTURE_2D, grass_texture);
-      glEnable(GL_TEXTURE_2D);
-      glBegin(GL_TRIANGLE_STRIP);
+      mesh->color(1.0, 1.0, 1.0);
+      mesh->layer(RoadMesh::GRASS);
+      mesh->begin(GL_TRIANGLE_STRIP);
       for (float a = 0.0; a < fabs(s->angle); a += dangle_length) {
-        glTexCoord2f(cos(f*a)*(s->radius+f*SIDE_WIDTH), sin(f*a)*(s->radius+f*SIDE_WIDTH));
-        glVertex3f(cos(f*a)*(s->radius+f*SIDE_WIDTH), -0.05, sin(f*a)*(s->radius+f*SIDE_WIDTH));
-        glTexCoord2f(cos(f*a)*(r-f*SIDE_WIDTH), sin(f*a)*(r-f*SIDE_WIDTH));
-        glVertex3f(cos(f*a)*(r-f*SIDE_WIDTH), -0.05, sin(f*a)*(r-f*SIDE_WIDTH));
+        mesh->texCoord(cos(f*a)*(s->radius+f*SIDE_WIDTH), sin(f*a)*(s->radius+f*SIDE_WIDTH));
+        mesh->vertex(cos(f*a)*(s->radius+f*SIDE_WIDTH), -0.05, sin(f*a)*(s->radius+f*SIDE_WIDTH));
+        mesh->texCoord(cos(f*a)*(r-f*SIDE_WIDTH), sin(f*a)*(r-f*SIDE_WIDTH));
+        mesh->vertex(cos(f*a)*(r-f*SIDE_WIDTH), -0.05, sin(f*a)*(r-f*SIDE_WIDTH));
       }
-      glTexCoord2f(cos(s->angle)*(s->radius+f*SIDE_WIDTH), sin(s->angle)*(s->radius+f*SIDE_WIDTH));
-      glVertex3f(cos(s->angle)*(s->radius+f*SIDE_WIDTH), -0.05, sin(s->angle)*(s->radius+f*SIDE_WIDTH));
-      glTexCoord2f(cos(s->angle)*(r-f*SIDE_WIDTH), sin(s->angle)*(r-f*SIDE_WIDTH));
-      glVertex3f(cos(s->angle)*(r-f*SIDE_WIDTH), -0.05, sin(s->angle)*(r-f*SIDE_WIDTH));
-      glEnd();
-      glDisable(GL_TEXTURE_2D);
-
-      glDisable(GL_TEXTURE_2D);
+      mesh->texCoord(cos(s->angle)*(s->radius+f*SIDE_WIDTH), sin(s->angle)*(s->radius+f*SIDE_WIDTH));
+      mesh->vertex(cos(s->angle)*(s->radius+f*SIDE_WIDTH), -0.05, sin(s->angle)*(s->radius+f*SIDE_WIDTH));
+      mesh->texCoord(cos(s->angle)*(r-f*SIDE_WIDTH), sin(s->angle)*(r-f*SIDE_WIDTH));
+      mesh->vertex(cos(s->angle)*(r-f*SIDE_WIDTH), -0.05, sin(s->angle)*(r-f*SIDE_WIDTH));
+      mesh->end();
+      mesh->layer(RoadMesh::MARKINGS);
 
       // Mark start of segment
-      glBegin(GL_LINES);
-      glColor3f(1, 1, 0);
-      glLineWidth(3);
+      mesh->begin(GL_LINES);
+      mesh->color(1, 1, 0);
       if (s->angle < 0.0) {
-        glVertex3f(s->radius-SIDE_WIDTH-1.0, 0.0, 0.0);
-        glVertex3f(s->radius+(float)(s->lanes.size())*map->lane_width+SIDE_WIDTH+1.0, 0.0, 0.0);
+        mesh->vertex(s->radius-SIDE_WIDTH-1.0, 0.0, 0.0);
+        mesh->vertex(s->radius+(float)(s->lanes.size())*map->lane_width+SIDE_WIDTH+1.0, 0.0, 0.0);
       } else {
-        glVertex3f(s->radius+SIDE_WIDTH+1.0, 0.0, 0.0);
-        glVertex3f(s->radius-(float)(s->lanes.size())*map->lane_width-SIDE_WIDTH-1.0, 0.0, 0.0);
+        mesh->vertex(s->radius+SIDE_WIDTH+1.0, 0.0, 0.0);
+        mesh->vertex(s->radius-(float)(s->lanes.size())*map->lane_width-SIDE_WIDTH-1.0, 0.0, 0.0);
       }
-      glEnd();
+      mesh->end();
 
       // broken lane markings
-      glBegin(GL_QUADS);
-      glColor3f(1, 1, 1);
+      mesh->begin(GL_QUADS);
+      mesh->color(1, 1, 1);
       for (unsigned int i = 0; i < s->lanes.size()-1; i++) {
         float r = s->radius;
         if (s->angle < 0.0) {
@@ -521,23 +526,23 @@ void RealisticDrawer::drawRoad()
         for (float a = 0.0; a < fabs(s->angle); a += dangle_length+dangle_inter) {
           if ((l->allowedRight(a) == 0.0 || l->right->allowedLeft(a) == 0.0) &&
               (l->allowedRight(a+dangle_length) == 0.0 || l->right->allowedLeft(a+dangle_length) == 0.0)) {
-            glVertex3f(cos(f*a)*(r-MARK_WIDTH/2.0), 0.01, sin(f*a)*(r-MARK_WIDTH/2.0));
-            glVertex3f(cos(f*a)*(r+MARK_WIDTH/2.0), 0.01, sin(f*a)*(r+MARK_WIDTH/2.0));
-            glVertex3f(cos(f*(a+dangle_length))*(r+MARK_WIDTH/2.0), 0.01, sin(f*(a+dangle_length))*(r+MARK_WIDTH/2.0));
-            glVertex3f(cos(f*(a+dangle_length))*(r-MARK_WIDTH/2.0), 0.01, sin(f*(a+dangle_length))*(r-MARK_WIDTH/2.0));
+            mesh->vertex(cos(f*a)*(r-MARK_WIDTH/2.0), 0.01, sin(f*a)*(r-MARK_WIDTH/2.0));
+            mesh->vertex(cos(f*a)*(r+MARK_WIDTH/2.0), 0.01, sin(f*a)*(r+MARK_WIDTH/2.0));
+            mesh->vertex(cos(f*(a+dangle_length))*(r+MARK_WIDTH/2.0), 0.01, sin(f*(a+dangle_length))*(r+MARK_WIDTH/2.0));
+            mesh->vertex(cos(f*(a+dangle_length))*(r-MARK_WIDTH/2.0), 0.01, sin(f*(a+dangle_length))*(r-MARK_WIDTH/2.0));
           } else {
-            glVertex3f(cos(f*a)*(r-MARK_WIDTH/2.0), 0.01, sin(f*a)*(r-MARK_WIDTH/2.0));
-            glVertex3f(cos(f*a)*(r+MARK_WIDTH/2.0), 0.01, sin(f*a)*(r+MARK_WIDTH/2.0));
-            glVertex3f(cos(f*(a+dangle_length+dangle_inter))*(r+MARK_WIDTH/2.0), 0.01, sin(f*(a+dangle_length+dangle_inter))*(r+MARK_WIDTH/2.0));
-            glVertex3f(cos(f*(a+dangle_length+dangle_inter))*(r-MARK_WIDTH/2.0), 0.01, sin(f*(a+dangle_length+dangle_inter))*(r-MARK_WIDTH/2.0));
+            mesh->vertex(cos(f*a)*(r-MARK_WIDTH/2.0), 0.01, sin(f*a)*(r-MARK_WIDTH/2.0));
+            mesh->vertex(cos(f*a)*(r+MARK_WIDTH/2.0), 0.01, sin(f*a)*(r+MARK_WIDTH/2.0));
+            mesh->vertex(cos(f*(a+dangle_length+dangle_inter))*(r+MARK_WIDTH/2.0), 0.01, sin(f*(a+dangle_length+dangle_inter))*(r+MARK_WIDTH/2.0));
+            mesh->vertex(cos(f*(a+dangle_length+dangle_inter))*(r-MARK_WIDTH/2.0), 0.01, sin(f*(a+dangle_length+dangle_inter))*(r-MARK_WIDTH/2.0));
           }
         }
       }
-      glEnd();
+      mesh->end();
 
       // solid markings
-      glBegin(GL_QUADS);
-      glColor3f(1, 1, 1);
+      mesh->begin(GL_QUADS);
+      mesh->color(1, 1, 1);
       for (unsigned int i = 0; i < s->lanes.size()-1; i++) {
         float r = s->radius;
         if (s->angle < 0.0) {
@@ -554,26 +559,26 @@ void RealisticDrawer::drawRoad()
         for (float a = 0.0; a < fabs(s->angle); a += dangle_length+dangle_inter) {
           if ((l->allowedRight(a) != 0.0 || l->allowedRight(a+dangle_length) != 0.0) &&
               (l->right->allowedLeft(a) == 0.0 && l->right->allowedLeft(a+dangle_length) == 0.0)) {
-            glVertex3f(cos(f*a)*(r+f*INNER_MARK_OFFSET-MARK_WIDTH/2.0), 0.01, sin(f*a)*(r+f*INNER_MARK_OFFSET-MARK_WIDTH/2.0));
-            glVertex3f(cos(f*a)*(r+f*INNER_MARK_OFFSET+MARK_WIDTH/2.0), 0.01, sin(f*a)*(r+f*INNER_MARK_OFFSET+MARK_WIDTH/2.0));
-            glVertex3f(cos(f*(a+dangle_length+dangle_inter))*(r+f*INNER_MARK_OFFSET+MARK_WIDTH/2.0), 0.01, sin(f*(a+dangle_length+dangle_inter))*(r+f*INNER_MARK_OFFSET+MARK_WIDTH/2.0));
-            glVertex3f(cos(f*(a+dangle_length+dangle_inter))*(r+f*INNER_MARK_OFFSET-MARK_WIDTH/2.0), 0.01, sin(f*(a+dangle_length+dangle_inter))*(r+f*INNER_MARK_OFFSET-MARK_WIDTH/2.0));
+            mesh->vertex(cos(f*a)*(r+f*INNER_MARK_OFFSET-MARK_WIDTH/2.0), 0.01, sin(f*a)*(r+f*INNER_MARK_OFFSET-MARK_WIDTH/2.0));
+            mesh->vertex(cos(f*a)*(r+f*INNER_MARK_OFFSET+MARK_WIDTH/2.0), 0.01, sin(f*a)*(r+f*INNER_MARK_OFFSET+MARK_WIDTH/2.0));
+            mesh->vertex(cos(f*(a+dangle_length+dangle_inter))*(r+f*INNER_MARK_OFFSET+MARK_WIDTH/2.0), 0.01, sin(f*(a+dangle_length+dangle_inter))*(r+f*INNER_MARK_OFFSET+MARK_WIDTH/2.0));
+            mesh->vertex(cos(f*(a+dangle_length+dangle_inter))*(r+f*INNER_MARK_OFFSET-MARK_WIDTH/2.0), 0.01, sin(f*(a+dangle_length+dangle_inter))*(r+f*INNER_MARK_OFFSET-MARK_WIDTH/2.0));
           }
           if ((l->right->allowedLeft(a) != 0.0 || l->right->allowedLeft(a+dangle_length) != 0.0) &&
               (l->allowedRight(a) == 0.0 && l->allowedRight(a+dangle_length) == 0.0)) {
-            glVertex3f(cos(f*a)*(r-f*INNER_MARK_OFFSET-MARK_WIDTH/2.0), 0.01, sin(f*a)*(r-f*INNER_MARK_OFFSET-MARK_WIDTH/2.0));
-            glVertex3f(cos(f*a)*(r-f*INNER_MARK_OFFSET+MARK_WIDTH/2.0), 0.01, sin(f*a)*(r-f*INNER_MARK_OFFSET+MARK_WIDTH/2.0));
-            glVertex3f(cos(f*(a+dangle_length+dangle_inter))*(r-f*INNER_MARK_OFFSET+MARK_WIDTH/2.0), 0.01, sin(f*(a+dangle_length+dangle_inter))*(r-f*INNER_MARK_OFFSET+MARK_WIDTH/2.0));
-            glVertex3f(cos(f*(a+dangle_length+dangle_inter))*(r-f*INNER_MARK_OFFSET-MARK_WIDTH/2.0), 0.01, sin(f*(a+dangle_length+dangle_inter))*(r-f*INNER_MARK_OFFSET-MARK_WIDTH/2.0));
+            mesh->vertex(cos(f*a)*(r-f*INNER_MARK_OFFSET-MARK_WIDTH/2.0), 0.01, sin(f*a)*(r-f*INNER_MARK_OFFSET-MARK_WIDTH/2.0));
+            mesh->vertex(cos(f*a)*(r-f*INNER_MARK_OFFSET+MARK_WIDTH/2.0), 0.01, sin(f*a)*(r-f*INNER_MARK_OFFSET+MARK_WIDTH/2.0));
+            mesh->vertex(cos(f*(a+dangle_length+dangle_inter))*(r-f*INNER_MARK_OFFSET+MARK_WIDTH/2.0), 0.01, sin(f*(a+dangle_length+dangle_inter))*(r-f*INNER_MARK_OFFSET+MARK_WIDTH/2.0));
+            mesh->vertex(cos(f*(a+dangle_length+dangle_inter))*(r-f*INNER_MARK_OFFSET-MARK_WIDTH/2.0), 0.01, sin(f*(a+dangle_length+dangle_inter))*(r-f*INNER_MARK_OFFSET-MARK_WIDTH/2.0));
           }
         }
       }
-      glEnd();
+      mesh->end();
 
       // plain white
-      glColor3f(1, 1, 1);
+      mesh->color(1, 1, 1);
       for (unsigned int i = 0; i < 2; i++) {
-        glBegin(GL_TRIANGLE_STRIP);
+        mesh->begin(GL_TRIANGLE_STRIP);
         float r = s->radius;
         if (s->angle < 0.0) {
           r += ((float)(i))*map->lane_width*(float)s->lanes.size();
@@ -584,43 +589,42 @@ void RealisticDrawer::drawRoad()
         float dangle_length = MARK_LENGTH/r;
         float f = (s->angle < 0.0)?-1.0:1.0;
         for (float a = 0.0; a < fabs(s->angle); a += dangle_length) {
-          glVertex3f(cos(f*a)*(r-MARK_WIDTH/2.0), 0.01, sin(f*a)*(r-MARK_WIDTH/2.0));
-          glVertex3f(cos(f*a)*(r+MARK_WIDTH/2.0), 0.01, sin(f*a)*(r+MARK_WIDTH/2.0));
+          mesh->vertex(cos(f*a)*(r-MARK_WIDTH/2.0), 0.01, sin(f*a)*(r-MARK_WIDTH/2.0));
+          mesh->vertex(cos(f*a)*(r+MARK_WIDTH/2.0), 0.01, sin(f*a)*(r+MARK_WIDTH/2.0));
         }
-        glVertex3f(cos(s->angle)*(r-MARK_WIDTH/2.0), 0.01, sin(s->angle)*(r-MARK_WIDTH/2.0));
-        glVertex3f(cos(s->angle)*(r+MARK_WIDTH/2.0), 0.01, sin(s->angle)*(r+MARK_WIDTH/2.0));
-        glEnd();
+        mesh->vertex(cos(s->angle)*(r-MARK_WIDTH/2.0), 0.01, sin(s->angle)*(r-MARK_WIDTH/2.0));
+        mesh->vertex(cos(s->angle)*(r+MARK_WIDTH/2.0), 0.01, sin(s->angle)*(r+MARK_WIDTH/2.0));
+        mesh->end();
       }
 
-      glPopMatrix();
+      mesh->pop();
     }
 
     // Draw entry and exit
-    glBegin(GL_TRIANGLES);
+    mesh->begin(GL_TRIANGLES);
     for (unsigned int i = 0; i < s->lanes.size(); i++) {
       Lane *l = s->lanes[i];
       if (l->type == ENTRY) {
-        glColor3f(0.0, 1.0, 0.0);
+        mesh->color(0.0, 1.0, 0.0);
         double x = l->x_start + cos(l->a_start)*1.0;
         double y = l->y_start + sin(l->a_start)*1.0;
-        glVertex3f(x + cos(l->a_start + M_PI/2.0)*0.5, 0.01, y + sin(l->a_start + M_PI/2.0)*0.5);
-        glVertex3f(x + cos(l->a_start)*1.0, 0.01, y + sin(l->a_start)*1.0);
-        glVertex3f(x + cos(l->a_start - M_PI/2.0)*0.5, 0.01, y + sin(l->a_start - M_PI/2.0)*0.5);
+        mesh->vertex(x + cos(l->a_start + M_PI/2.0)*0.5, 0.01, y + sin(l->a_start + M_PI/2.0)*0.5);
+        mesh->vertex(x + cos(l->a_start)*1.0, 0.01, y + sin(l->a_start)*1.0);
+        mesh->vertex(x + cos(l->a_start - M_PI/2.0)*0.5, 0.01, y + sin(l->a_start - M_PI/2.0)*0.5);
       } else if (l->type == EXIT) {
-        glColor3f(1.0, 0.0, 0.0);
+        mesh->color(1.0, 0.0, 0.0);
         double x = l->x_end + cos(l->a_end + M_PI)*2.0;
         double y = l->y_end + sin(l->a_end + M_PI)*2.0;
-        glVertex3f(x + cos(l->a_end + M_PI/2.0)*0.5, 0.01, y + sin(l->a_end + M_PI/2.0)*0.5);
-        glVertex3f(x + cos(l->a_end)*1.0, 0.01, y + sin(l->a_end)*1.0);
-        glVertex3f(x + cos(l->a_end - M_PI/2.0)*0.5, 0.01, y + sin(l->a_end - M_PI/2.0)*0.5);
+        mesh->vertex(x + cos(l->a_end + M_PI/2.0)*0.5, 0.01, y + sin(l->a_end + M_PI/2.0)*0.5);
+        mesh->vertex(x + cos(l->a_end)*1.0, 0.01, y + sin(l->a_end)*1.0);
+        mesh->vertex(x + cos(l->a_end - M_PI/2.0)*0.5, 0.01, y + sin(l->a_end - M_PI/2.0)*0.5);
       }
     }
-    glEnd();
+    mesh->end();
 
     // Draw connections
-    glBegin(GL_LINES);
-    glLineWidth(3);
-    glColor3f(0.0, 0.0, 1.0);
+    mesh->begin(GL_LINES);
+    mesh->color(0.0, 0.0, 1.0);
     for (unsigned int i = 0; i < s->lanes.size(); i++) {
       Lane *l = s->lanes[i];
       if (l->next) {
@@ -628,14 +632,14 @@ void RealisticDrawer::drawRoad()
         double y1 = l->y_end + sin(l->a_end + M_PI)*1.0;
         double x2 = l->next->x_start + cos(l->next->a_start)*1.0;
         double y2 = l->next->y_start + sin(l->next->a_start)*1.0;
-        glVertex3f(x1, 0.01, y1);
-        glVertex3f(x2, 0.01, y2);
+        mesh->vertex(x1, 0.01, y1);
+        mesh->vertex(x2, 0.01, y2);
       }
     }
-    glEnd();
+    mesh->end();
 
     // Draw merge direction
-    glColor3f(1.0, 1.0, 1.0);
+    mesh->color(1.0, 1.0, 1.0);
     for (unsigned int i = 0; i < s->lanes.size(); i++) {
       Lane *l = s->lanes[i];
       if (l->merge_direction != 0) {
@@ -645,25 +649,25 @@ void RealisticDrawer::drawRoad()
         }
         double x = l->x_end + cos(l->a_end + M_PI)*2.0;
         double y = l->y_end + sin(l->a_end + M_PI)*2.0;
-        glPushMatrix();
-        glTranslatef(x, 0.0, y);
-        glRotatef((a - l->a_end)*180.0/M_PI, 0.0, 1.0, 0.0);
+        mesh->push();
+        mesh->translate(x, 0.0, y);
+        mesh->rotate((a - l->a_end)*180.0/M_PI);
 
-        glBegin(GL_TRIANGLES);
-        glVertex3f(-0.5, 0.01, 0.2);
-        glVertex3f(0.3, 0.01, 0.2);
-        glVertex3f(0.3, 0.01, -0.2);
+        mesh->begin(GL_TRIANGLES);
+        mesh->vertex(-0.5, 0.01, 0.2);
+        mesh->vertex(0.3, 0.01, 0.2);
+        mesh->vertex(0.3, 0.01, -0.2);
 
-        glVertex3f(0.3, 0.01, 0.5);
-        glVertex3f(0.6, 0.01, 0.0);
-        glVertex3f(0.3, 0.01, -0.5);
+        mesh->vertex(0.3, 0.01, 0.5);
+        mesh->vertex(0.6, 0.01, 0.0);
+        mesh->vertex(0.3, 0.01, -0.5);
 
-        glVertex3f(-0.5, 0.01, 0.2);
-        glVertex3f(0.3, 0.01, -0.2);
-        glVertex3f(-0.5, 0.01, -0.2);
-        glEnd();
+        mesh->vertex(-0.5, 0.01, 0.2);
+        mesh->vertex(0.3, 0.01, -0.2);
+        mesh->vertex(-0.5, 0.01, -0.2);
+        mesh->end();
 
-        glPopMatrix();
+        mesh->pop();
       }
     }
   }
@@ -671,7 +675,7 @@ void RealisticDrawer::drawRoad()
   return;
 }
 
-void RealisticDrawer::drawEnvironment()
+void RealisticDrawer::buildEnvironment()
 {
   double lx1 = terrain_xmin + 0.3*(terrain_xmax-terrain_xmin);
   double ly1 = terrain_ymin + 0.3*(terrain_ymax-terrain_ymin);
@@ -682,8 +686,11 @@ void RealisticDrawer::drawEnvironment()
   double d1 = (terrain_xmax-terrain_xmin)/5.0;
   double d2 = (terrain_xmax-terrain_xmin)/3.0;
 
+  // The same colors whether the terrain was computed or cached
+  random_state = seed;
+  mesh->layer(RoadMesh::TERRAIN);
   for (unsigned int j=0; j < TERRAIN_RESOLUTION-1; j++) {
-    glBegin(GL_TRIANGLE_STRIP);
+    mesh->begin(GL_TRIANGLE_STRIP);
     double y1 = GET_TERRAIN_Y(j);
     double y2 = GET_TERRAIN_Y(j+1);
     for (unsigned int i=0; i < TERRAIN_RESOLUTION; i++) {
@@ -705,284 +712,23 @@ void RealisticDrawer::drawEnvironment()
       if (this->weather & RAIN)
         a = 0.3;
       
-      glColor3f(a*(60.0/255.0 + f), a*(74.0/255.0 + random_uniform()*50.0/255.0 + f), a*(14.0/255.0 + f));
-      glVertex3f(x, z1, y1);
-      glColor3f(a*(60.0/255.0 + f), a*(74.0/255.0 + random_uniform()*50.0/255.0 + f), a*(14.0/255.0 + f));
-      glVertex3f(x, z2, y2);
+      mesh->color(a*(60.0/255.0 + f), a*(74.0/255.0 + random_uniform()*50.0/255.0 + f), a*(14.0/255.0 + f));
+      mesh->vertex(x, z1, y1);
+      mesh->color(a*(60.0/255.0 + f), a*(74.0/255.0 + random_uniform()*50.0/255.0 + f), a*(14.0/255.0 + f));
+      mesh->vertex(x, z2, y2);
     }
-    glEnd();
+    mesh->end();
   }
 
   return;
 }
 
-#define LIGHT_HEIGHT 2.0
-#define LIGHT_SIDE   0.07
-#define LIGHT_BOX_HEIGHT 0.6
-#define LIGHT_BOX_SIDE 0.17
-#define SPEED_RADIUS 1.0
-#define SPEED_HEIGHT 10.0
-
-void RealisticDrawer::draw()
+void RealisticDrawer::draw(const Snapshot *snapshot)
 {
-  char str[30];
-
-  // Draw the road actuators
-  for (unsigned int i = 0; i < map->actuators.size(); i++) {
-    RoadActuator *a = map->actuators[i];
-    Lane *l = a->lane;
-    double x1, y1, f, yaw;
-    color_t color;
-    
-    switch (a->type) {
-    case TRAFFICLIGHT:
-      if (l->segment->geometry == STRAIGHT) {
-        x1 = l->x_start + cos(l->a_start)*a->position + cos(l->a_start + M_PI/2.0)*map->lane_width/2.0;
-        y1 = l->y_start + sin(l->a_start)*a->position + sin(l->a_start + M_PI/2.0)*map->lane_width/2.0;
-        yaw = l->a_start - M_PI/2.0;
-      } else {
-        f = (l->segment->angle < 0.0)?-1.0:1.0;
-        x1 = l->xc - cos(l->angle_start + f*a->position)*(l->radius-f*map->lane_width/2.0);
-        y1 = l->yc - sin(l->angle_start + f*a->position)*(l->radius-f*map->lane_width/2.0);
-        yaw = l->angle_start + f*a->position + ((f < 0.0)?0.0:M_PI);
-      }
-
-      glPushMatrix();
-      glTranslatef(x1,LIGHT_HEIGHT/2.0,y1);
-      glRotatef(-(yaw/M_PI)*180.0, 0.0, 1.0, 0.0);
-      glScalef(LIGHT_SIDE,LIGHT_HEIGHT,LIGHT_SIDE);
-      glColor3f(0.0,0.0,0.0);
-      glutSolidCube(1.0);
-      glPopMatrix();
-
-      glPushMatrix();
-      glTranslatef(x1,LIGHT_HEIGHT+LIGHT_BOX_HEIGHT/2.0,y1);
-      glRotatef(-(yaw/M_PI)*180.0, 0.0, 1.0, 0.0);
-      glScalef(LIGHT_BOX_SIDE,LIGHT_BOX_HEIGHT,LIGHT_BOX_SIDE);
-      glColor3f(0.0,0.0,0.0);
-      glutSolidCube(1.0);
-      glPopMatrix();
-
-      color = (static_cast<TrafficLightActuator *>(a))->color();
-      if (color == GREEN) glColor3f(0.0,1.0,0.0);
-      else glColor3f(0.0,0.3,0.0);
-      glPushMatrix();
-      glTranslatef(x1,LIGHT_HEIGHT+2.0*LIGHT_BOX_HEIGHT/3.0,y1);
-      glRotatef(-(yaw/M_PI)*180.0, 0.0, 1.0, 0.0);
-      glTranslatef(0.0, 0.0, -LIGHT_BOX_SIDE/2.0*0.9);
-      glScalef(LIGHT_BOX_SIDE*0.4,LIGHT_BOX_SIDE*0.4, 0.05);
-      glutSolidSphere(1.0,8,8);
-      glPopMatrix();
-
-      if (color == RED) glColor3f(1.0,0.0,0.0);
-      else glColor3f(0.3,0.0,0.0);
-      glPushMatrix();
-      glTranslatef(x1,LIGHT_HEIGHT+1.0*LIGHT_BOX_HEIGHT/3.0,y1);
-      glRotatef(-(yaw/M_PI)*180.0, 0.0, 1.0, 0.0);
-      glTranslatef(0.0, 0.0, -LIGHT_BOX_SIDE/2.0*0.9);
-      glScalef(LIGHT_BOX_SIDE*0.4,LIGHT_BOX_SIDE*0.4, 0.05);
-      glutSolidSphere(1.0,8,8);
-      glPopMatrix();
-      
-      break;
-    case SPEEDLIMIT:
-      if (l->segment->geometry == STRAIGHT) {
-        x1 = l->x_start + cos(l->a_start)*a->position;
-        y1 = l->y_start + sin(l->a_start)*a->position;
-        yaw = l->a_start;
-      } else {
-        f = (l->segment->angle < 0.0)?-1.0:1.0;
-        x1 = l->xc - cos(l->angle_start + f*a->position)*l->radius;
-        y1 = l->yc - sin(l->angle_start + f*a->position)*l->radius;
-        yaw = l->angle_start + f*a->position + ((f < 0.0)?0.0:M_PI) + M_PI/2.0;
-      }
-
-      glPushMatrix();
-      glTranslatef(x1,SPEED_HEIGHT,y1);
-      glRotatef(-(yaw/M_PI)*180.0, 0.0, 1.0, 0.0);
-      glColor3f(1.0,0.0,0.0);
-      glBegin(GL_QUAD_STRIP);
-      for (double b = 0.0; b < 2.0*M_PI; b+=M_PI/8) {
-        glVertex3f(0.0, sin(b)*SPEED_RADIUS, cos(b)*SPEED_RADIUS);
-        glVertex3f(0.0, sin(b)*SPEED_RADIUS*0.8, cos(b)*SPEED_RADIUS*0.8);
-      }
-      glVertex3f(0.0, 0.0, SPEED_RADIUS);
-      glVertex3f(0.0, 0.0, SPEED_RADIUS*0.8);
-      glEnd();
-      glColor3f(1.0,1.0,1.0);
-      glBegin(GL_TRIANGLE_FAN);
-      glVertex3f(0.0, 0.0, 0.0);
-      for (double b = 0.0; b < 2.0*M_PI; b+=M_PI/8) {
-        glVertex3f(0.0, sin(b)*SPEED_RADIUS*0.8, cos(b)*SPEED_RADIUS*0.8);
-      }
-      glVertex3f(0.0, 0.0, SPEED_RADIUS*0.8);
-      glEnd();
-      glColor3f(0.0, 0.0, 0.0);
-      glTranslatef(-0.02, 0.0, 0.0);
-      glRotatef(-90, 1.0, 0.0, 0.0);
-      glRotatef(90, 0.0, 0.0, 1.0);
-      snprintf(str, 30, "%.0f", a->lane->maximum_speed*3.6);
-      drawText(0.0, 0.0, 0.0, 0.0, SPEED_RADIUS*0.5, 0.0, 0.0, SPEED_RADIUS*0.05, str);
-      glPopMatrix();
-
-      glPushMatrix();
-      glTranslatef(x1,SPEED_HEIGHT-SPEED_RADIUS*2.0,y1);
-      glRotatef(-(yaw/M_PI)*180.0, 0.0, 1.0, 0.0);
-      glColor3f(1.0,1.0,1.0);
-      glBegin(GL_QUAD_STRIP);
-      for (double b = 0.0; b < 2.0*M_PI; b+=M_PI/8) {
-        glVertex3f(0.0, sin(b)*SPEED_RADIUS*0.8, cos(b)*SPEED_RADIUS*0.8);
-        glVertex3f(0.0, sin(b)*SPEED_RADIUS*0.8*0.8, cos(b)*SPEED_RADIUS*0.8*0.8);
-      }
-      glVertex3f(0.0, 0.0, SPEED_RADIUS*0.8);
-      glVertex3f(0.0, 0.0, SPEED_RADIUS*0.8*0.8);
-      glEnd();
-      glColor3f(0.0,0.0,1.0);
-      glBegin(GL_TRIANGLE_FAN);
-      glVertex3f(0.0, 0.0, 0.0);
-      for (double b = 0.0; b < 2.0*M_PI; b+=M_PI/8) {
-        glVertex3f(0.0, sin(b)*SPEED_RADIUS*0.8*0.8, cos(b)*SPEED_RADIUS*0.8*0.8);
-      }
-      glVertex3f(0.0, 0.0, SPEED_RADIUS*0.8*0.8);
-      glEnd();
-      glColor3f(1.0, 1.0, 1.0);
-      glTranslatef(-0.02, 0.0, 0.0);
-      glRotatef(-90, 1.0, 0.0, 0.0);
-      glRotatef(90, 0.0, 0.0, 1.0);
-      snprintf(str, 30, "%.0f", a->lane->minimum_speed*3.6);
-      drawText(0.0, 0.0, 0.0, 0.0, SPEED_RADIUS*0.8*0.5, 0.0, 0.0, SPEED_RADIUS*0.8*0.05, str);
-      glPopMatrix();
-
-      break;
-    }
-  }
-
-  // Draw the road sensors
-  for (unsigned int i = 0; i < map->sensors.size(); i++) {
-    RoadSensor *r = map->sensors[i];
-    Lane *l = r->lane;
-    double x1, y1, x2, y2, f, x, y, yaw;
-    
-    switch (r->type) {
-    case DENSITY:
-      glBegin(GL_LINES);
-      glLineWidth(3.0f);
-
-      if (l->segment->geometry == STRAIGHT) {
-        x1 = l->x_start + cos(l->a_start)*r->position + cos(l->a_start + M_PI/2.0)*map->lane_width/2.0;
-        x2 = l->x_start + cos(l->a_start)*r->position + cos(l->a_start - M_PI/2.0)*map->lane_width/2.0;
-        y1 = l->y_start + sin(l->a_start)*r->position + sin(l->a_start + M_PI/2.0)*map->lane_width/2.0;
-        y2 = l->y_start + sin(l->a_start)*r->position + sin(l->a_start - M_PI/2.0)*map->lane_width/2.0;
-        yaw = -l->a_start + M_PI/2.0;
-        x = (x1+x2)/2.0;
-        y = (y1+y2)/2.0;
-      } else {
-        f = (l->segment->angle < 0.0)?-1.0:1.0;
-        x1 = l->xc - cos(l->angle_start + f*r->position)*(l->radius+map->lane_width/2.0);
-        x2 = l->xc - cos(l->angle_start + f*r->position)*(l->radius-map->lane_width/2.0);
-        y1 = l->yc - sin(l->angle_start + f*r->position)*(l->radius+map->lane_width/2.0);
-        y2 = l->yc - sin(l->angle_start + f*r->position)*(l->radius-map->lane_width/2.0);
-        yaw = -(l->angle_start + f*r->position) + ((f < 0.0)?0.0:M_PI);
-        x = (x1+x2)/2.0;
-        y = (y1+y2)/2.0;
-      }
-      if (r->wasEntryTriggered())
-        glColor3f(0.0, 1.0, 1.0);
-      else
-        glColor3f(0.0, 0.5, 0.5);
-      glVertex3f(x1, 0.01, y1);
-      glVertex3f(x2, 0.01, y2);
-
-      
-      if (l->segment->geometry == STRAIGHT) {
-        x1 = l->x_start + cos(l->a_start)*r->position2 + cos(l->a_start + M_PI/2.0)*map->lane_width/2.0;
-        x2 = l->x_start + cos(l->a_start)*r->position2 + cos(l->a_start - M_PI/2.0)*map->lane_width/2.0;
-        y1 = l->y_start + sin(l->a_start)*r->position2 + sin(l->a_start + M_PI/2.0)*map->lane_width/2.0;
-        y2 = l->y_start + sin(l->a_start)*r->position2 + sin(l->a_start - M_PI/2.0)*map->lane_width/2.0;
-      } else {
-        f = (l->segment->angle < 0.0)?-1.0:1.0;
-        x1 = l->xc - cos(l->angle_start + f*r->position2)*(l->radius+map->lane_width/2.0);
-        x2 = l->xc - cos(l->angle_start + f*r->position2)*(l->radius-map->lane_width/2.0);
-        y1 = l->yc - sin(l->angle_start + f*r->position2)*(l->radius+map->lane_width/2.0);
-        y2 = l->yc - sin(l->angle_start + f*r->position2)*(l->radius-map->lane_width/2.0);
-      }
-      if (r->wasExitTriggered())
-        glColor3f(0.0, 1.0, 1.0);
-      else
-        glColor3f(0.0, 0.5, 0.5);
-      glVertex3f(x1, 0.01, y1);
-      glVertex3f(x2, 0.01, y2);
-
-      glEnd();
-
-      glColor3f(0.0, 1.0, 1.0);
-      snprintf(str, 30, "%.0f veh/km", r->getResult());
-      drawText(x, 0.02, y, yaw, 0.2, 0.0, 0.0, -0.1, str);
-
-      break;
-    case SPEED:
-      if (r->wasTriggered())
-        glColor3f(1.0, 0.0, 0.0);
-      else
-        glColor3f(0.5, 0.0, 0.0);
-      glBegin(GL_LINE_LOOP);
-      glLineWidth(3.0f);
-
-      if (l->segment->geometry == STRAIGHT) {
-        x1 = l->x_start + cos(l->a_start)*r->position;
-        y1 = l->y_start + sin(l->a_start)*r->position;
-        yaw = -l->a_start + M_PI/2.0;
-      } else {
-        f = (l->segment->angle < 0.0)?-1.0:1.0;
-        x1 = l->xc - cos(l->angle_start + f*r->position)*l->radius;
-        y1 = l->yc - sin(l->angle_start + f*r->position)*l->radius;
-        yaw = -(l->angle_start + f*r->position) + ((f < 0.0)?0.0:M_PI);
-      }
-
-      for (double a = 0.0; a < 2.0*M_PI; a+=M_PI/8) {
-        glVertex3f(x1+cos(a)*map->lane_width/4.0, 0.01, y1+sin(a)*map->lane_width/4.0);
-      }
-
-      glEnd();
-
-      glColor3f(1.0, 0.0, 0.0);
-      snprintf(str, 30, "%.0f km/h", r->getResult());
-      drawText(x1, 0.02, y1, yaw, 0.2, 0.0, 0.0, -map->lane_width/4.0-0.1, str);
+  // The snapshot can be from the previous map until the next one
+  if (snapshot->map != map) return;
 
-      break;
-    case FLOW:
-      if (r->wasTriggered())
-        glColor3f(1.0, 1.0, 0.0);
-      else
-        glColor3f(0.5, 0.5, 0.0);
-      glBegin(GL_POLYGON);
-
-      if (l->segment->geometry == STRAIGHT) {
-        x1 = l->x_start + cos(l->a_start)*r->position;
-        y1 = l->y_start + sin(l->a_start)*r->position;
-        yaw = -l->a_start + M_PI/2.0;
-      } else {
-        f = (l->segment->angle < 0.0)?-1.0:1.0;
-        x1 = l->xc - cos(l->angle_start + f*r->position)*l->radius;
-        y1 = l->yc - sin(l->angle_start + f*r->position)*l->radius;
-        yaw = -(l->angle_start + f*r->position) + ((f < 0.0)?0.0:M_PI);
-      }
-
-      for (double a = 0.0; a < 2.0*M_PI; a+=M_PI/8) {
-        glVertex3f(x1+cos(a)*map->lane_width/8.0, 0.01, y1+sin(a)*map->lane_width/8.0);
-      }
-
-      glEnd();
-
-      glColor3f(1.0, 1.0, 0.0);
-      snprintf(str, 30, "%.0f veh/h", r->getResult());
-      drawText(x1, 0.02, y1, yaw, 0.2, 0.0, 0.0, map->lane_width/8.0+0.1, str);
-
-      break;
-    }
-  }
-
-  return;
+  devices->draw(snapshot);
 }
 
 #define BOTTOM 0.5f
@@ -1098,60 +844,6 @@ void RealisticDrawer::drawSkybox()
   glPopMatrix();
 }
 
-void RealisticDrawer::renderBitmapString(float x, float y, float z, void *font, char *string)
-{  
-  char *c;
-  glRasterPos3f(x, y, z);
-  for (c=string; *c != '\0'; c++) {
-    glutBitmapCharacter(font, *c);
-  }
-}
-
-void RealisticDrawer::drawText(float x, float y, float z, float angle, float size, const char *text)
-{
-  drawText(x, y, z, angle, size, 0.0, 0.0, 0.0, text);
-}
-
-// Draw a text box
-void RealisticDrawer::drawText(float x, float y, float z, float angle, float size, float offset_x, float offset_y, float offset_z, const char *text)
-{
-  int i, count;
-  float sx, sy;
-
-  // Compute the scale factors in x/y directions, based on the 'M'
-  // character.
-  sx = glutStrokeWidth(GLUT_STROKE_MONO_ROMAN, 'M');
-  sy = sx * 1.3;
-
-  glPushMatrix();
-  glTranslatef(x, y, z);
-  glRotatef(180, 0, 0, 1);
-  glRotatef(90, 1, 0, 0);
-  glRotatef(angle*180.0/M_PI, 0, 0, 1);
-  glTranslatef(offset_x, offset_z, offset_y);
-    
-  glScalef(size / sx, size / sy, 1);
-  glTranslatef(0, -sy/2.0, 0);
-  glTranslatef(-sx*(float)strlen(text)/2.0, 0.0, 0);
-
-  for (i = 0, count = 0; i < (int) strlen(text); i++, count++)
-  {
-    if (text[i] == '\n')
-    {
-      glTranslatef(-count*sx, -sy, 0);
-      count = 0;      
-    }
-    else
-    {
-      glutStrokeCharacter(GLUT_STROKE_MONO_ROMAN, text[i]);
-    }
-  }
-
-  glPopMatrix();
-
-  return;
-}
-
 #define FAULT_ITERATIONS 100
 #define DZ_N   1.0
 #define DZ_0  20.0
@@ -1327,9 +1019,89 @@ void RealisticDrawer::computeTerrain()
   }
 }
 
+#define TERRAIN_CACHE_MAGIC "DISIMTER"
+#define TERRAIN_CACHE_VERSION 1
+
+int RealisticDrawer::terrainCache(char *filename, size_t size, terrain_header_t *header)
+{
+  if (!options->cache_path_arg || !options->cache_path_arg[0]) return -1;
+
+  struct stat st;
+  if (stat(options->map_arg, &st)) return -1;
+
+  // One file per map (FNV-1a hash of its path)
+  unsigned int hash = 2166136261u;
+  for (const char *c = options->map_arg; *c; c++) {
+    hash = (hash ^ (unsigned char)*c) * 16777619u;
+  }
+  snprintf(filename, size, "%s/disim-terrain-%08x.bin", options->cache_path_arg, hash);
+
+  memset(header, 0, sizeof(terrain_header_t));
+  memcpy(header->magic, TERRAIN_CACHE_MAGIC, sizeof(header->magic));
+  header->version = TERRAIN_CACHE_VERSION;
+  header->resolution = TERRAIN_RESOLUTION;
+  header->seed = seed;
+  header->map_size = st.st_size;
+  header->map_mtime = st.st_mtime;
+  return 0;
+}
+
+int RealisticDrawer::loadTerrain()
+{
+  char filename[256];
+  terrain_header_t expected, header;
+  if (terrainCache(filename, sizeof(filename), &expected)) return -1;
+
+  FILE *f = fopen(filename, "rb");
+  if (!f) return -1;
+  int ok = fread(&header, sizeof(header), 1, f) == 1 &&
+    !memcmp(header.magic, expected.magic, sizeof(header.magic)) &&
+    header.version == expected.version && header.resolution == expected.resolution &&
+    header.seed == expected.seed && header.map_size == expected.map_size &&
+    header.map_mtime == expected.map_mtime &&
+    fread(terrain, sizeof(terrain), 1, f) == 1;
+  fclose(f);
+  if (!ok) {
+    Log::getStream(5) << "Terrain cache " << filename << " is stale" << endl;
+    return -1;
+  }
+
+  terrain_xmin = header.xmin;
+  terrain_xmax = header.xmax;
+  terrain_ymin = header.ymin;
+  terrain_ymax = header.ymax;
+  Log::getStream(5) << "Terrain loaded from " << filename << endl;
+  return 0;
+}
+
+void RealisticDrawer::saveTerrain()
+{
+  char filename[256], temporary[264];
+  terrain_header_t header;
+  if (terrainCache(filename, sizeof(filename), &header)) return;
+  header.xmin = terrain_xmin;
+  header.xmax = terrain_xmax;
+  header.ymin = terrain_ymin;
+  header.ymax = terrain_ymax;
+
+  // Written aside and renamed, so that a concurrent run never reads half a file
+  snprintf(temporary, sizeof(temporary), "%s.%d", filename, (int)getpid());
+  FILE *f = fopen(temporary, "wb");
+  if (!f) {
+    fprintf(stderr, "Warning: Unable to write the terrain cache %s.\n", temporary);
+    return;
+  }
+  int ok = fwrite(&header, sizeof(header), 1, f) == 1 && fwrite(terrain, sizeof(terrain), 1, f) == 1;
+  if (fclose(f) || !ok || rename(temporary, filename)) {
+    fprintf(stderr, "Warning: Unable to write the terrain cache %s.\n", filename);
+    unlink(temporary);
+  }
+}
+
 double RealisticDrawer::random_uniform()
 {
-  return (double)rand()/(double)RAND_MAX;
+  // Its own generator, so that the terrain does not change the simulation
+  return (double)rand_r(&random_state)/(double)RAND_MAX;
 }
 
 void RealisticDrawer::setWeather(int w)
@@ -9,6 +9,9 @@
 #include <cmdline.h>
 #include <map/Map.h>
 #include "TextureManager.h"
+#include "RoadMesh.h"
+#include "DeviceOverlay.h"
+#include "Snapshot.h"
 
 #define TERRAIN_RESOLUTION 256
 
@@ -18,24 +21,38 @@ class RealisticDrawer
   RealisticDrawer(gengetopt_args_info *options, Map *map);
   ~RealisticDrawer();
   void reset();
-  int predraw();
+  void predraw();
+  void drawRoad();
   void drawSkybox();
-  void draw();
+  void draw(const Snapshot *snapshot);
   double getTerrainHeight(double x, double y);
   void setWeather(int w);
   void update(double dt);
 
  private:
-  void drawRoad();
-  void drawEnvironment();
-  void renderBitmapString(float x, float y, float z, void *font, char *string);
-  void drawText(float x, float y, float z, float angle, float size, float offset_x, float offset_y, float offset_z, const char *text);
-  void drawText(float x, float y, float z, float angle, float size, const char *text);
+  typedef struct {
+    char magic[8];
+    int version;
+    int resolution;
+    unsigned int seed;
+    long long map_size;
+    long long map_mtime;
+    double xmin, xmax, ymin, ymax;
+  } terrain_header_t;
+
+  void buildRoad();
+  void buildEnvironment();
   void computeTerrain();
+  int terrainCache(char *filename, size_t size, terrain_header_t *header);
+  int loadTerrain();
+  void saveTerrain();
   double random_uniform();
 
-  // drawing list
-  int roadList;
+  // static geometry of the road and of the terrain
+  RoadMesh *mesh;
+
+  // road actuators and sensors
+  DeviceOverlay *devices;
   
   // texture
   TextureManager *textureManager;
@@ -53,6 +70,8 @@ class RealisticDrawer
   double terrain_ymin;
   double terrain_ymax;
   double terrain[TERRAIN_RESOLUTION][TERRAIN_RESOLUTION]; // z in function of x,y indices
+  unsigned int seed;
+  unsigned int random_state;
 
   // weather conditions
   int weather;
@@ -0,0 +1,343 @@
+#define GL_GLEXT_PROTOTYPES
+#include "RoadMesh.h"
+#ifdef MAC
+#include <OpenGL/glext.h>
+#else
+#include <GL/glext.h>
+#endif
+#include <float.h>
+#include <math.h>
+#include <stdio.h>
+#include <stddef.h>
+#include <utils/Log.h>
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+static GLubyte toByte(double c)
+{
+  // As glColor() would clamp it
+  if (c < 0.0) return 0;
+  if (c > 1.0) return 255;
+  return (GLubyte)(c*255.0 + 0.5);
+}
+
+RoadMesh::RoadMesh()
+{
+  buffer = 0;
+  uploaded = false;
+  checked = false;
+  buffers = false;
+  clear();
+}
+
+RoadMesh::~RoadMesh()
+{
+  clear();
+}
+
+void RoadMesh::clear()
+{
+  if (buffers && buffer) glDeleteBuffers(1, &buffer);
+  buffer = 0;
+  uploaded = false;
+  checked = false;
+
+  grid.clear();
+  chunks.clear();
+  vertices.clear();
+  primitive.clear();
+  stack.clear();
+
+  current_layer = MARKINGS;
+  mode = GL_TRIANGLES;
+  current.u = current.v = 0.0f;
+  current.color[0] = current.color[1] = current.color[2] = current.color[3] = 255;
+  transform.x = transform.y = transform.z = 0.0;
+  transform.c = 1.0;
+  transform.s = 0.0;
+}
+
+bool RoadMesh::empty()
+{
+  return chunks.empty();
+}
+
+void RoadMesh::layer(layer_t l)
+{
+  current_layer = l;
+}
+
+void RoadMesh::begin(GLenum mode)
+{
+  this->mode = mode;
+  primitive.clear();
+}
+
+void RoadMesh::color(double r, double g, double b, double a)
+{
+  current.color[0] = toByte(r);
+  current.color[1] = toByte(g);
+  current.color[2] = toByte(b);
+  current.color[3] = toByte(a);
+}
+
+void RoadMesh::texCoord(double u, double v)
+{
+  current.u = u;
+  current.v = v;
+}
+
+void RoadMesh::vertex(double x, double y, double z)
+{
+  vertex_t v = current;
+  v.x = transform.x + transform.c*x + transform.s*z;
+  v.y = transform.y + y;
+  v.z = transform.z - transform.s*x + transform.c*z;
+  primitive.push_back(v);
+}
+
+void RoadMesh::push()
+{
+  stack.push_back(transform);
+}
+
+void RoadMesh::pop()
+{
+  if (stack.empty()) return;
+  transform = stack.back();
+  stack.pop_back();
+}
+
+void RoadMesh::translate(double x, double y, double z)
+{
+  transform.x += transform.c*x + transform.s*z;
+  transform.y += y;
+  transform.z += -transform.s*x + transform.c*z;
+}
+
+void RoadMesh::rotate(double angle)
+{
+  double c = cos(angle*M_PI/180.0);
+  double s = sin(angle*M_PI/180.0);
+  double t = transform.c*c - transform.s*s;
+  transform.s = transform.s*c + transform.c*s;
+  transform.c = t;
+}
+
+void RoadMesh::end()
+{
+  vertex_t t[3];
+  int n = primitive.size();
+  const vertex_t *p = primitive.empty() ? NULL : &primitive[0];
+
+  // Everything becomes independent triangles (or lines)
+  switch (mode) {
+  case GL_LINES:
+    for (int i = 0; i+1 < n; i += 2) addPrimitive(p+i, 2, LINES);
+    break;
+  case GL_TRIANGLES:
+    for (int i = 0; i+2 < n; i += 3) addPrimitive(p+i, 3, current_layer);
+    break;
+  case GL_QUADS:
+    for (int i = 0; i+3 < n; i += 4) {
+      t[0] = p[i]; t[1] = p[i+1]; t[2] = p[i+2];
+      addPrimitive(t, 3, current_layer);
+      t[1] = p[i+2]; t[2] = p[i+3];
+      addPrimitive(t, 3, current_layer);
+    }
+    break;
+  case GL_TRIANGLE_STRIP:
+  case GL_QUAD_STRIP:
+    for (int i = 2; i < n; i++) {
+      // Keep the winding of the odd triangles
+      t[0] = p[(i & 1) ? i-1 : i-2];
+      t[1] = p[(i & 1) ? i-2 : i-1];
+      t[2] = p[i];
+      addPrimitive(t, 3, current_layer);
+    }
+    break;
+  case GL_TRIANGLE_FAN:
+  case GL_POLYGON:
+    for (int i = 2; i < n; i++) {
+      t[0] = p[0]; t[1] = p[i-1]; t[2] = p[i];
+      addPrimitive(t, 3, current_layer);
+    }
+    break;
+  default:
+    Log::getStream(5) << "RoadMesh: unsupported primitive " << mode << endl;
+    break;
+  }
+  primitive.clear();
+}
+
+void RoadMesh::addPrimitive(const vertex_t *v, int n, layer_t l)
+{
+  // The chunk of its center
+  double x = 0.0, z = 0.0;
+  for (int i = 0; i < n; i++) {
+    x += v[i].x;
+    z += v[i].z;
+  }
+  pair<int, int> key((int)floor(x/(double)n/CHUNK_SIZE), (int)floor(z/(double)n/CHUNK_SIZE));
+
+  std::map<pair<int, int>, int>::iterator it = grid.find(key);
+  int k;
+  if (it == grid.end()) {
+    k = chunks.size();
+    grid[key] = k;
+    chunks.push_back(chunk_t());
+    for (int j = 0; j < 3; j++) {
+      chunks[k].min[j] = FLT_MAX;
+      chunks[k].max[j] = -FLT_MAX;
+    }
+  } else {
+    k = it->second;
+  }
+
+  chunk_t *c = &chunks[k];
+  for (int i = 0; i < n; i++) {
+    const GLfloat p[3] = {v[i].x, v[i].y, v[i].z};
+    for (int j = 0; j < 3; j++) {
+      if (p[j] < c->min[j]) c->min[j] = p[j];
+      if (p[j] > c->max[j]) c->max[j] = p[j];
+    }
+    c->vertices[l].push_back(v[i]);
+  }
+}
+
+void RoadMesh::upload()
+{
+  if (!checked) {
+    int major = 1, minor = 0;
+    const char *version = (const char *)glGetString(GL_VERSION);
+    if (version) sscanf(version, "%d.%d", &major, &minor);
+    buffers = major > 1 || minor >= 5;
+    checked = true;
+  }
+
+  // The chunks in the order of the grid, so that neighbors are often
+  // consecutive in the buffer and drawn with one call
+  vector<chunk_t> sorted(chunks.size());
+  int k = 0;
+  for (std::map<pair<int, int>, int>::iterator it = grid.begin(); it != grid.end(); it++, k++) {
+    chunk_t *c = &chunks[it->second];
+    for (int j = 0; j < 3; j++) {
+      sorted[k].min[j] = c->min[j];
+      sorted[k].max[j] = c->max[j];
+    }
+    for (int l = 0; l < NLAYERS; l++) sorted[k].vertices[l].swap(c->vertices[l]);
+    it->second = k;
+  }
+  chunks.swap(sorted);
+
+  vertices.clear();
+  for (int l = 0; l < NLAYERS; l++) {
+    for (unsigned int i = 0; i < chunks.size(); i++) {
+      chunk_t *c = &chunks[i];
+      c->first[l] = vertices.size();
+      c->count[l] = c->vertices[l].size();
+      vertices.insert(vertices.end(), c->vertices[l].begin(), c->vertices[l].end());
+      vector<vertex_t>().swap(c->vertices[l]);
+    }
+  }
+
+  if (buffers && !vertices.empty()) {
+    if (!buffer) glGenBuffers(1, &buffer);
+    glBindBuffer(GL_ARRAY_BUFFER, buffer);
+    glBufferData(GL_ARRAY_BUFFER, vertices.size()*sizeof(vertex_t), &vertices[0], GL_STATIC_DRAW);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    // The copy in the client memory is not needed anymore
+    vector<vertex_t>().swap(vertices);
+  }
+  uploaded = true;
+
+  Log::getStream(5) << "Road mesh: " << chunks.size() << " chunks in " << (buffers ? "a vertex buffer" : "vertex arrays") << endl;
+}
+
+const GLvoid *RoadMesh::bind(const void *data)
+{
+  // Offsets in the buffer object, or pointers to the client memory
+  if (buffers) {
+    glBindBuffer(GL_ARRAY_BUFFER, buffer);
+    return NULL;
+  }
+  return data;
+}
+
+bool RoadMesh::visible(const chunk_t *c, const GLdouble planes[6][4])
+{
+  for (int i = 0; i < 6; i++) {
+    // The corner of the box the farthest along the normal of the plane
+    double x = planes[i][0] > 0.0 ? c->max[0] : c->min[0];
+    double y = planes[i][1] > 0.0 ? c->max[1] : c->min[1];
+    double z = planes[i][2] > 0.0 ? c->max[2] : c->min[2];
+    if (planes[i][0]*x + planes[i][1]*y + planes[i][2]*z + planes[i][3] < 0.0) return false;
+  }
+  return true;
+}
+
+void RoadMesh::draw(const GLuint *textures)
+{
+  if (!uploaded || chunks.empty()) return;
+
+  // The planes of the frustum from the clip matrix (projection * modelview)
+  GLdouble p[16], m[16], clip[16], planes[6][4];
+  glGetDoublev(GL_PROJECTION_MATRIX, p);
+  glGetDoublev(GL_MODELVIEW_MATRIX, m);
+  for (int i = 0; i < 4; i++) {
+    for (int j = 0; j < 4; j++) {
+      clip[4*i+j] = m[4*i]*p[j] + m[4*i+1]*p[4+j] + m[4*i+2]*p[8+j] + m[4*i+3]*p[12+j];
+    }
+  }
+  for (int i = 0; i < 3; i++) {
+    for (int j = 0; j < 4; j++) {
+      planes[2*i][j]   = clip[4*j+3] + clip[4*j+i];
+      planes[2*i+1][j] = clip[4*j+3] - clip[4*j+i];
+    }
+  }
+
+  vector<bool> in(chunks.size());
+  for (unsigned int i = 0; i < chunks.size(); i++) in[i] = visible(&chunks[i], planes);
+
+  glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+  glEnableClientState(GL_VERTEX_ARRAY);
+  glEnableClientState(GL_COLOR_ARRAY);
+  glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+  const char *base = (const char *)bind(vertices.empty() ? NULL : &vertices[0]);
+  glVertexPointer(3, GL_FLOAT, sizeof(vertex_t), base + offsetof(vertex_t, x));
+  glTexCoordPointer(2, GL_FLOAT, sizeof(vertex_t), base + offsetof(vertex_t, u));
+  glColorPointer(4, GL_UNSIGNED_BYTE, sizeof(vertex_t), base + offsetof(vertex_t, color));
+
+  for (int l = 0; l < NLAYERS; l++) {
+    GLenum primitive_mode = (l == LINES) ? GL_LINES : GL_TRIANGLES;
+    if (textures[l]) {
+      glBindTexture(GL_TEXTURE_2D, textures[l]);
+      glEnable(GL_TEXTURE_2D);
+    }
+
+    // One call per run of consecutive visible chunks
+    GLint first = 0;
+    GLsizei count = 0;
+    for (unsigned int i = 0; i < chunks.size(); i++) {
+      chunk_t *c = &chunks[i];
+      if (!in[i] || !c->count[l]) continue;
+      if (count && first + count == c->first[l]) {
+        count += c->count[l];
+        continue;
+      }
+      if (count) glDrawArrays(primitive_mode, first, count);
+      first = c->first[l];
+      count = c->count[l];
+    }
+    if (count) glDrawArrays(primitive_mode, first, count);
+
+    if (textures[l]) glDisable(GL_TEXTURE_2D);
+  }
+
+  if (buffers) glBindBuffer(GL_ARRAY_BUFFER, 0);
+  glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+  glDisableClientState(GL_COLOR_ARRAY);
+  glDisableClientState(GL_VERTEX_ARRAY);
+}
@@ -0,0 +1,129 @@
+#ifndef ROAD_MESH_H
+#define ROAD_MESH_H
+
+#ifdef MAC
+#include <GLUT/glut.h>
+#else
+#include <GL/glut.h>
+#endif
+#include <map>
+#include <vector>
+
+using namespace std;
+
+// Side of the square chunks the static geometry is split into [m]
+#define CHUNK_SIZE 250.0
+
+/**
+ * @brief Static geometry of the road network and of the terrain.
+ *
+ * The geometry is recorded once with an interface that mirrors the
+ * immediate mode of OpenGL (begin/vertex/end with the current color and
+ * texture coordinates, and push/translate/rotate around the vertical
+ * axis), so that the drawing code stays readable. The primitives are
+ * turned into triangles (or lines) in world coordinates and sorted in
+ * square chunks of CHUNK_SIZE, each with its bounding box. upload() stores
+ * everything in one vertex buffer (or in client memory when vertex buffers
+ * are not available), ordered by layer then by chunk. draw() only draws
+ * the chunks that intersect the view frustum, one call per layer and per
+ * run of consecutive visible chunks.
+ */
+class RoadMesh
+{
+ public:
+  /**
+   * The layers, in the order they are drawn.
+   */
+  typedef enum {TUNNEL = 0, ROAD, GRASS, MARKINGS, LINES, TERRAIN, NLAYERS} layer_t;
+
+  RoadMesh();
+  ~RoadMesh();
+
+  /**
+   * Discards the geometry and releases the GL objects.
+   */
+  void clear();
+
+  /**
+   * Whether some geometry was recorded.
+   */
+  bool empty();
+
+  /**
+   * Sets the layer of the following triangles (the lines always go to LINES).
+   */
+  void layer(layer_t l);
+
+  void begin(GLenum mode);
+  void end();
+  void color(double r, double g, double b, double a = 1.0);
+  void texCoord(double u, double v);
+  void vertex(double x, double y, double z);
+  void push();
+  void pop();
+  void translate(double x, double y, double z);
+
+  /**
+   * Rotates around the vertical axis (as glRotatef(angle, 0.0, 1.0, 0.0)).
+   * @param angle The angle in degrees.
+   */
+  void rotate(double angle);
+
+  /**
+   * Uploads the recorded geometry to the GL (the GL context must be current).
+   */
+  void upload();
+
+  /**
+   * Draws the chunks in the view frustum of the current projection and modelview matrices.
+   * @param textures The texture of each layer (0 for none).
+   */
+  void draw(const GLuint *textures);
+
+ private:
+  typedef struct {
+    GLfloat x, y, z;
+    GLfloat u, v;
+    GLubyte color[4];
+  } vertex_t;
+
+  typedef struct {
+    double x, y, z;  // Translation
+    double c, s;     // Rotation around the vertical axis
+  } transform_t;
+
+  typedef struct {
+    GLfloat min[3];
+    GLfloat max[3];
+    vector<vertex_t> vertices[NLAYERS];
+    GLint first[NLAYERS];
+    GLsizei count[NLAYERS];
+  } chunk_t;
+
+  void addPrimitive(const vertex_t *v, int n, layer_t l);
+  bool visible(const chunk_t *c, const GLdouble planes[6][4]);
+  const GLvoid *bind(const void *data);
+
+  // Recording
+  layer_t current_layer;
+  GLenum mode;
+  vector<vertex_t> primitive;
+  vertex_t current;
+  transform_t transform;
+  vector<transform_t> stack;
+
+  // Chunks (in the order of their grid coordinates)
+  std::map<pair<int, int>, int> grid;
+  vector<chunk_t> chunks;
+
+  // Uploaded geometry
+  vector<vertex_t> vertices;
+  GLuint buffer;
+  bool uploaded;
+
+  // GL capabilities
+  bool checked;
+  bool buffers;
+};
+
+#endif
@@ -4,12 +4,17 @@
 #include <math.h>
 #include <sys/time.h>
 #include <unistd.h>
+#include <sched.h>
 #include <assert.h>
+#include <limits.h>
 
 #include <agents/Car.h>
 #include <engine/Simulator.h>
 #include <utils/utils.h>
 #include <utils/Log.h>
+#include <utils/Stats.h>
+#include <utils/Trace.h>
+#include <utils/Memory.h>
 
 #ifdef GUI
 #include <utils/Fl_Glv_Window.H>
@@ -37,6 +42,9 @@
 #define MAPS_PATH "maps/"
 #define SCRIPTS_PATH "scripts/car/"
 #define MODELS_PATH "src/display/models/"
+#define TEXTURES_PATH "src/display/textures/"
+#define ASSETS_PATH "src/display/"
+#define ASSETS_PACK "assets.pack"
 
 /* Utilities */
 #ifndef M_PI
@@ -45,6 +53,12 @@
 #define MAX(x,y) (((x)>(y))?(x):(y))
 #define MIN(x,y) (((x)<(y))?(x):(y))
 
+/* Sleep of the GUI thread when there is nothing to draw [us] */
+#define IDLE_SLEEP 10000
+/* Speedup above which the display shows the last state instead of every step */
+#define FAST_FORWARD 10.0
+#define MAX_SPEEDUP 1000.0
+
 SimViewer::SimViewer()
 {
   /* Init flags */
@@ -54,6 +68,7 @@ SimViewer::SimViewer()
   draw_realistic = true;
   draw_skybox = false;
   draw_shadows = false;
+  draw_hud = false;
   pause = false;
   nodisplay = false;
   fast = false;
@@ -89,9 +104,29 @@ SimViewer::SimViewer()
   /* Model */
   car_model = NULL;
   truck_model = NULL;
+  vehicle_renderer = NULL;
+  hud = NULL;
+  draw_time = 0.0;
+  overview = NULL;
+  overview_mode = false;
+  overview_height = 0.0;
+  overview_metric = Overview::SPEED;
 
   /* Option windows */
   laneoptions = NULL;
+  headless = NULL;
+
+  /* Simulation thread */
+  simulation_started = false;
+  waiting = 0;
+  snapshot_period = 1.0/60.0;
+  fast_period = 0.0;
+  last_redraw = 0.0;
+  generation = 0;
+  tracked = -1;
+  follow_x = 0.0;
+  follow_z = 0.0;
+  follow_yaw = 0.0;
 #endif
 }
 
@@ -104,6 +139,7 @@ int SimViewer::parseCmdLine(int argc, char *args[])
 {
   /* Parse arguments */
   cmdline_parser(argc, args, &options);
+  if (options.memory_stats_flag) Memory::enable();
 
   /* Init logging if needed */
   Log::setVerboseLevel(options.verbose_level_arg);
@@ -168,6 +204,16 @@ int SimViewer::parseCmdLine(int argc, char *args[])
   sscanf(options.start_time_arg, "%d:%d", &h,  &m);
   start_time = h*60+m;
 
+#ifdef GUI
+  /* Overview of the traffic */
+  overview_height = options.overview_height_arg;
+  if (strcmp(options.overview_metric_arg, "density") == 0) {
+    overview_metric = Overview::DENSITY;
+  } else if (strcmp(options.overview_metric_arg, "speed") != 0) {
+    fprintf(stderr, "Warning: Unknown overview metric %s (speed or density), using the speed.\n", options.overview_metric_arg);
+  }
+#endif
+
   return 0;
 }
 
@@ -217,6 +263,7 @@ void SimViewer::UTF8toASCII(char *str, char *newstr)
 #ifdef GUI
 int SimViewer::initGUI(int cols, int rows)
 {
+  Memory::Scope scope(Memory::MEM_GUI);
   int fast_flag = FL_MENU_TOGGLE;
   int pause_flag = FL_MENU_TOGGLE;
   int rain_flag = FL_MENU_TOGGLE;
@@ -252,7 +299,8 @@ int SimViewer::initGUI(int cols, int rows)
         {"Show grid", 0, (Fl_Callback*)SimViewer::onView, (void*)APP_VIEW_GRID, FL_MENU_TOGGLE | FL_MENU_VALUE},
         {"Show Real World", 0, (Fl_Callback*)SimViewer::onView, (void*)APP_VIEW_REALISTIC, FL_MENU_TOGGLE | FL_MENU_VALUE},
         {"Show Skybox", 0, (Fl_Callback*)SimViewer::onView, (void*)APP_VIEW_SKYBOX, FL_MENU_TOGGLE},
-        {"Draw Shadows", 0, (Fl_Callback*)SimViewer::onView, (void*)APP_VIEW_SHADOWS, FL_MENU_TOGGLE},
+        {"Draw Shadows", 0, (Fl_Callback*)SimViewer::onView, (void*)APP_VIEW_SHADOWS, FL_MENU_TOGGLE | FL_MENU_DIVIDER},
+        {"Performance", 'h', (Fl_Callback*)SimViewer::onView, (void*)APP_VIEW_HUD, FL_MENU_TOGGLE},
         {0},
       {"&Weather", 0, 0, 0, FL_SUBMENU},
         {"Rain", 0, (Fl_Callback*)SimViewer::onView, (void*)APP_WEATHER_RAIN, rain_flag},
@@ -291,8 +339,15 @@ int SimViewer::initGUI(int cols, int rows)
   /* Exit when clicking the cross */
   this->mainwin->callback((Fl_Callback *)SimViewer::onExit);
 
+  /* The preprocessed models and textures */
+  openAssets();
+
   /* Initialize the realistic drawer */
   realistic_drawer = new RealisticDrawer(&options, map);
+  vehicle_renderer = new VehicleRenderer();
+  hud = new PerformanceHud();
+  overview = new Overview();
+  overview->build(map);
 
   /* Set the title */
   sprintf(this->wintitle, "Disim: %s", map->name);
@@ -309,7 +364,13 @@ int SimViewer::initGUI(int cols, int rows)
     pause = true;
   }
 
-  /* This mutex locks when modifying graphical data */
+  /* Rate at which the simulation thread publishes its state */
+  if (options.snapshot_rate_arg > 0.0)
+    snapshot_period = 1.0/options.snapshot_rate_arg;
+  if (options.fast_fps_arg > 0.0)
+    fast_period = 1.0/options.fast_fps_arg;
+
+  /* This mutex locks the simulation while it steps */
   pthread_mutex_init(&(this->mutex), NULL);
 
   return 0;
@@ -329,6 +390,15 @@ int SimViewer::finiGUI()
   delete realistic_drawer;
   realistic_drawer = NULL;
 
+  delete vehicle_renderer;
+  vehicle_renderer = NULL;
+
+  delete hud;
+  hud = NULL;
+
+  delete overview;
+  overview = NULL;
+
   if (this->car_model)
     delete this->car_model;
   this->car_model = NULL;
@@ -368,6 +438,28 @@ int SimViewer::fini()
 }
 
 #ifdef GUI
+/* Next speedup: by tenths up to the real time, then 2, 5, 10, 20, 50... */
+static double stepSpeedup(double speedup, bool faster)
+{
+  if (faster ? speedup < 1.0 - 1e-6 : speedup < 1.0 + 1e-6) {
+    return MIN(1.0, MAX(0.1, speedup + (faster ? 0.1 : -0.1)));
+  }
+
+  double decade = pow(10.0, floor(log10(speedup) + 1e-6));
+  double m = speedup/decade;
+  if (faster) {
+    if (m < 2.0 - 1e-6) m = 2.0;
+    else if (m < 5.0 - 1e-6) m = 5.0;
+    else m = 10.0;
+  } else {
+    if (m > 5.0 + 1e-6) m = 5.0;
+    else if (m > 2.0 + 1e-6) m = 2.0;
+    else if (m > 1.0 + 1e-6) m = 1.0;
+    else m = 0.5;
+  }
+  return MIN(MAX_SPEEDUP, m*decade);
+}
+
 void SimViewer::onAction(Fl_Widget *w, int option)
 {
   SimViewer *self;
@@ -375,6 +467,10 @@ void SimViewer::onAction(Fl_Widget *w, int option)
 
   self = (SimViewer *)w->user_data();
 
+  /* The simulation thread uses the mode and the times between two steps */
+  bool locked = (option != APP_ACTION_OPEN && option != APP_ACTION_RELOAD && option != APP_ACTION_INFO);
+  if (locked) self->lockSimulation();
+
   if (option == APP_ACTION_OPEN) {
     Fl_File_Chooser *chooser = new Fl_File_Chooser("", "", Fl_File_Chooser::SINGLE, "");
     char path[256];
@@ -439,13 +535,13 @@ void SimViewer::onAction(Fl_Widget *w, int option)
     self->init_time = current_time;
   } else if (option == APP_ACTION_SLOWER) {
     if (self->simulation_mode == NORMAL) {
-      self->simulation_speedup = MAX(0.1, self->simulation_speedup - 0.1);
+      self->simulation_speedup = stepSpeedup(self->simulation_speedup, false);
       self->offset_time = self->current_simulation_time;
       self->init_time = current_time;
     }
   } else if (option == APP_ACTION_FASTER) {
     if (self->simulation_mode == NORMAL) {
-      self->simulation_speedup = MIN(10.0, self->simulation_speedup + 0.1);
+      self->simulation_speedup = stepSpeedup(self->simulation_speedup, true);
       self->offset_time = self->current_simulation_time;
       self->init_time = current_time;
     }
@@ -467,12 +563,14 @@ void SimViewer::onAction(Fl_Widget *w, int option)
     }
 
     if (!self->laneoptions) {
-      self->laneoptions = new LaneOptions(closest);
+      self->laneoptions = new LaneOptions(closest, self);
     } else {
       self->laneoptions->setLane(closest);
     }
   }
 
+  if (locked) self->unlockSimulation();
+
   return;
 }
 
@@ -485,10 +583,15 @@ void SimViewer::onView(Fl_Widget *w, int option)
   if (option == APP_VIEW_GRID) {
     self->draw_grid = !self->draw_grid;
   } else if (option == APP_VIEW_FOLLOW) {
+    self->lockSimulation();
     if (self->worldwin->is_camera_free()) {
       CarState *state = self->simulator->trackCarID(&self->car_followed);
       if (state) {
-        self->worldwin->set_follow_coords(&(state->x), &fixed_y, &(state->y), &(state->yaw));
+        /* The camera follows the interpolated car (see updateFrame) */
+        self->follow_x = state->x;
+        self->follow_z = state->y;
+        self->follow_yaw = state->yaw;
+        self->worldwin->set_follow_coords(&self->follow_x, &fixed_y, &self->follow_z, &self->follow_yaw);
         self->worldwin->set_camera_follow();
         self->simulator->trackingOn();
       } else {
@@ -500,18 +603,26 @@ void SimViewer::onView(Fl_Widget *w, int option)
       self->worldwin->set_camera_free();
       self->simulator->trackingOff();
     }
+    self->tracked = self->worldwin->is_camera_follow() ? self->car_followed : -1;
+    self->unlockSimulation();
   } else if (option == APP_VIEW_PREV_CAR) {
+    self->lockSimulation();
     self->car_followed = self->simulator->getPrevCarID(self->car_followed);
     self->simulator->trackCarID(&self->car_followed);
     if (self->worldwin->is_camera_follow()) {
       self->simulator->trackingOn();
+      self->tracked = self->car_followed;
     }
+    self->unlockSimulation();
   } else if (option == APP_VIEW_NEXT_CAR) {
+    self->lockSimulation();
     self->car_followed = self->simulator->getNextCarID(self->car_followed);
     self->simulator->trackCarID(&self->car_followed);
     if (self->worldwin->is_camera_follow()) {
       self->simulator->trackingOn();
+      self->tracked = self->car_followed;
     }
+    self->unlockSimulation();
   } else if (option == APP_VIEW_REALISTIC) {
     self->draw_realistic = !self->draw_realistic;
     if (self->fog && self->draw_realistic) {
@@ -530,8 +641,11 @@ void SimViewer::onView(Fl_Widget *w, int option)
     self->draw_skybox = !self->draw_skybox;
   } else if (option == APP_VIEW_SHADOWS) {
     self->draw_shadows = !self->draw_shadows;
+  } else if (option == APP_VIEW_HUD) {
+    self->draw_hud = !self->draw_hud;
   }  else if (option == APP_WEATHER_RAIN) {
     self->rain = !self->rain;
+    self->lockSimulation();
     if (self->rain && self->fog) {
       self->simulator->setWeather(RAIN | FOG);
       self->realistic_drawer->setWeather(RAIN | FOG);
@@ -545,11 +659,13 @@ void SimViewer::onView(Fl_Widget *w, int option)
       self->simulator->setWeather(NICE);
       self->realistic_drawer->setWeather(NICE);
     }
+    self->unlockSimulation();
     /* We need to recompute the road list */
     self->realistic_drawer->reset();
-    self->realisticDL = self->realistic_drawer->predraw();
+    self->realistic_drawer->predraw();
   } else if (option == APP_WEATHER_FOG) {
     self->fog = !self->fog;
+    self->lockSimulation();
     if (self->rain && self->fog) {
       self->simulator->setWeather(RAIN | FOG);
       self->realistic_drawer->setWeather(RAIN | FOG);
@@ -563,6 +679,7 @@ void SimViewer::onView(Fl_Widget *w, int option)
       self->simulator->setWeather(NICE);
       self->realistic_drawer->setWeather(NICE);
     }
+    self->unlockSimulation();
     if (self->fog && self->draw_realistic) {
       glEnable(GL_FOG);
       float FogCol[3]={ 0.8f, 0.8f, 0.8f}; // Define a nice light grey
@@ -577,7 +694,7 @@ void SimViewer::onView(Fl_Widget *w, int option)
     }
     /* We need to recompute the road list */
     self->realistic_drawer->reset();
-    self->realisticDL = self->realistic_drawer->predraw();
+    self->realistic_drawer->predraw();
   }
 
   return;
@@ -601,6 +718,7 @@ void SimViewer::onController(Fl_Widget *w, int option)
     }
     if (chooser->value()) {
       printf("Open script: %s\n", chooser->value());
+      self->lockSimulation();
 
       // Set the options
       self->options.lua_given = 1;
@@ -622,9 +740,11 @@ void SimViewer::onController(Fl_Widget *w, int option)
           LuaBinding::getInstance().callInit(l->new_car->getControl()->getLuaCar());
         }
       }
+      self->unlockSimulation();
     }
   } else if (option == APP_CONTROLLER_RELOAD) {
     if (self->options.lua_given) {
+      self->lockSimulation();
       LuaBinding::getInstance().loadFile(self->options.lua_arg);
       // We have to call init on all cars
       for (int i = 0; i < self->simulator->getCarsCount(); i++) {
@@ -638,10 +758,13 @@ void SimViewer::onController(Fl_Widget *w, int option)
           LuaBinding::getInstance().callInit(l->new_car->getControl()->getLuaCar());
         }
       }
+      self->unlockSimulation();
     }
   } else if (option == APP_CONTROLLER_UNLOAD) {
+    self->lockSimulation();
     self->options.lua_given = 0;
     LuaBinding::getInstance().unload();
+    self->unlockSimulation();
   }
 }
 #endif
@@ -667,83 +790,188 @@ void SimViewer::onPredraw(Fl_Glv_Window *win, SimViewer *self)
 
 void SimViewer::onDraw(Fl_Glv_Window *win, SimViewer *self)
 {
+  Memory::Scope scope(Memory::MEM_GUI);
+  double start = Trace::begin();
+  double now = _gettime();
+
+  /* The overlay shows the time of the previous frame */
+  self->hud->update(now, self->draw_time, self->frame.time, self->frame.cars);
+
   if (!self->lists_created || self->worldwin->has_changed_context()) {
-    if (self->lists_created) {
-      self->realistic_drawer->reset();
-      if (self->car_model)
-        delete self->car_model;
-      if (self->truck_model)
-        delete self->truck_model;
-      if (self->carDL != 0)
-        glDeleteLists(self->carDL, 1);
-      if (self->truckDL != 0)
-        glDeleteLists(self->truckDL, 1);
-    }
+    self->createLists();
+  }
+  self->updateOverviewMode();
+  self->drawScene();
 
-    self->realisticDL = self->realistic_drawer->predraw();
+  self->draw_time = _gettime() - now;
+  Trace::end("draw", start);
+}
 
-    self->car_model = new Model_3DS();
-    char path[256];
-    snprintf(path, 256, "%s/%svan.3ds", self->options.exe_path_arg, MODELS_PATH);
-    self->car_model->Load(path);
-    self->carDL = glGenLists(1);
-    glNewList(self->carDL, GL_COMPILE);
-    self->car_model->Draw();
-    glEndList();
-
-    self->truck_model = new Model_3DS();
-    snprintf(path, 256, "%s/%struck.3ds", self->options.exe_path_arg, MODELS_PATH);
-    self->truck_model->Load(path);
-    self->truckDL = glGenLists(1);
-    glNewList(self->truckDL, GL_COMPILE);
-    self->truck_model->Draw();
-    glEndList();
+void SimViewer::createLists()
+{
+  if (lists_created) {
+    realistic_drawer->reset();
+    vehicle_renderer->reset();
+    if (car_model)
+      delete car_model;
+    if (truck_model)
+      delete truck_model;
+    if (carDL != 0)
+      glDeleteLists(carDL, 1);
+    if (truckDL != 0)
+      glDeleteLists(truckDL, 1);
+  }
 
-    if (self->fog && self->draw_realistic) {
-      glEnable(GL_FOG);
-      float FogCol[3]={ 0.8f, 0.8f, 0.8f}; // Define a nice light grey
-      glFogfv(GL_FOG_COLOR,FogCol);     // Set the fog color
-      glFogi(GL_FOG_MODE, GL_LINEAR);   // Note the 'i' after glFog - the GL_LINEAR constant is an integer.
-      glFogf(GL_FOG_START, 100.f);
-      glFogf(GL_FOG_END, 500.f);
-      self->worldwin->setClearColor(0.8, 0.8, 0.8);
-    } else {
-      glDisable(GL_FOG);
-      self->worldwin->setClearColor(0.0, 0.0, 0.0);
-    }
+  realistic_drawer->predraw();
+
+  car_model = new Model_3DS();
+  char path[256];
+  snprintf(path, 256, "%s/%svan.3ds", options.exe_path_arg, MODELS_PATH);
+  car_model->Load(path);
+  carDL = glGenLists(1);
+  glNewList(carDL, GL_COMPILE);
+  car_model->Draw();
+  glEndList();
+
+  truck_model = new Model_3DS();
+  snprintf(path, 256, "%s/%struck.3ds", options.exe_path_arg, MODELS_PATH);
+  truck_model->Load(path);
+  truckDL = glGenLists(1);
+  glNewList(truckDL, GL_COMPILE);
+  truck_model->Draw();
+  glEndList();
+
+  vehicle_renderer->load(CAR, car_model);
+  vehicle_renderer->load(TRUCK, truck_model);
+
+  if (hud) {
+    if (lists_created) hud->reset();
+    snprintf(path, 256, "%s/%sfont.png", options.exe_path_arg, TEXTURES_PATH);
+    hud->load(path);
+  }
 
-    if (!self->lists_created) {
-      self->lists_created = true;
-    }
+  if (fog && draw_realistic) {
+    glEnable(GL_FOG);
+    float FogCol[3]={ 0.8f, 0.8f, 0.8f}; // Define a nice light grey
+    glFogfv(GL_FOG_COLOR,FogCol);     // Set the fog color
+    glFogi(GL_FOG_MODE, GL_LINEAR);   // Note the 'i' after glFog - the GL_LINEAR constant is an integer.
+    glFogf(GL_FOG_START, 100.f);
+    glFogf(GL_FOG_END, 500.f);
+    setClearColor(0.8, 0.8, 0.8);
+  } else {
+    glDisable(GL_FOG);
+    setClearColor(0.0, 0.0, 0.0);
   }
 
-  if (self->draw_realistic && (self->draw_shadows || self->rain)) {
+  lists_created = true;
+}
+
+void SimViewer::drawScene()
+{
+  /* The snapshots only have the cells once the simulation thread saw the switch */
+  bool aggregated = overview_mode && overview->matches(&frame);
+  if (!aggregated) prepareVehicles();
+
+  if (draw_realistic && (draw_shadows || rain)) {
     glEnable(GL_BLEND);
     glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
   }
 
-  if (self->rain && self->draw_realistic) {
+  if (rain && draw_realistic && !aggregated) {
     glPushMatrix();
     glScalef(1.0, -1.0, 1.0);
-    bool s = self->draw_shadows;
-    self->draw_shadows = false;
-    self->drawVehicles();
-    self->draw_shadows = s;
+    bool s = draw_shadows;
+    draw_shadows = false;
+    drawVehicles();
+    draw_shadows = s;
     glPopMatrix();
   }
-  self->drawRoad();
-  self->drawVehicles();
+  drawRoad();
+  if (aggregated) {
+    overview->draw(&frame, overview_metric);
+  } else {
+    drawVehicles();
+  }
 
-  if (self->draw_realistic && (self->draw_shadows || self->rain)) {
+  if (draw_realistic && (draw_shadows || rain)) {
     glDisable(GL_BLEND);
   }
 
-  self->drawGrid();
-  self->drawInfo();
-  self->drawMouseClick();
-  self->drawInfoPoint();
+  drawGrid();
+  realistic_drawer->draw(&frame);
+
+  /* The overlays drawn with GLUT need its window */
+  if (headless) return;
 
-  self->realistic_drawer->draw();
+  drawInfo();
+  drawMouseClick();
+  drawInfoPoint();
+}
+
+double SimViewer::cameraHeight()
+{
+#ifdef HEADLESS
+  if (headless) return headless->get_camera_height();
+#endif
+  double x, y, z, dist, phi, alpha;
+  worldwin->get_camera(&x, &y, &z, &dist, &phi, &alpha);
+  return y;
+}
+
+void SimViewer::updateOverviewMode()
+{
+  if (overview_height <= 0.0) {
+    overview_mode = false;
+    return;
+  }
+  /* A margin, so that the mode does not flicker around the threshold */
+  double height = cameraHeight();
+  if (height > overview_height) overview_mode = true;
+  else if (height < 0.9*overview_height) overview_mode = false;
+}
+
+void SimViewer::getViewerCoords(double *x, double *y, double *z)
+{
+#ifdef HEADLESS
+  if (headless) {
+    headless->get_viewer_coords(x, y, z);
+    return;
+  }
+#endif
+  worldwin->get_viewer_coords(x, y, z);
+}
+
+bool SimViewer::isFollowing()
+{
+  /* The camera path of --render follows cars without the follow mode */
+  return !headless && worldwin->is_camera_follow();
+}
+
+int SimViewer::viewWidth()
+{
+#ifdef HEADLESS
+  if (headless) return headless->w();
+#endif
+  return worldwin->w();
+}
+
+int SimViewer::viewHeight()
+{
+#ifdef HEADLESS
+  if (headless) return headless->h();
+#endif
+  return worldwin->h();
+}
+
+void SimViewer::setClearColor(double r, double g, double b)
+{
+#ifdef HEADLESS
+  if (headless) {
+    headless->setClearColor(r, g, b);
+    return;
+  }
+#endif
+  worldwin->setClearColor(r, g, b);
 }
 
 #define GRID_SPACING 10.0
@@ -755,7 +983,7 @@ void SimViewer::drawGrid()
   if (!this->draw_grid) return;
 
   double vx, vy, vz;
-  this->worldwin->get_viewer_coords(&vx, &vy, &vz);
+  getViewerCoords(&vx, &vy, &vz);
 
   GLfloat x, z;
   GLfloat xavg = (double)(10*((int)(vx/10.0)));
@@ -803,7 +1031,7 @@ void SimViewer::drawRoad()
 {
   /* Draw road */
   if (this->draw_realistic)
-    glCallList(realisticDL);
+    realistic_drawer->drawRoad();
   return;
 }
 
@@ -817,42 +1045,61 @@ void SimViewer::drawInfo()
   glLoadIdentity();
   glColor3f(1.0, 1.0, 1.0);
 
-  int m = (int)(current_simulation_time/60.0) + start_time;
+  int m = (int)(frame.time/60.0) + start_time;
   int h = m/60;
   m = m - h*60;
   h %= 24;
-  snprintf(str, 40, "Time elapsed: %.2f (%02d:%02d)", current_simulation_time, h, m);
+  snprintf(str, 40, "Time elapsed: %.2f (%02d:%02d)", frame.time, h, m);
   renderBitmapString(5, 20, 0, GLUT_BITMAP_HELVETICA_18, str);
-  if (this->worldwin->is_camera_follow()) {
+  if (isFollowing()) {
     snprintf(str, 30, "Following car: %d", car_followed);
-    renderBitmapString(this->worldwin->w()-200, 20, 0, GLUT_BITMAP_HELVETICA_18, str);
+    renderBitmapString(viewWidth()-200, 20, 0, GLUT_BITMAP_HELVETICA_18, str);
   }
   if (simulation_mode == NORMAL) {
     snprintf(str, 30, "Speed: %.2f", simulation_speedup);
-    renderBitmapString(5, this->worldwin->h()-20, 0, GLUT_BITMAP_HELVETICA_12, str);
+    renderBitmapString(5, viewHeight()-20, 0, GLUT_BITMAP_HELVETICA_12, str);
   } else if (simulation_mode == FAST) {
     snprintf(str, 30, "FAST");
-    renderBitmapString(5, this->worldwin->h()-20, 0, GLUT_BITMAP_HELVETICA_12, str);
+    renderBitmapString(5, viewHeight()-20, 0, GLUT_BITMAP_HELVETICA_12, str);
   }
-  snprintf(str, 30, "%.2f x", (current_simulation_time-offset_time)/(_gettime() - init_time));
-  renderBitmapString(this->worldwin->w()-50, this->worldwin->h()-20, 0, GLUT_BITMAP_HELVETICA_12, str);
+  snprintf(str, 30, "%.2f x", (frame.time-offset_time)/(_gettime() - init_time));
+  renderBitmapString(viewWidth()-50, viewHeight()-20, 0, GLUT_BITMAP_HELVETICA_12, str);
+
+  if (draw_hud) hud->draw(viewWidth(), viewHeight());
 
   glPopMatrix();
   resetPerspectiveProjection();
 }
 
+void SimViewer::prepareVehicles()
+{
+  double x, y, z;
+  getViewerCoords(&x, &y, &z);
+
+  /* Batch the vehicles once per frame, except the followed car */
+  int followed = isFollowing() ? car_followed : -1;
+  vehicle_renderer->begin(x, z, draw_realistic);
+  for (unsigned int i = 0; i < frame.vehicles.size(); i++) {
+    if (frame.vehicles[i].id != followed) vehicle_renderer->add(&frame.vehicles[i]);
+  }
+  vehicle_renderer->upload(draw_realistic && draw_shadows && light_alpha > M_PI/20.0 && light_alpha < M_PI/2.0,
+                           light_alpha, light_beta);
+}
+
 void SimViewer::drawVehicles()
 {
   /* Draw vehicles */
-  for (int i = 0; i < simulator->getCarsCount(); i++) {
-    drawVehicle(simulator->getCar(i));
+  vehicle_renderer->draw(draw_shadows);
+
+  /* The followed car with its neighbors and frame */
+  if (isFollowing()) {
+    const vehicle_snapshot_t *car = frame.find(car_followed);
+    if (car) drawVehicle(car);
   }
 }
 
-void SimViewer::drawVehicle(Car *car)
+void SimViewer::drawVehicle(const vehicle_snapshot_t *car)
 {
-  static vector<neighbor_t> neighbors;
-
   GLfloat vehicle_x;
   GLfloat vehicle_y;
   GLfloat vehicle_z;
@@ -861,29 +1108,30 @@ void SimViewer::drawVehicle(Car *car)
   double REAR, FRONT, SIDE, TOP, TIRE_RADIUS = 0.3, AXLE_DIST;
   double steerAngle;
 
-  if (this->worldwin->is_camera_follow() && simulator->getCarFromID(car_followed) == car) {
+  if (isFollowing() && car->id == car_followed) {
     // If we are following this car, then draw the neighbors
-    neighbors.clear();
-    simulator->getNeighbors(car, &neighbors);
     glColor3f(1.0, 0.0, 1.0);
     glBegin(GL_LINES);
     glLineWidth(3);
-    for (unsigned int i = 0; i < neighbors.size(); i++) {
-      Car *n = neighbors[i].car;
+    for (unsigned int i = 0; i < frame.neighbors.size(); i++) {
+      const vehicle_snapshot_t *n = frame.find(frame.neighbors[i]);
       if (n) {
-        glVertex3f(car->getX(), 0.01, car->getY());
-        glVertex3f(n->getX(), 0.01, n->getY());
+        glVertex3f(car->x, 0.01, car->y);
+        glVertex3f(n->x, 0.01, n->y);
       }
     }
     glEnd();
   }
 
-  car->getCarGeometry(&FRONT, &REAR, &SIDE, &TOP);
-  vehicle_x = car->getX();
+  FRONT = car->front;
+  REAR = car->rear;
+  SIDE = car->side;
+  TOP = car->top;
+  vehicle_x = car->x;
   vehicle_y = 0.0;
-  vehicle_z = car->getY();
-  vehicle_yaw = car->getYaw();
-  steerAngle = car->getSteeringAngle();
+  vehicle_z = car->y;
+  vehicle_yaw = car->yaw;
+  steerAngle = car->steering_angle;
 
   glMatrixMode(GL_MODELVIEW);
 
@@ -891,27 +1139,27 @@ void SimViewer::drawVehicle(Car *car)
   glTranslatef(vehicle_x, vehicle_y, vehicle_z);
   glRotatef(-(vehicle_yaw/M_PI)*180.0, 0.0, 1.0, 0.0);
 
-  this->worldwin->get_viewer_coords(&x, &y, &z);
+  getViewerCoords(&x, &y, &z);
   double dist = sqrt((vehicle_x - x)*(vehicle_x - x)+(vehicle_z - z)*(vehicle_z - z));
 
   if (draw_realistic && dist < 500.0) {
     glRotatef(90.0, 0.0, 1.0, 0.0);
-    if (car->getID() % 7 == 0) {
+    if (car->id % 7 == 0) {
       glColor3f(1.0, 0.0, 0.0);
-    } else if (car->getID() % 7 == 1) {
+    } else if (car->id % 7 == 1) {
       glColor3f(0.0, 1.0, 0.0);
-    } else if (car->getID() % 7 == 2) {
+    } else if (car->id % 7 == 2) {
       glColor3f(0.0, 0.0, 1.0);
-    } else if (car->getID() % 7 == 3) {
+    } else if (car->id % 7 == 3) {
       glColor3f(1.0, 1.0, 0.0);
-    } else if (car->getID() % 7 == 4) {
+    } else if (car->id % 7 == 4) {
       glColor3f(1.0, 0.0, 1.0);
-    } else if (car->getID() % 7 == 5) {
+    } else if (car->id % 7 == 5) {
       glColor3f(0.0, 1.0, 1.0);
     } else {
       glColor3f(1.0, 1.0, 1.0);
     }
-    if (car->getType() == CAR) {
+    if (car->type == CAR) {
       glCallList(carDL);
     } else
       glCallList(truckDL);
@@ -977,7 +1225,7 @@ void SimViewer::drawVehicle(Car *car)
     }
   } else {
 
-    if (this->worldwin->is_camera_follow() && simulator->getCarFromID(car_followed) == car) {
+    if (isFollowing() && car->id == car_followed) {
       glLineWidth(1);
       glColorMaterial(GL_FRONT_AND_BACK, GL_AMBIENT);
 
@@ -1096,7 +1344,7 @@ void SimViewer::drawMouseClick()
       this->mouse_y = 0.0;
       this->mouse_z = closest->y_start;
       if (!this->laneoptions) {
-        this->laneoptions = new LaneOptions(closest);
+        this->laneoptions = new LaneOptions(closest, this);
       } else {
         this->laneoptions->setLane(closest);
       }
@@ -1153,9 +1401,9 @@ void SimViewer::setOrthographicProjection()
   glMatrixMode(GL_PROJECTION);
   glPushMatrix();
   glLoadIdentity();
-  gluOrtho2D(0, this->worldwin->w(), 0, this->worldwin->h());
+  gluOrtho2D(0, viewWidth(), 0, viewHeight());
   glScalef(1, -1, 1);
-  glTranslatef(0, -this->worldwin->h(), 0);
+  glTranslatef(0, -viewHeight(), 0);
   glMatrixMode(GL_MODELVIEW);
 }
 
@@ -1168,80 +1416,222 @@ void SimViewer::resetPerspectiveProjection()
 
 void SimViewer::onIdle(SimViewer *self)
 {
-  static bool first = true;
-  static double previous_time;
+  /* Nothing to draw */
+  if (self->simulation_mode == NODISPLAY) {
+    usleep(IDLE_SLEEP);
+    return;
+  }
 
-  double current_time = _gettime();
-  double dt;
+  /* Fast-forward: the last state at most every fast_period */
+  double now = _gettime();
+  if (self->fastForward() && now - self->last_redraw < self->fast_period) {
+    usleep((useconds_t)MIN((double)IDLE_SLEEP, (self->fast_period - (now - self->last_redraw))*1e6));
+    return;
+  }
+  self->last_redraw = now;
+
+  double previous_time = self->frame.time;
+  self->updateFrame();
+
+  /* Shawdows update */
+  if (self->draw_shadows) self->updateLight(self->frame.time);
+
+  /* Redraw */
+  self->realistic_drawer->update(MAX(0.0, self->frame.time - previous_time));
+  self->worldwin->redraw();
+
+  /* Refresh the lane options */
+  if (self->laneoptions) self->laneoptions->update();
+}
+
+void SimViewer::updateLight(double time)
+{
+  int m = (int)(time/60.0) + start_time;
+  int h = m/60;
+  m = m - h*60;
+  h %= 24;
 
-  if (first) {
-    first = false;
-    previous_time = self->init_time;
+  double w = 21.0-6.0;
+  double f = (21.0+6.0)/2.0;
+  double r = (((double)h+(double)m/60.0)-f)/w*2.0;
+  if (r < -1.0 || r > 1.0) light_alpha = -M_PI/2.0;
+  else {
+    light_alpha = (1.0-r*r)*M_PI/3.0;
+    light_beta = M_PI/4.0*r;
   }
+}
 
-  /* Update simulation time */
-  if (self->simulation_mode != NORMAL && !self->pause) {
-    dt = self->min_step;
-    self->current_simulation_time += self->min_step;
-  } else {
-    dt = (current_time - previous_time)*self->simulation_speedup;
-    /* Fail-safe mechanism */
-    if (dt > self->min_step) {
-      /* Step time was too big */
-      dt = self->min_step;
-      self->current_simulation_time += dt;
-      self->offset_time = self->current_simulation_time;
-      self->init_time = current_time;
-    } else {
-      /* Normal update */
-      self->current_simulation_time = ((current_time - self->init_time)*self->simulation_speedup +
-                                       self->offset_time);
-    }
+void SimViewer::updateFrame()
+{
+  snapshots.acquire(&previous_snapshot);
+  const Snapshot *a = &previous_snapshot;
+  const Snapshot *b = snapshots.front();
+
+  /* The frame lags one snapshot behind, so that it moves from the previous
+     snapshot to the last one in the time the last one took to come */
+  double alpha = 1.0;
+  if (!fastForward() && a->generation == b->generation && b->published > a->published) {
+    alpha = (_gettime() - b->published)/(b->published - a->published);
+    alpha = MAX(0.0, MIN(1.0, alpha));
+  }
+  frame.interpolate(a, b, alpha);
+
+  /* Move the camera with the interpolated car */
+  const vehicle_snapshot_t *car = frame.find(car_followed);
+  if (car) {
+    follow_x = car->x;
+    follow_z = car->y;
+    follow_yaw = car->yaw;
   }
+}
 
-  /* Simulates the cars */
-  self->simulator->step(dt);
+bool SimViewer::fastForward()
+{
+  /* The steps between two frames are skipped rather than interpolated */
+  return simulation_mode == FAST || (simulation_mode == NORMAL && !pause && simulation_speedup > FAST_FORWARD);
+}
 
-  /* Update previous time */
-  previous_time = current_time;
+void SimViewer::publishSnapshot()
+{
+  /* Called by the thread that holds the simulation lock */
+  Snapshot *snapshot = snapshots.back();
+  snapshot->capture(simulator, map, tracked, overview_mode ? overview : NULL);
+  snapshot->time = current_simulation_time;
+  snapshot->published = _gettime();
+  snapshot->generation = generation;
+  snapshots.publish();
+}
 
-  /* Shawdows update */
-  if (self->draw_shadows) {
-    int m = (int)(self->current_simulation_time/60.0) + self->start_time;
-    int h = m/60;
-    m = m - h*60;
-    h %= 24;
-
-    double w = 21.0-6.0;
-    double f = (21.0+6.0)/2.0;
-    double r = (((double)h+(double)m/60.0)-f)/w*2.0;
-    if (r < -1.0 || r > 1.0) self->light_alpha = -M_PI/2.0;
-    else {
-      self->light_alpha = (1.0-r*r)*M_PI/3.0;
-      self->light_beta = M_PI/4.0*r;
-    }
+int SimViewer::openAssets(bool build)
+{
+  char directory[PATH_MAX], pack[PATH_MAX];
+  if (snprintf(directory, sizeof(directory), "%s/%s", options.exe_path_arg, ASSETS_PATH) >= (int)sizeof(directory) ||
+      snprintf(pack, sizeof(pack), "%s/%s%s", options.exe_path_arg, ASSETS_PATH, ASSETS_PACK) >= (int)sizeof(pack)) {
+    fprintf(stderr, "Error: The path of the assets is too long.\n");
+    return -1;
   }
+  if (build) return AssetPack::build(directory, pack);
+  return AssetPack::getInstance().open(directory, pack);
+}
+
+void SimViewer::lockSimulation()
+{
+  /* The simulation thread lets go of the lock between two steps when someone waits */
+  __sync_fetch_and_add(&waiting, 1);
+  pthread_mutex_lock(&(this->mutex));
+  __sync_fetch_and_sub(&waiting, 1);
+}
+
+void SimViewer::unlockSimulation()
+{
+  pthread_mutex_unlock(&(this->mutex));
+}
+
+void *SimViewer::simulate(void *ptr)
+{
+  SimViewer *self = (SimViewer *)ptr;
+  double last_snapshot = 0.0;
+  int generation = -1;
 
-  /* Redraw */
   pthread_mutex_lock(&(self->mutex));
-  self->realistic_drawer->update(dt);
-  self->worldwin->redraw();
-  pthread_mutex_unlock(&(self->mutex));
+  while (!self->quit) {
+    double current_time = _gettime();
+    double wait = 0.0;
+
+    /* This thread steps in place of the main one (again when the simulator is rebuilt) */
+    if (generation != self->generation) {
+      Stats::attach(0);
+      Trace::attach(0);
+      generation = self->generation;
+    }
+
+    if (self->pause) {
+      /* Nothing moves, but the display still gets the changes (e.g. the followed car) */
+      wait = self->snapshot_period;
+    } else if (self->simulation_mode != NORMAL) {
+      /* As fast as possible */
+      self->current_simulation_time += self->min_step;
+      self->simulator->step(self->min_step);
+    } else {
+      /* Fixed steps paced to the real time */
+      double target = (current_time - self->init_time)*self->simulation_speedup + self->offset_time;
+      if (target > self->current_simulation_time + 2.0*self->min_step) {
+        /* Fail-safe mechanism: the simulation cannot keep up */
+        self->offset_time = self->current_simulation_time;
+        self->init_time = current_time;
+        target = self->current_simulation_time + self->min_step;
+      }
+      if (target >= self->current_simulation_time + self->min_step) {
+        self->current_simulation_time += self->min_step;
+        self->simulator->step(self->min_step);
+      } else {
+        wait = (self->current_simulation_time + self->min_step - target)/self->simulation_speedup;
+        wait = MIN(wait, self->snapshot_period);
+      }
+    }
+
+    /* Do we need to exit */
+    if (self->options.duration_given && self->options.duration_arg > 0) {
+      if (self->current_simulation_time > (double)self->options.duration_arg) {
+        self->quit = true;
+      }
+    }
 
-  /* Do we need to exit */
-  if (self->options.duration_given && self->options.duration_arg > 0) {
-    if (self->current_simulation_time > (double)self->options.duration_arg) {
-      self->quit = true;
+    /* Publish the state for the display (only as often as it is drawn in fast-forward) */
+    double period = self->fastForward() ? MAX(self->snapshot_period, self->fast_period) : self->snapshot_period;
+    if (self->simulation_mode != NODISPLAY && current_time - last_snapshot >= period) {
+      self->publishSnapshot();
+      last_snapshot = current_time;
     }
+
+    /* Let the GUI thread change the simulation */
+    pthread_mutex_unlock(&(self->mutex));
+    if (wait > 0.0) usleep((useconds_t)(wait*1e6));
+    while (self->waiting) sched_yield();
+    pthread_mutex_lock(&(self->mutex));
   }
+  pthread_mutex_unlock(&(self->mutex));
+  Stats::detach();
+  Trace::detach();
 
-  /* Refresh the lane options */
-  if (self->laneoptions) self->laneoptions->update();
+  return NULL;
+}
+
+int SimViewer::startSimulation()
+{
+  /* The first frame */
+  lockSimulation();
+  publishSnapshot();
+  unlockSimulation();
+
+  /* The slots of the main thread go to the simulation thread */
+  Stats::detach();
+  Trace::attach(Trace::DISPLAY);
+  if (pthread_create(&simulation_thread, NULL, SimViewer::simulate, this) != 0) {
+    fprintf(stderr, "Error: Cannot start the simulation thread.\n");
+    return -1;
+  }
+  simulation_started = true;
+
+  return 0;
+}
+
+void SimViewer::stopSimulation()
+{
+  if (!simulation_started) return;
+
+  lockSimulation();
+  quit = true;
+  unlockSimulation();
+
+  pthread_join(simulation_thread, NULL);
+  simulation_started = false;
+  Trace::detach();
 }
 
 void SimViewer::resetCompleteStack(void)
 {
-  pthread_mutex_lock(&(this->mutex));
+  lockSimulation();
 
   this->worldwin->set_camera(0.0, 0.0, 0.0, 300.0, M_PI/4.0, 0.0);
 
@@ -1259,6 +1649,7 @@ void SimViewer::resetCompleteStack(void)
   else if (this->fog) this->simulator->setWeather(FOG);
   else this->simulator->setWeather(NICE);
   this->realistic_drawer = new RealisticDrawer(&this->options, this->map);
+  this->overview->build(this->map);
   if (this->rain && this->fog) this->realistic_drawer->setWeather(RAIN | FOG);
   else if (this->rain) this->realistic_drawer->setWeather(RAIN);
   else if (this->fog) this->realistic_drawer->setWeather(FOG);
@@ -1273,9 +1664,126 @@ void SimViewer::resetCompleteStack(void)
   this->current_simulation_time = 0.0;
   this->init_time = _gettime();
 
-  pthread_mutex_unlock(&(this->mutex));
+  /* The new slots of the main thread are bound by the simulation thread */
+  if (this->simulation_started) {
+    Stats::detach();
+    Trace::attach(Trace::DISPLAY);
+  }
+
+  /* The old snapshots point to the old map */
+  this->tracked = -1;
+  this->generation++;
+  publishSnapshot();
+
+  unlockSimulation();
+
+  /* Do not interpolate from the old simulation */
+  updateFrame();
+}
+
+#ifdef HEADLESS
+int SimViewer::render()
+{
+  Memory::Scope scope(Memory::MEM_GUI);
+  int width, height;
+  if (sscanf(options.render_size_arg, "%dx%d", &width, &height) != 2 || width <= 0 || height <= 0) {
+    fprintf(stderr, "Error: Invalid frame size %s (expected <width>x<height>).\n", options.render_size_arg);
+    return -1;
+  }
+  double interval = options.render_interval_arg;
+  if (interval <= 0.0) {
+    fprintf(stderr, "Error: The interval between two frames must be positive.\n");
+    return -1;
+  }
+  if (!options.duration_given || options.duration_arg <= 0) {
+    fprintf(stderr, "Error: Rendering needs the duration of the run (--duration).\n");
+    return -1;
+  }
+
+  headless = new HeadlessRenderer();
+  if (headless->init(width, height) != 0)
+    return -1;
+  if (options.render_camera_given && headless->loadCameraPath(options.render_camera_arg) != 0)
+    return -1;
+
+  /* The preprocessed models and textures */
+  openAssets();
+
+  realistic_drawer = new RealisticDrawer(&options, map);
+  vehicle_renderer = new VehicleRenderer();
+  overview = new Overview();
+  overview->build(map);
+  createLists();
+
+  FrameWriter writer;
+  if (writer.start(options.render_threads_arg, width, height) != 0)
+    return -1;
+
+  /* One frame every interval of simulated time, whatever the time it takes
+     to compute: the frame is interpolated between the steps around it */
+  Snapshot before, after;
+  int frames = 0;
+  double next_frame = 0.0;
+  char filename[512];
+  double start = _gettime();
+  while (!quit) {
+    if (current_simulation_time + min_step >= next_frame) {
+      before.capture(simulator, map, -1, overview_mode ? overview : NULL);
+      before.time = current_simulation_time;
+    }
+
+    current_simulation_time += min_step;
+    simulator->step(min_step);
+    if (current_simulation_time > (double)options.duration_arg) {
+      quit = true;
+    }
+
+    if (current_simulation_time < next_frame) continue;
+    after.capture(simulator, map, -1, overview_mode ? overview : NULL);
+    after.time = current_simulation_time;
+
+    while (next_frame <= current_simulation_time) {
+      frame.interpolate(&before, &after, (next_frame - before.time)/(after.time - before.time));
+      if (draw_shadows) updateLight(frame.time);
+      realistic_drawer->update(interval);
+
+      headless->begin(&frame);
+      onPredraw(NULL, this);
+      drawScene();
+      updateOverviewMode();
+
+      /* The workers compress the previous frames meanwhile */
+      unsigned char *pixels = writer.acquire();
+      headless->read(pixels);
+      snprintf(filename, 512, "%s%06d.png", options.render_arg, frames);
+      writer.submit(pixels, filename);
+
+      frames++;
+      next_frame = frames*interval;
+    }
+  }
+
+  int failures = writer.finish();
+  printf("Rendered %d frames to %s*.png in %.1f s\n", frames, options.render_arg, _gettime() - start);
+
+  /* The lists belong to the offscreen context */
+  delete realistic_drawer;
+  realistic_drawer = NULL;
+  delete vehicle_renderer;
+  vehicle_renderer = NULL;
+  delete overview;
+  overview = NULL;
+  delete car_model;
+  car_model = NULL;
+  delete truck_model;
+  truck_model = NULL;
+  delete headless;
+  headless = NULL;
+
+  return failures ? -1 : 0;
 }
 #endif
+#endif
 
 int main(int argc, char *argv[])
 {
@@ -1287,6 +1795,27 @@ int main(int argc, char *argv[])
     return -1;
 
 #ifdef GUI
+  if (sim->options.pack_assets_given) {
+    /* Preprocess the models and textures, without any GL context */
+    int result = sim->openAssets(true);
+    sim->fini();
+    delete sim;
+    return result;
+  }
+
+  if (sim->options.render_given) {
+    /* Draw the run offscreen instead of showing it */
+#ifdef HEADLESS
+    int result = sim->render();
+#else
+    fprintf(stderr, "Error: Disim was compiled without offscreen rendering (set HEADLESS = 1 in Makefile.include).\n");
+    int result = -1;
+#endif
+    sim->fini();
+    delete sim;
+    return result;
+  }
+
   if (sim->options.nogui_given) {
 #endif
     /* Run the simulation loop as fast as possible */
@@ -1301,8 +1830,6 @@ int main(int argc, char *argv[])
           break;
         }
       }
-
-      usleep(100);
     }
 
 #ifdef GUI
@@ -1318,6 +1845,10 @@ int main(int argc, char *argv[])
     if (sim->init() != 0)
       return -1;
 
+    /* Run the simulation on its own thread */
+    if (sim->startSimulation() != 0)
+      return -1;
+
     /* Idle callback */
     Fl::add_idle((void (*) (void*))SimViewer::onIdle, sim);
 
@@ -1329,6 +1860,7 @@ int main(int argc, char *argv[])
     printf("Exiting...\n");
 
     /* Clean up */
+    sim->stopSimulation();
     sim->finiGUI();
   }
 #endif
@@ -15,8 +15,19 @@
 #include <utils/Fl_Glv_Window.H>
 #include <pthread.h>
 #include "RealisticDrawer.h"
+#include "VehicleRenderer.h"
+#include "Snapshot.h"
+#include "AssetPack.h"
 #include "Model_3DS.h"
 #include "LaneOptions.h"
+#include "PerformanceHud.h"
+#include "Overview.h"
+#ifdef HEADLESS
+#include "HeadlessRenderer.h"
+#include "FrameWriter.h"
+#else
+class HeadlessRenderer;
+#endif
 #endif
 
 #include <engine/Simulator.h>
@@ -41,6 +52,7 @@ enum
   APP_VIEW_REALISTIC,
   APP_VIEW_SKYBOX,
   APP_VIEW_SHADOWS,
+  APP_VIEW_HUD,
   APP_WEATHER_RAIN,
   APP_WEATHER_FOG,
   APP_CONTROLLER_LOAD,
@@ -81,6 +93,21 @@ class SimViewer {
 
   // Handle idle callbacks
   static void onIdle(SimViewer *self);
+
+  // Simulation thread
+  static void *simulate(void *ptr);
+  int startSimulation();
+  void stopSimulation();
+  void lockSimulation();
+  void unlockSimulation();
+
+  // Opens the preprocessed models and textures (or builds them if build is true)
+  int openAssets(bool build = false);
+
+#ifdef HEADLESS
+  // Renders the run offscreen to a PNG sequence
+  int render();
+#endif
 #endif
 
   int init();
@@ -89,17 +116,31 @@ class SimViewer {
  public:
 
 #ifdef GUI
+  void createLists();
+  void drawScene();
+  void updateLight(double time);
+  void getViewerCoords(double *x, double *y, double *z);
+  bool isFollowing();
+  int viewWidth();
+  int viewHeight();
+  void setClearColor(double r, double g, double b);
+  double cameraHeight();
+  void updateOverviewMode();
   void drawGrid();
   void drawRoad();
   void drawInfo();
+  void prepareVehicles();
   void drawVehicles();
-  void drawVehicle(Car *car);
+  void drawVehicle(const vehicle_snapshot_t *car);
   void drawMouseClick();
   void drawInfoPoint();
   void renderBitmapString(float x, float y, float z, void *font, char *string);
   void setOrthographicProjection(void);
   void resetPerspectiveProjection(void);
   void resetCompleteStack(void);
+  void publishSnapshot();
+  void updateFrame();
+  bool fastForward();
 #endif
 
  public:
@@ -116,6 +157,9 @@ class SimViewer {
   // 3D window
   Fl_Glv_Window *worldwin;
 
+  // Offscreen context replacing the 3D window with --render (NULL otherwise)
+  HeadlessRenderer *headless;
+
   // Lane Options window
   LaneOptions *laneoptions;
 
@@ -123,9 +167,36 @@ class SimViewer {
   RealisticDrawer *realistic_drawer;
   Model_3DS *car_model;
   Model_3DS *truck_model;
-  GLuint realisticDL;
   GLuint carDL;
   GLuint truckDL;
+
+  // Batches of vehicles
+  VehicleRenderer *vehicle_renderer;
+
+  // Lanes colored by their traffic, drawn instead of the vehicles from high above
+  Overview *overview;
+  volatile bool overview_mode;  // Read by the simulation thread
+  double overview_height;       // Camera height of the switch (0 for never) [m]
+  Overview::metric_t overview_metric;
+
+  // Performance overlay
+  PerformanceHud *hud;
+  double draw_time;  // CPU time of the last frame [s]
+
+  // Snapshots published by the simulation thread
+  SnapshotBuffer snapshots;
+  Snapshot previous_snapshot;
+  Snapshot frame;  // Interpolated between the last two snapshots
+  double snapshot_period;
+  double fast_period;  // Smallest time between two frames in fast-forward (0 for no limit) [s]
+  double last_redraw;
+  int generation;
+  int tracked;  // ID of the followed car as seen by the simulation thread (-1 if none)
+
+  // Coordinates followed by the camera
+  double follow_x;
+  double follow_z;
+  double follow_yaw;
 #endif
   
   // Center of initial attention
@@ -164,6 +235,7 @@ class SimViewer {
   bool draw_realistic;
   bool draw_skybox;
   bool draw_shadows;
+  bool draw_hud;
 
   // Starting time of day (in minutes)
   int start_time;
@@ -191,7 +263,10 @@ class SimViewer {
   char wintitle[256];
 
 #ifdef GUI
-  pthread_mutex_t mutex; // locks display
+  pthread_mutex_t mutex; // locks the simulation (held by the simulation thread except between two steps)
+  pthread_t simulation_thread;
+  bool simulation_started;
+  volatile int waiting; // number of threads waiting for the lock
 #endif
 
  private:
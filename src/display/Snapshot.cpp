@@ -0,0 +1,187 @@
+#include "Snapshot.h"
+#include "Overview.h"
+#include <math.h>
+#include <algorithm>
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+#define FRESH 4
+
+static bool compareID(const vehicle_snapshot_t &a, const vehicle_snapshot_t &b)
+{
+  return a.id < b.id;
+}
+
+static void copy(Car *car, vehicle_snapshot_t *v)
+{
+  v->id = car->getID();
+  v->type = car->getType();
+  v->x = car->getX();
+  v->y = car->getY();
+  v->yaw = car->getYaw();
+  v->steering_angle = car->getSteeringAngle();
+  car->getCarGeometry(&v->front, &v->rear, &v->side, &v->top);
+}
+
+Snapshot::Snapshot()
+{
+  time = 0.0;
+  published = 0.0;
+  generation = 0;
+  map = NULL;
+  cars = 0;
+  followed = -1;
+}
+
+void Snapshot::capture(Simulator *simulator, Map *map, int followed, const Overview *overview)
+{
+  this->map = map;
+  this->followed = followed;
+  cars = simulator->getCarsCount();
+
+  if (overview) {
+    // The camera still follows its car
+    vehicles.clear();
+    Car *car = (followed >= 0) ? simulator->getCarFromID(followed) : NULL;
+    if (car) {
+      vehicles.resize(1);
+      copy(car, &vehicles[0]);
+    }
+    overview->aggregate(&cells);
+  } else {
+    cells.clear();
+    vehicles.resize(cars);
+    for (unsigned int i = 0; i < vehicles.size(); i++) {
+      copy(simulator->getCar(i), &vehicles[i]);
+    }
+    // The cars are mostly in the order of their IDs already
+    sort(vehicles.begin(), vehicles.end(), compareID);
+  }
+
+  actuators.resize(map->actuators.size());
+  for (unsigned int i = 0; i < actuators.size(); i++) {
+    RoadActuator *a = map->actuators[i];
+    actuators[i].color = (a->type == TRAFFICLIGHT) ? static_cast<TrafficLightActuator *>(a)->color() : GREEN;
+    actuators[i].maximum_speed = a->lane->maximum_speed;
+    actuators[i].minimum_speed = a->lane->minimum_speed;
+  }
+
+  sensors.resize(map->sensors.size());
+  for (unsigned int i = 0; i < sensors.size(); i++) {
+    RoadSensor *r = map->sensors[i];
+    sensors[i].triggered = r->wasTriggered();
+    sensors[i].entry_triggered = r->wasEntryTriggered();
+    sensors[i].exit_triggered = r->wasExitTriggered();
+    sensors[i].result = r->getResult();
+  }
+
+  neighbors.clear();
+  Car *car = (followed >= 0) ? simulator->getCarFromID(followed) : NULL;
+  if (car) {
+    static vector<neighbor_t> n;
+    n.clear();
+    simulator->getNeighbors(car, &n);
+    for (unsigned int i = 0; i < n.size(); i++) {
+      if (n[i].car) neighbors.push_back(n[i].car->getID());
+    }
+  }
+}
+
+void Snapshot::interpolate(const Snapshot *a, const Snapshot *b, double alpha)
+{
+  time = a->time + (b->time - a->time)*alpha;
+  published = b->published;
+  generation = b->generation;
+  map = b->map;
+  cars = b->cars;
+  cells = b->cells;
+  actuators = b->actuators;
+  sensors = b->sensors;
+  followed = b->followed;
+  neighbors = b->neighbors;
+
+  // Both are sorted by ID
+  vehicles = b->vehicles;
+  unsigned int j = 0;
+  for (unsigned int i = 0; i < vehicles.size(); i++) {
+    vehicle_snapshot_t *v = &vehicles[i];
+    while (j < a->vehicles.size() && a->vehicles[j].id < v->id) j++;
+    if (j == a->vehicles.size()) break;
+    const vehicle_snapshot_t *u = &a->vehicles[j];
+    if (u->id != v->id) continue;
+
+    double dyaw = v->yaw - u->yaw;
+    while (dyaw > M_PI) dyaw -= 2.0*M_PI;
+    while (dyaw < -M_PI) dyaw += 2.0*M_PI;
+    v->x = u->x + (v->x - u->x)*alpha;
+    v->y = u->y + (v->y - u->y)*alpha;
+    v->yaw = u->yaw + dyaw*alpha;
+    v->steering_angle = u->steering_angle + (v->steering_angle - u->steering_angle)*alpha;
+  }
+}
+
+const vehicle_snapshot_t *Snapshot::find(int id) const
+{
+  vehicle_snapshot_t key;
+  key.id = id;
+  vector<vehicle_snapshot_t>::const_iterator it = lower_bound(vehicles.begin(), vehicles.end(), key, compareID);
+  if (it == vehicles.end() || it->id != id) return NULL;
+  return &(*it);
+}
+
+void Snapshot::swap(Snapshot &other)
+{
+  std::swap(time, other.time);
+  std::swap(published, other.published);
+  std::swap(generation, other.generation);
+  std::swap(map, other.map);
+  std::swap(followed, other.followed);
+  std::swap(cars, other.cars);
+  vehicles.swap(other.vehicles);
+  cells.swap(other.cells);
+  actuators.swap(other.actuators);
+  sensors.swap(other.sensors);
+  neighbors.swap(other.neighbors);
+}
+
+SnapshotBuffer::SnapshotBuffer()
+{
+  back_index = 0;
+  middle = 1;
+  front_index = 2;
+}
+
+int SnapshotBuffer::exchange(int value)
+{
+  // Full barrier, so that the content of the snapshot is visible before its index
+  int old;
+  do {
+    old = middle;
+  } while (__sync_val_compare_and_swap(&middle, old, value) != old);
+  return old;
+}
+
+Snapshot *SnapshotBuffer::back()
+{
+  return &snapshots[back_index];
+}
+
+void SnapshotBuffer::publish()
+{
+  back_index = exchange(back_index | FRESH) & ~FRESH;
+}
+
+bool SnapshotBuffer::acquire(Snapshot *previous)
+{
+  if (!(middle & FRESH)) return false;
+  if (previous) previous->swap(snapshots[front_index]);
+  front_index = exchange(front_index) & ~FRESH;
+  return true;
+}
+
+Snapshot *SnapshotBuffer::front()
+{
+  return &snapshots[front_index];
+}
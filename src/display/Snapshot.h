@@ -0,0 +1,152 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <vector>
+#include <engine/Simulator.h>
+#include <map/Map.h>
+
+using namespace std;
+
+/**
+ * The pose of a vehicle (and what is needed to draw it).
+ */
+typedef struct {
+  int id;
+  car_t type;
+  double x;
+  double y;
+  double yaw;
+  double steering_angle;
+  double front;
+  double rear;
+  double side;
+  double top;
+} vehicle_snapshot_t;
+
+/**
+ * The state of a road actuator (in the order of Map::actuators).
+ */
+typedef struct {
+  color_t color;         // Traffic lights
+  double maximum_speed;  // Speed limits [m/s]
+  double minimum_speed;
+} actuator_snapshot_t;
+
+/**
+ * The state of a road sensor (in the order of Map::sensors).
+ */
+typedef struct {
+  bool triggered;
+  bool entry_triggered;
+  bool exit_triggered;
+  double result;
+} sensor_snapshot_t;
+
+/**
+ * The vehicles of a cell of the overview (in the order of the cells of Overview).
+ */
+typedef struct {
+  int vehicles;
+  float speed;  // Sum of the speeds relative to the speed limit
+} cell_snapshot_t;
+
+class Overview;
+
+/**
+ * @brief A copy of the state of the simulation needed to draw a frame.
+ *
+ * The snapshots are captured by the simulation thread between two steps,
+ * so that the display never reads the cars while they move.
+ */
+class Snapshot {
+ public:
+  Snapshot();
+
+  /**
+   * Copies the state of the simulation (the simulation must not be stepping).
+   * @param simulator The simulator.
+   * @param map The map.
+   * @param followed The ID of the followed car (-1 if none), whose neighbors are also copied.
+   * @param overview If given, only the followed car is copied and the others are counted in the cells of the overview.
+   */
+  void capture(Simulator *simulator, Map *map, int followed, const Overview *overview = NULL);
+
+  /**
+   * Sets this snapshot in between two others. The vehicles that are not in
+   * the first one are taken as is from the second.
+   * @param a The older snapshot.
+   * @param b The newer snapshot.
+   * @param alpha The position between a (0) and b (1).
+   */
+  void interpolate(const Snapshot *a, const Snapshot *b, double alpha);
+
+  /**
+   * Returns the vehicle with the given ID (NULL if there is none).
+   */
+  const vehicle_snapshot_t *find(int id) const;
+
+  /**
+   * Exchanges the content of two snapshots (without copying it).
+   */
+  void swap(Snapshot &other);
+
+  // Simulation time [s]
+  double time;
+  // Wall time of the capture [s]
+  double published;
+  // Changes when the simulation is rebuilt
+  int generation;
+  Map *map;
+
+  vector<vehicle_snapshot_t> vehicles;  // Sorted by ID
+  int cars;  // Number of vehicles (also when they are only counted in the cells)
+  vector<cell_snapshot_t> cells;  // Empty unless captured for an overview
+  vector<actuator_snapshot_t> actuators;
+  vector<sensor_snapshot_t> sensors;
+  int followed;
+  vector<int> neighbors;  // IDs of the neighbors of the followed car
+};
+
+/**
+ * @brief Triple buffer of snapshots between one writer and one reader.
+ *
+ * The writer fills back() and publishes it, the reader acquires the last
+ * published snapshot as front(). Neither of them ever waits for the other:
+ * the snapshot in the middle is exchanged atomically.
+ */
+class SnapshotBuffer {
+ public:
+  SnapshotBuffer();
+
+  /**
+   * The snapshot to fill (writer only).
+   */
+  Snapshot *back();
+
+  /**
+   * Publishes the back snapshot (writer only).
+   */
+  void publish();
+
+  /**
+   * Makes the last published snapshot the front one, if there is a new one (reader only).
+   * @param previous Receives the content of the old front snapshot.
+   * @return Whether there was a new snapshot.
+   */
+  bool acquire(Snapshot *previous);
+
+  /**
+   * The last acquired snapshot (reader only).
+   */
+  Snapshot *front();
+
+ private:
+  int exchange(int value);
+
+  Snapshot snapshots[3];
+  int back_index;
+  int front_index;
+  volatile int middle;  // Index of the middle snapshot, with FRESH when it was not acquired yet
+};
+
+#endif
@@ -1,4 +1,5 @@
 #include "TextureManager.h"
+#include "AssetPack.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -61,33 +62,15 @@ int TextureManager::buildColorTexture(GLuint *TID, unsigned char r, unsigned cha
 
 int TextureManager::loadTexture(GLuint *TID, char *filename, image_type_t type, bool wrap)
 {
-  FILE *file;
   image_t image;
-  int result = -1;
+  int result;
 
   if (!TID) return -1;
 
-  // open texture data
-  file = fopen(filename, "rb");
-  if (file == NULL) return -1;
-  switch (type) {
-  case RAW_IMAGE:
-    result = loadRAWImage(filename, file, 256, 256, &image);
-    break;
-  case BMP_IMAGE:
-    result = loadBMPImage(filename, file, &image);
-    break;
-  case BMP_ALPHA_IMAGE:
-    result = loadBMPAlphaImage(filename, file, &image);
-    break;
-  case PNG_IMAGE:
-    result = loadPNGImage(filename, file, &image);
-    break;
-  case JPG_IMAGE:
-    result = loadJPGImage(filename, file, &image);
-    break;
-  }
-  fclose(file);
+  // the preprocessed copy, if it is up to date
+  if (AssetPack::getInstance().loadTexture(TID, filename, type, wrap) == 0) return 0;
+
+  result = loadImage(filename, type, &image);
   if (result < 0) return -1;
 
   // allocate a texture name
@@ -113,6 +96,36 @@ int TextureManager::loadTexture(GLuint *TID, char *filename, image_type_t type,
   return 0;
 }
 
+int TextureManager::loadImage(char *filename, image_type_t type, image_t *image)
+{
+  FILE *file;
+  int result = -1;
+
+  // open texture data
+  file = fopen(filename, "rb");
+  if (file == NULL) return -1;
+  switch (type) {
+  case RAW_IMAGE:
+    result = loadRAWImage(filename, file, 256, 256, image);
+    break;
+  case BMP_IMAGE:
+    result = loadBMPImage(filename, file, image);
+    break;
+  case BMP_ALPHA_IMAGE:
+    result = loadBMPAlphaImage(filename, file, image);
+    break;
+  case PNG_IMAGE:
+    result = loadPNGImage(filename, file, image);
+    break;
+  case JPG_IMAGE:
+    result = loadJPGImage(filename, file, image);
+    break;
+  }
+  fclose(file);
+
+  return result;
+}
+
 /**
  * Code taken from: http://zarb.org/~gc/html/libpng.html
  */
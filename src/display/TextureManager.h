@@ -26,6 +26,12 @@ class TextureManager {
   ~TextureManager();
 
   int loadTexture(GLuint *TID, char *filename, image_type_t type, bool wrap = true);
+
+  /**
+   * Decodes an image without creating a texture.
+   * @return -1 on error, 0 for RGB data and 1 for RGBA data (to be freed by the caller).
+   */
+  int loadImage(char *filename, image_type_t type, image_t *image);
   int buildColorTexture(GLuint *TID, unsigned char r, unsigned char g, unsigned char b);
 
  private:
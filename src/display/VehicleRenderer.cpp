@@ -0,0 +1,568 @@
+#define GL_GLEXT_PROTOTYPES
+#include "VehicleRenderer.h"
+#ifdef MAC
+#include <OpenGL/glext.h>
+#else
+#include <GL/glext.h>
+#endif
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include <utils/Log.h>
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+#define SHADOW_HEIGHT 0.02
+
+// Same colors as the vehicles drawn one by one (by ID modulo 7)
+static const GLubyte palette[7][4] = {
+  {255, 0, 0, 255}, {0, 255, 0, 255}, {0, 0, 255, 255}, {255, 255, 0, 255},
+  {255, 0, 255, 255}, {0, 255, 255, 255}, {255, 255, 255, 255}
+};
+static const GLubyte shadow_color[4] = {0, 0, 0, 128};
+static const GLubyte wireframe_color[4] = {179, 179, 179, 255};
+
+// The model is rotated around the vertical axis and moved by the instance attributes
+static const char *vertex_shader =
+  "#version 120\n"
+  "attribute vec4 instance;\n"  // x, y, z, angle
+  "attribute vec4 instance_color;\n"
+  "uniform vec4 group_color;\n"
+  "uniform float textured;\n"
+  "varying vec4 color;\n"
+  "void main() {\n"
+  "  float c = cos(instance.w);\n"
+  "  float s = sin(instance.w);\n"
+  "  vec4 p = vec4(c*gl_Vertex.x + s*gl_Vertex.z, gl_Vertex.y, -s*gl_Vertex.x + c*gl_Vertex.z, 1.0);\n"
+  "  p.xyz += instance.xyz;\n"
+  "  vec4 eye = gl_ModelViewMatrix*p;\n"
+  "  gl_Position = gl_ProjectionMatrix*eye;\n"
+  "  gl_FogFragCoord = abs(eye.z);\n"
+  "  gl_TexCoord[0] = gl_MultiTexCoord0;\n"
+  "  color = mix(group_color, instance_color, textured);\n"
+  "}\n";
+
+static const char *fragment_shader =
+  "#version 120\n"
+  "uniform sampler2D texture0;\n"
+  "uniform float textured;\n"
+  "uniform float fog;\n"
+  "varying vec4 color;\n"
+  "void main() {\n"
+  "  vec4 c = color;\n"
+  "  if (textured > 0.5) c *= texture2D(texture0, gl_TexCoord[0].st);\n"
+  "  float f = mix(1.0, clamp((gl_Fog.end - gl_FogFragCoord)*gl_Fog.scale, 0.0, 1.0), fog);\n"
+  "  gl_FragColor = vec4(mix(gl_Fog.color.rgb, c.rgb, f), c.a);\n"
+  "}\n";
+
+static GLuint compileShader(GLenum type, const char *source)
+{
+  GLuint shader = glCreateShader(type);
+  glShaderSource(shader, 1, &source, NULL);
+  glCompileShader(shader);
+  GLint status = 0;
+  glGetShaderiv(shader, GL_COMPILE_STATUS, &status);
+  if (!status) {
+    char log[1024];
+    glGetShaderInfoLog(shader, sizeof(log), NULL, log);
+    fprintf(stderr, "Warning: Unable to compile the vehicle shader: %s\n", log);
+    glDeleteShader(shader);
+    return 0;
+  }
+  return shader;
+}
+
+static bool hasExtension(const char *name)
+{
+  const char *extensions = (const char *)glGetString(GL_EXTENSIONS);
+  if (!extensions) return false;
+  size_t n = strlen(name);
+  for (const char *p = strstr(extensions, name); p; p = strstr(p + n, name)) {
+    if ((p == extensions || p[-1] == ' ') && (p[n] == ' ' || p[n] == '\0')) return true;
+  }
+  return false;
+}
+
+VehicleRenderer::VehicleRenderer()
+{
+  for (int t = 0; t < 2; t++) models[t].buffer = 0;
+  instance_buffer = 0;
+  stream_buffer = 0;
+  viewer_x = 0.0;
+  viewer_z = 0.0;
+  realistic = true;
+  has_shadows = false;
+  checked = false;
+  buffers = false;
+  instancing = false;
+  program = 0;
+}
+
+VehicleRenderer::~VehicleRenderer()
+{
+  reset();
+}
+
+void VehicleRenderer::reset()
+{
+  if (buffers) {
+    for (int t = 0; t < 2; t++) {
+      if (models[t].buffer) glDeleteBuffers(1, &models[t].buffer);
+    }
+    if (instance_buffer) glDeleteBuffers(1, &instance_buffer);
+    if (stream_buffer) glDeleteBuffers(1, &stream_buffer);
+  }
+  if (program) glDeleteProgram(program);
+  for (int t = 0; t < 2; t++) {
+    models[t].buffer = 0;
+    models[t].vertices.clear();
+    models[t].groups.clear();
+  }
+  instance_buffer = 0;
+  stream_buffer = 0;
+  program = 0;
+  checked = false;
+}
+
+bool VehicleRenderer::initInstancing()
+{
+  if (!hasExtension("GL_ARB_draw_instanced") || !hasExtension("GL_ARB_instanced_arrays")) return false;
+
+  GLuint vs = compileShader(GL_VERTEX_SHADER, vertex_shader);
+  GLuint fs = compileShader(GL_FRAGMENT_SHADER, fragment_shader);
+  if (!vs || !fs) {
+    if (vs) glDeleteShader(vs);
+    if (fs) glDeleteShader(fs);
+    return false;
+  }
+  program = glCreateProgram();
+  glAttachShader(program, vs);
+  glAttachShader(program, fs);
+  glLinkProgram(program);
+  glDeleteShader(vs);
+  glDeleteShader(fs);
+  GLint status = 0;
+  glGetProgramiv(program, GL_LINK_STATUS, &status);
+  if (!status) {
+    char log[1024];
+    glGetProgramInfoLog(program, sizeof(log), NULL, log);
+    fprintf(stderr, "Warning: Unable to link the vehicle shader: %s\n", log);
+    glDeleteProgram(program);
+    program = 0;
+    return false;
+  }
+
+  instance_location = glGetAttribLocation(program, "instance");
+  instance_color_location = glGetAttribLocation(program, "instance_color");
+  group_color_location = glGetUniformLocation(program, "group_color");
+  textured_location = glGetUniformLocation(program, "textured");
+  fog_location = glGetUniformLocation(program, "fog");
+  return instance_location >= 0 && instance_color_location >= 0;
+}
+
+void VehicleRenderer::load(car_t type, Model_3DS *model)
+{
+  if (!checked) {
+    int major = 1, minor = 0;
+    const char *version = (const char *)glGetString(GL_VERSION);
+    if (version) sscanf(version, "%d.%d", &major, &minor);
+    buffers = major > 1 || minor >= 5;
+    instancing = major >= 2 && initInstancing();
+    checked = true;
+    Log::getStream(5) << "Vehicle rendering: " << (instancing ? "instanced" : (buffers ? "vertex buffers" : "vertex arrays")) << endl;
+  }
+
+  model_t *m = &models[type];
+  m->vertices.clear();
+  m->groups.clear();
+  if (!model->visible) return;
+
+  // The transforms of Model_3DS::Draw() are applied once to the vertices
+  glMatrixMode(GL_MODELVIEW);
+  for (int i = 0; i < model->numObjects; i++) {
+    Model_3DS::Object *o = &model->Objects[i];
+    GLfloat t[16];
+    glPushMatrix();
+    glLoadIdentity();
+    glTranslatef(model->pos.x, model->pos.y, model->pos.z);
+    glRotatef(model->rot.x, 1.0f, 0.0f, 0.0f);
+    glRotatef(model->rot.y, 0.0f, 1.0f, 0.0f);
+    glRotatef(model->rot.z, 0.0f, 0.0f, 1.0f);
+    glScalef(model->scale, model->scale, model->scale);
+    glTranslatef(o->pos.x, o->pos.y, o->pos.z);
+    glRotatef(o->rot.z, 0.0f, 0.0f, 1.0f);
+    glRotatef(o->rot.y, 0.0f, 1.0f, 0.0f);
+    glRotatef(o->rot.x, 1.0f, 0.0f, 0.0f);
+    glGetFloatv(GL_MODELVIEW_MATRIX, t);
+    glPopMatrix();
+
+    for (int j = 0; j < o->numMatFaces; j++) {
+      Model_3DS::MaterialFaces *f = &o->MatFaces[j];
+      Model_3DS::Material *mat = &model->Materials[f->MatIndex];
+      group_t g;
+      g.first = m->vertices.size();
+      g.count = f->numSubFaces;
+      g.texture = mat->textured ? mat->tex : 0;
+      // As glColor3f() would clamp them
+      g.color[0] = mat->color.r > 0 ? 1.0f : 0.0f;
+      g.color[1] = mat->color.g > 0 ? 1.0f : 0.0f;
+      g.color[2] = mat->color.b > 0 ? 1.0f : 0.0f;
+      for (int k = 0; k < f->numSubFaces; k++) {
+        int index = f->subFaces[k];
+        const float *p = &o->Vertexes[3*index];
+        model_vertex_t v;
+        v.x = t[0]*p[0] + t[4]*p[1] + t[8]*p[2] + t[12];
+        v.y = t[1]*p[0] + t[5]*p[1] + t[9]*p[2] + t[13];
+        v.z = t[2]*p[0] + t[6]*p[1] + t[10]*p[2] + t[14];
+        v.u = o->textured ? o->TexCoords[2*index] : 0.0f;
+        v.v = o->textured ? o->TexCoords[2*index+1] : 0.0f;
+        m->vertices.push_back(v);
+      }
+      if (g.count > 0) m->groups.push_back(g);
+    }
+  }
+
+  if (buffers && !m->vertices.empty()) {
+    glGenBuffers(1, &m->buffer);
+    glBindBuffer(GL_ARRAY_BUFFER, m->buffer);
+    glBufferData(GL_ARRAY_BUFFER, m->vertices.size()*sizeof(model_vertex_t), &m->vertices[0], GL_STATIC_DRAW);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+  }
+}
+
+const GLvoid *VehicleRenderer::bind(GLuint buffer, const void *data)
+{
+  // Offsets in the buffer object, or pointers to the client memory
+  if (buffers) {
+    glBindBuffer(GL_ARRAY_BUFFER, buffer);
+    return NULL;
+  }
+  return data;
+}
+
+void VehicleRenderer::begin(double x, double z, bool realistic)
+{
+  this->viewer_x = x;
+  this->viewer_z = z;
+  this->realistic = realistic;
+  for (int t = 0; t < 2; t++) instances[t].clear();
+  shadowed.clear();
+  solids.clear();
+  shadows.clear();
+  lines.clear();
+  has_shadows = false;
+}
+
+void VehicleRenderer::add(const vehicle_snapshot_t *car)
+{
+  if (!realistic) {
+    addWireframe(car);
+    return;
+  }
+
+  double dx = car->x - viewer_x;
+  double dz = car->y - viewer_z;
+  double dist2 = dx*dx + dz*dz;
+  int id = car->id % 7;
+  const GLubyte *color = palette[id >= 0 ? id : 6];
+  int type = car->type;
+
+  if (dist2 < MODEL_DISTANCE*MODEL_DISTANCE && !models[type].groups.empty()) {
+    instance_t i;
+    i.x = car->x;
+    i.y = 0.0f;
+    i.z = car->y;
+    // The models face the z axis
+    i.angle = M_PI/2.0 - car->yaw;
+    memcpy(i.color, color, 4);
+    instances[type].push_back(i);
+    shadowed.push_back(car);
+  } else if (dist2 < BOX_DISTANCE*BOX_DISTANCE) {
+    addBox(car, color, false);
+    shadowed.push_back(car);
+  } else {
+    addBox(car, color, true);
+  }
+}
+
+void VehicleRenderer::addVertex(vector<vertex_t> &v, const vehicle_snapshot_t *car, double x, double y, double z, const GLubyte *color, double shade)
+{
+  // (x, y, z) in the frame of the vehicle: x forward, y up
+  double yaw = car->yaw;
+  double c = cos(yaw), s = sin(yaw);
+  vertex_t p;
+  p.x = car->x + c*x - s*z;
+  p.y = y;
+  p.z = car->y + s*x + c*z;
+  p.color[0] = (GLubyte)(color[0]*shade);
+  p.color[1] = (GLubyte)(color[1]*shade);
+  p.color[2] = (GLubyte)(color[2]*shade);
+  p.color[3] = color[3];
+  v.push_back(p);
+}
+
+void VehicleRenderer::addBox(const vehicle_snapshot_t *car, const GLubyte *color, bool impostor)
+{
+  double front = car->front, rear = car->rear, side = car->side, top = car->top;
+
+  // Corners: x in {-rear, front}, y in {0, top}, z in {-side, side}
+  const double x[2] = {-rear, front};
+  const double y[2] = {0.0, top};
+  const double z[2] = {-side, side};
+  // Faces as quads of corner indices (x, y, z), the top first, shaded since nothing is lit
+  static const int faces[5][4][3] = {
+    {{0,1,0}, {1,1,0}, {1,1,1}, {0,1,1}},
+    {{1,0,0}, {1,1,0}, {1,1,1}, {1,0,1}},
+    {{0,0,0}, {0,1,0}, {0,1,1}, {0,0,1}},
+    {{0,0,0}, {1,0,0}, {1,1,0}, {0,1,0}},
+    {{0,0,1}, {1,0,1}, {1,1,1}, {0,1,1}},
+  };
+  static const double shades[5] = {1.0, 0.8, 0.8, 0.65, 0.65};
+  static const int triangles[6] = {0, 1, 2, 0, 2, 3};
+
+  // Far away, only the roof is drawn
+  int nfaces = impostor ? 1 : 5;
+  for (int f = 0; f < nfaces; f++) {
+    for (int k = 0; k < 6; k++) {
+      const int *c = faces[f][triangles[k]];
+      addVertex(solids, car, x[c[0]], y[c[1]], z[c[2]], color, shades[f]);
+    }
+  }
+}
+
+void VehicleRenderer::addWireframe(const vehicle_snapshot_t *car)
+{
+  double front = car->front, rear = car->rear, side = car->side, top = car->top;
+
+  const double x[2] = {-rear, front};
+  const double y[2] = {0.0, top};
+  const double z[2] = {-side, side};
+  for (int a = 0; a < 2; a++) {
+    for (int b = 0; b < 2; b++) {
+      // The 4 edges along each axis
+      addVertex(lines, car, x[0], y[a], z[b], wireframe_color, 1.0);
+      addVertex(lines, car, x[1], y[a], z[b], wireframe_color, 1.0);
+      addVertex(lines, car, x[a], y[0], z[b], wireframe_color, 1.0);
+      addVertex(lines, car, x[a], y[1], z[b], wireframe_color, 1.0);
+      addVertex(lines, car, x[a], y[b], z[0], wireframe_color, 1.0);
+      addVertex(lines, car, x[a], y[b], z[1], wireframe_color, 1.0);
+    }
+  }
+}
+
+void VehicleRenderer::addShadow(const vehicle_snapshot_t *car, double light_alpha, double light_beta)
+{
+  double FRONT = car->front, REAR = car->rear, SIDE = car->side, TOP = car->top;
+
+  // Ported shadow intersection of line with ground, in the frame of the
+  // models (x to the side, z forward)
+  double alpha = light_alpha;
+  double beta = light_beta + car->yaw;
+  while (beta >= M_PI) beta -= 2.0*M_PI;
+  while (beta <= -M_PI) beta += 2.0*M_PI;
+
+  double px[6], pz[6];
+  double x[3];
+  double y[3];
+  double z[3];
+
+  // Under the car and points to intersect
+  if (beta >= 0.0 && beta <= M_PI/2.0) {
+    px[0] = SIDE; pz[0] = -REAR;
+    px[1] = SIDE; pz[1] = FRONT;
+    px[2] = -SIDE; pz[2] = FRONT;
+    x[0] = FRONT; y[0] = -SIDE; z[0] = TOP;
+    x[1] = -REAR; y[1] = -SIDE; z[1] = TOP;
+    x[2] = -REAR; y[2] = SIDE; z[2] = TOP;
+  } else if (beta >= -M_PI && beta <= -M_PI/2.0) {
+    px[0] = SIDE; pz[0] = -REAR;
+    px[1] = -SIDE; pz[1] = -REAR;
+    px[2] = -SIDE; pz[2] = FRONT;
+    x[0] = FRONT; y[0] = -SIDE; z[0] = TOP;
+    x[1] = FRONT; y[1] = SIDE; z[1] = TOP;
+    x[2] = -REAR; y[2] = SIDE; z[2] = TOP;
+  } else if (beta > -M_PI/2.0 && beta < 0.0) {
+    px[0] = -SIDE; pz[0] = -REAR;
+    px[1] = -SIDE; pz[1] = FRONT;
+    px[2] = SIDE; pz[2] = FRONT;
+    x[0] = FRONT; y[0] = SIDE; z[0] = TOP;
+    x[1] = -REAR; y[1] = SIDE; z[1] = TOP;
+    x[2] = -REAR; y[2] = -SIDE; z[2] = TOP;
+  } else {
+    px[0] = -SIDE; pz[0] = -REAR;
+    px[1] = SIDE; pz[1] = -REAR;
+    px[2] = SIDE; pz[2] = FRONT;
+    x[0] = FRONT; y[0] = SIDE; z[0] = TOP;
+    x[1] = FRONT; y[1] = -SIDE; z[1] = TOP;
+    x[2] = -REAR; y[2] = -SIDE; z[2] = TOP;
+  }
+
+  // For each point intersection the light line with the ground
+  for (int i = 0; i < 3; i++) {
+    double t = -z[i]/sin(alpha);
+    px[3+i] = cos(alpha)*sin(beta)*t + y[i];
+    pz[3+i] = cos(alpha)*cos(beta)*t + x[i];
+  }
+
+  // The convex polygon as a fan (the side axis of the models is -z in the frame of the vehicle)
+  for (int i = 1; i < 5; i++) {
+    addVertex(shadows, car, pz[0], SHADOW_HEIGHT, -px[0], shadow_color, 1.0);
+    addVertex(shadows, car, pz[i], SHADOW_HEIGHT, -px[i], shadow_color, 1.0);
+    addVertex(shadows, car, pz[i+1], SHADOW_HEIGHT, -px[i+1], shadow_color, 1.0);
+  }
+}
+
+void VehicleRenderer::upload(bool shadows, double light_alpha, double light_beta)
+{
+  if (shadows) {
+    for (unsigned int i = 0; i < shadowed.size(); i++) {
+      addShadow(shadowed[i], light_alpha, light_beta);
+    }
+  }
+  has_shadows = !this->shadows.empty();
+
+  if (!buffers) return;
+
+  // The instances of both types in one buffer
+  if (instancing) {
+    size_t n = instances[0].size() + instances[1].size();
+    if (!instance_buffer) glGenBuffers(1, &instance_buffer);
+    glBindBuffer(GL_ARRAY_BUFFER, instance_buffer);
+    glBufferData(GL_ARRAY_BUFFER, n*sizeof(instance_t), NULL, GL_STREAM_DRAW);
+    if (!instances[0].empty())
+      glBufferSubData(GL_ARRAY_BUFFER, 0, instances[0].size()*sizeof(instance_t), &instances[0][0]);
+    if (!instances[1].empty())
+      glBufferSubData(GL_ARRAY_BUFFER, instances[0].size()*sizeof(instance_t),
+                      instances[1].size()*sizeof(instance_t), &instances[1][0]);
+  }
+
+  // The boxes, the shadows right after them and the wireframes
+  size_t n = solids.size() + this->shadows.size() + lines.size();
+  if (!stream_buffer) glGenBuffers(1, &stream_buffer);
+  glBindBuffer(GL_ARRAY_BUFFER, stream_buffer);
+  glBufferData(GL_ARRAY_BUFFER, n*sizeof(vertex_t), NULL, GL_STREAM_DRAW);
+  size_t offset = 0;
+  if (!solids.empty())
+    glBufferSubData(GL_ARRAY_BUFFER, 0, solids.size()*sizeof(vertex_t), &solids[0]);
+  offset += solids.size();
+  if (!this->shadows.empty())
+    glBufferSubData(GL_ARRAY_BUFFER, offset*sizeof(vertex_t), this->shadows.size()*sizeof(vertex_t), &this->shadows[0]);
+  offset += this->shadows.size();
+  if (!lines.empty())
+    glBufferSubData(GL_ARRAY_BUFFER, offset*sizeof(vertex_t), lines.size()*sizeof(vertex_t), &lines[0]);
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+void VehicleRenderer::drawModels()
+{
+  glEnableClientState(GL_VERTEX_ARRAY);
+  glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+
+  if (instancing) {
+    glUseProgram(program);
+    glUniform1f(fog_location, glIsEnabled(GL_FOG) ? 1.0f : 0.0f);
+    glEnableVertexAttribArray(instance_location);
+    glEnableVertexAttribArray(instance_color_location);
+    glVertexAttribDivisorARB(instance_location, 1);
+    glVertexAttribDivisorARB(instance_color_location, 1);
+  }
+
+  size_t first = 0;
+  for (int t = 0; t < 2; t++) {
+    model_t *m = &models[t];
+    size_t n = instances[t].size();
+    if (n == 0 || m->groups.empty()) {
+      first += n;
+      continue;
+    }
+
+    const char *base = (const char *)bind(m->buffer, &m->vertices[0]);
+    glVertexPointer(3, GL_FLOAT, sizeof(model_vertex_t), base);
+    glTexCoordPointer(2, GL_FLOAT, sizeof(model_vertex_t), base + offsetof(model_vertex_t, u));
+
+    if (instancing) {
+      // One call per material for all the vehicles of the type
+      const char *i = (const char *)bind(instance_buffer, NULL) + first*sizeof(instance_t);
+      glVertexAttribPointer(instance_location, 4, GL_FLOAT, GL_FALSE, sizeof(instance_t), i);
+      glVertexAttribPointer(instance_color_location, 4, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(instance_t),
+                            i + offsetof(instance_t, color));
+      for (unsigned int j = 0; j < m->groups.size(); j++) {
+        group_t *g = &m->groups[j];
+        if (g->texture) {
+          glEnable(GL_TEXTURE_2D);
+          glBindTexture(GL_TEXTURE_2D, g->texture);
+        }
+        glUniform1f(textured_location, g->texture ? 1.0f : 0.0f);
+        glUniform4f(group_color_location, g->color[0], g->color[1], g->color[2], 1.0f);
+        glDrawArraysInstancedARB(GL_TRIANGLES, g->first, g->count, n);
+        glDisable(GL_TEXTURE_2D);
+      }
+    } else {
+      for (size_t k = 0; k < n; k++) {
+        instance_t *i = &instances[t][k];
+        glPushMatrix();
+        glTranslatef(i->x, i->y, i->z);
+        glRotatef(i->angle/M_PI*180.0, 0.0, 1.0, 0.0);
+        for (unsigned int j = 0; j < m->groups.size(); j++) {
+          group_t *g = &m->groups[j];
+          if (g->texture) {
+            glEnable(GL_TEXTURE_2D);
+            glBindTexture(GL_TEXTURE_2D, g->texture);
+            glColor4ubv(i->color);
+          } else {
+            glColor3fv(g->color);
+          }
+          glDrawArrays(GL_TRIANGLES, g->first, g->count);
+          glDisable(GL_TEXTURE_2D);
+        }
+        glPopMatrix();
+      }
+    }
+    first += n;
+  }
+
+  if (instancing) {
+    glVertexAttribDivisorARB(instance_location, 0);
+    glVertexAttribDivisorARB(instance_color_location, 0);
+    glDisableVertexAttribArray(instance_location);
+    glDisableVertexAttribArray(instance_color_location);
+    glUseProgram(0);
+  }
+  glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+  glDisableClientState(GL_VERTEX_ARRAY);
+  if (buffers) glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+void VehicleRenderer::draw(bool shadows)
+{
+  drawModels();
+
+  glEnableClientState(GL_VERTEX_ARRAY);
+  glEnableClientState(GL_COLOR_ARRAY);
+  size_t nshadows = (shadows && has_shadows) ? this->shadows.size() : 0;
+  if (buffers) {
+    const char *base = (const char *)bind(stream_buffer, NULL);
+    glVertexPointer(3, GL_FLOAT, sizeof(vertex_t), base);
+    glColorPointer(4, GL_UNSIGNED_BYTE, sizeof(vertex_t), base + offsetof(vertex_t, color));
+    // The shadows are stored right after the boxes: one call for both
+    if (solids.size() + nshadows > 0) glDrawArrays(GL_TRIANGLES, 0, solids.size() + nshadows);
+    if (!lines.empty()) {
+      glLineWidth(1);
+      glDrawArrays(GL_LINES, solids.size() + this->shadows.size(), lines.size());
+    }
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+  } else {
+    vector<vertex_t> *v[3] = {&solids, &this->shadows, &lines};
+    for (int k = 0; k < 3; k++) {
+      if (v[k]->empty() || (k == 1 && !nshadows)) continue;
+      glVertexPointer(3, GL_FLOAT, sizeof(vertex_t), &(*v[k])[0].x);
+      glColorPointer(4, GL_UNSIGNED_BYTE, sizeof(vertex_t), (*v[k])[0].color);
+      glDrawArrays(k == 2 ? GL_LINES : GL_TRIANGLES, 0, v[k]->size());
+    }
+  }
+  glDisableClientState(GL_COLOR_ARRAY);
+  glDisableClientState(GL_VERTEX_ARRAY);
+}
@@ -0,0 +1,146 @@
+#ifndef VEHICLE_RENDERER_H
+#define VEHICLE_RENDERER_H
+
+#ifdef MAC
+#include <GLUT/glut.h>
+#else
+#include <GL/glut.h>
+#endif
+#include <vector>
+#include <agents/Car.h>
+#include "Snapshot.h"
+#include "Model_3DS.h"
+
+using namespace std;
+
+// Vehicles closer than this are drawn with their model [m]
+#define MODEL_DISTANCE 150.0
+// Vehicles closer than this are drawn as boxes, the others as flat impostors [m]
+#define BOX_DISTANCE 500.0
+
+/**
+ * @brief Batched rendering of the vehicles.
+ *
+ * The vehicles are sorted once per frame by level of detail: the closest
+ * ones are drawn with the 3DS models, the ones up to BOX_DISTANCE as
+ * colored boxes and the farther ones as flat impostors. The models are
+ * kept in one vertex buffer per vehicle type. When the GL supports it
+ * (GLSL with ARB_draw_instanced and ARB_instanced_arrays), all the models
+ * of a type are drawn with one instanced call per material from a buffer
+ * of per-instance attributes (position, yaw and color), otherwise one
+ * transform per vehicle is still needed. The boxes, impostors, shadows
+ * and wireframes are expanded on the CPU into a single vertex stream so
+ * that they take one draw call, the shadows in the same pass as the boxes.
+ * Everything is uploaded once per frame by upload(), so that the vehicles
+ * can be drawn twice (e.g. for the reflections in the rain).
+ */
+class VehicleRenderer
+{
+ public:
+  VehicleRenderer();
+  ~VehicleRenderer();
+
+  /**
+   * Builds the vertex buffer of a vehicle model (the GL context must be current).
+   * @param type The vehicle type drawn with that model.
+   * @param model The loaded model.
+   */
+  void load(car_t type, Model_3DS *model);
+
+  /**
+   * Releases the GL objects (when the context is recreated).
+   */
+  void reset();
+
+  /**
+   * Starts a new frame.
+   * @param x The x coordinate of the viewer.
+   * @param z The z coordinate of the viewer.
+   * @param realistic Whether to draw models, boxes and impostors (otherwise wireframes).
+   */
+  void begin(double x, double z, bool realistic);
+
+  /**
+   * Adds a vehicle to the frame.
+   * @param car The pose of the vehicle.
+   */
+  void add(const vehicle_snapshot_t *car);
+
+  /**
+   * Uploads the vehicles of the frame to the GL.
+   * @param shadows Whether to compute the shadows.
+   * @param light_alpha The angle of the light with the ground.
+   * @param light_beta The angle of the light around the vertical axis.
+   */
+  void upload(bool shadows, double light_alpha, double light_beta);
+
+  /**
+   * Draws the vehicles of the frame.
+   * @param shadows Whether to draw the shadows (if they were uploaded).
+   */
+  void draw(bool shadows);
+
+ private:
+  typedef struct {
+    GLfloat x, y, z;
+    GLfloat u, v;
+  } model_vertex_t;
+
+  typedef struct {
+    GLint first;
+    GLsizei count;
+    GLuint texture;  // 0 if the material has a color instead
+    GLfloat color[3];
+  } group_t;
+
+  typedef struct {
+    GLuint buffer;
+    vector<model_vertex_t> vertices;
+    vector<group_t> groups;
+  } model_t;
+
+  typedef struct {
+    GLfloat x, y, z;
+    GLfloat angle;  // Around the vertical axis [rad]
+    GLubyte color[4];
+  } instance_t;
+
+  typedef struct {
+    GLfloat x, y, z;
+    GLubyte color[4];
+  } vertex_t;
+
+  void addBox(const vehicle_snapshot_t *car, const GLubyte *color, bool impostor);
+  void addShadow(const vehicle_snapshot_t *car, double light_alpha, double light_beta);
+  void addWireframe(const vehicle_snapshot_t *car);
+  void addVertex(vector<vertex_t> &v, const vehicle_snapshot_t *car, double x, double y, double z, const GLubyte *color, double shade);
+  void drawModels();
+  bool initInstancing();
+  const GLvoid *bind(GLuint buffer, const void *data);
+
+  model_t models[2];
+  vector<instance_t> instances[2];
+  vector<const vehicle_snapshot_t *> shadowed;
+  vector<vertex_t> solids;
+  vector<vertex_t> shadows;
+  vector<vertex_t> lines;
+  GLuint instance_buffer;
+  GLuint stream_buffer;
+  double viewer_x;
+  double viewer_z;
+  bool realistic;
+  bool has_shadows;
+
+  // GL capabilities
+  bool checked;
+  bool buffers;
+  bool instancing;
+  GLuint program;
+  GLint instance_location;
+  GLint instance_color_location;
+  GLint group_color_location;
+  GLint textured_location;
+  GLint fog_location;
+};
+
+#endif
@@ -3,17 +3,24 @@
 #include <stdlib.h>
 #include <time.h>
 #include "Simulator.h"
+#include <utils/Stats.h>
+#include <utils/Trace.h>
+#include <utils/Memory.h>
 
 #ifdef LUA
 #include <bindings/lua/LuaBinding.h>
 #endif
 
 #define MIN_CAR_SPACING 10.0
+// Threads are rebalanced when they differ by more than that many cars
+#define BALANCE_THRESHOLD 32
 
 #define MIN(x,y) (((x)>(y))?(y):(x))
 
 Simulator::Simulator(gengetopt_args_info *options, Map *map)
 {
+  Memory::Scope scope(Memory::MEM_SIMULATOR);
+
   /* Save options */
   this->options = options;
 
@@ -32,7 +39,13 @@ Simulator::Simulator(gengetopt_args_info *options, Map *map)
   trackedCar = NULL;
 
   /* Random seed */
-  srand(time(NULL));
+  srand(options->seed_given ? options->seed_arg : time(NULL));
+
+  /* Performance counters */
+  Stats::init(options->ncpu_arg, options->stats_given ? options->stats_arg : NULL, options->stats_period_arg,
+              options->hw_counters_given && options->hw_counters_arg);
+  Trace::init(options->ncpu_arg, options->trace_given ? options->trace_arg : NULL,
+              options->trace_start_arg, options->trace_end_arg);
 
   /* Set weather conditions */
   setWeather(NICE);
@@ -63,12 +76,21 @@ Simulator::Simulator(gengetopt_args_info *options, Map *map)
       threads_arg[i].id = i;
       threads_arg[i].s = this;
     }
+    task_generation = 0;
+    tasks_pending = 0;
+    pthread_mutex_init(&workers_mutex, NULL);
+    pthread_cond_init(&task_cond, NULL);
+    pthread_cond_init(&done_cond, NULL);
+    for (int i = 0; i < options->ncpu_arg; i++) {
+      pthread_create(&threads[i], NULL, thread_worker, &threads_arg[i]); // We assume everything works
+    }
   }
 
   /* Initialize the mutex: this mutex should be taken before modifying cars */
   pthread_mutex_init(&(this->mutex), NULL);
 
   /* Initialize cars to the proper density */
+  unbalanced = true;
   lock();
   for (unsigned int i = 0; i < map->segments.size(); i++) {
     Segment *s = map->segments[i];
@@ -80,9 +102,10 @@ Simulator::Simulator(gengetopt_args_info *options, Map *map)
         double dp = ((length - MIN_CAR_SPACING)/(double)ncars)/l->radius;
         for (int k = 0; k < ncars; k++) {
           Car *car = new Car(current_car_id, options);
+          Stats::count(Stats::CARS_CREATED);
           cars.push_back(car);
           if (options->ncpu_arg > 0) {
-            threads_arg[car->getID() % options->ncpu_arg].cars.push_back(car);
+            threads_arg[getWorker(car)].cars.push_back(car);
           }
           car->setLane(l);
           car->setPosition(dp*(double)k);
@@ -99,9 +122,10 @@ Simulator::Simulator(gengetopt_args_info *options, Map *map)
         double dp = (s->length - MIN_CAR_SPACING)/(double)ncars;
         for (int k = 0; k < ncars; k++) {
           Car *car = new Car(current_car_id, options);
+          Stats::count(Stats::CARS_CREATED);
           cars.push_back(car);
           if (options->ncpu_arg > 0) {
-            threads_arg[car->getID() % options->ncpu_arg].cars.push_back(car);
+            threads_arg[getWorker(car)].cars.push_back(car);
           }
           car->setLane(l);
           car->setPosition(dp*(double)k);
@@ -136,6 +160,22 @@ Simulator::~Simulator()
   cars.clear();
   unlock();
 
+  /* Stop the workers (they release their counters) */
+  if (options->ncpu_arg > 0) {
+    runWorkers(TASK_QUIT);
+    for (int i = 0; i < options->ncpu_arg; i++)
+      pthread_join(threads[i], NULL);
+    pthread_cond_destroy(&task_cond);
+    pthread_cond_destroy(&done_cond);
+    pthread_mutex_destroy(&workers_mutex);
+  }
+
+#ifdef LUA
+  LuaBinding::getInstance().writeProfile();
+#endif
+  Stats::stop();
+  Trace::stop();
+
   pthread_mutex_destroy(&(this->mutex));
 
   /* Destroy threading */
@@ -149,7 +189,9 @@ Simulator::~Simulator()
 
 void Simulator::lock()
 {
+  double start = Trace::begin();
   pthread_mutex_lock(&(this->mutex));
+  Trace::end("lock", start);
 }
 
 void Simulator::unlock()
@@ -244,6 +286,7 @@ void Simulator::trackingOff()
 
 void Simulator::step(double dt)
 {
+  Memory::Scope scope(Memory::MEM_SIMULATOR);
   static unsigned int steps_count = 0;
   static double current_time = 0.0;
   vector<neighbor_t> neighbors;
@@ -253,11 +296,19 @@ void Simulator::step(double dt)
   Log::getStream(9) << "Simulation step #" << steps_count
                     << " at time " << current_time << " seconds" << endl;
 
+  Trace::setTime(current_time);
+  double step_start = Trace::begin();
+  double start = Stats::begin();
+
   /* Update the infrastructure */
 #ifdef LUA
-  // If there is a lua binding then call the update function there
-  LuaBinding::getInstance().callControlUpdate(map->getLuaInfrastructure(), current_time, dt);
+  // If there is a lua binding then call the update function there (when due)
+  LuaBinding::getInstance().collectControl();
+  if (LuaBinding::getInstance().isControlDue(current_time)) {
+    LuaBinding::getInstance().callControlUpdate(map->getLuaInfrastructure(), current_time, dt);
+  }
 #endif
+  start = Stats::lap(Stats::CONTROL, start);
 
   /* Create new cars if needed */
   lock();
@@ -282,6 +333,7 @@ void Simulator::step(double dt)
 
       if (!l->new_car) {
         l->new_car = new Car(current_car_id, options);
+        Stats::count(Stats::CARS_CREATED);
         l->new_car->setLane(l);
         l->new_car->setPosition(0.0);
         current_car_id++;
@@ -308,7 +360,8 @@ void Simulator::step(double dt)
         l->new_car = NULL;
         cars.push_back(car);
         if (options->ncpu_arg > 0) {
-          threads_arg[car->getID() % options->ncpu_arg].cars.push_back(car);
+          threads_arg[getWorker(car)].cars.push_back(car);
+          unbalanced = true;
         }
         l->cars.push_back(car);
         if (l->force_entry) l->force_entry--;
@@ -327,6 +380,8 @@ void Simulator::step(double dt)
     }
   }
 
+  start = Stats::lap(Stats::ENTRIES, start);
+
   /* Update sensors -- This has to come here, otherwise the occupied status of
    the sensors is wrong! */
   for (unsigned int i = 0; i < map->sensors.size(); i++) {
@@ -335,33 +390,26 @@ void Simulator::step(double dt)
   for (unsigned int i = 0; i < map->actuators.size(); i++) {
     map->actuators[i]->update(dt);
   }
+  start = Stats::lap(Stats::SENSORS, start);
 
-  /* Start threading */
+  /* Simulate car behaviors */
   for (int i = 0; i < options->ncpu_arg; i++) {
     threads_arg[i].dt = dt;
-    pthread_create(&threads[i], NULL, thread_simulate, &threads_arg[i]); // We assume everything works
-  }
-  
-  /* Simulate car behaviors */
-  if (options->ncpu_arg == 0) {
-    for (unsigned int i = 0; i < cars.size(); i++) {
-      neighbors.clear();
-      getNeighbors(cars[i], &neighbors);
-      cars[i]->simulate(dt, neighbors);
-    }
   }
-  
-  /* Finish threading */
-  for (int i = 0; i < options->ncpu_arg; i++)
-    pthread_join(threads[i], NULL);
-
-  /* Start threading */
-  for (int i = 0; i < options->ncpu_arg; i++) {
-    pthread_create(&threads[i], NULL, thread_move, &threads_arg[i]);
+  if (options->ncpu_arg > 0) {
+    runWorkers(TASK_SIMULATE);
+  } else {
+#ifdef LUA
+    LuaBinding::getInstance().collect(0, 0);
+#endif
+    simulateCars(cars, cars_neighbors, dt);
   }
+  start = Stats::lap(Stats::SIMULATE, start);
 
   /* Update car position */
-  if (options->ncpu_arg == 0) {
+  if (options->ncpu_arg > 0) {
+    runWorkers(TASK_MOVE);
+  } else {
     for (unsigned int i = 0; i < cars.size(); i++) {
       Car *car = cars[i];
       
@@ -401,9 +449,7 @@ void Simulator::step(double dt)
     }
   }
 
-  /* Finish threading */
-  for (int i = 0; i < options->ncpu_arg; i++)
-    pthread_join(threads[i], NULL);
+  start = Stats::lap(Stats::MOVE, start);
 
   /* Delete cars */
   for (unsigned int i = 0; i < cars.size(); i++) {
@@ -412,15 +458,22 @@ void Simulator::step(double dt)
                         << " seconds (" << current_time << ")" << endl;
       clearCar(cars[i]);
       delete cars[i];
+      Stats::count(Stats::CARS_DELETED);
       cars.erase(cars.begin() + i);
+      unbalanced = true;
       i--;
     }
   }
+  // The load of the threads only changes with the cars entering and leaving
+  if (unbalanced) balanceWorkers();
   unlock();
+  Stats::lap(Stats::DELETE, start);
+  Trace::end("step", step_start);
 
   /* Increment static counters */
   steps_count++;
   current_time += dt;
+  Stats::endStep(current_time, cars.size());
 
   /* Update tracked car */
   if (trackedCar)
@@ -441,30 +494,150 @@ void Simulator::clearCar(Car *car)
   if (car == trackedCar) trackedCar = NULL;
 }
 
+int Simulator::getWorker(Car *car)
+{
+#ifdef LUA
+  // All the cars of a LUA state go to the same thread
+  return car->getControl()->getLuaCar()->getState() % options->ncpu_arg;
+#else
+  return car->getID() % options->ncpu_arg;
+#endif
+}
+
+void Simulator::balanceWorkers()
+{
+  unbalanced = false;
+  int n = options->ncpu_arg;
+#ifdef LUA
+  // Threads without a LUA state of their own cannot take cars
+  if (n > LuaBinding::getInstance().getStateCount()) n = LuaBinding::getInstance().getStateCount();
+  // Nor can cars whose script state cannot be carried over
+  if (!LuaBinding::getInstance().canMigrate()) return;
+#endif
+  if (n < 2) return;
+
+  int most = 0, least = 0;
+  for (int i = 1; i < n; i++) {
+    if (threads_arg[i].cars.size() > threads_arg[most].cars.size()) most = i;
+    if (threads_arg[i].cars.size() < threads_arg[least].cars.size()) least = i;
+  }
+  unsigned int diff = threads_arg[most].cars.size() - threads_arg[least].cars.size();
+  if (diff <= BALANCE_THRESHOLD) return;
+
+  // Move the last cars of the busiest thread (to its state for LUA). A car
+  // that could not be moved stays where it is: its state is still owned
+  // by the busiest thread.
+  for (unsigned int k = 0; k < diff/2; k++) {
+    Car *car = threads_arg[most].cars.back();
+#ifdef LUA
+    if (LuaBinding::getInstance().migrate(car->getControl()->getLuaCar(), least) != 0) break;
+#endif
+    threads_arg[most].cars.pop_back();
+    threads_arg[least].cars.push_back(car);
+  }
+}
+
+void Simulator::runWorkers(int task)
+{
+  pthread_mutex_lock(&workers_mutex);
+  this->task = task;
+  tasks_pending = options->ncpu_arg;
+  task_generation++;
+  pthread_cond_broadcast(&task_cond);
+  while (task != TASK_QUIT && tasks_pending > 0) {
+    pthread_cond_wait(&done_cond, &workers_mutex);
+  }
+  pthread_mutex_unlock(&workers_mutex);
+}
+
+void *Simulator::thread_worker(void *ptr)
+{
+  Simulator *s = ((thread_arg_t *)ptr)->s;
+  int generation = 0;
+
+  // The counters and the trace buffer of the worker are bound once
+  Stats::attach(((thread_arg_t *)ptr)->id + 1);
+  Trace::attach(((thread_arg_t *)ptr)->id + 1);
+
+  while (true) {
+    pthread_mutex_lock(&s->workers_mutex);
+    while (s->task_generation == generation) {
+      pthread_cond_wait(&s->task_cond, &s->workers_mutex);
+    }
+    generation = s->task_generation;
+    int task = s->task;
+    pthread_mutex_unlock(&s->workers_mutex);
+
+    if (task == TASK_QUIT) break;
+    if (task == TASK_SIMULATE) thread_simulate(ptr);
+    else thread_move(ptr);
+
+    pthread_mutex_lock(&s->workers_mutex);
+    if (--s->tasks_pending == 0) pthread_cond_signal(&s->done_cond);
+    pthread_mutex_unlock(&s->workers_mutex);
+  }
+
+  Stats::detach();
+  return NULL;
+}
+
 void *Simulator::thread_simulate(void *ptr)
 {
-  vector<neighbor_t> neighbors;
-  
+  Memory::Scope scope(Memory::MEM_SIMULATOR);
   Simulator *s = ((thread_arg_t *)ptr)->s;
   double dt = ((thread_arg_t *)ptr)->dt;
   vector<Car *> &cars = ((thread_arg_t *)ptr)->cars;
 
+  double start = Stats::begin();
+
+#ifdef LUA
+  // The states of the worker are not running anywhere else
+  LuaBinding::getInstance().collect(((thread_arg_t *)ptr)->id, s->options->ncpu_arg);
+#endif
+
   /* Simulate car behaviors */
+  s->simulateCars(cars, ((thread_arg_t *)ptr)->neighbors, dt);
+
+  Stats::lap(Stats::SIMULATE, start);
+
+  return NULL;
+}
+
+void Simulator::simulateCars(vector<Car *> &cars, vector< vector<neighbor_t> > &neighbors, double dt)
+{
+  // The neighbors vectors are kept from one step to the next to avoid reallocations
+  if (neighbors.size() < cars.size()) neighbors.resize(cars.size());
   for (unsigned int i = 0; i < cars.size(); i++) {
-    neighbors.clear();
-    s->getNeighbors(cars[i], &neighbors);
-    cars[i]->simulate(dt, neighbors);
+    neighbors[i].clear();
+    getNeighbors(cars[i], &neighbors[i]);
   }
 
-  return NULL;
+#ifdef LUA
+  // If the script can handle all cars at once, do so (the cars of a
+  // state that failed fall back to their own think())
+  if (LuaBinding::getInstance().callThinkBatch(cars, neighbors, dt) == 0) {
+    for (unsigned int i = 0; i < cars.size(); i++) {
+      bool batched = LuaBinding::getInstance().isBatched(cars[i]->getControl()->getLuaCar());
+      cars[i]->simulate(dt, neighbors[i], false, !batched);
+    }
+    return;
+  }
+#endif
+
+  for (unsigned int i = 0; i < cars.size(); i++) {
+    cars[i]->simulate(dt, neighbors[i]);
+  }
 }
 
 void *Simulator::thread_move(void *ptr)
 {
+  Memory::Scope scope(Memory::MEM_SIMULATOR);
   Simulator *s = ((thread_arg_t *)ptr)->s;
   double dt = ((thread_arg_t *)ptr)->dt;
   vector<Car *> &cars = ((thread_arg_t *)ptr)->cars;
 
+  double start = Stats::begin();
+
   /* Update car position */
   for (unsigned int i = 0; i < cars.size(); i++) {
     Car *car = cars[i];
@@ -509,6 +682,7 @@ void *Simulator::thread_move(void *ptr)
     }
   }
 
+  Stats::lap(Stats::MOVE, start);
   return NULL;
 }
 
@@ -610,7 +784,9 @@ Car *Simulator::getExtendedNextCar(Car *c, Lane *l, double position, double *dis
   double d;
   *distance = 0.0;
 
+  Stats::count(Stats::LANE_WALKS);
   while (!car && l && *distance < visibility) {
+    Stats::count(Stats::LANE_WALK_LANES);
     car = getNextCar(c, l, position, &d);
     if (!car) {
       if (l->next && l->next->prev == l) {
@@ -640,7 +816,9 @@ Car *Simulator::getExtendedPrevCar(Car *c, Lane *l, double position, double *dis
   double d;
   *distance = 0.0;
 
+  Stats::count(Stats::LANE_WALKS);
   while (!car && l && *distance < visibility) {
+    Stats::count(Stats::LANE_WALK_LANES);
     car = getPrevCar(c, l, position, &d);
     if (!car) {
       if (l->prev) {
@@ -672,6 +850,7 @@ void Simulator::moveCarAlongStraight(Car *car, double dx)
   position += dx;
 
   // Trigger sensors
+  Stats::count(Stats::SENSOR_TRIGGERS, l->sensors.size());
   for (unsigned int i = 0; i < l->sensors.size(); i++) {
     l->sensors[i]->trigger(car, car->getPosition(), position);
   }
@@ -730,6 +909,7 @@ void Simulator::moveCarAlongCircular(Car *car, double dx)
   position += dx/l->radius;
 
   // Trigger sensors
+  Stats::count(Stats::SENSOR_TRIGGERS, l->sensors.size());
   for (unsigned int i = 0; i < l->sensors.size(); i++) {
     l->sensors[i]->trigger(car, car->getPosition(), position);
   }
@@ -794,6 +974,7 @@ int Simulator::exchangeCar(Car *car, Lane *o, Lane *n, bool force)
       if (d < 1.0) {
         // Ooops cannot change lanes
         pthread_mutex_unlock(&(n->cars_mutex));
+        Stats::count(Stats::EXCHANGE_REJECTS);
         return -1;
       }
     }
@@ -260,6 +260,12 @@
  * the same functions. Hence self is bound to be different at each call of this
  * function. This function does not return any values.
  *
+ * Numeric per-vehicle variables can also be declared as slots in a global array
+ * (e.g. <em>slots = { "max_speed", "llc" }</em>). They are then stored natively in
+ * CarControl (see CarControl::getSlot()) and start at 0. Slot i is the i-th name of
+ * the array counting from 0: <em>self:setSlot(0, 10.0)</em> sets max_speed and
+ * <em>local max_speed, llc = self:getSlots()</em> reads them all in one call.
+ *
  * @code
  * function think(self, dt, neighbors)
  * @endcode
@@ -275,6 +281,8 @@
  *                       of this array is an array indexed with 2 keys: <em>car</em> and <em>distance</em>.
  *                       Hence you can access the car pointer of the leading vehicle with <em>neighbors[LEAD].car</em>
  *                       and the longitudinal distance to that car with <em>neighbors[LEAD].distance</em>.
+ *                       The neighbors table is reused from one call to the next, copy the values
+ *                       you want to keep instead of keeping a reference to the table.
  *
  * This function needs to return 2 values: first an acceleration (that will be applied to the car
  * until the next time-step) and a lane change command. As an example, for make the car
@@ -282,6 +290,27 @@
  * To change to the right lane breaking at -1.0 m/s2 one could do <em>return -1.0, 1</em> and to not do anything
  * <em>return 0, 0</em>.
  *
+ * Optionally, the script can also provide:
+ * @code
+ * function think_batch(cars, dt)
+ * @endcode
+ *
+ * When it exists, this function is called once per group of cars (all the cars handled by the same
+ * thread) instead of calling think() for each car. <b>cars</b> is an array (indexed from 1) whose
+ * elements have the keys <em>car</em> (the LuaCar), <em>speed</em>, <em>position</em> and
+ * <em>neighbors</em> (the same table think() receives). It should return two arrays with the
+ * acceleration and the lane change of each car (in the same order). If it returns nothing, the
+ * commands given with <em>LuaCar:setAcceleration()</em> and <em>LuaCar:setLaneChange()</em> are kept.
+ * The tables given to think_batch() are reused from one call to the next.
+ *
+ * When disim is compiled with LuaJIT (LUAJIT = 1 in Makefile.include), think() receives a fourth
+ * argument and think_batch() a third one: a FFI pointer (<em>ffi_car_t *</em>, see bindings/lua/LuaFFI.h)
+ * to a plain copy of the vehicle state. Its fields can be read without calling into C, e.g.
+ * <em>car.speed</em>, <em>car.front</em> or <em>car.neighbors[LEAD].distance</em> (the id of a
+ * missing neighbor is -1). <em>car.slots[i]</em> reads and writes the slots of the car directly
+ * (it is NULL if the script declares none). In think_batch(), <em>views[k]</em> matches <em>cars[k]</em>.
+ * These views are only valid during the call. With LUA 5.1 the extra argument is nil.
+ *
  * @code
  * function destroy(self)
  * @endcode
@@ -351,6 +380,7 @@ typedef struct {
   Simulator *s;
   double dt;
   vector<Car *> cars;
+  vector< vector<neighbor_t> > neighbors;
 } thread_arg_t;
 
 /**
@@ -365,6 +395,8 @@ typedef struct {
  * @author Sven Gowal (svenadrian.gowal@epfl.ch)
  */
 class Simulator {
+  friend class MicroBench;
+
  public:
 
   /**
@@ -480,7 +512,12 @@ class Simulator {
   void moveCarAlongStraight(Car *car, double dx);
   void moveCarAlongCircular(Car *car, double dx);
   void clearCar(Car *car);
+  void simulateCars(vector<Car *> &cars, vector< vector<neighbor_t> > &neighbors, double dt);
+  int getWorker(Car *car);
+  void balanceWorkers();
   int exchangeCar(Car *car, Lane *o, Lane *n, bool force=false);
+  void runWorkers(int task);
+  static void *thread_worker(void *ptr);
   static void *thread_simulate(void *ptr);
   static void *thread_move(void *ptr);
   static void *thread_cleanup(void *ptr);
@@ -488,8 +525,18 @@ class Simulator {
 
   int current_car_id;
   vector<Car *> cars;
+  vector< vector<neighbor_t> > cars_neighbors;
   pthread_t *threads;
   thread_arg_t *threads_arg;
+  // The workers live as long as the simulator and wait for their next task
+  enum {TASK_SIMULATE, TASK_MOVE, TASK_QUIT};
+  int task;
+  int task_generation;
+  int tasks_pending;
+  pthread_mutex_t workers_mutex;
+  pthread_cond_t task_cond;
+  pthread_cond_t done_cond;
+  bool unbalanced; // Cars entered or left since the last balanceWorkers()
   Map *map;
 
   Car *trackedCar;
@@ -4,6 +4,8 @@
 #include <stdlib.h>
 #include <agents/Car.h>
 #include <utils/Log.h>
+#include <utils/Trace.h>
+#include <utils/Memory.h>
 #include <iomanip>
 
 #ifdef LUA
@@ -105,6 +107,8 @@ Segment::~Segment()
 
 Map::Map(gengetopt_args_info *options)
 {
+  Memory::Scope scope(Memory::MEM_MAP);
+
   this->options = options;
   /* Set starting time of day */
   int h, m;
@@ -365,6 +369,7 @@ void Map::createMap(gengetopt_args_info *options)
       }
 
     } else if (strcmp(cid, "$DENSITY_SENSOR") == 0) {
+      Memory::Scope scope(Memory::MEM_SENSORS);
       char *name = strtok(NULL, ",");
       int id = atoi(strtok(NULL, ","));
       double position = atof(strtok(NULL, ","));
@@ -382,6 +387,7 @@ void Map::createMap(gengetopt_args_info *options)
       if (options->record_given && (!lstr || strcmp(lstr,"log")==0)) r->log();
 
     } else if (strcmp(cid, "$SPEED_SENSOR") == 0) {
+      Memory::Scope scope(Memory::MEM_SENSORS);
       char *name = strtok(NULL, ",");
       int id = atoi(strtok(NULL, ","));
       double position = atof(strtok(NULL, ","));
@@ -397,6 +403,7 @@ void Map::createMap(gengetopt_args_info *options)
       if (options->record_given && (!lstr || strcmp(lstr,"log")==0)) r->log();
       
     } else if (strcmp(cid, "$FLOW_SENSOR") == 0) {
+      Memory::Scope scope(Memory::MEM_SENSORS);
       char *name = strtok(NULL, ",");
       int id = atoi(strtok(NULL, ","));
       double position = atof(strtok(NULL, ","));
@@ -412,6 +419,7 @@ void Map::createMap(gengetopt_args_info *options)
       if (options->record_given && (!lstr || strcmp(lstr,"log")==0)) r->log();
 
     } else if (strcmp(cid, "$TRAFFIC_LIGHT") == 0) {
+      Memory::Scope scope(Memory::MEM_SENSORS);
       char *name = strtok(NULL, ",");
       int id = atoi(strtok(NULL, ","));
       double position = atof(strtok(NULL, ","));
@@ -427,6 +435,7 @@ void Map::createMap(gengetopt_args_info *options)
       if (options->record_given && (!lstr || strcmp(lstr,"log")==0)) r->log();
 
     } else if (strcmp(cid, "$SPEED_LIMIT") == 0) {
+      Memory::Scope scope(Memory::MEM_SENSORS);
       char *name = strtok(NULL, ",");
       int id = atoi(strtok(NULL, ","));
       double position = atof(strtok(NULL, ","));
@@ -824,6 +833,7 @@ void RoadSensor::update(double dt)
   }
 
   if (this->t > this->delta) {
+    double start = Trace::begin();
     switch (type) {
     case DENSITY:
       result = density/(double)cnt; // average density
@@ -850,6 +860,7 @@ void RoadSensor::update(double dt)
       }
       break;
     }
+    Trace::end("sensor log", start);
 
     // Reset timer
     this->cnt = 0;
@@ -1095,7 +1106,9 @@ void RoadActuator::update(double dt)
     queue_time = 0.0;
     count = 0;
     if (file) {
+      double start = Trace::begin();
       fprintf(file, "%.2f %.2f %d\n", current_time, result, result_count);
+      Trace::end("actuator log", start);
     }
 
     // Reset timer
@@ -0,0 +1,135 @@
+/*!
+ * \file Memory.cpp
+ * \brief Memory accounting per subsystem
+ */
+
+#include <stdlib.h>
+#include <new>
+#include "Memory.h"
+
+// Each block starts with its size and tag (16 bytes keep the alignment of malloc).
+// The tag is -1 for the blocks allocated while the accounting is off.
+#define HEADER_SIZE 16
+
+typedef struct {
+  size_t size;
+  int tag;
+} header_t;
+
+static const char *tag_names[] = {"other", "simulator", "map", "sensors", "lua", "gui"};
+
+Memory::tag_stats_t Memory::tags[NTAGS];
+__thread int Memory::tag = MEM_OTHER;
+bool Memory::enabled = false;
+
+Memory::Scope::Scope(tag_t tag)
+{
+  previous = Memory::tag;
+  Memory::tag = tag;
+}
+
+Memory::Scope::~Scope()
+{
+  Memory::tag = previous;
+}
+
+void Memory::enable()
+{
+  enabled = true;
+}
+
+void Memory::add(tag_t tag, long bytes)
+{
+  if (!enabled) return;
+  long current = __sync_add_and_fetch(&tags[tag].current, bytes);
+  long peak = tags[tag].peak;
+  while (current > peak && !__sync_bool_compare_and_swap(&tags[tag].peak, peak, current)) {
+    peak = tags[tag].peak;
+  }
+}
+
+long Memory::getCurrent(tag_t tag)
+{
+  return tags[tag].current;
+}
+
+long Memory::getPeak(tag_t tag)
+{
+  return tags[tag].peak;
+}
+
+const char *Memory::getName(tag_t tag)
+{
+  return tag_names[tag];
+}
+
+int Memory::getTag()
+{
+  return tag;
+}
+
+static void *allocate(size_t size)
+{
+  header_t *h = (header_t *)malloc(size + HEADER_SIZE);
+  if (!h) return NULL;
+  h->size = size;
+  if (Memory::isEnabled()) {
+    h->tag = Memory::getTag();
+    Memory::add((Memory::tag_t)h->tag, (long)size);
+  } else {
+    h->tag = -1;
+  }
+  return (char *)h + HEADER_SIZE;
+}
+
+static void release(void *ptr)
+{
+  if (!ptr) return;
+  header_t *h = (header_t *)((char *)ptr - HEADER_SIZE);
+  if (h->tag >= 0) Memory::add((Memory::tag_t)h->tag, -(long)h->size);
+  free(h);
+}
+
+void *operator new(size_t size)
+{
+  void *p = allocate(size ? size : 1);
+  if (!p) throw std::bad_alloc();
+  return p;
+}
+
+void *operator new[](size_t size)
+{
+  void *p = allocate(size ? size : 1);
+  if (!p) throw std::bad_alloc();
+  return p;
+}
+
+void *operator new(size_t size, const std::nothrow_t &) noexcept
+{
+  return allocate(size ? size : 1);
+}
+
+void *operator new[](size_t size, const std::nothrow_t &) noexcept
+{
+  return allocate(size ? size : 1);
+}
+
+void operator delete(void *ptr) noexcept
+{
+  release(ptr);
+}
+
+void operator delete[](void *ptr) noexcept
+{
+  release(ptr);
+}
+
+void operator delete(void *ptr, const std::nothrow_t &) noexcept
+{
+  release(ptr);
+}
+
+void operator delete[](void *ptr, const std::nothrow_t &) noexcept
+{
+  release(ptr);
+}
@@ -0,0 +1,92 @@
+/*!
+ * \file Memory.h
+ * \brief Memory accounting per subsystem
+ */
+
+#ifndef _MEMORY_H_
+#define _MEMORY_H_
+
+/**
+ * @brief Memory accounting per subsystem.
+ *
+ * The global operator new and delete are replaced so that every allocation
+ * is charged to the tag of the calling thread (set with Memory::Scope) and
+ * given back to the same tag when it is freed, whichever thread frees it.
+ * The LUA states use their own allocator which adds to MEM_LUA directly.
+ * The current and peak number of bytes of each tag are reported by Stats.
+ *
+ * The accounting updates counters shared by all the threads, so it is off
+ * unless enable() is called (with --memory-stats) before the allocations to
+ * account for. The blocks allocated before are never charged to a tag.
+ */
+class Memory {
+ public:
+  typedef enum {MEM_OTHER = 0, MEM_SIMULATOR, MEM_MAP, MEM_SENSORS, MEM_LUA, MEM_GUI, NTAGS} tag_t;
+
+  /**
+   * Charges the allocations of the calling thread to a tag until
+   * the end of the scope.
+   */
+  class Scope {
+   public:
+    Scope(tag_t tag);
+    ~Scope();
+   private:
+    int previous;
+  };
+
+  /**
+   * Turns the accounting on (it cannot be turned off).
+   */
+  static void enable();
+
+  /**
+   * @return true if the allocations are accounted for.
+   */
+  static inline bool isEnabled() {
+    return enabled;
+  }
+
+  /**
+   * Adds bytes to a tag (negative to remove them).
+   * @param tag The tag.
+   * @param bytes The number of bytes.
+   */
+  static void add(tag_t tag, long bytes);
+
+  /**
+   * @param tag The tag.
+   * @return The number of bytes currently allocated.
+   */
+  static long getCurrent(tag_t tag);
+
+  /**
+   * @param tag The tag.
+   * @return The largest number of bytes allocated at once.
+   */
+  static long getPeak(tag_t tag);
+
+  /**
+   * @param tag The tag.
+   * @return The name of the tag.
+   */
+  static const char *getName(tag_t tag);
+
+  /**
+   * @return The tag of the calling thread.
+   */
+  static int getTag();
+
+ private:
+  typedef struct {
+    long current;
+    long peak;
+    char padding[64];  // Each tag on its own cache line
+  } tag_stats_t;
+
+  static tag_stats_t tags[NTAGS];
+  static __thread int tag;
+  static bool enabled;
+};
+
+#endif
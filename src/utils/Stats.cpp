@@ -0,0 +1,352 @@
+/*!
+ * \file Stats.cpp
+ * \brief Performance counters of the simulator
+ */
+
+#include <string.h>
+#include <time.h>
+#include <string>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+#include "Stats.h"
+#include "Trace.h"
+#include "Memory.h"
+
+static const char *phase_names[] = {"control", "entries", "sensors", "simulate", "move", "delete"};
+static const char *counter_names[] = {"lane_walks", "lane_walk_lanes", "exchange_rejects", "sensor_triggers",
+                                      "lua_calls", "cars_created", "cars_deleted"};
+static const char *hardware_names[] = {"cycles", "instructions", "cache_misses", "branch_misses"};
+
+vector<Stats::thread_stats_t> Stats::threads;
+__thread Stats::thread_stats_t *Stats::local = NULL;
+FILE *Stats::file = NULL;
+bool Stats::csv = false;
+int Stats::period = 0;
+long Stats::steps = 0;
+long long Stats::vehicle_steps = 0;
+double Stats::time = 0.0;
+int Stats::cars = 0;
+double Stats::start = 0.0;
+bool Stats::hardware = false;
+int Stats::nhardware = 0;
+int Stats::hardware_index[NHARDWARE];
+
+void Stats::init(int nworkers, const char *filename, int period, bool hardware)
+{
+  stop();
+
+  threads.resize(nworkers + 1);
+  for (unsigned int i = 0; i < threads.size(); i++) {
+    memset(&threads[i], 0, sizeof(thread_stats_t));
+    threads[i].fd = -1;
+    for (int h = 0; h < NHARDWARE; h++) threads[i].fds[h] = -1;
+  }
+
+  // The main thread finds out which hardware counters are available
+  Stats::hardware = hardware;
+  nhardware = 0;
+  attach(0);
+  if (hardware && !nhardware) {
+    fprintf(stderr, "Warning: The hardware counters are not available, only the timers are reported.\n");
+    Stats::hardware = false;
+  }
+
+  Stats::period = period;
+  steps = 0;
+  vehicle_steps = 0;
+  time = 0.0;
+  cars = 0;
+  start = now();
+
+  if (!filename) return;
+  file = fopen(filename, "a+");
+  if (!file) {
+    fprintf(stderr, "Unable to write the statistics to %s.\n", filename);
+    return;
+  }
+  int n = strlen(filename);
+  csv = (n >= 4 && strcmp(filename + n - 4, ".csv") == 0);
+  if (!csv) return;
+
+  // The columns depend on the threads, the hardware counters and the memory accounting
+  char buffer[128];
+  string header = "step,time,wall,cars,vehicle_steps";
+  for (int p = 0; p < NPHASES; p++) header += string(",") + phase_names[p];
+  for (int c = 0; c < NCOUNTERS; c++) header += string(",") + counter_names[c];
+  for (int i = 0; i < nworkers; i++) {
+    snprintf(buffer, sizeof(buffer), ",thread%d_simulate,thread%d_move", i, i);
+    header += buffer;
+  }
+  for (int p = 0; p < NPHASES && nhardware; p++) {
+    for (int h = 0; h < NHARDWARE; h++) header += string(",") + phase_names[p] + "_" + hardware_names[h];
+    header += string(",") + phase_names[p] + "_ipc";
+  }
+  for (int m = 0; m < Memory::NTAGS && Memory::isEnabled(); m++) {
+    const char *name = Memory::getName((Memory::tag_t)m);
+    header += string(",") + name + "_bytes," + name + "_peak_bytes";
+  }
+  header += Memory::isEnabled() ? ",bytes_per_vehicle\n" : "\n";
+
+  // The header is only written at the top of a new file, the runs appended
+  // after it need the same columns
+  fseek(file, 0, SEEK_END);
+  if (ftell(file) == 0) {
+    fputs(header.c_str(), file);
+    return;
+  }
+  vector<char> line(header.size() + 2, '\0');
+  rewind(file);
+  if (!fgets(&line[0], line.size(), file) || header != &line[0]) {
+    fprintf(stderr, "The statistics in %s have other columns (e.g. another --ncpu), use another file.\n", filename);
+    fclose(file);
+    file = NULL;
+    return;
+  }
+  fseek(file, 0, SEEK_END);
+}
+
+void Stats::attach(int index)
+{
+  local = (index < (int)threads.size()) ? &threads[index] : NULL;
+  if (local && hardware && local->fd < 0) openHardware(local);
+}
+
+void Stats::detach()
+{
+  if (local) closeHardware(local);
+  local = NULL;
+}
+
+void Stats::closeHardware(thread_stats_t *s)
+{
+  for (int h = 0; h < NHARDWARE; h++) {
+    if (s->fds[h] >= 0) close(s->fds[h]);
+    s->fds[h] = -1;
+  }
+  s->fd = -1;
+}
+
+void Stats::openHardware(thread_stats_t *s)
+{
+#ifdef __linux__
+  static const unsigned long long configs[] = {PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+                                               PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES};
+  // The first call decides which counters are used
+  bool first = (nhardware == 0);
+
+  for (int h = 0; h < NHARDWARE; h++) {
+    if (!first && hardware_index[h] < 0) continue;
+
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = configs[h];
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP;
+
+    // Counts the calling thread on any CPU
+    int fd = syscall(__NR_perf_event_open, &attr, 0, -1, s->fd, 0);
+    if (fd < 0) {
+      if (first) {
+        hardware_index[h] = -1;
+        continue;
+      }
+      // All threads need the same counters
+      closeHardware(s);
+      return;
+    }
+    if (first) hardware_index[h] = nhardware++;
+    s->fds[h] = fd;
+    if (s->fd < 0) s->fd = fd;
+  }
+#endif
+}
+
+void Stats::startHardware(thread_stats_t *s)
+{
+#ifdef __linux__
+  ioctl(s->fd, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+  ioctl(s->fd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+#endif
+}
+
+void Stats::stopHardware(thread_stats_t *s, long long *values)
+{
+  unsigned long long buffer[1 + NHARDWARE];
+  memset(buffer, 0, sizeof(buffer));
+#ifdef __linux__
+  ioctl(s->fd, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+  if (read(s->fd, buffer, sizeof(buffer)) < (ssize_t)sizeof(buffer[0])) memset(buffer, 0, sizeof(buffer));
+#endif
+  for (int h = 0; h < NHARDWARE; h++) {
+    values[h] = (hardware_index[h] >= 0) ? (long long)buffer[1 + hardware_index[h]] : 0;
+  }
+}
+
+double Stats::now()
+{
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (double)t.tv_sec + (double)t.tv_nsec*1e-9;
+}
+
+double Stats::begin()
+{
+  if (local && local->fd >= 0) startHardware(local);
+  return now();
+}
+
+double Stats::lap(phase_t p, double start)
+{
+  double t = now();
+  if (local) local->phases[p] += t - start;
+  if (local && local->fd >= 0) {
+    // The group is stopped while it is read, then counts the next phase from 0
+    long long values[NHARDWARE];
+    stopHardware(local, values);
+    for (int h = 0; h < NHARDWARE; h++) local->hardware[p][h] += values[h];
+    startHardware(local);
+  }
+  Trace::add(phase_names[p], start, t);
+  return t;
+}
+
+void Stats::endStep(double t, int cars)
+{
+  steps++;
+  vehicle_steps += cars;
+  time = t;
+  Stats::cars = cars;
+  if (file && period > 0 && steps % period == 0) write();
+}
+
+void Stats::getTotals(totals_t *totals)
+{
+  memset(totals, 0, sizeof(totals_t));
+  totals->steps = steps;
+  for (unsigned int i = 0; i < threads.size(); i++) {
+    for (int p = 0; p < NPHASES; p++) {
+      // The main thread only waits for the workers in these phases
+      if (i == 0 && threads.size() > 1 && (p == SIMULATE || p == MOVE)) continue;
+      totals->busy += threads[i].phases[p];
+    }
+    totals->lua += threads[i].lua;
+  }
+  for (int p = 0; p < NPHASES; p++) totals->phases[p] = threads.empty() ? 0.0 : threads[0].phases[p];
+}
+
+void Stats::stop()
+{
+  if (file) {
+    write();
+    fclose(file);
+    file = NULL;
+  }
+  // Whichever thread stops, no group stays open
+  for (unsigned int i = 0; i < threads.size(); i++) closeHardware(&threads[i]);
+  local = NULL;
+}
+
+void Stats::write()
+{
+  // Totals over all threads
+  long counters[NCOUNTERS];
+  memset(counters, 0, sizeof(counters));
+  long long hw[NPHASES][NHARDWARE];
+  memset(hw, 0, sizeof(hw));
+  for (unsigned int i = 0; i < threads.size(); i++) {
+    for (int c = 0; c < NCOUNTERS; c++) counters[c] += threads[i].counters[c];
+    for (int p = 0; p < NPHASES; p++) {
+      for (int h = 0; h < NHARDWARE; h++) hw[p][h] += threads[i].hardware[p][h];
+    }
+  }
+  double wall = now() - start;
+
+  // The memory of the vehicles is the one of the simulator and of their controllers
+  long vehicles = Memory::getCurrent(Memory::MEM_SIMULATOR) + Memory::getCurrent(Memory::MEM_LUA);
+  double per_vehicle = cars ? (double)vehicles/(double)cars : 0.0;
+
+  // The phases are the wall times seen by the main thread, the workers give their busy times
+  if (csv) {
+    fprintf(file, "%ld,%.3f,%.6f,%d,%lld", steps, time, wall, cars, vehicle_steps);
+    for (int p = 0; p < NPHASES; p++) fprintf(file, ",%.6f", threads[0].phases[p]);
+    for (int c = 0; c < NCOUNTERS; c++) fprintf(file, ",%ld", counters[c]);
+    for (unsigned int i = 1; i < threads.size(); i++) {
+      fprintf(file, ",%.6f,%.6f", threads[i].phases[SIMULATE], threads[i].phases[MOVE]);
+    }
+    for (int p = 0; p < NPHASES && nhardware; p++) {
+      for (int h = 0; h < NHARDWARE; h++) {
+        if (hardware_index[h] >= 0) fprintf(file, ",%lld", hw[p][h]);
+        else fprintf(file, ",");
+      }
+      if (hw[p][CYCLES] > 0 && hardware_index[INSTRUCTIONS] >= 0) {
+        fprintf(file, ",%.3f", (double)hw[p][INSTRUCTIONS]/(double)hw[p][CYCLES]);
+      } else {
+        fprintf(file, ",");
+      }
+    }
+    for (int m = 0; m < Memory::NTAGS && Memory::isEnabled(); m++) {
+      fprintf(file, ",%ld,%ld", Memory::getCurrent((Memory::tag_t)m), Memory::getPeak((Memory::tag_t)m));
+    }
+    if (Memory::isEnabled()) fprintf(file, ",%.1f", per_vehicle);
+    fprintf(file, "\n");
+  } else {
+    fprintf(file, "{\"step\": %ld, \"time\": %.3f, \"wall\": %.6f, \"cars\": %d, \"vehicle_steps\": %lld, \"phases\": {",
+            steps, time, wall, cars, vehicle_steps);
+    for (int p = 0; p < NPHASES; p++) {
+      fprintf(file, "%s\"%s\": %.6f", (p ? ", " : ""), phase_names[p], threads[0].phases[p]);
+    }
+    fprintf(file, "}, \"counters\": {");
+    for (int c = 0; c < NCOUNTERS; c++) {
+      fprintf(file, "%s\"%s\": %ld", (c ? ", " : ""), counter_names[c], counters[c]);
+    }
+    fprintf(file, "}, \"threads\": [");
+    for (unsigned int i = 1; i < threads.size(); i++) {
+      fprintf(file, "%s{\"simulate\": %.6f, \"move\": %.6f}", ((i > 1) ? ", " : ""),
+              threads[i].phases[SIMULATE], threads[i].phases[MOVE]);
+    }
+    fprintf(file, "]");
+    if (nhardware) {
+      // Summed over the threads, the miss rates are per 1000 instructions
+      fprintf(file, ", \"hardware\": {");
+      for (int p = 0; p < NPHASES; p++) {
+        fprintf(file, "%s\"%s\": {", (p ? ", " : ""), phase_names[p]);
+        int n = 0;
+        for (int h = 0; h < NHARDWARE; h++) {
+          if (hardware_index[h] < 0) continue;
+          fprintf(file, "%s\"%s\": %lld", (n++ ? ", " : ""), hardware_names[h], hw[p][h]);
+        }
+        if (hw[p][CYCLES] > 0 && hardware_index[INSTRUCTIONS] >= 0) {
+          fprintf(file, ", \"ipc\": %.3f", (double)hw[p][INSTRUCTIONS]/(double)hw[p][CYCLES]);
+        }
+        if (hw[p][INSTRUCTIONS] > 0) {
+          if (hardware_index[CACHE_MISSES] >= 0) {
+            fprintf(file, ", \"cache_mpki\": %.3f", 1000.0*(double)hw[p][CACHE_MISSES]/(double)hw[p][INSTRUCTIONS]);
+          }
+          if (hardware_index[BRANCH_MISSES] >= 0) {
+            fprintf(file, ", \"branch_mpki\": %.3f", 1000.0*(double)hw[p][BRANCH_MISSES]/(double)hw[p][INSTRUCTIONS]);
+          }
+        }
+        fprintf(file, "}");
+      }
+      fprintf(file, "}");
+    }
+    if (Memory::isEnabled()) {
+      fprintf(file, ", \"memory\": {");
+      for (int m = 0; m < Memory::NTAGS; m++) {
+        fprintf(file, "\"%s\": {\"current\": %ld, \"peak\": %ld}, ", Memory::getName((Memory::tag_t)m),
+                Memory::getCurrent((Memory::tag_t)m), Memory::getPeak((Memory::tag_t)m));
+      }
+      fprintf(file, "\"per_vehicle\": %.1f}", per_vehicle);
+    }
+    fprintf(file, "}\n");
+  }
+  fflush(file);
+}
@@ -0,0 +1,159 @@
+/*!
+ * \file Stats.h
+ * \brief Performance counters of the simulator
+ */
+
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include <stdio.h>
+#include <vector>
+
+using namespace std;
+
+/**
+ * @brief Performance counters of the simulator.
+ *
+ * The time spent in each phase of Simulator::step() and a few hot-path
+ * counters are always accumulated. Each thread increments its own
+ * counters (the main thread uses index 0 and the worker i the index i+1),
+ * so nothing is locked. When a file is given, the totals since the start
+ * are appended to it every few steps and at exit, either as one JSON object
+ * per line or as CSV rows when the file name ends with ".csv". The file is
+ * not truncated: the runs follow each other in it. Since the CSV columns
+ * depend on the options, nothing is written to a CSV file whose header
+ * differs from the one of the run.
+ *
+ * Optionally, each thread also reads its hardware counters (cycles,
+ * instructions, cache and branch misses) at the end of each phase. The
+ * group of counters is opened once per thread with perf_event_open(), then
+ * reset, enabled and disabled around each phase. When the counters are not
+ * available (e.g. inside a container), only the timers are reported.
+ *
+ * When the Memory accounting is on, the current and peak bytes of each tag,
+ * and the bytes per vehicle, are written along with the counters.
+ */
+class Stats {
+ public:
+  typedef enum {CONTROL = 0, ENTRIES, SENSORS, SIMULATE, MOVE, DELETE, NPHASES} phase_t;
+  typedef enum {LANE_WALKS = 0, LANE_WALK_LANES, EXCHANGE_REJECTS, SENSOR_TRIGGERS,
+                LUA_CALLS, CARS_CREATED, CARS_DELETED, NCOUNTERS} counter_t;
+  typedef enum {CYCLES = 0, INSTRUCTIONS, CACHE_MISSES, BRANCH_MISSES, NHARDWARE} hardware_t;
+
+  typedef struct {
+    long steps;
+    double phases[NPHASES];  // Wall times of the phases (main thread)
+    double busy;             // Time spent working by all the threads
+    double lua;              // Time spent in the LUA controllers by all the threads
+  } totals_t;
+
+  /**
+   * Resets the counters and binds the calling thread to the index 0.
+   * @param nworkers The number of worker threads.
+   * @param filename The output file (or NULL).
+   * @param period The number of steps between two outputs (0 to only write at exit).
+   * @param hardware Whether to read the hardware counters.
+   */
+  static void init(int nworkers, const char *filename, int period, bool hardware = false);
+
+  /**
+   * Binds the calling thread to its counters.
+   * @param index 0 for the main thread, i+1 for the worker i.
+   */
+  static void attach(int index);
+
+  /**
+   * Releases the hardware counters of the calling thread (before it exits)
+   * and unbinds it from its counters.
+   */
+  static void detach();
+
+  /**
+   * Increments a counter of the calling thread.
+   * @param c The counter.
+   * @param n The increment.
+   */
+  static inline void count(counter_t c, long n = 1) {
+    if (local) local->counters[c] += n;
+  }
+
+  /**
+   * Adds to the LUA time of the calling thread.
+   * @param time The duration of a call of the controller [s].
+   */
+  static inline void addLua(double time) {
+    if (local) local->lua += time;
+  }
+
+  /**
+   * Reads the totals since init(). This can be called from another thread
+   * while the simulation steps (the totals can then be one step behind).
+   * @param totals The totals.
+   */
+  static void getTotals(totals_t *totals);
+
+  /**
+   * @return A monotonic time in seconds.
+   */
+  static double now();
+
+  /**
+   * Marks the beginning of the first phase of the calling thread.
+   * @return The current time (see now()).
+   */
+  static double begin();
+
+  /**
+   * Adds the time elapsed since start to a phase of the calling thread
+   * (and records it as a span when tracing).
+   * @param p The phase.
+   * @param start The start of the phase (see begin()).
+   * @return The current time (to start the next phase).
+   */
+  static double lap(phase_t p, double start);
+
+  /**
+   * Marks the end of a step and writes the counters when it is time to.
+   * @param t The simulation time.
+   * @param cars The number of cars.
+   */
+  static void endStep(double t, int cars);
+
+  /**
+   * Writes the counters a last time and closes the file.
+   */
+  static void stop();
+
+ private:
+  typedef struct {
+    double phases[NPHASES];
+    double lua;
+    long counters[NCOUNTERS];
+    long long hardware[NPHASES][NHARDWARE];
+    int fd;        // Leader of the group of hardware counters (-1 if none)
+    int fds[NHARDWARE];
+    char padding[64];  // Keeps the counters of two threads on different cache lines
+  } thread_stats_t;
+
+  static void write();
+  static void openHardware(thread_stats_t *s);
+  static void closeHardware(thread_stats_t *s);
+  static void startHardware(thread_stats_t *s);
+  static void stopHardware(thread_stats_t *s, long long *values);
+
+  static vector<thread_stats_t> threads;
+  static __thread thread_stats_t *local;
+  static FILE *file;
+  static bool csv;
+  static int period;
+  static long steps;
+  static long long vehicle_steps;
+  static double time;
+  static int cars;
+  static double start;
+  static bool hardware;
+  static int nhardware;
+  static int hardware_index[NHARDWARE];  // Position in the group (-1 if not available)
+};
+
+#endif
@@ -0,0 +1,115 @@
+/*!
+ * \file Trace.cpp
+ * \brief Timeline tracing of the simulator
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "Trace.h"
+#include "Stats.h"
+
+vector<Trace::thread_trace_t> Trace::threads;
+__thread Trace::thread_trace_t *Trace::local = NULL;
+char *Trace::filename = NULL;
+bool Trace::recording = false;
+double Trace::from = 0.0;
+double Trace::to = 0.0;
+double Trace::time = 0.0;
+double Trace::origin = 0.0;
+
+void Trace::init(int nworkers, const char *filename, double from, double to)
+{
+  stop();
+
+  threads.clear();
+  threads.resize(nworkers + 2);
+  attach(0);
+
+  Trace::filename = filename ? strdup(filename) : NULL;
+  Trace::from = from;
+  Trace::to = to;
+  origin = Stats::now();
+  setTime(0.0);
+}
+
+void Trace::attach(int index)
+{
+  if (index == DISPLAY) index = (int)threads.size() - 1;
+  local = (index >= 0 && index < (int)threads.size()) ? &threads[index] : NULL;
+}
+
+void Trace::detach()
+{
+  local = NULL;
+}
+
+void Trace::setTime(double t)
+{
+  time = t;
+  recording = filename && t >= from && (to <= 0.0 || t <= to);
+}
+
+double Trace::begin()
+{
+  return recording ? Stats::now() : 0.0;
+}
+
+void Trace::end(const char *name, double start)
+{
+  // The recording may have started in between
+  if (start <= 0.0) return;
+  add(name, start, Stats::now());
+}
+
+void Trace::add(const char *name, double start, double stop)
+{
+  if (!recording || !local) return;
+  event_t e;
+  e.name = name;
+  e.start = start;
+  e.stop = stop;
+  e.time = time;
+  local->events.push_back(e);
+}
+
+int Trace::stop()
+{
+  recording = false;
+  if (!filename) return 0;
+
+  FILE *f = fopen(filename, "w");
+  if (!f) {
+    fprintf(stderr, "Unable to write the trace to %s.\n", filename);
+    free(filename);
+    filename = NULL;
+    return -1;
+  }
+
+  // Timestamps are in microseconds since init()
+  fprintf(f, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+  fprintf(f, "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 1, \"args\": {\"name\": \"disim\"}}");
+  for (unsigned int i = 0; i < threads.size(); i++) {
+    if (i == 0) {
+      fprintf(f, ",\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": 0, \"args\": {\"name\": \"main\"}}");
+    } else if (i == threads.size() - 1) {
+      if (threads[i].events.empty()) continue;
+      fprintf(f, ",\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %u, \"args\": {\"name\": \"display\"}}", i);
+    } else {
+      fprintf(f, ",\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %u, \"args\": {\"name\": \"worker %u\"}}", i, i-1);
+    }
+    vector<event_t> &events = threads[i].events;
+    for (unsigned int k = 0; k < events.size(); k++) {
+      event_t &e = events[k];
+      fprintf(f, ",\n{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %u, \"ts\": %.3f, \"dur\": %.3f, \"args\": {\"t\": %.3f}}",
+              e.name, i, (e.start - origin)*1e6, (e.stop - e.start)*1e6, e.time);
+    }
+    events.clear();
+  }
+  fprintf(f, "\n]}\n");
+  fclose(f);
+
+  free(filename);
+  filename = NULL;
+  return 0;
+}
@@ -0,0 +1,115 @@
+/*!
+ * \file Trace.h
+ * \brief Timeline tracing of the simulator
+ */
+
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <vector>
+
+using namespace std;
+
+/**
+ * @brief Timeline tracing of the simulator.
+ *
+ * Records spans (the phases of a step, the tasks of the workers, the LUA
+ * calls, the log writes, the redraws and the waits on the simulator mutex)
+ * while the simulation time is inside the selected window. Each thread
+ * appends to its own buffer (the thread that steps uses the index 0, the
+ * worker i the index i+1 and the GUI thread DISPLAY when the simulation runs
+ * on its own thread), so nothing is locked while recording. The buffers are
+ * written at exit in the Chrome trace event format, which chrome://tracing
+ * and the Perfetto UI both open.
+ */
+class Trace {
+ public:
+  // The buffer of the GUI thread
+  enum {DISPLAY = -1};
+
+  /**
+   * Clears the buffers and binds the calling thread to the index 0.
+   * Nothing is recorded if filename is NULL.
+   * @param nworkers The number of worker threads.
+   * @param filename The output file (or NULL).
+   * @param from The simulation time at which the recording starts.
+   * @param to The simulation time at which the recording stops (0 for the end of the simulation).
+   */
+  static void init(int nworkers, const char *filename, double from, double to);
+
+  /**
+   * Binds the calling thread to its buffer.
+   * @param index 0 for the main thread, i+1 for the worker i or DISPLAY.
+   */
+  static void attach(int index);
+
+  /**
+   * Unbinds the calling thread (it records nothing until attached again).
+   */
+  static void detach();
+
+  /**
+   * Sets the current simulation time and starts or stops the recording.
+   * It must not be called while the workers are running.
+   * @param t The simulation time.
+   */
+  static void setTime(double t);
+
+  /**
+   * @return true if the spans are being recorded.
+   */
+  static inline bool isRecording() {
+    return recording;
+  }
+
+  /**
+   * Marks the beginning of a span.
+   * @return The start time to give to end() (0 if nothing is recorded).
+   */
+  static double begin();
+
+  /**
+   * Records a span of the calling thread.
+   * @param name The name of the span (it must be a constant string).
+   * @param start The value returned by begin().
+   */
+  static void end(const char *name, double start);
+
+  /**
+   * Records a span of the calling thread with known bounds.
+   * @param name The name of the span (it must be a constant string).
+   * @param start The start time (see Stats::now()).
+   * @param stop The end time.
+   */
+  static void add(const char *name, double start, double stop);
+
+  /**
+   * Writes the trace and clears the buffers.
+   * @return 0 on success.
+   */
+  static int stop();
+
+ private:
+  typedef struct {
+    const char *name;
+    double start;
+    double stop;
+    double time;   // Simulation time
+  } event_t;
+
+  typedef struct {
+    vector<event_t> events;
+    char padding[64];  // Keeps the buffers of two threads on different cache lines
+  } thread_trace_t;
+
+  static vector<thread_trace_t> threads;
+  static __thread thread_trace_t *local;
+  static char *filename;
+  static bool recording;
+  static double from;
+  static double to;
+  static double time;
+  static double origin;
+};
+
+#endif